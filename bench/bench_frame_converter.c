@@ -0,0 +1,424 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+/* Conversion micro-benchmark: runs fc_ndi_video_frame_to_avframe for every
+ * FourCC known to ndi_fourcc_to_ffmpeg over a grid of input and output sizes
+ * and fc_ndi_audio_frame_to_avframe for a few encoder sample formats, then
+ * prints the results as JSON. Single threaded, so frames_per_core is simply
+ * frames per second of process CPU time. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libavutil/channel_layout.h>
+#include <libavutil/cpu.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "common.h"
+#include "frame_converter.h"
+#include "json.h"
+#include "synthetic_source.h"
+#include "util.h"
+
+typedef struct BenchSize {
+    int width;
+    int height;
+} BenchSize;
+
+typedef struct BenchAudioFormat {
+    const char *name;
+    enum AVSampleFormat sample_fmt;
+    int sample_rate;
+    int frame_size;
+} BenchAudioFormat;
+
+typedef struct BenchResult {
+    int64_t frames;
+    double ns_per_frame;
+    double gb_per_s;
+    double frames_per_core;
+} BenchResult;
+
+static const NDIlib_FourCC_video_type_e bench_fourccs[] = {
+    NDIlib_FourCC_video_type_UYVY, NDIlib_FourCC_video_type_UYVA,
+    NDIlib_FourCC_video_type_BGRA, NDIlib_FourCC_video_type_BGRX,
+    NDIlib_FourCC_video_type_RGBA, NDIlib_FourCC_video_type_RGBX,
+    NDIlib_FourCC_video_type_I420, NDIlib_FourCC_video_type_YV12,
+    NDIlib_FourCC_video_type_NV12, NDIlib_FourCC_video_type_P216,
+    NDIlib_FourCC_video_type_PA16,
+};
+
+static const BenchSize bench_inputs[] = {
+    { 1280, 720 },
+    { 1920, 1080 },
+    { 2560, 1440 },
+    { 3840, 2160 },
+};
+
+static const BenchSize bench_outputs[] = {
+    { 1280, 720 },
+    { 1920, 1080 },
+    { 3840, 2160 },
+};
+
+static const BenchAudioFormat bench_audio_formats[] = {
+    { "aac", AV_SAMPLE_FMT_FLTP, 48000, 1024 },
+    { "opus", AV_SAMPLE_FMT_S16, 48000, 960 },
+    { "mp3", AV_SAMPLE_FMT_S16P, 44100, 1152 },
+};
+
+static const int bench_audio_channels[] = { 2, 8 };
+
+#define BENCH_AUDIO_SAMPLES 1600 // 30 fps at 48 kHz
+#define BENCH_WARMUP_FRAMES 2
+#define BENCH_MIN_FRAMES 5
+
+static void
+fourcc_name(NDIlib_FourCC_video_type_e fourcc, char out[5])
+{
+    for (int i = 0; i < 4; ++i) {
+        out[i] = (char)((unsigned)fourcc >> (8 * i));
+    }
+    out[4] = '\0';
+}
+
+static void
+fill_noise(uint8_t *data, size_t size, uint32_t seed)
+{
+    uint32_t x = seed | 1;
+    for (size_t i = 0; i < size; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = (uint8_t)((i & 0xff) ^ (x & 0x3f));
+    }
+}
+
+static double
+cpu_seconds()
+{
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static void
+bench_finish(BenchResult *res, int64_t start_us, double start_cpu,
+             int64_t bytes_per_frame)
+{
+    double wall_ns = (double)(get_current_ts_usec() - start_us) * 1000;
+    double cpu = cpu_seconds() - start_cpu;
+
+    res->ns_per_frame = wall_ns / (double)res->frames;
+    res->gb_per_s = (double)bytes_per_frame / res->ns_per_frame;
+    res->frames_per_core = cpu > 0 ? (double)res->frames / cpu : 0;
+}
+
+static int
+bench_video(FrameConverterCtx *fc_ctx, AVCodecContext *codec_ctx,
+            NDIlib_video_frame_v2_t *frame, int64_t bytes_per_frame,
+            double seconds, BenchResult *res)
+{
+    for (int i = 0; i < BENCH_WARMUP_FRAMES; ++i) {
+        fc_ndi_video_frame_to_avframe(fc_ctx, codec_ctx, frame);
+        if (!fc_ctx->sws_ctx) {
+            return -1;
+        }
+    }
+
+    int64_t budget_us = (int64_t)(seconds * 1000000);
+    int64_t start_us = get_current_ts_usec();
+    double start_cpu = cpu_seconds();
+
+    res->frames = 0;
+    while (res->frames < BENCH_MIN_FRAMES
+           || get_current_ts_usec() - start_us < budget_us) {
+        fc_ndi_video_frame_to_avframe(fc_ctx, codec_ctx, frame);
+        res->frames++;
+    }
+
+    bench_finish(res, start_us, start_cpu, bytes_per_frame);
+    return 0;
+}
+
+static int
+bench_audio(FrameConverterCtx *fc_ctx, AVCodecContext *codec_ctx,
+            NDIlib_audio_frame_v2_t *frame, int64_t bytes_per_frame,
+            double seconds, BenchResult *res)
+{
+    int64_t budget_us = (int64_t)(seconds * 1000000);
+    int64_t start_us = get_current_ts_usec();
+    double start_cpu = cpu_seconds();
+
+    res->frames = 0;
+    while (res->frames < BENCH_MIN_FRAMES
+           || get_current_ts_usec() - start_us < budget_us) {
+        fc_ndi_audio_frame_to_avframe(fc_ctx, codec_ctx, frame);
+        // drain whole encoder frames the way output_audio_job does
+        while (fc_ndi_audio_frame_to_avframe(fc_ctx, codec_ctx, NULL)) {
+        }
+        if (!fc_ctx->swr_context) {
+            return -1;
+        }
+        res->frames++;
+    }
+
+    bench_finish(res, start_us, start_cpu, bytes_per_frame);
+    return 0;
+}
+
+static void
+write_result(JsonWriter *jw, const BenchResult *res)
+{
+    jw_int(jw, "frames", res->frames);
+    jw_double(jw, "ns_per_frame", res->ns_per_frame);
+    jw_double(jw, "gb_per_s", res->gb_per_s);
+    jw_double(jw, "frames_per_core", res->frames_per_core);
+}
+
+static void
+run_video(JsonWriter *jw, const char *fourcc_filter,
+          enum AVPixelFormat out_pix_fmt, double seconds)
+{
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(NULL);
+    codec_ctx->pix_fmt = out_pix_fmt;
+
+    jw_array_begin(jw, "video");
+
+    for (size_t f = 0; f < sizeof bench_fourccs / sizeof *bench_fourccs;
+         ++f) {
+        char name[5];
+        fourcc_name(bench_fourccs[f], name);
+        if (fourcc_filter && strcmp(fourcc_filter, name) != 0) {
+            continue;
+        }
+        enum AVPixelFormat in_pix_fmt = ndi_fourcc_to_ffmpeg(bench_fourccs[f]);
+
+        for (size_t i = 0; i < sizeof bench_inputs / sizeof *bench_inputs;
+             ++i) {
+            const BenchSize *in = &bench_inputs[i];
+            int stride;
+            int ndi_size = ss_frame_size(bench_fourccs[f], in->width,
+                                         in->height, &stride);
+            uint8_t *data = av_malloc(ndi_size);
+            fill_noise(data, ndi_size, (uint32_t)(f * 31 + i));
+
+            NDIlib_video_frame_v2_t frame = {
+                .xres = in->width,
+                .yres = in->height,
+                .FourCC = bench_fourccs[f],
+                .frame_rate_N = 30000,
+                .frame_rate_D = 1001,
+                .picture_aspect_ratio = 0,
+                .frame_format_type = NDIlib_frame_format_type_progressive,
+                .p_data = data,
+                .line_stride_in_bytes = stride,
+            };
+
+            for (size_t o = 0;
+                 o < sizeof bench_outputs / sizeof *bench_outputs; ++o) {
+                const BenchSize *out = &bench_outputs[o];
+                FrameConverterCtx *fc_ctx = new_frame_converter_ctx();
+                BenchResult res = {};
+
+                codec_ctx->width = out->width;
+                codec_ctx->height = out->height;
+                int64_t bytes = ndi_size
+                                + av_image_get_buffer_size(
+                                        out_pix_fmt, out->width,
+                                        out->height, 1);
+
+                int ret = bench_video(fc_ctx, codec_ctx, &frame, bytes,
+                                      seconds, &res);
+
+                jw_object_begin(jw, NULL);
+                jw_string(jw, "fourcc", name);
+                jw_string(jw, "in_pix_fmt", in_pix_fmt < 0
+                                                    ? "none"
+                                                    : av_get_pix_fmt_name(
+                                                            in_pix_fmt));
+                jw_int(jw, "in_width", in->width);
+                jw_int(jw, "in_height", in->height);
+                jw_string(jw, "out_pix_fmt", av_get_pix_fmt_name(out_pix_fmt));
+                jw_int(jw, "out_width", out->width);
+                jw_int(jw, "out_height", out->height);
+                if (ret < 0) {
+                    jw_string(jw, "error", fc_ctx->error_str);
+                }
+                else {
+                    write_result(jw, &res);
+                }
+                jw_object_end(jw);
+
+                fprintf(stderr, "%s %dx%d -> %dx%d: %.0f ns/frame\n", name,
+                        in->width, in->height, out->width, out->height,
+                        res.ns_per_frame);
+                free_frame_converter_ctx(&fc_ctx);
+            }
+
+            av_free(data);
+        }
+    }
+
+    jw_array_end(jw);
+    avcodec_free_context(&codec_ctx);
+}
+
+static void
+run_audio(JsonWriter *jw, double seconds)
+{
+    jw_array_begin(jw, "audio");
+
+    for (size_t c = 0;
+         c < sizeof bench_audio_channels / sizeof *bench_audio_channels; ++c) {
+        int channels = bench_audio_channels[c];
+        float *data = av_malloc(sizeof(float) * channels * BENCH_AUDIO_SAMPLES);
+        for (int i = 0; i < channels * BENCH_AUDIO_SAMPLES; ++i) {
+            data[i] = (float)((i * 7919) % 2001 - 1000) / 1000.0f;
+        }
+
+        NDIlib_audio_frame_v2_t frame = {
+            .sample_rate = 48000,
+            .no_channels = channels,
+            .no_samples = BENCH_AUDIO_SAMPLES,
+            .p_data = data,
+            .channel_stride_in_bytes = sizeof(float) * BENCH_AUDIO_SAMPLES,
+        };
+        int64_t bytes = (int64_t)sizeof(float) * channels * BENCH_AUDIO_SAMPLES;
+
+        for (size_t f = 0;
+             f < sizeof bench_audio_formats / sizeof *bench_audio_formats;
+             ++f) {
+            const BenchAudioFormat *fmt = &bench_audio_formats[f];
+            AVCodecContext *codec_ctx = avcodec_alloc_context3(NULL);
+            codec_ctx->sample_fmt = fmt->sample_fmt;
+            codec_ctx->sample_rate = fmt->sample_rate;
+            codec_ctx->frame_size = fmt->frame_size;
+            av_channel_layout_default(&codec_ctx->ch_layout, 2);
+
+            FrameConverterCtx *fc_ctx = new_frame_converter_ctx();
+            BenchResult res = {};
+            int ret = bench_audio(fc_ctx, codec_ctx, &frame, bytes, seconds,
+                                  &res);
+
+            jw_object_begin(jw, NULL);
+            jw_string(jw, "encoder", fmt->name);
+            jw_int(jw, "in_channels", channels);
+            jw_int(jw, "in_sample_rate", frame.sample_rate);
+            jw_int(jw, "in_samples", frame.no_samples);
+            jw_string(jw, "out_sample_fmt",
+                      av_get_sample_fmt_name(fmt->sample_fmt));
+            jw_int(jw, "out_sample_rate", fmt->sample_rate);
+            jw_int(jw, "out_channels", 2);
+            if (ret < 0) {
+                jw_string(jw, "error", fc_ctx->error_str);
+            }
+            else {
+                write_result(jw, &res);
+            }
+            jw_object_end(jw);
+
+            fprintf(stderr, "audio %dch -> %s: %.0f ns/frame\n", channels,
+                    fmt->name, res.ns_per_frame);
+            free_frame_converter_ctx(&fc_ctx);
+            avcodec_free_context(&codec_ctx);
+        }
+
+        av_free(data);
+    }
+
+    jw_array_end(jw);
+}
+
+const ProgramOption options[] = {
+    { "t,time", "seconds per case (optional, by default '0.25')", 0 },
+    { "fourcc", "only benchmark this FourCC, e.g. UYVY (optional)", 0 },
+    { "pix_fmt", "output pixel format (optional, by default 'yuv420p')", 0 },
+    { "o,output", "write JSON to the file (optional, by default stdout)", 0 },
+    { "h,help", "show help", 1 },
+    { NULL, NULL, 0 },
+};
+
+int
+main(int argc, char **argv)
+{
+    double seconds = 0.25;
+    const char *fourcc = NULL;
+    const char *output = NULL;
+    enum AVPixelFormat pix_fmt = AV_PIX_FMT_YUV420P;
+
+    const ProgramOption *opt = NULL;
+    OptionParserCtx *op_ctx = op_init(options);
+    int c;
+    char *end;
+
+    for (; (c = op_parse(argc, argv, op_ctx, &opt)) != -1;) {
+        switch (c) {
+        case 't':
+            seconds = strtod(optarg, &end);
+            if (end == optarg || seconds <= 0) {
+                printf("couldn't convert \"%s\" to number\n", optarg);
+                op_free(&op_ctx);
+                return 1;
+            }
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'h':
+            op_print_help(argv[0], op_ctx);
+            op_free(&op_ctx);
+            return 0;
+        default:
+            if (opt == NULL) {
+                break;
+            }
+            if (strcmp(opt->name, "fourcc") == 0) {
+                fourcc = optarg;
+            }
+            else if (strcmp(opt->name, "pix_fmt") == 0) {
+                pix_fmt = av_get_pix_fmt(optarg);
+                if (pix_fmt == AV_PIX_FMT_NONE) {
+                    printf("[ERROR] pixel format '%s' not found\n", optarg);
+                    op_free(&op_ctx);
+                    return 1;
+                }
+            }
+            break;
+        }
+    }
+    op_free(&op_ctx);
+
+    JsonWriter jw;
+    jw_init(&jw);
+    jw_object_begin(&jw, NULL);
+    jw_string(&jw, "ffmpeg", av_version_info());
+    jw_int(&jw, "cpu_count", av_cpu_count());
+    jw_int(&jw, "cpu_flags", av_get_cpu_flags());
+    jw_double(&jw, "seconds_per_case", seconds);
+
+    run_video(&jw, fourcc, pix_fmt, seconds);
+    if (!fourcc) {
+        run_audio(&jw, seconds);
+    }
+
+    jw_object_end(&jw);
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        printf("[ERROR] could not open \"%s\"\n", output);
+        jw_free(&jw);
+        return 1;
+    }
+    fprintf(out, "%s\n", jw.buf);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    jw_free(&jw);
+    return 0;
+}
@@ -0,0 +1,427 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+/* End-to-end throughput benchmark: synthetic NDI frames go through the same
+ * frame converter, encoders and send_packets as a pipeline output, into the
+ * `null` muxer, as fast as the encoder accepts them. One case per encoder
+ * profile, results as JSON.
+ *
+ * CPU time is split into the stages run on the feeding thread (source,
+ * convert, encode+mux calls) and whatever the encoder's own threads burn
+ * on top of that. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/cpu.h>
+#include <libavutil/pixdesc.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#elif !defined(__linux__)
+#include <sys/resource.h>
+#endif
+
+#include "common.h"
+#include "ffmpeg_output.h"
+#include "frame_converter.h"
+#include "json.h"
+#include "latency.h"
+#include "synthetic_source.h"
+#include "util.h"
+
+#define BENCH_MAX_CASES 16
+
+static const char *bench_default_cases[] = {
+    "libx264",
+    "libx264:preset=ultrafast:tune=zerolatency",
+    "libvpx:deadline=realtime:cpu-used=8",
+};
+
+typedef struct BenchOptions {
+    double seconds;
+    NDIlib_FourCC_video_type_e fourcc;
+    const char *fourcc_name;
+    int width;
+    int height;
+    int frame_rate_N;
+    int frame_rate_D;
+    int64_t video_bitrate;
+    const char *audio_encoder;
+    int64_t audio_bitrate;
+    const char *cases[BENCH_MAX_CASES];
+    int nb_cases;
+} BenchOptions;
+
+typedef struct BenchStages {
+    int64_t source;
+    int64_t convert;
+    int64_t encode;
+} BenchStages;
+
+/* Peak RSS since the last reset. Linux can reset the high-water mark, other
+ * systems report the peak of the whole process. */
+static void
+reset_peak_rss()
+{
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f) {
+        fputs("5", f);
+        fclose(f);
+    }
+#endif
+}
+
+static int64_t
+peak_rss_bytes()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof pmc)) {
+        return 0;
+    }
+    return (int64_t)pmc.PeakWorkingSetSize;
+#elif defined(__linux__)
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = 0;
+    if (!f) {
+        return 0;
+    }
+    while (fgets(line, sizeof line, f)) {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return (int64_t)kb * 1024;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (int64_t)usage.ru_maxrss; // bytes on macOS
+#endif
+}
+
+static int
+bench_setup(FFmpegOutputCtx *out, const BenchOptions *opts,
+            const char *encoder)
+{
+    AVRational frame_rate = { opts->frame_rate_N, opts->frame_rate_D };
+
+    if (ffmpeg_output_init(out, "null", "-") < 0
+        || ffmpeg_output_setup_video(out, encoder, opts->width, opts->height,
+                                     frame_rate, opts->video_bitrate,
+                                     AV_PIX_FMT_YUV420P)
+                   < 0) {
+        return -1;
+    }
+    if (opts->audio_encoder
+        && ffmpeg_output_setup_audio(out, (char *)opts->audio_encoder,
+                                     opts->audio_bitrate, 0)
+                   < 0) {
+        return -1;
+    }
+    return ffmpeg_output_write_header(out, NULL);
+}
+
+static int
+bench_run(FFmpegOutputCtx *out, const BenchOptions *opts,
+          SyntheticSourceCtx *source, int64_t *frames, BenchStages *stages)
+{
+    FrameConverterCtx *video_fc = new_frame_converter_ctx();
+    FrameConverterCtx *audio_fc = new_frame_converter_ctx();
+    NDIlib_video_frame_v2_t v_frame;
+    NDIlib_audio_frame_v2_t a_frame;
+    int ret = 0;
+
+    int64_t budget_us = (int64_t)(opts->seconds * 1000000);
+    int64_t start = get_current_ts_usec();
+
+    *frames = 0;
+    while (get_current_ts_usec() - start < budget_us) {
+        int64_t t0 = get_thread_cpu_usec();
+
+        ss_next_video(source, &v_frame);
+        if (out->nb_audio_tracks > 0) {
+            ss_next_audio(source, &a_frame);
+        }
+
+        int64_t t1 = get_thread_cpu_usec();
+        stages->source += t1 - t0;
+
+        AVFrame *frame = fc_ndi_video_frame_to_avframe(
+                video_fc, out->video_codec_ctx, &v_frame);
+
+        int64_t t2 = get_thread_cpu_usec();
+        stages->convert += t2 - t1;
+
+        if ((ret = ffmpeg_output_send_video_frame(out, frame)) < 0) {
+            break;
+        }
+
+        int64_t t3 = get_thread_cpu_usec();
+        stages->encode += t3 - t2;
+
+        if (out->nb_audio_tracks > 0) {
+            AVCodecContext *codec_ctx = out->audio_codec_ctx[0];
+            frame = fc_ndi_audio_frame_to_avframe(audio_fc, codec_ctx,
+                                                  &a_frame);
+            while (frame != NULL && ret >= 0) {
+                int64_t t4 = get_thread_cpu_usec();
+                stages->convert += t4 - t3;
+
+                ret = ffmpeg_output_send_audio_frame(out, 0, frame);
+
+                t3 = get_thread_cpu_usec();
+                stages->encode += t3 - t4;
+                frame = fc_ndi_audio_frame_to_avframe(audio_fc, codec_ctx,
+                                                      NULL);
+            }
+            stages->convert += get_thread_cpu_usec() - t3;
+            if (ret < 0) {
+                break;
+            }
+        }
+
+        (*frames)++;
+    }
+
+    free_frame_converter_ctx(&video_fc);
+    free_frame_converter_ctx(&audio_fc);
+    return ret;
+}
+
+static void
+bench_case(JsonWriter *jw, const BenchOptions *opts, const char *spec)
+{
+    char encoder[64];
+    const char *options = strchr(spec, ':');
+    size_t len = options ? (size_t)(options - spec) : strlen(spec);
+    snprintf(encoder, sizeof encoder, "%.*s", (int)len, spec);
+
+    SyntheticSourceCtx *source = new_synthetic_source_ctx();
+    FFmpegOutputCtx *out = new_ffmpeg_output_ctx();
+    OutputMetrics *metrics = new_output_metrics();
+    BenchStages stages = {};
+    int64_t frames = 0;
+
+    out->metrics = metrics;
+    out->video_options = options ? options + 1 : NULL;
+
+    jw_object_begin(jw, NULL);
+    jw_string(jw, "encoder", encoder);
+    jw_string(jw, "options", options ? options + 1 : "");
+
+    reset_peak_rss();
+
+    int ret = ss_setup_video(source, opts->fourcc, opts->width, opts->height,
+                             opts->frame_rate_N, opts->frame_rate_D);
+    if (ret >= 0 && opts->audio_encoder) {
+        ret = ss_setup_audio(source, 48000, 2);
+    }
+    if (ret < 0) {
+        jw_string(jw, "error", source->error_str);
+    }
+    else if (bench_setup(out, opts, encoder) < 0) {
+        jw_string(jw, "error", out->error_str);
+    }
+    else {
+        int64_t process_start = get_process_cpu_usec();
+        int64_t wall_start = get_current_ts_usec();
+
+        ret = bench_run(out, opts, source, &frames, &stages);
+
+        double wall = (double)(get_current_ts_usec() - wall_start) / 1e6;
+        int64_t process = get_process_cpu_usec() - process_start;
+        int64_t feeding = stages.source + stages.convert + stages.encode;
+        double per_frame = frames > 0 ? 1000.0 / (double)frames : 0;
+
+        if (ret < 0) {
+            jw_string(jw, "error", out->error_str);
+        }
+        jw_int(jw, "frames", frames);
+        jw_double(jw, "seconds", wall);
+        jw_double(jw, "fps", wall > 0 ? (double)frames / wall : 0);
+        jw_int(jw, "packets", atomic_load(&metrics->packets));
+        jw_int(jw, "bytes", atomic_load(&metrics->bytes));
+
+        // milliseconds of CPU per frame
+        jw_object_begin(jw, "cpu_ms_per_frame");
+        jw_double(jw, "source", (double)stages.source / 1000 * per_frame);
+        jw_double(jw, "convert", (double)stages.convert / 1000 * per_frame);
+        jw_double(jw, "encode", (double)stages.encode / 1000 * per_frame);
+        jw_double(jw, "encoder_threads",
+                  (double)(process - feeding) / 1000 * per_frame);
+        jw_double(jw, "total", (double)process / 1000 * per_frame);
+        jw_object_end(jw);
+        jw_double(jw, "cores_used", wall > 0 ? (double)process / 1e6 / wall
+                                            : 0);
+    }
+    jw_int(jw, "peak_rss_bytes", peak_rss_bytes());
+    jw_object_end(jw);
+
+    fprintf(stderr, "%s: %lld frames\n", spec, (long long)frames);
+
+    free_ffmpeg_output_ctx(&out);
+    free_output_metrics(&metrics);
+    free_synthetic_source_ctx(&source);
+}
+
+const ProgramOption options[] = {
+    { "t,time", "seconds per encoder (optional, by default '10')", 0 },
+    { "e,encoder",
+      "encoder with options, e.g. 'libx264:preset=fast', repeatable "
+      "(optional, by default libx264 and libvpx profiles)",
+      0 },
+    { "fourcc", "source FourCC (optional, by default 'UYVY')", 0 },
+    { "size", "source size WxH (optional, by default '1920x1080')", 0 },
+    { "rate", "source frame rate N/D (optional, by default '30000/1001')", 0 },
+    { "video_bitrate", "video bitrate (optional, by default '6000000')", 0 },
+    { "audio_codec",
+      "audio encoder, 'none' disables audio (optional, by default "
+      "'libopus')",
+      0 },
+    { "o,output", "write JSON to the file (optional, by default stdout)", 0 },
+    { "h,help", "show help", 1 },
+    { NULL, NULL, 0 },
+};
+
+int
+main(int argc, char **argv)
+{
+    BenchOptions opts = {
+        .seconds = 10,
+        .fourcc = NDIlib_FourCC_video_type_UYVY,
+        .fourcc_name = "UYVY",
+        .width = 1920,
+        .height = 1080,
+        .frame_rate_N = 30000,
+        .frame_rate_D = 1001,
+        .video_bitrate = 6000000,
+        .audio_encoder = "libopus",
+        .audio_bitrate = 128000,
+    };
+    const char *output = NULL;
+
+    const ProgramOption *opt = NULL;
+    OptionParserCtx *op_ctx = op_init(options);
+    int c;
+    char *end;
+
+    for (; (c = op_parse(argc, argv, op_ctx, &opt)) != -1;) {
+        switch (c) {
+        case 't':
+            opts.seconds = strtod(optarg, &end);
+            if (end == optarg || opts.seconds <= 0) {
+                printf("couldn't convert \"%s\" to number\n", optarg);
+                op_free(&op_ctx);
+                return 1;
+            }
+            break;
+        case 'e':
+            if (opts.nb_cases < BENCH_MAX_CASES) {
+                opts.cases[opts.nb_cases++] = optarg;
+            }
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'h':
+            op_print_help(argv[0], op_ctx);
+            op_free(&op_ctx);
+            return 0;
+        default:
+            if (opt == NULL) {
+                break;
+            }
+            if (strcmp(opt->name, "fourcc") == 0) {
+                if (ss_fourcc_from_name(optarg, &opts.fourcc) < 0) {
+                    printf("[ERROR] unknown FourCC '%s'\n", optarg);
+                    op_free(&op_ctx);
+                    return 1;
+                }
+                opts.fourcc_name = optarg;
+            }
+            else if (strcmp(opt->name, "size") == 0) {
+                if (sscanf(optarg, "%dx%d", &opts.width, &opts.height) != 2) {
+                    printf("[ERROR] invalid size '%s'\n", optarg);
+                    op_free(&op_ctx);
+                    return 1;
+                }
+            }
+            else if (strcmp(opt->name, "rate") == 0) {
+                if (sscanf(optarg, "%d/%d", &opts.frame_rate_N,
+                           &opts.frame_rate_D)
+                    != 2) {
+                    printf("[ERROR] invalid frame rate '%s'\n", optarg);
+                    op_free(&op_ctx);
+                    return 1;
+                }
+            }
+            else if (strcmp(opt->name, "video_bitrate") == 0) {
+                long long si = strtoll(optarg, &end, 10);
+                if (end == optarg) {
+                    printf("couldn't convert \"%s\" to number\n", optarg);
+                    op_free(&op_ctx);
+                    return 1;
+                }
+                opts.video_bitrate = (int64_t)si;
+            }
+            else if (strcmp(opt->name, "audio_codec") == 0) {
+                opts.audio_encoder = strcmp(optarg, "none") == 0 ? NULL
+                                                                  : optarg;
+            }
+            break;
+        }
+    }
+    op_free(&op_ctx);
+
+    if (opts.nb_cases == 0) {
+        for (size_t i = 0; i < sizeof bench_default_cases
+                                       / sizeof *bench_default_cases;
+             ++i) {
+            opts.cases[opts.nb_cases++] = bench_default_cases[i];
+        }
+    }
+
+    av_log_set_level(AV_LOG_ERROR);
+
+    JsonWriter jw;
+    jw_init(&jw);
+    jw_object_begin(&jw, NULL);
+    jw_string(&jw, "ffmpeg", av_version_info());
+    jw_int(&jw, "cpu_count", av_cpu_count());
+    jw_string(&jw, "fourcc", opts.fourcc_name);
+    jw_int(&jw, "width", opts.width);
+    jw_int(&jw, "height", opts.height);
+    jw_string(&jw, "audio_encoder",
+              opts.audio_encoder ? opts.audio_encoder : "none");
+
+    jw_array_begin(&jw, "results");
+    for (int i = 0; i < opts.nb_cases; ++i) {
+        bench_case(&jw, &opts, opts.cases[i]);
+    }
+    jw_array_end(&jw);
+    jw_object_end(&jw);
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        printf("[ERROR] could not open \"%s\"\n", output);
+        jw_free(&jw);
+        return 1;
+    }
+    fprintf(out, "%s\n", jw.buf);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    jw_free(&jw);
+    return 0;
+}
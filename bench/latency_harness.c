@@ -0,0 +1,527 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+/* Glass-to-glass latency harness. Synthetic frames get the capture time
+ * burned into their pixels (ss_stamp) and are sent in real time through the
+ * converter, encoder and mpegts muxer to a local UDP port or pipe. A reader
+ * thread demuxes and decodes that stream with libavcodec, reads the stamp
+ * back and records now - stamp, so the numbers include encoder lookahead,
+ * muxer buffering and decoder delay, everything but the display. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/pixdesc.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "common.h"
+#include "ffmpeg_output.h"
+#include "frame_converter.h"
+#include "json.h"
+#include "latency.h"
+#include "synthetic_source.h"
+#include "thread.h"
+#include "util.h"
+
+#define HARNESS_MAX_CASES 16
+#define HARNESS_DRAIN_MS 1000
+
+static const char *harness_default_cases[] = {
+    "libx264:preset=ultrafast:tune=zerolatency",
+    "libx264",
+    "libvpx:deadline=realtime:cpu-used=8:lag-in-frames=0",
+};
+
+typedef struct HarnessOptions {
+    double seconds;
+    double warmup;
+    NDIlib_FourCC_video_type_e fourcc;
+    const char *fourcc_name;
+    int width;
+    int height;
+    int out_width;
+    int out_height;
+    int frame_rate_N;
+    int frame_rate_D;
+    int64_t video_bitrate;
+    const char *transport;
+    int port;
+    const char *cases[HARNESS_MAX_CASES];
+    int nb_cases;
+} HarnessOptions;
+
+typedef struct HarnessReader {
+    char url[64];
+    int64_t measure_from; // stamps older than this are warmup
+    Histogram *latency;
+    _Atomic(int64_t) decoded;
+    _Atomic(int64_t) unreadable;
+    _Atomic(int) stop;
+    _Atomic(int) ready;
+    char error[AV_ERROR_MAX_STRING_SIZE + 100];
+} HarnessReader;
+
+static int
+reader_interrupt_cb(void *opaque)
+{
+    HarnessReader *reader = opaque;
+    return atomic_load(&reader->stop);
+}
+
+static void
+reader_frame(HarnessReader *reader, const AVFrame *frame)
+{
+    int64_t now = get_current_ts_usec();
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    uint64_t stamp;
+
+    atomic_fetch_add(&reader->decoded, 1);
+
+    if (!desc || desc->comp[0].depth != 8
+        || (desc->flags & AV_PIX_FMT_FLAG_RGB)
+        || ss_read_stamp(frame->data[0], frame->linesize[0], frame->width,
+                         frame->height, &stamp)
+                   < 0) {
+        atomic_fetch_add(&reader->unreadable, 1);
+        return;
+    }
+    if ((int64_t)stamp >= reader->measure_from) {
+        hist_record(reader->latency, now - (int64_t)stamp);
+    }
+}
+
+static void
+reader_run(void *arg)
+{
+    HarnessReader *reader = arg;
+    AVFormatContext *in = avformat_alloc_context();
+    AVCodecContext *dec = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    AVDictionary *opts = NULL;
+    int ret, stream = -1;
+
+    in->interrupt_callback.callback = reader_interrupt_cb;
+    in->interrupt_callback.opaque = reader;
+
+    av_dict_set(&opts, "fflags", "nobuffer", 0);
+    av_dict_set(&opts, "probesize", "65536", 0);
+    av_dict_set(&opts, "analyzeduration", "200000", 0);
+
+    atomic_store(&reader->ready, 1);
+
+    if ((ret = avformat_open_input(&in, reader->url,
+                                   av_find_input_format("mpegts"), &opts))
+        < 0) {
+        av_error_fmt(reader->error, "could not open input!", ret);
+        goto end;
+    }
+    if ((ret = avformat_find_stream_info(in, NULL)) < 0) {
+        av_error_fmt(reader->error, "could not read stream info!", ret);
+        goto end;
+    }
+
+    stream = av_find_best_stream(in, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (stream < 0) {
+        sprintf(reader->error, "%s", "no video stream in output");
+        goto end;
+    }
+
+    const AVCodec *codec
+            = avcodec_find_decoder(in->streams[stream]->codecpar->codec_id);
+    dec = avcodec_alloc_context3(codec);
+    avcodec_parameters_to_context(dec, in->streams[stream]->codecpar);
+    dec->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    dec->thread_type = FF_THREAD_SLICE; // frame threads add a frame each
+
+    if ((ret = avcodec_open2(dec, codec, NULL)) < 0) {
+        av_error_fmt(reader->error, "could not open decoder!", ret);
+        goto end;
+    }
+
+    while (av_read_frame(in, pkt) >= 0) {
+        if (pkt->stream_index == stream
+            && avcodec_send_packet(dec, pkt) >= 0) {
+            while (avcodec_receive_frame(dec, frame) >= 0) {
+                reader_frame(reader, frame);
+                av_frame_unref(frame);
+            }
+        }
+        av_packet_unref(pkt);
+    }
+
+end:
+    av_dict_free(&opts);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec);
+    avformat_close_input(&in);
+}
+
+static int
+harness_open_transport(const HarnessOptions *opts, char *out_url,
+                       size_t out_size, HarnessReader *reader, int *fds,
+                       char *error)
+{
+    if (strcmp(opts->transport, "udp") == 0) {
+        snprintf(out_url, out_size, "udp://127.0.0.1:%d?pkt_size=1316",
+                 opts->port);
+        snprintf(reader->url, sizeof reader->url,
+                 "udp://127.0.0.1:%d?overrun_nonfatal=1", opts->port);
+        return 0;
+    }
+    if (strcmp(opts->transport, "pipe") == 0) {
+#ifdef _WIN32
+        sprintf(error, "%s", "pipe transport is not supported on windows");
+        return -1;
+#else
+        if (pipe(fds) < 0) {
+            sprintf(error, "%s", "could not create pipe");
+            return -1;
+        }
+        snprintf(out_url, out_size, "pipe:%d", fds[1]);
+        snprintf(reader->url, sizeof reader->url, "pipe:%d", fds[0]);
+        return 0;
+#endif
+    }
+    sprintf(error, "unknown transport '%s'", opts->transport);
+    return -1;
+}
+
+static void
+harness_case(JsonWriter *jw, const HarnessOptions *opts, const char *spec)
+{
+    char encoder[64];
+    const char *options = strchr(spec, ':');
+    size_t len = options ? (size_t)(options - spec) : strlen(spec);
+    snprintf(encoder, sizeof encoder, "%.*s", (int)len, spec);
+
+    HarnessReader *reader = calloc(1, sizeof(HarnessReader));
+    reader->latency = calloc(1, sizeof(Histogram));
+    SyntheticSourceCtx *source = new_synthetic_source_ctx();
+    FrameConverterCtx *fc_ctx = new_frame_converter_ctx();
+    FFmpegOutputCtx *out = new_ffmpeg_output_ctx();
+    out->video_options = options ? options + 1 : NULL;
+
+    char out_url[64];
+    char error[AV_ERROR_MAX_STRING_SIZE + 100] = "";
+    int fds[2] = { -1, -1 };
+    int64_t sent = 0;
+    Thread thread;
+    int reader_started = 0;
+
+    AVRational frame_rate = { opts->frame_rate_N, opts->frame_rate_D };
+    AVDictionary *mux_opts = NULL;
+    av_dict_set(&mux_opts, "flush_packets", "1", 0);
+    av_dict_set(&mux_opts, "max_delay", "0", 0);
+
+    int ret = ss_setup_video(source, opts->fourcc, opts->width, opts->height,
+                             opts->frame_rate_N, opts->frame_rate_D);
+    if (ret < 0) {
+        snprintf(error, sizeof error, "%s", source->error_str);
+    }
+    else {
+        ret = harness_open_transport(opts, out_url, sizeof out_url, reader,
+                                     fds, error);
+    }
+    if (ret >= 0 && thread_create(&thread, reader_run, reader) < 0) {
+        sprintf(error, "%s", "could not start reader thread");
+        ret = -1;
+    }
+
+    if (ret >= 0) {
+        reader_started = 1;
+        // the udp reader has to be bound before the first packet goes out
+        while (!atomic_load(&reader->ready)) {
+            thread_sleep_ms(1);
+        }
+        thread_sleep_ms(100);
+
+        if (ffmpeg_output_init(out, "mpegts", out_url) < 0
+            || ffmpeg_output_setup_video(out, encoder, opts->out_width,
+                                         opts->out_height, frame_rate,
+                                         opts->video_bitrate,
+                                         AV_PIX_FMT_YUV420P)
+                       < 0
+            || ffmpeg_output_write_header(out, &mux_opts) < 0) {
+            snprintf(error, sizeof error, "%s", out->error_str);
+        }
+        else {
+            int64_t frame_us = (int64_t)1000000 * opts->frame_rate_D
+                               / opts->frame_rate_N;
+            int64_t start = get_current_ts_usec();
+            int64_t duration = (int64_t)(opts->seconds * 1000000);
+            reader->measure_from = start + (int64_t)(opts->warmup * 1000000);
+
+            for (;;) {
+                int64_t next = start + sent * frame_us;
+                int64_t now = get_current_ts_usec();
+                if (next - start >= duration) {
+                    break;
+                }
+                if (next > now) {
+                    thread_sleep_ms((int)((next - now) / 1000));
+                }
+
+                NDIlib_video_frame_v2_t v_frame;
+                ss_next_video(source, &v_frame);
+                ss_stamp(source, (uint64_t)get_current_ts_usec());
+
+                AVFrame *frame = fc_ndi_video_frame_to_avframe(
+                        fc_ctx, out->video_codec_ctx, &v_frame);
+                if (ffmpeg_output_send_video_frame(out, frame) < 0) {
+                    snprintf(error, sizeof error, "%s", out->error_str);
+                    break;
+                }
+                sent++;
+            }
+            av_write_trailer(out->o_ctx);
+        }
+    }
+
+    ffmpeg_output_close(out);
+#ifndef _WIN32
+    if (fds[1] >= 0) {
+        close(fds[1]); // EOF for the pipe reader
+    }
+#endif
+    if (reader_started) {
+        thread_sleep_ms(HARNESS_DRAIN_MS);
+        atomic_store(&reader->stop, 1);
+        thread_join(thread);
+    }
+#ifndef _WIN32
+    if (fds[0] >= 0) {
+        close(fds[0]);
+    }
+#endif
+
+    if (!error[0] && reader->error[0]) {
+        snprintf(error, sizeof error, "%s", reader->error);
+    }
+
+    Histogram *h = reader->latency;
+    jw_object_begin(jw, NULL);
+    jw_string(jw, "encoder", encoder);
+    jw_string(jw, "options", options ? options + 1 : "");
+    if (error[0]) {
+        jw_string(jw, "error", error);
+    }
+    jw_int(jw, "frames_sent", sent);
+    jw_int(jw, "frames_decoded", atomic_load(&reader->decoded));
+    jw_int(jw, "frames_unreadable", atomic_load(&reader->unreadable));
+    jw_int(jw, "frames_measured", (int64_t)atomic_load(&h->total));
+    jw_object_begin(jw, "latency_ms");
+    jw_double(jw, "p50", (double)hist_quantile(h, 0.5) / 1000);
+    jw_double(jw, "p90", (double)hist_quantile(h, 0.9) / 1000);
+    jw_double(jw, "p99", (double)hist_quantile(h, 0.99) / 1000);
+    jw_double(jw, "p999", (double)hist_quantile(h, 0.999) / 1000);
+    jw_double(jw, "max", (double)atomic_load(&h->max) / 1000);
+    jw_object_end(jw);
+    jw_object_end(jw);
+
+    fprintf(stderr, "%s: p50 %.1f ms, p99 %.1f ms\n", spec,
+            (double)hist_quantile(h, 0.5) / 1000,
+            (double)hist_quantile(h, 0.99) / 1000);
+
+    av_dict_free(&mux_opts);
+    free_ffmpeg_output_ctx(&out);
+    free_frame_converter_ctx(&fc_ctx);
+    free_synthetic_source_ctx(&source);
+    free(reader->latency);
+    free(reader);
+}
+
+const ProgramOption options[] = {
+    { "t,time", "seconds per encoder (optional, by default '10')", 0 },
+    { "warmup",
+      "seconds ignored at the start of each run (optional, by default '2')",
+      0 },
+    { "e,encoder",
+      "encoder with options, e.g. 'libx264:preset=fast', repeatable "
+      "(optional, by default libx264 and libvpx profiles)",
+      0 },
+    { "fourcc", "source FourCC (optional, by default 'UYVY')", 0 },
+    { "size", "source size WxH (optional, by default '1920x1080')", 0 },
+    { "out_size", "encoded size WxH (optional, by default the source size)",
+      0 },
+    { "rate", "source frame rate N/D (optional, by default '30000/1001')", 0 },
+    { "video_bitrate", "video bitrate (optional, by default '6000000')", 0 },
+    { "transport", "udp or pipe (optional, by default 'udp')", 0 },
+    { "port", "udp port (optional, by default '23000')", 0 },
+    { "o,output", "write JSON to the file (optional, by default stdout)", 0 },
+    { "h,help", "show help", 1 },
+    { NULL, NULL, 0 },
+};
+
+int
+main(int argc, char **argv)
+{
+    HarnessOptions opts = {
+        .seconds = 10,
+        .warmup = 2,
+        .fourcc = NDIlib_FourCC_video_type_UYVY,
+        .fourcc_name = "UYVY",
+        .width = 1920,
+        .height = 1080,
+        .frame_rate_N = 30000,
+        .frame_rate_D = 1001,
+        .video_bitrate = 6000000,
+        .transport = "udp",
+        .port = 23000,
+    };
+    const char *output = NULL;
+
+    const ProgramOption *opt = NULL;
+    OptionParserCtx *op_ctx = op_init(options);
+    int c;
+    char *end;
+
+    for (; (c = op_parse(argc, argv, op_ctx, &opt)) != -1;) {
+        switch (c) {
+        case 't':
+            opts.seconds = strtod(optarg, &end);
+            if (end == optarg || opts.seconds <= 0) {
+                printf("couldn't convert \"%s\" to number\n", optarg);
+                op_free(&op_ctx);
+                return 1;
+            }
+            break;
+        case 'e':
+            if (opts.nb_cases < HARNESS_MAX_CASES) {
+                opts.cases[opts.nb_cases++] = optarg;
+            }
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'h':
+            op_print_help(argv[0], op_ctx);
+            op_free(&op_ctx);
+            return 0;
+        default:
+            if (opt == NULL) {
+                break;
+            }
+            if (strcmp(opt->name, "warmup") == 0) {
+                opts.warmup = strtod(optarg, &end);
+                if (end == optarg) {
+                    printf("couldn't convert \"%s\" to number\n", optarg);
+                    op_free(&op_ctx);
+                    return 1;
+                }
+            }
+            else if (strcmp(opt->name, "fourcc") == 0) {
+                if (ss_fourcc_from_name(optarg, &opts.fourcc) < 0) {
+                    printf("[ERROR] unknown FourCC '%s'\n", optarg);
+                    op_free(&op_ctx);
+                    return 1;
+                }
+                opts.fourcc_name = optarg;
+            }
+            else if (strcmp(opt->name, "size") == 0
+                     || strcmp(opt->name, "out_size") == 0) {
+                int *w = opt->name[0] == 's' ? &opts.width : &opts.out_width;
+                int *h = opt->name[0] == 's' ? &opts.height : &opts.out_height;
+                if (sscanf(optarg, "%dx%d", w, h) != 2) {
+                    printf("[ERROR] invalid size '%s'\n", optarg);
+                    op_free(&op_ctx);
+                    return 1;
+                }
+            }
+            else if (strcmp(opt->name, "rate") == 0) {
+                if (sscanf(optarg, "%d/%d", &opts.frame_rate_N,
+                           &opts.frame_rate_D)
+                    != 2) {
+                    printf("[ERROR] invalid frame rate '%s'\n", optarg);
+                    op_free(&op_ctx);
+                    return 1;
+                }
+            }
+            else if (strcmp(opt->name, "video_bitrate") == 0) {
+                long long si = strtoll(optarg, &end, 10);
+                if (end == optarg) {
+                    printf("couldn't convert \"%s\" to number\n", optarg);
+                    op_free(&op_ctx);
+                    return 1;
+                }
+                opts.video_bitrate = (int64_t)si;
+            }
+            else if (strcmp(opt->name, "transport") == 0) {
+                opts.transport = optarg;
+            }
+            else if (strcmp(opt->name, "port") == 0) {
+                long si = strtol(optarg, &end, 10);
+                if (end == optarg || si <= 0 || si > 65535) {
+                    printf("invalid port \"%s\"\n", optarg);
+                    op_free(&op_ctx);
+                    return 1;
+                }
+                opts.port = (int)si;
+            }
+            break;
+        }
+    }
+    op_free(&op_ctx);
+
+    if (opts.out_width == 0) {
+        opts.out_width = opts.width;
+        opts.out_height = opts.height;
+    }
+    if (opts.nb_cases == 0) {
+        for (size_t i = 0; i < sizeof harness_default_cases
+                                       / sizeof *harness_default_cases;
+             ++i) {
+            opts.cases[opts.nb_cases++] = harness_default_cases[i];
+        }
+    }
+
+    av_log_set_level(AV_LOG_ERROR);
+    avformat_network_init();
+
+    JsonWriter jw;
+    jw_init(&jw);
+    jw_object_begin(&jw, NULL);
+    jw_string(&jw, "ffmpeg", av_version_info());
+    jw_string(&jw, "fourcc", opts.fourcc_name);
+    jw_int(&jw, "width", opts.width);
+    jw_int(&jw, "height", opts.height);
+    jw_int(&jw, "out_width", opts.out_width);
+    jw_int(&jw, "out_height", opts.out_height);
+    jw_double(&jw, "frame_rate",
+              (double)opts.frame_rate_N / opts.frame_rate_D);
+    jw_string(&jw, "muxer", "mpegts");
+    jw_string(&jw, "transport", opts.transport);
+
+    jw_array_begin(&jw, "results");
+    for (int i = 0; i < opts.nb_cases; ++i) {
+        harness_case(&jw, &opts, opts.cases[i]);
+    }
+    jw_array_end(&jw);
+    jw_object_end(&jw);
+
+    avformat_network_deinit();
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        printf("[ERROR] could not open \"%s\"\n", output);
+        jw_free(&jw);
+        return 1;
+    }
+    fprintf(out, "%s\n", jw.buf);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    jw_free(&jw);
+    return 0;
+}
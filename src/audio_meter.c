@@ -0,0 +1,282 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "audio_meter.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define AM_SSE2
+#endif
+
+// keeps the filters out of denormals in silence, far below any level
+#define AM_DENORMAL_BIAS 1e-15f
+
+AudioMeterCtx *
+new_audio_meter_ctx()
+{
+    AudioMeterCtx *ctx = malloc(sizeof(AudioMeterCtx));
+    memset(ctx, 0, sizeof(AudioMeterCtx));
+    return ctx;
+}
+
+int
+free_audio_meter_ctx(AudioMeterCtx **ctx)
+{
+    free(*ctx);
+    *ctx = NULL;
+    return 0;
+}
+
+/* The BS.1770 pre-filter for any sample rate, as derived in libebur128:
+ * a high shelf for the head and a high pass (RLB weighting). */
+static void
+am_reset(AudioMeterCtx *ctx, int nb_channels, int sample_rate)
+{
+    memset(ctx, 0, sizeof(AudioMeterCtx));
+    ctx->sample_rate = sample_rate;
+    ctx->nb_channels = nb_channels;
+    ctx->block_size = sample_rate / 10;
+
+    double f0 = 1681.974450955533;
+    double q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / sample_rate);
+    double vh = pow(10.0, 3.999843853973347 / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+
+    ctx->shelf[0] = (float)((vh + vb * k / q + k * k) / a0);
+    ctx->shelf[1] = (float)(2.0 * (k * k - vh) / a0);
+    ctx->shelf[2] = (float)((vh - vb * k / q + k * k) / a0);
+    ctx->shelf[3] = (float)(2.0 * (k * k - 1.0) / a0);
+    ctx->shelf[4] = (float)((1.0 - k / q + k * k) / a0);
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / sample_rate);
+    a0 = 1.0 + k / q + k * k;
+
+    ctx->pass[0] = 1.0f;
+    ctx->pass[1] = -2.0f;
+    ctx->pass[2] = 1.0f;
+    ctx->pass[3] = (float)(2.0 * (k * k - 1.0) / a0);
+    ctx->pass[4] = (float)((1.0 - k / q + k * k) / a0);
+}
+
+static void
+am_channel(AudioMeterCtx *ctx, const float *in, int c, int nb_samples,
+           float *frame_peak)
+{
+    const float *s = ctx->shelf;
+    const float *p = ctx->pass;
+    float z1 = ctx->state[0][c];
+    float z2 = ctx->state[1][c];
+    float w1 = ctx->state[2][c];
+    float w2 = ctx->state[3][c];
+    float peak = *frame_peak;
+    float square = 0;
+    float weighted = 0;
+
+    // transposed direct form II, in the order of the SIMD version
+    for (int i = 0; i < nb_samples; ++i) {
+        float x = in[i];
+        float a = fabsf(x);
+        peak = peak > a ? peak : a;
+        square = square + x * x;
+
+        x = x + AM_DENORMAL_BIAS;
+        float y = s[0] * x + z1;
+        z1 = (s[1] * x - s[3] * y) + z2;
+        z2 = s[2] * x - s[4] * y;
+
+        float w = p[0] * y + w1;
+        w1 = (p[1] * y - p[3] * w) + w2;
+        w2 = p[2] * y - p[4] * w;
+        weighted = weighted + w * w;
+    }
+
+    ctx->state[0][c] = z1;
+    ctx->state[1][c] = z2;
+    ctx->state[2][c] = w1;
+    ctx->state[3][c] = w2;
+    *frame_peak = peak;
+    ctx->square[ctx->block][c] += square;
+    ctx->weighted[ctx->block][c] += weighted;
+}
+
+#ifdef AM_SSE2
+// four channels from c on, one in each lane
+static void
+am_channels4(AudioMeterCtx *ctx, const float *const *in, int c,
+             int nb_samples, float *frame_peak)
+{
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 bias = _mm_set1_ps(AM_DENORMAL_BIAS);
+    const __m128 s0 = _mm_set1_ps(ctx->shelf[0]);
+    const __m128 s1 = _mm_set1_ps(ctx->shelf[1]);
+    const __m128 s2 = _mm_set1_ps(ctx->shelf[2]);
+    const __m128 s3 = _mm_set1_ps(ctx->shelf[3]);
+    const __m128 s4 = _mm_set1_ps(ctx->shelf[4]);
+    const __m128 p0 = _mm_set1_ps(ctx->pass[0]);
+    const __m128 p1 = _mm_set1_ps(ctx->pass[1]);
+    const __m128 p2 = _mm_set1_ps(ctx->pass[2]);
+    const __m128 p3 = _mm_set1_ps(ctx->pass[3]);
+    const __m128 p4 = _mm_set1_ps(ctx->pass[4]);
+
+    __m128 z1 = _mm_loadu_ps(&ctx->state[0][c]);
+    __m128 z2 = _mm_loadu_ps(&ctx->state[1][c]);
+    __m128 w1 = _mm_loadu_ps(&ctx->state[2][c]);
+    __m128 w2 = _mm_loadu_ps(&ctx->state[3][c]);
+    __m128 peak = _mm_loadu_ps(&frame_peak[c]);
+    __m128 square = _mm_setzero_ps();
+    __m128 weighted = _mm_setzero_ps();
+
+    for (int i = 0; i < nb_samples; ++i) {
+        __m128 x = _mm_set_ps(in[c + 3][i], in[c + 2][i], in[c + 1][i],
+                              in[c][i]);
+        peak = _mm_max_ps(peak, _mm_andnot_ps(sign, x));
+        square = _mm_add_ps(square, _mm_mul_ps(x, x));
+
+        x = _mm_add_ps(x, bias);
+        __m128 y = _mm_add_ps(_mm_mul_ps(s0, x), z1);
+        z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(s1, x), _mm_mul_ps(s3, y)), z2);
+        z2 = _mm_sub_ps(_mm_mul_ps(s2, x), _mm_mul_ps(s4, y));
+
+        __m128 w = _mm_add_ps(_mm_mul_ps(p0, y), w1);
+        w1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(p1, y), _mm_mul_ps(p3, w)), w2);
+        w2 = _mm_sub_ps(_mm_mul_ps(p2, y), _mm_mul_ps(p4, w));
+        weighted = _mm_add_ps(weighted, _mm_mul_ps(w, w));
+    }
+
+    _mm_storeu_ps(&ctx->state[0][c], z1);
+    _mm_storeu_ps(&ctx->state[1][c], z2);
+    _mm_storeu_ps(&ctx->state[2][c], w1);
+    _mm_storeu_ps(&ctx->state[3][c], w2);
+    _mm_storeu_ps(&frame_peak[c], peak);
+
+    float *sq = &ctx->square[ctx->block][c];
+    float *wt = &ctx->weighted[ctx->block][c];
+    _mm_storeu_ps(sq, _mm_add_ps(_mm_loadu_ps(sq), square));
+    _mm_storeu_ps(wt, _mm_add_ps(_mm_loadu_ps(wt), weighted));
+}
+#endif
+
+static float
+am_db(float power)
+{
+    float db = power > 0 ? 10.0f * log10f(power) : AUDIO_METER_FLOOR;
+    return db > AUDIO_METER_FLOOR ? db : AUDIO_METER_FLOOR;
+}
+
+static void
+am_end_block(AudioMeterCtx *ctx, const float *block_peak)
+{
+    AudioLevels *levels = &ctx->levels;
+    int b = ctx->block;
+
+    memcpy(ctx->peak[b], block_peak, sizeof(ctx->peak[b]));
+    if (ctx->nb_blocks < AUDIO_METER_BLOCKS) {
+        ctx->nb_blocks++;
+    }
+
+    int64_t samples = (int64_t)ctx->nb_blocks * ctx->block_size;
+    levels->nb_channels = ctx->nb_channels;
+
+    for (int c = 0; c < ctx->nb_channels; ++c) {
+        float peak = 0;
+        float square = 0;
+        float weighted = 0;
+
+        for (int i = 0; i < ctx->nb_blocks; ++i) {
+            peak = ctx->peak[i][c] > peak ? ctx->peak[i][c] : peak;
+            square += ctx->square[i][c];
+            weighted += ctx->weighted[i][c];
+        }
+
+        float momentary = -0.691f + am_db(weighted / samples);
+
+        levels->peak[c] = am_db(peak * peak);
+        levels->rms[c] = am_db(square / samples);
+        levels->momentary[c] = momentary > AUDIO_METER_FLOOR
+                                       ? momentary
+                                       : AUDIO_METER_FLOOR;
+    }
+
+    ctx->block = (b + 1) % AUDIO_METER_BLOCKS;
+    memset(ctx->square[ctx->block], 0, sizeof(ctx->square[0]));
+    memset(ctx->weighted[ctx->block], 0, sizeof(ctx->weighted[0]));
+}
+
+int
+am_process(AudioMeterCtx *ctx, const float *const *planes, int nb_channels,
+           int nb_samples, int sample_rate, float *peak)
+{
+    float frame_peak[AUDIO_METER_MAX_CHANNELS] = {};
+    float block_peak[AUDIO_METER_MAX_CHANNELS];
+    int updated = 0;
+
+    if (nb_channels > AUDIO_METER_MAX_CHANNELS) {
+        nb_channels = AUDIO_METER_MAX_CHANNELS;
+    }
+    if (nb_channels != ctx->nb_channels || sample_rate != ctx->sample_rate) {
+        am_reset(ctx, nb_channels, sample_rate);
+    }
+
+    *peak = AUDIO_METER_FLOOR;
+    if (ctx->block_size <= 0) {
+        return 0;
+    }
+
+    memcpy(block_peak, ctx->peak[ctx->block], sizeof(block_peak));
+    if (ctx->block_fill == 0) {
+        memset(block_peak, 0, sizeof(block_peak));
+    }
+
+    const float *in[AUDIO_METER_MAX_CHANNELS];
+    for (int offset = 0; offset < nb_samples;) {
+        int n = ctx->block_size - ctx->block_fill;
+        n = n < nb_samples - offset ? n : nb_samples - offset;
+
+        for (int c = 0; c < nb_channels; ++c) {
+            in[c] = planes[c] + offset;
+        }
+
+        // block_peak holds the peak of the block in frame_peak's place
+        int c = 0;
+#ifdef AM_SSE2
+        for (; c + 4 <= nb_channels; c += 4) {
+            am_channels4(ctx, in, c, n, block_peak);
+        }
+#endif
+        for (; c < nb_channels; ++c) {
+            am_channel(ctx, in[c], c, n, &block_peak[c]);
+        }
+
+        for (c = 0; c < nb_channels; ++c) {
+            frame_peak[c] = block_peak[c] > frame_peak[c] ? block_peak[c]
+                                                          : frame_peak[c];
+        }
+
+        offset += n;
+        ctx->block_fill += n;
+        if (ctx->block_fill == ctx->block_size) {
+            am_end_block(ctx, block_peak);
+            ctx->block_fill = 0;
+            memset(block_peak, 0, sizeof(block_peak));
+            updated = 1;
+        }
+    }
+    memcpy(ctx->peak[ctx->block], block_peak, sizeof(block_peak));
+
+    for (int c = 0; c < nb_channels; ++c) {
+        float db = am_db(frame_peak[c] * frame_peak[c]);
+        *peak = db > *peak ? db : *peak;
+    }
+    return updated;
+}
@@ -0,0 +1,55 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef AUDIO_METER_H
+#define AUDIO_METER_H
+
+#define AUDIO_METER_MAX_CHANNELS 16 // the rest are not metered
+#define AUDIO_METER_BLOCKS 4        // 100 ms blocks of the 400 ms window
+#define AUDIO_METER_FLOOR (-144.0f) // level of digital silence
+
+typedef struct AudioLevels {
+    int nb_channels;
+    float peak[AUDIO_METER_MAX_CHANNELS];      // dBFS
+    float rms[AUDIO_METER_MAX_CHANNELS];       // dBFS
+    float momentary[AUDIO_METER_MAX_CHANNELS]; // LUFS, BS.1770 K-weighted
+} AudioLevels;
+
+/* Peak, RMS and momentary loudness of every channel over the last 400 ms,
+ * updated every 100 ms. The K-weighting filters run on four channels at
+ * a time. */
+typedef struct AudioMeterCtx {
+    int sample_rate;
+    int nb_channels;
+    float shelf[5]; // b0 b1 b2 a1 a2 of the high shelf
+    float pass[5];  // and of the high pass
+    float state[4][AUDIO_METER_MAX_CHANNELS];
+
+    int block_size; // samples of 100 ms
+    int block_fill;
+    float peak[AUDIO_METER_BLOCKS][AUDIO_METER_MAX_CHANNELS];
+    float square[AUDIO_METER_BLOCKS][AUDIO_METER_MAX_CHANNELS];
+    float weighted[AUDIO_METER_BLOCKS][AUDIO_METER_MAX_CHANNELS];
+    int block;     // the one being filled
+    int nb_blocks; // complete ones, up to AUDIO_METER_BLOCKS
+
+    AudioLevels levels;
+} AudioMeterCtx;
+
+AudioMeterCtx *
+new_audio_meter_ctx();
+
+int
+free_audio_meter_ctx(AudioMeterCtx **ctx);
+
+/* Meters planar float samples, a change of the format starts over.
+ * Returns 1 when ctx->levels was updated. `peak` is set to the highest
+ * sample of these samples, in dBFS. */
+int
+am_process(AudioMeterCtx *ctx, const float *const *planes, int nb_channels,
+           int nb_samples, int sample_rate, float *peak);
+
+#endif
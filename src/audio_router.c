@@ -0,0 +1,341 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "audio_router.h"
+
+#include <ctype.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define AR_SSE2
+#endif
+
+static char *
+ar_trim(char *str)
+{
+    while (isspace((unsigned char)*str)) {
+        str++;
+    }
+
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return str;
+}
+
+// a source channel counted from 1, stored from 0
+static int
+ar_parse_channel(const char *str, int *channel, char *error_str, size_t size)
+{
+    char *end;
+    long n = strtol(str, &end, 10);
+
+    if (end == str || *ar_trim(end) != '\0' || n < 1
+        || n > AUDIO_MAX_INPUTS) {
+        snprintf(error_str, size,
+                 "audio channel \"%s\" is not a number from 1 to %d", str,
+                 AUDIO_MAX_INPUTS);
+        return -1;
+    }
+    *channel = (int)n - 1;
+    return 0;
+}
+
+static int
+ar_parse_range(char *str, int *first, int *last, char *error_str,
+               size_t size)
+{
+    char *dash = strchr(str, '-');
+    *dash = '\0';
+
+    if (ar_parse_channel(str, first, error_str, size) < 0
+        || ar_parse_channel(dash + 1, last, error_str, size) < 0) {
+        return -1;
+    }
+    if (*last < *first) {
+        snprintf(error_str, size, "audio channels %d-%d are reversed",
+                 *first + 1, *last + 1);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+ar_add(AudioRoute *route, const AudioMix *mix, char *error_str, size_t size)
+{
+    int track = route->nb_tracks - 1;
+
+    if (route->track_channels[track] == AUDIO_MAX_TRACK_CHANNELS) {
+        snprintf(error_str, size, "audio track %d has more than %d channels",
+                 track + 1, AUDIO_MAX_TRACK_CHANNELS);
+        return -1;
+    }
+    route->channels[route->nb_channels++] = *mix;
+    route->track_channels[track]++;
+    return 0;
+}
+
+// "N-M>LAYOUT", with the coefficients swresample would use
+static int
+ar_parse_downmix(AudioRoute *route, char *str, char *error_str, size_t size)
+{
+    char *arrow = strchr(str, '>');
+    int first;
+    int last;
+
+    *arrow = '\0';
+    if (!strchr(str, '-')) {
+        snprintf(error_str, size, "audio downmix \"%s\" needs a range N-M",
+                 str);
+        return -1;
+    }
+    if (ar_parse_range(str, &first, &last, error_str, size) < 0) {
+        return -1;
+    }
+
+    int nb_in = last - first + 1;
+    if (nb_in > AUDIO_MAX_TERMS) {
+        snprintf(error_str, size, "audio downmix takes at most %d channels",
+                 AUDIO_MAX_TERMS);
+        return -1;
+    }
+
+    AVChannelLayout in_layout;
+    AVChannelLayout out_layout;
+    char *name = ar_trim(arrow + 1);
+
+    if (av_channel_layout_from_string(&out_layout, name) < 0) {
+        snprintf(error_str, size, "audio layout \"%s\" is not supported",
+                 name);
+        return -1;
+    }
+    if (out_layout.nb_channels > AUDIO_MAX_TRACK_CHANNELS) {
+        snprintf(error_str, size, "audio layout \"%s\" has too many channels",
+                 name);
+        av_channel_layout_uninit(&out_layout);
+        return -1;
+    }
+
+    double matrix[AUDIO_MAX_TRACK_CHANNELS * AUDIO_MAX_TERMS];
+    av_channel_layout_default(&in_layout, nb_in);
+    int ret = swr_build_matrix2(&in_layout, &out_layout, M_SQRT1_2,
+                                M_SQRT1_2, 0, 1, 1, matrix, nb_in,
+                                AV_MATRIX_ENCODING_NONE, NULL);
+    int nb_out = out_layout.nb_channels;
+    av_channel_layout_uninit(&in_layout);
+    av_channel_layout_uninit(&out_layout);
+
+    if (ret < 0) {
+        snprintf(error_str, size, "audio channels %d-%d can not be mixed "
+                                  "to \"%s\"",
+                 first + 1, last + 1, name);
+        return -1;
+    }
+
+    for (int o = 0; o < nb_out; ++o) {
+        AudioMix mix = {};
+        for (int i = 0; i < nb_in; ++i) {
+            double gain = matrix[o * nb_in + i];
+            if (gain != 0) {
+                mix.terms[mix.nb_terms].channel = first + i;
+                mix.terms[mix.nb_terms].gain = (float)gain;
+                mix.nb_terms++;
+            }
+        }
+        if (ar_add(route, &mix, error_str, size) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// "G*N+N+..."
+static int
+ar_parse_mix(AudioRoute *route, char *str, char *error_str, size_t size)
+{
+    AudioMix mix = {};
+
+    for (char *term = str; term;) {
+        char *next = strchr(term, '+');
+        if (next) {
+            *next++ = '\0';
+        }
+
+        if (mix.nb_terms == AUDIO_MAX_TERMS) {
+            snprintf(error_str, size, "audio mix takes at most %d channels",
+                     AUDIO_MAX_TERMS);
+            return -1;
+        }
+
+        AudioTerm *t = &mix.terms[mix.nb_terms++];
+        char *star = strchr(term, '*');
+        t->gain = 1;
+
+        if (star) {
+            char *end;
+            *star = '\0';
+            t->gain = strtof(term, &end);
+            if (end == term || *ar_trim(end) != '\0' || !isfinite(t->gain)) {
+                snprintf(error_str, size, "audio gain \"%s\" is invalid",
+                         ar_trim(term));
+                return -1;
+            }
+            term = star + 1;
+        }
+
+        if (ar_parse_channel(ar_trim(term), &t->channel, error_str, size)
+            < 0) {
+            return -1;
+        }
+        term = next;
+    }
+
+    return ar_add(route, &mix, error_str, size);
+}
+
+static int
+ar_parse_item(AudioRoute *route, char *item, char *error_str, size_t size)
+{
+    if (strchr(item, '>')) {
+        return ar_parse_downmix(route, item, error_str, size);
+    }
+    if (strchr(item, '-') && !strpbrk(item, "+*")) {
+        int first;
+        int last;
+
+        if (ar_parse_range(item, &first, &last, error_str, size) < 0) {
+            return -1;
+        }
+        for (int c = first; c <= last; ++c) {
+            AudioMix mix = { .terms = { { c, 1 } }, .nb_terms = 1 };
+            if (ar_add(route, &mix, error_str, size) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    return ar_parse_mix(route, item, error_str, size);
+}
+
+int
+ar_parse(AudioRoute *route, const char *str, char *error_str, size_t size)
+{
+    char buf[1024];
+
+    memset(route, 0, sizeof(AudioRoute));
+    snprintf(buf, sizeof buf, "%s", str);
+
+    for (char *track = buf; track;) {
+        char *next = strchr(track, '|');
+        if (next) {
+            *next++ = '\0';
+        }
+
+        if (route->nb_tracks == AUDIO_MAX_TRACKS) {
+            snprintf(error_str, size, "at most %d audio tracks are supported",
+                     AUDIO_MAX_TRACKS);
+            return -1;
+        }
+        route->track_offset[route->nb_tracks] = route->nb_channels;
+        route->nb_tracks++;
+
+        for (char *item = track; item;) {
+            char *next_item = strchr(item, ',');
+            if (next_item) {
+                *next_item++ = '\0';
+            }
+
+            item = ar_trim(item);
+            if (*item == '\0') {
+                snprintf(error_str, size, "audio track %d has an empty "
+                                          "channel",
+                         route->nb_tracks);
+                return -1;
+            }
+            if (ar_parse_item(route, item, error_str, size) < 0) {
+                return -1;
+            }
+            item = next_item;
+        }
+        track = next;
+    }
+
+    return 0;
+}
+
+static void
+ar_scale(float *dst, const float *src, float gain, int nb_samples)
+{
+    int i = 0;
+
+#ifdef AR_SSE2
+    __m128 g = _mm_set1_ps(gain);
+
+    for (; i + 4 <= nb_samples; i += 4) {
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), g));
+    }
+#endif
+
+    for (; i < nb_samples; ++i) {
+        dst[i] = src[i] * gain;
+    }
+}
+
+static void
+ar_accumulate(float *dst, const float *src, float gain, int nb_samples)
+{
+    int i = 0;
+
+#ifdef AR_SSE2
+    __m128 g = _mm_set1_ps(gain);
+
+    for (; i + 4 <= nb_samples; i += 4) {
+        __m128 x = _mm_mul_ps(_mm_loadu_ps(src + i), g);
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), x));
+    }
+#endif
+
+    for (; i < nb_samples; ++i) {
+        dst[i] = dst[i] + src[i] * gain;
+    }
+}
+
+void
+ar_mix(const AudioRoute *route, const float *const *in, int nb_in,
+       float *const *out, int nb_samples)
+{
+    for (int c = 0; c < route->nb_channels; ++c) {
+        const AudioMix *mix = &route->channels[c];
+        int first = 1;
+
+        for (int t = 0; t < mix->nb_terms; ++t) {
+            const AudioTerm *term = &mix->terms[t];
+            if (term->channel >= nb_in) {
+                continue;
+            }
+
+            if (first) {
+                ar_scale(out[c], in[term->channel], term->gain, nb_samples);
+            }
+            else {
+                ar_accumulate(out[c], in[term->channel], term->gain,
+                              nb_samples);
+            }
+            first = 0;
+        }
+
+        if (first) {
+            memset(out[c], 0, (size_t)nb_samples * sizeof(float));
+        }
+    }
+}
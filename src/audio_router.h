@@ -0,0 +1,52 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef AUDIO_ROUTER_H
+#define AUDIO_ROUTER_H
+
+#include <stddef.h>
+
+#define AUDIO_MAX_TRACKS 8
+#define AUDIO_MAX_TRACK_CHANNELS 8
+#define AUDIO_MAX_INPUTS 64 // highest source channel a route can take
+#define AUDIO_MAX_TERMS 16  // source channels mixed into one channel
+
+typedef struct AudioTerm {
+    int channel; // of the source, from 0
+    float gain;
+} AudioTerm;
+
+// one routed channel, the sum of its terms
+typedef struct AudioMix {
+    AudioTerm terms[AUDIO_MAX_TERMS];
+    int nb_terms;
+} AudioMix;
+
+/* "TRACK | TRACK ...", every TRACK a comma separated list of channels:
+ *   N          source channel N, counted from 1
+ *   N-M        source channels N to M, one channel each
+ *   G*N+...    a mix of source channels, each with an optional gain
+ *   N-M>LAYOUT channels N to M in the default FFmpeg layout of that many
+ *              channels, downmixed to LAYOUT ("mono", "stereo", "5.1", ...)
+ * The channels of all tracks are stored one after the other. */
+typedef struct AudioRoute {
+    AudioMix channels[AUDIO_MAX_TRACKS * AUDIO_MAX_TRACK_CHANNELS];
+    int nb_channels;
+    int track_channels[AUDIO_MAX_TRACKS];
+    int track_offset[AUDIO_MAX_TRACKS]; // first channel of every track
+    int nb_tracks;
+} AudioRoute;
+
+int
+ar_parse(AudioRoute *route, const char *str, char *error_str, size_t size);
+
+/* Computes every channel of `route` for nb_samples planar float samples.
+ * Source channels from nb_in on are silent. */
+void
+ar_mix(const AudioRoute *route, const float *const *in, int nb_in,
+       float *const *out, int nb_samples);
+
+#endif
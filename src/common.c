@@ -11,6 +11,7 @@
 #include <windows.h>
 #else
 #include <sys/time.h>
+#include <time.h>
 #endif
 
 void
@@ -42,4 +43,43 @@ get_current_ts_usec()
     gettimeofday(&now, NULL);
     return (int64_t)now.tv_sec * 1000000 + (int64_t)now.tv_usec;
 #endif
-}
\ No newline at end of file
+}
+
+#ifdef _WIN32
+static int64_t
+filetime_usec(FILETIME ft)
+{
+    ULARGE_INTEGER x;
+    x.LowPart = ft.dwLowDateTime;
+    x.HighPart = ft.dwHighDateTime;
+    return (int64_t)(x.QuadPart / 10);
+}
+#endif
+
+int64_t
+get_thread_cpu_usec()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+    return filetime_usec(kernel) + filetime_usec(user);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+int64_t
+get_process_cpu_usec()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    return filetime_usec(kernel) + filetime_usec(user);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
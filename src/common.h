@@ -15,4 +15,10 @@ av_error_fmt(char *out, char *str, int ec);
 int64_t
 get_current_ts_usec();
 
+int64_t
+get_thread_cpu_usec();
+
+int64_t
+get_process_cpu_usec();
+
 #endif
@@ -0,0 +1,358 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "compositor.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define COMP_SSE2
+#endif
+
+// UYVY black, one pixel pair, as a little-endian word
+#define COMP_BLACK 0x10801080u
+#define COMP_DEFAULT_LOST_MS 1000
+#define COMP_DEFAULT_RESTORE_MS 3000
+
+static char *
+comp_trim(char *str)
+{
+    while (isspace((unsigned char)*str)) {
+        str++;
+    }
+
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return str;
+}
+
+int
+comp_parse(CompositeSpec *spec, const char *str, char *error_str,
+           size_t size)
+{
+    char buf[1024];
+    char layout[16];
+    int n = 0;
+
+    memset(spec, 0, sizeof(CompositeSpec));
+    snprintf(buf, sizeof buf, "%s", str);
+
+    char *sources = strchr(buf, '|');
+    if (sources) {
+        *sources++ = '\0';
+    }
+
+    if (sscanf(buf, " %15s %dx%d %d/%d %n", layout, &spec->width,
+               &spec->height, &spec->frame_rate_N, &spec->frame_rate_D, &n)
+        != 5) {
+        snprintf(error_str, size,
+                 "composite must start with \"LAYOUT WxH N/D\", got \"%s\"",
+                 comp_trim(buf));
+        return -1;
+    }
+
+    if (strcmp(layout, "grid") == 0) {
+        spec->layout = COMPOSITE_GRID;
+    }
+    else if (strcmp(layout, "pip") == 0) {
+        spec->layout = COMPOSITE_PIP;
+    }
+    else if (strcmp(layout, "switch") == 0) {
+        spec->layout = COMPOSITE_SWITCH;
+    }
+    else if (strcmp(layout, "failover") == 0) {
+        spec->layout = COMPOSITE_FAILOVER;
+    }
+    else {
+        snprintf(error_str, size, "composite layout \"%s\" is not supported",
+                 layout);
+        return -1;
+    }
+
+    if (spec->width < 16 || spec->height < 16 || spec->width % 2 != 0) {
+        snprintf(error_str, size,
+                 "composite size %dx%d must be even and at least 16x16",
+                 spec->width, spec->height);
+        return -1;
+    }
+
+    if (spec->frame_rate_N <= 0 || spec->frame_rate_D <= 0) {
+        snprintf(error_str, size, "composite frame rate %d/%d is invalid",
+                 spec->frame_rate_N, spec->frame_rate_D);
+        return -1;
+    }
+
+    spec->lost_ms = COMP_DEFAULT_LOST_MS;
+    spec->restore_ms = COMP_DEFAULT_RESTORE_MS;
+
+    for (char *opt = buf + n; *opt;) {
+        char key[16];
+        int value;
+        int len = 0;
+
+        if (sscanf(opt, "%15[a-z_]=%d %n", key, &value, &len) != 2
+            || len == 0) {
+            snprintf(error_str, size, "composite option \"%s\" is invalid",
+                     comp_trim(opt));
+            return -1;
+        }
+        if (strcmp(key, "lost_ms") == 0 && value > 0) {
+            spec->lost_ms = value;
+        }
+        else if (strcmp(key, "restore_ms") == 0 && value >= 0) {
+            spec->restore_ms = value;
+        }
+        else {
+            snprintf(error_str, size, "composite option \"%s\" is invalid",
+                     key);
+            return -1;
+        }
+        opt += len;
+    }
+
+    while (sources) {
+        char *next = strchr(sources, '|');
+        if (next) {
+            *next++ = '\0';
+        }
+
+        char *source = comp_trim(sources);
+        sources = next;
+
+        if (*source == '\0') {
+            snprintf(error_str, size, "composite has an empty source");
+            return -1;
+        }
+        if (spec->nb_sources == COMPOSITE_MAX_SOURCES) {
+            snprintf(error_str, size, "composite takes at most %d sources",
+                     COMPOSITE_MAX_SOURCES);
+            return -1;
+        }
+
+        CompositeSource *src = &spec->sources[spec->nb_sources++];
+        if (strchr(source, '(')) {
+            snprintf(src->name, sizeof src->name, "%s", source);
+        }
+        else {
+            snprintf(src->url, sizeof src->url, "%s", source);
+        }
+    }
+
+    if (spec->nb_sources == 0) {
+        snprintf(error_str, size, "composite has no sources");
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+comp_tile(const CompositeSpec *spec, int index, CompositeRect *rect)
+{
+    int width = spec->width;
+    int height = spec->height;
+
+    memset(rect, 0, sizeof(CompositeRect));
+
+    if (index < 0 || index >= spec->nb_sources) {
+        return;
+    }
+
+    if (spec->layout == COMPOSITE_SWITCH || spec->layout == COMPOSITE_FAILOVER
+        || (spec->layout == COMPOSITE_PIP && index == 0)) {
+        rect->width = width;
+        rect->height = height;
+        return;
+    }
+
+    if (spec->layout == COMPOSITE_PIP) {
+        // insets are a quarter of the frame, stacked up from the bottom
+        // right corner
+        int margin = width / 32 & ~1;
+        int y = height - (height / 4 + margin) * index;
+
+        if (y < margin) {
+            return;
+        }
+
+        rect->width = width / 4 & ~1;
+        rect->height = height / 4;
+        rect->x = width - margin - rect->width;
+        rect->y = y;
+        return;
+    }
+
+    int cols = (int)ceil(sqrt(spec->nb_sources));
+    int rows = (spec->nb_sources + cols - 1) / cols;
+    int col = index % cols;
+    int row = index / cols;
+
+    rect->x = col * width / cols & ~1;
+    rect->y = row * height / rows;
+    rect->width = ((col + 1) * width / cols & ~1) - rect->x;
+    rect->height = (row + 1) * height / rows - rect->y;
+}
+
+void
+comp_fit(const CompositeRect *tile, double aspect, CompositeRect *fit)
+{
+    *fit = *tile;
+
+    if (aspect <= 0 || tile->width <= 0 || tile->height <= 0) {
+        return;
+    }
+
+    if (tile->width > tile->height * aspect) {
+        fit->width = (int)lround(tile->height * aspect) & ~1;
+        fit->width = fit->width < 2 ? 2 : fit->width;
+    }
+    else {
+        fit->height = (int)lround(tile->width / aspect);
+        fit->height = fit->height < 1 ? 1 : fit->height;
+    }
+
+    fit->x += (tile->width - fit->width) / 2 & ~1;
+    fit->y += (tile->height - fit->height) / 2;
+}
+
+void
+comp_fill(uint8_t *canvas, int stride, const CompositeRect *rect)
+{
+    for (int y = 0; y < rect->height; ++y) {
+        uint8_t *row = canvas + (size_t)(rect->y + y) * stride + rect->x * 2;
+        int i = 0;
+
+#ifdef COMP_SSE2
+        const __m128i black = _mm_set1_epi32((int)COMP_BLACK);
+
+        for (; i + 8 <= rect->width; i += 8) {
+            _mm_storeu_si128((__m128i *)(row + i * 2), black);
+        }
+#endif
+
+        for (; i + 2 <= rect->width; i += 2) {
+            uint32_t black = COMP_BLACK;
+            memcpy(row + i * 2, &black, 4);
+        }
+    }
+}
+
+void
+comp_fill_around(uint8_t *canvas, int stride, const CompositeRect *tile,
+                 const CompositeRect *fit)
+{
+    CompositeRect top = {tile->x, tile->y, tile->width, fit->y - tile->y};
+    CompositeRect bottom = {tile->x, fit->y + fit->height, tile->width,
+                            tile->y + tile->height - fit->y - fit->height};
+    CompositeRect left = {tile->x, fit->y, fit->x - tile->x, fit->height};
+    CompositeRect right = {fit->x + fit->width, fit->y,
+                           tile->x + tile->width - fit->x - fit->width,
+                           fit->height};
+
+    comp_fill(canvas, stride, &top);
+    comp_fill(canvas, stride, &bottom);
+    comp_fill(canvas, stride, &left);
+    comp_fill(canvas, stride, &right);
+}
+
+/* s * a + d * (255 - a), divided by 255 with rounding. The SIMD version
+ * computes the same. */
+static inline uint8_t
+comp_mix(unsigned s, unsigned d, unsigned a)
+{
+    unsigned t = s * a + d * (255 - a) + 128;
+    return (uint8_t)((t + (t >> 8)) >> 8);
+}
+
+#ifdef COMP_SSE2
+static inline __m128i
+comp_mix_epi16(__m128i s, __m128i d, __m128i a)
+{
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i half = _mm_set1_epi16(128);
+
+    // 255 * 255 + 128 still fits an unsigned 16-bit lane
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(s, a),
+                              _mm_mullo_epi16(d, _mm_sub_epi16(max, a)));
+    t = _mm_add_epi16(t, half);
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static inline __m128i
+comp_mix_epi8(__m128i s, __m128i d, __m128i a)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i lo = comp_mix_epi16(_mm_unpacklo_epi8(s, zero),
+                                _mm_unpacklo_epi8(d, zero),
+                                _mm_unpacklo_epi8(a, zero));
+    __m128i hi = comp_mix_epi16(_mm_unpackhi_epi8(s, zero),
+                                _mm_unpackhi_epi8(d, zero),
+                                _mm_unpackhi_epi8(a, zero));
+    return _mm_packus_epi16(lo, hi);
+}
+#endif
+
+static void
+comp_blend_line(uint8_t *dst, const uint8_t *y, const uint8_t *u,
+                const uint8_t *v, const uint8_t *a, int width)
+{
+    int i = 0;
+
+#ifdef COMP_SSE2
+    const __m128i even = _mm_set1_epi16(0xff);
+
+    for (; i + 16 <= width; i += 16) {
+        __m128i vy = _mm_loadu_si128((const __m128i *)(y + i));
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i uv = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *)(u + i / 2)),
+                _mm_loadl_epi64((const __m128i *)(v + i / 2)));
+
+        // alpha of every left pixel, once for U and once for V
+        __m128i left = _mm_and_si128(va, even);
+        __m128i ca = _mm_or_si128(left, _mm_slli_epi16(left, 8));
+
+        __m128i s0 = _mm_unpacklo_epi8(uv, vy);
+        __m128i s1 = _mm_unpackhi_epi8(uv, vy);
+        __m128i a0 = _mm_unpacklo_epi8(ca, va);
+        __m128i a1 = _mm_unpackhi_epi8(ca, va);
+        __m128i d0 = _mm_loadu_si128((const __m128i *)(dst + i * 2));
+        __m128i d1 = _mm_loadu_si128((const __m128i *)(dst + i * 2 + 16));
+
+        _mm_storeu_si128((__m128i *)(dst + i * 2), comp_mix_epi8(s0, d0, a0));
+        _mm_storeu_si128((__m128i *)(dst + i * 2 + 16),
+                         comp_mix_epi8(s1, d1, a1));
+    }
+#endif
+
+    for (; i + 2 <= width; i += 2) {
+        uint8_t *p = dst + i * 2;
+        p[0] = comp_mix(u[i / 2], p[0], a[i]);
+        p[1] = comp_mix(y[i], p[1], a[i]);
+        p[2] = comp_mix(v[i / 2], p[2], a[i]);
+        p[3] = comp_mix(y[i + 1], p[3], a[i + 1]);
+    }
+}
+
+void
+comp_blend(uint8_t *canvas, int stride, const CompositeRect *rect,
+           uint8_t *const planes[4], const int linesize[4])
+{
+    for (int y = 0; y < rect->height; ++y) {
+        comp_blend_line(canvas + (size_t)(rect->y + y) * stride + rect->x * 2,
+                        planes[0] + (size_t)y * linesize[0],
+                        planes[1] + (size_t)y * linesize[1],
+                        planes[2] + (size_t)y * linesize[2],
+                        planes[3] + (size_t)y * linesize[3], rect->width);
+    }
+}
@@ -0,0 +1,76 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef COMPOSITOR_H
+#define COMPOSITOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COMPOSITE_MAX_SOURCES 16
+
+typedef enum CompositeLayout {
+    COMPOSITE_GRID,     // equal tiles, as many columns as rows or one more
+    COMPOSITE_PIP,      // the first source fills the frame, the rest insets
+    COMPOSITE_SWITCH,   // one source fills the frame, cut by input_select
+    COMPOSITE_FAILOVER, // like switch, the first source that is up wins
+} CompositeLayout;
+
+typedef struct CompositeSource {
+    char url[255];  // NDI address, or empty
+    char name[255]; // NDI name "HOST (SOURCE)", or empty
+} CompositeSource;
+
+/* "LAYOUT WxH N/D [OPTION=N ...] | SOURCE | SOURCE ...", a SOURCE with
+ * parentheses is taken as an NDI name, anything else as an address. */
+typedef struct CompositeSpec {
+    CompositeLayout layout;
+    int width;
+    int height;
+    int frame_rate_N;
+    int frame_rate_D;
+    int lost_ms;    // a source without video for this long is down
+    int restore_ms; // failover returns to a source up for this long
+    CompositeSource sources[COMPOSITE_MAX_SOURCES];
+    int nb_sources;
+} CompositeSpec;
+
+typedef struct CompositeRect {
+    int x;
+    int y;
+    int width;
+    int height;
+} CompositeRect;
+
+int
+comp_parse(CompositeSpec *spec, const char *str, char *error_str,
+           size_t size);
+
+/* The area of source `index`, empty when it does not fit. x and width
+ * are even, so that tiles start on a whole UYVY pixel pair. */
+void
+comp_tile(const CompositeSpec *spec, int index, CompositeRect *rect);
+
+/* The largest rectangle of the source aspect ratio centered in `tile`. */
+void
+comp_fit(const CompositeRect *tile, double aspect, CompositeRect *fit);
+
+/* Paints `rect` of a UYVY frame black. */
+void
+comp_fill(uint8_t *canvas, int stride, const CompositeRect *rect);
+
+/* Paints `tile` black around `fit`. */
+void
+comp_fill_around(uint8_t *canvas, int stride, const CompositeRect *tile,
+                 const CompositeRect *fit);
+
+/* Blends a yuva422p picture of the size of `rect` over that area of a UYVY
+ * frame. Chroma takes the alpha of the left pixel of each pair. */
+void
+comp_blend(uint8_t *canvas, int stride, const CompositeRect *rect,
+           uint8_t *const planes[4], const int linesize[4]);
+
+#endif
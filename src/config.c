@@ -0,0 +1,337 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "config.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#define CONFIG_ERROR_SIZE 512
+
+enum ConfigSection {
+    CONFIG_SECTION_NONE,
+    CONFIG_SECTION_DAEMON,
+    CONFIG_SECTION_PIPELINE,
+};
+
+DaemonConfig *
+new_daemon_config()
+{
+    DaemonConfig *config = malloc(sizeof(DaemonConfig));
+    memset(config, 0, sizeof(DaemonConfig));
+    config->error_str = malloc(CONFIG_ERROR_SIZE);
+    return config;
+}
+
+int
+free_daemon_config(DaemonConfig **config)
+{
+    free((*config)->pipelines);
+    free((*config)->error_str);
+    free(*config);
+    *config = NULL;
+    return 0;
+}
+
+static char *
+config_trim(char *str)
+{
+    while (isspace((unsigned char)*str)) {
+        str++;
+    }
+
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return str;
+}
+
+static int
+config_parse_int64(const char *value, int64_t *out)
+{
+    char *end;
+    long long res = strtoll(value, &end, 10);
+    if (end == value || *end != '\0') {
+        return -1;
+    }
+    *out = (int64_t)res;
+    return 0;
+}
+
+int
+config_set_pipeline_key(PipelineConfig *p, const char *key, char *value)
+{
+    int64_t num;
+
+    if (strcmp(key, "source") == 0) {
+        snprintf(p->source_url, sizeof p->source_url, "%s", value);
+    }
+    else if (strcmp(key, "source_name") == 0) {
+        snprintf(p->source_name, sizeof p->source_name, "%s", value);
+    }
+    else if (strcmp(key, "input") == 0) {
+        snprintf(p->input_url, sizeof p->input_url, "%s", value);
+    }
+    else if (strcmp(key, "composite") == 0) {
+        snprintf(p->composite, sizeof p->composite, "%s", value);
+    }
+    else if (strcmp(key, "dump_raw") == 0) {
+        snprintf(p->dump_raw, sizeof p->dump_raw, "%s", value);
+    }
+    else if (strcmp(key, "video_codec") == 0) {
+        snprintf(p->video_encoder, sizeof p->video_encoder, "%s", value);
+    }
+    else if (strcmp(key, "audio_codec") == 0) {
+        snprintf(p->audio_encoder, sizeof p->audio_encoder, "%s", value);
+    }
+    else if (strcmp(key, "audio_tracks") == 0) {
+        snprintf(p->audio_tracks, sizeof p->audio_tracks, "%s", value);
+    }
+    else if (strcmp(key, "replay_dir") == 0) {
+        snprintf(p->replay_dir, sizeof p->replay_dir, "%s", value);
+    }
+    else if (strcmp(key, "static_frames") == 0) {
+        return pipeline_static_mode_from_name(value, &p->static_frames);
+    }
+    else if (strcmp(key, "deinterlace") == 0) {
+        return di_mode_from_name(value, &p->deinterlace);
+    }
+    else if (strcmp(key, "output") == 0) {
+        if (p->nb_outputs == PIPELINE_MAX_OUTPUTS) {
+            return -1;
+        }
+
+        char *url = value;
+        while (*url && !isspace((unsigned char)*url)) {
+            url++;
+        }
+        if (*url == '\0') {
+            return -1;
+        }
+        *url++ = '\0';
+
+        // optional trailing priority class:
+        // output = FORMAT URL [program|preview]
+        url = config_trim(url);
+        WorkPriority priority = WORK_PRIORITY_HIGH;
+        char *last = strrchr(url, ' ');
+        if (!last) {
+            last = strrchr(url, '\t');
+        }
+        if (last && strcmp(last + 1, "preview") == 0) {
+            priority = WORK_PRIORITY_LOW;
+            *last = '\0';
+        }
+        else if (last && strcmp(last + 1, "program") == 0) {
+            *last = '\0';
+        }
+
+        OutputConfig *out = &p->outputs[p->nb_outputs++];
+        snprintf(out->format, sizeof out->format, "%s", value);
+        snprintf(out->url, sizeof out->url, "%s", config_trim(url));
+        out->priority = priority;
+    }
+    else if (config_parse_int64(value, &num) < 0) {
+        return -1;
+    }
+    else if (strcmp(key, "video_bitrate") == 0) {
+        p->video_bitrate = num;
+    }
+    else if (strcmp(key, "audio_bitrate") == 0) {
+        p->audio_bitrate = num;
+    }
+    else if (strcmp(key, "replay_seconds") == 0) {
+        p->replay_seconds = (int)num;
+    }
+    else if (strcmp(key, "replay_max_bytes") == 0) {
+        p->replay_max_bytes = num;
+    }
+    else if (strcmp(key, "input_fast") == 0) {
+        p->input_fast = num != 0;
+    }
+    else if (strcmp(key, "input_loop") == 0) {
+        p->input_loop = num != 0;
+    }
+    else if (strcmp(key, "static_keepalive_ms") == 0 && num >= 0) {
+        p->static_keepalive_ms = (int)num;
+    }
+    else if (strcmp(key, "dirty_regions") == 0) {
+        p->dirty_regions = num != 0;
+    }
+    else if (strcmp(key, "cfr") == 0) {
+        p->cfr = num != 0;
+    }
+    else if (strcmp(key, "silence_gate_db") == 0) {
+        p->silence_gate_db = (int)num;
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+config_load(DaemonConfig *config, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        snprintf(config->error_str, CONFIG_ERROR_SIZE,
+                 "could not open config file \"%s\"", path);
+        return -1;
+    }
+
+    char buf[1024];
+    int line_no = 0;
+    int ret = 0;
+    enum ConfigSection section = CONFIG_SECTION_NONE;
+    PipelineConfig *pipeline = NULL;
+
+    while (fgets(buf, sizeof buf, file) != NULL) {
+        line_no++;
+
+        // inline comments must be separated by whitespace, '#' may be a
+        // part of an url
+        for (char *c = buf; *c; ++c) {
+            if (*c == '#' && c > buf && isspace((unsigned char)c[-1])) {
+                *c = '\0';
+                break;
+            }
+        }
+
+        char *line = config_trim(buf);
+
+        if (*line == '\0' || *line == '#' || *line == ';') {
+            continue;
+        }
+
+        if (*line == '[') {
+            char *end = strchr(line, ']');
+            if (!end) {
+                ret = -1;
+                break;
+            }
+            *end = '\0';
+            line = config_trim(line + 1);
+
+            if (strcmp(line, "daemon") == 0) {
+                section = CONFIG_SECTION_DAEMON;
+            }
+            else if (strncmp(line, "pipeline", 8) == 0) {
+                section = CONFIG_SECTION_PIPELINE;
+                size_t size
+                        = sizeof(PipelineConfig) * (config->nb_pipelines + 1);
+                config->pipelines = realloc(config->pipelines, size);
+                pipeline = &config->pipelines[config->nb_pipelines++];
+                pipeline_config_defaults(pipeline);
+
+                char *name = config_trim(line + 8);
+                if (*name) {
+                    snprintf(pipeline->name, sizeof pipeline->name, "%s", name);
+                }
+                else {
+                    snprintf(pipeline->name, sizeof pipeline->name, "%d",
+                             config->nb_pipelines);
+                }
+            }
+            else {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+
+        char *eq = strchr(line, '=');
+        if (!eq) {
+            ret = -1;
+            break;
+        }
+        *eq = '\0';
+        char *key = config_trim(line);
+        char *value = config_trim(eq + 1);
+
+        if (section == CONFIG_SECTION_DAEMON && strcmp(key, "workers") == 0) {
+            int64_t workers;
+            if (config_parse_int64(value, &workers) < 0) {
+                ret = -1;
+                break;
+            }
+            config->workers = (int)workers;
+        }
+        else if (section == CONFIG_SECTION_DAEMON
+                 && strcmp(key, "metrics_port") == 0) {
+            int64_t port;
+            if (config_parse_int64(value, &port) < 0 || port <= 0
+                || port > 65535) {
+                ret = -1;
+                break;
+            }
+            config->metrics_port = (int)port;
+        }
+        else if (section == CONFIG_SECTION_DAEMON
+                 && strcmp(key, "control_socket") == 0) {
+            snprintf(config->control_socket, sizeof config->control_socket,
+                     "%s", value);
+        }
+        else if (section == CONFIG_SECTION_DAEMON
+                 && strcmp(key, "log_level") == 0) {
+            LogLevel level;
+            if (log_level_from_name(value, &level) < 0) {
+                ret = -1;
+                break;
+            }
+            snprintf(config->log_level, sizeof config->log_level, "%s",
+                     value);
+        }
+        else if (section == CONFIG_SECTION_DAEMON
+                 && strcmp(key, "log_format") == 0) {
+            LogFormat format;
+            if (log_format_from_name(value, &format) < 0) {
+                ret = -1;
+                break;
+            }
+            snprintf(config->log_format, sizeof config->log_format, "%s",
+                     value);
+        }
+        else if (section != CONFIG_SECTION_PIPELINE
+                 || config_set_pipeline_key(pipeline, key, value) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    fclose(file);
+
+    if (ret < 0) {
+        snprintf(config->error_str, CONFIG_ERROR_SIZE,
+                 "%s:%d: invalid config line", path, line_no);
+        return ret;
+    }
+
+    for (int i = 0; i < config->nb_pipelines; ++i) {
+        char error_str[200];
+        if (pipeline_config_validate(&config->pipelines[i], error_str,
+                                     sizeof error_str)
+            < 0) {
+            snprintf(config->error_str, CONFIG_ERROR_SIZE, "%s: %s", path,
+                     error_str);
+            return -1;
+        }
+    }
+
+    if (config->nb_pipelines == 0) {
+        snprintf(config->error_str, CONFIG_ERROR_SIZE,
+                 "%s: no pipelines defined", path);
+        return -1;
+    }
+
+    return 0;
+}
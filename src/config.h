@@ -0,0 +1,55 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "pipeline.h"
+
+/* Daemon configuration file, ini-like:
+ *
+ *   [daemon]
+ *   workers = 8
+ *   control_socket = /run/ndi-streamer.sock
+ *   metrics_port = 9464
+ *   log_level = info
+ *   log_format = json
+ *
+ *   [pipeline camera1]
+ *   source = 10.0.0.5:5961
+ *   video_codec = libx264
+ *   output = rtmp rtmp://10.0.0.100/live/camera1
+ *   output = rtsp rtsp://127.0.0.1:8554/camera1 preview
+ *
+ * An output line may end with its priority class, `program` (default) or
+ * `preview`; preview outputs get the CPU after program outputs.
+ */
+typedef struct DaemonConfig {
+    int workers;
+    char control_socket[255];
+    int metrics_port;
+    char log_level[16];
+    char log_format[16];
+    PipelineConfig *pipelines;
+    int nb_pipelines;
+    char *error_str;
+} DaemonConfig;
+
+DaemonConfig *
+new_daemon_config();
+
+int
+free_daemon_config(DaemonConfig **config);
+
+/* Sets one pipeline key as it would appear in the config file, `value` may
+ * be modified. Used by the control socket to describe new pipelines. */
+int
+config_set_pipeline_key(PipelineConfig *p, const char *key, char *value);
+
+int
+config_load(DaemonConfig *config, const char *path);
+
+#endif
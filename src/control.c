@@ -0,0 +1,594 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "control.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "config.h"
+#include "json.h"
+#include "log.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+#define CONTROL_POLL_TIMEOUT 200
+#define CONTROL_SEND_TIMEOUT 1000
+#define CONTROL_ERROR_SIZE 512
+
+ControlServerCtx *
+new_control_server_ctx(DaemonCtx *daemon)
+{
+    ControlServerCtx *ctx = malloc(sizeof(ControlServerCtx));
+    memset(ctx, 0, sizeof(ControlServerCtx));
+    ctx->daemon = daemon;
+    ctx->listen_fd = -1;
+    ctx->error_str = malloc(AV_ERROR_MAX_STRING_SIZE + 100);
+    return ctx;
+}
+
+int
+free_control_server_ctx(ControlServerCtx **ctx)
+{
+    control_server_stop(*ctx);
+    free((*ctx)->path);
+    free((*ctx)->error_str);
+    free(*ctx);
+    *ctx = NULL;
+    return 0;
+}
+
+#ifdef _WIN32
+
+int
+control_server_start(ControlServerCtx *ctx, const char *socket_path)
+{
+    sprintf(ctx->error_str, "%s",
+            "control socket is not supported on windows");
+    return -1;
+}
+
+void
+control_server_stop(ControlServerCtx *ctx)
+{
+}
+
+#else
+
+static const char *
+control_state_name(int state)
+{
+    switch (state) {
+    case PIPELINE_OUTPUT_OPENING:
+        return "opening";
+    case PIPELINE_OUTPUT_ACTIVE:
+        return "active";
+    case PIPELINE_OUTPUT_FAILED:
+        return "failed";
+    default:
+        return "closed";
+    }
+}
+
+static void
+control_write_pipeline(JsonWriter *jw, PipelineCtx *pipeline)
+{
+    mutex_lock(&pipeline->lock);
+    int width = pipeline->width;
+    int height = pipeline->height;
+    AVRational frame_rate = pipeline->frame_rate;
+    InputStats stats = pipeline->input_stats;
+    int has_stats = pipeline->has_input_stats;
+    AudioLevels levels = pipeline->audio_levels;
+    int has_levels = pipeline->has_audio_levels;
+    mutex_unlock(&pipeline->lock);
+
+    jw_object_begin(jw, NULL);
+    jw_string(jw, "name", pipeline->config.name);
+    jw_int(jw, "width", width);
+    jw_int(jw, "height", height);
+    jw_double(jw, "frame_rate", frame_rate.den ? av_q2d(frame_rate) : 0);
+    jw_int(jw, "dropped_frames", atomic_load(&pipeline->dropped_frames));
+    jw_int(jw, "skipped_frames", atomic_load(&pipeline->skipped_frames));
+    jw_int(jw, "static_frames", atomic_load(&pipeline->static_frames));
+    jw_int(jw, "partial_frames", atomic_load(&pipeline->partial_frames));
+    jw_int(jw, "repeated_frames", atomic_load(&pipeline->cfr_repeated));
+    jw_int(jw, "cfr_dropped_frames", atomic_load(&pipeline->cfr_dropped));
+    jw_int(jw, "cfr_cut_audio_frames", atomic_load(&pipeline->cfr_audio_cut));
+    jw_int(jw, "silent_audio_frames", atomic_load(&pipeline->silent_frames));
+    jw_int(jw, "dump_dropped_frames", atomic_load(&pipeline->dump_dropped));
+
+    if (has_stats) {
+        jw_object_begin(jw, "input");
+        jw_int(jw, "video_frames", stats.video_frames);
+        jw_int(jw, "audio_frames", stats.audio_frames);
+        jw_int(jw, "video_dropped", stats.video_dropped);
+        jw_int(jw, "audio_dropped", stats.audio_dropped);
+        jw_int(jw, "video_queued", stats.video_queued);
+        jw_int(jw, "audio_queued", stats.audio_queued);
+        jw_object_end(jw);
+    }
+
+    if (has_levels) {
+        jw_array_begin(jw, "audio_levels");
+        for (int c = 0; c < levels.nb_channels; ++c) {
+            jw_object_begin(jw, NULL);
+            jw_double(jw, "peak_dbfs", levels.peak[c]);
+            jw_double(jw, "rms_dbfs", levels.rms[c]);
+            jw_double(jw, "momentary_lufs", levels.momentary[c]);
+            jw_object_end(jw);
+        }
+        jw_array_end(jw);
+    }
+
+    jw_array_begin(jw, "outputs");
+    for (int i = 0; i < pipeline->nb_outputs; ++i) {
+        PipelineOutput *out = &pipeline->outputs[i];
+        OutputConfig config;
+        pipeline_get_output_config(pipeline, i, &config);
+
+        jw_object_begin(jw, NULL);
+        jw_int(jw, "index", i);
+        jw_string(jw, "format", config.format);
+        jw_string(jw, "url", config.url);
+        jw_string(jw, "priority", config.priority == WORK_PRIORITY_LOW
+                                          ? "preview"
+                                          : "program");
+        jw_string(jw, "state", control_state_name(atomic_load(&out->state)));
+        jw_int(jw, "frames", atomic_load(&out->frames));
+        jw_int(jw, "dropped_frames", atomic_load(&out->dropped_frames));
+        jw_int(jw, "errors", atomic_load(&out->errors));
+        jw_int(jw, "queue_depth", wq_depth(out->queue));
+        jw_int(jw, "video_bitrate", atomic_load(&out->video_bitrate));
+        jw_int(jw, "audio_bitrate", atomic_load(&out->audio_bitrate));
+        jw_object_end(jw);
+    }
+    jw_array_end(jw);
+    jw_object_end(jw);
+}
+
+static int
+control_cmd_add(ControlServerCtx *ctx, const JsonObject *req, char *error)
+{
+    PipelineConfig config;
+    pipeline_config_defaults(&config);
+    snprintf(config.name, sizeof config.name, "%s",
+             json_get_string(req, "pipeline"));
+
+    for (int i = 0; i < req->nb_fields; ++i) {
+        const JsonField *field = &req->fields[i];
+        char value[600];
+        int ret = 0;
+
+        if (strcmp(field->key, "cmd") == 0
+            || strcmp(field->key, "pipeline") == 0) {
+            continue;
+        }
+
+        if (field->type == JSON_STRING) {
+            snprintf(value, sizeof value, "%s", field->str);
+            ret = config_set_pipeline_key(&config, field->key, value);
+        }
+        else if (field->type == JSON_NUMBER) {
+            int64_t num;
+            ret = json_field_int64(field, &num);
+            if (ret >= 0) {
+                snprintf(value, sizeof value, "%lld", (long long)num);
+                ret = config_set_pipeline_key(&config, field->key, value);
+            }
+        }
+        else if (field->type == JSON_ARRAY
+                 && strcmp(field->key, "outputs") == 0) {
+            for (int j = 0; j < field->nb_items && ret >= 0; ++j) {
+                snprintf(value, sizeof value, "%s", field->items[j]);
+                ret = config_set_pipeline_key(&config, "output", value);
+            }
+        }
+        else {
+            ret = -1;
+        }
+
+        if (ret < 0) {
+            snprintf(error, CONTROL_ERROR_SIZE, "invalid value for \"%.64s\"",
+                     field->key);
+            return -1;
+        }
+    }
+
+    if (daemon_add_pipeline(ctx->daemon, &config) < 0) {
+        snprintf(error, CONTROL_ERROR_SIZE, "%s", ctx->daemon->error_str);
+        return -1;
+    }
+
+    LOG_INFO("control: pipeline \"%s\" added", config.name);
+    return 0;
+}
+
+static int
+control_cmd_pipeline(PipelineCtx *pipeline, const char *cmd,
+                     const JsonObject *req, JsonWriter *jw, char *error)
+{
+    if (strcmp(cmd, "stats") == 0) {
+        jw_array_begin(jw, "pipelines");
+        control_write_pipeline(jw, pipeline);
+        jw_array_end(jw);
+    }
+    else if (strcmp(cmd, "set_output") == 0) {
+        int64_t index = 0;
+        const char *format = json_get_string(req, "format");
+        const char *url = json_get_string(req, "url");
+
+        if (json_get(req, "output")
+            && (json_get_int64(req, "output", &index) < 0 || index < 0
+                || index > INT_MAX)) {
+            snprintf(error, CONTROL_ERROR_SIZE, "%s", "invalid output index");
+            return -1;
+        }
+        if (!format && !url) {
+            snprintf(error, CONTROL_ERROR_SIZE, "%s", "url or format required");
+            return -1;
+        }
+        if (pipeline_set_output(pipeline, (int)index, format, url) < 0) {
+            snprintf(error, CONTROL_ERROR_SIZE, "%s", pipeline->error_str);
+            return -1;
+        }
+    }
+    else if (strcmp(cmd, "set_bitrate") == 0) {
+        int64_t video_bitrate = 0, audio_bitrate = 0;
+
+        if ((json_get(req, "video_bitrate")
+             && json_get_int64(req, "video_bitrate", &video_bitrate) < 0)
+            || (json_get(req, "audio_bitrate")
+                && json_get_int64(req, "audio_bitrate", &audio_bitrate)
+                           < 0)) {
+            snprintf(error, CONTROL_ERROR_SIZE, "%s", "invalid bitrate");
+            return -1;
+        }
+        if (video_bitrate <= 0 && audio_bitrate <= 0) {
+            snprintf(error, CONTROL_ERROR_SIZE, "%s",
+                     "video_bitrate or audio_bitrate required");
+            return -1;
+        }
+        pipeline_set_bitrate(pipeline, video_bitrate, audio_bitrate);
+    }
+    else if (strcmp(cmd, "keyframe") == 0) {
+        pipeline_force_keyframe(pipeline);
+    }
+    else if (strcmp(cmd, "switch") == 0) {
+        int64_t index;
+        if (json_get_int64(req, "source", &index) < 0 || index < 0
+            || index > INT_MAX) {
+            snprintf(error, CONTROL_ERROR_SIZE, "%s", "source index required");
+            return -1;
+        }
+        if (pipeline_switch_source(pipeline, (int)index) < 0) {
+            snprintf(error, CONTROL_ERROR_SIZE, "%s", pipeline->error_str);
+            return -1;
+        }
+    }
+    else if (strcmp(cmd, "replay") == 0) {
+        int64_t seconds = 0, duration = 0;
+
+        if (pipeline->nb_outputs == 0 || !pipeline->outputs[0].fa_ctx->replay) {
+            snprintf(error, CONTROL_ERROR_SIZE, "%s",
+                     "replay buffer is disabled");
+            return -1;
+        }
+        if ((json_get(req, "seconds")
+             && (json_get_int64(req, "seconds", &seconds) < 0 || seconds <= 0
+                 || seconds > INT_MAX))
+            || (json_get(req, "duration")
+                && (json_get_int64(req, "duration", &duration) < 0
+                    || duration <= 0 || duration > INT_MAX))) {
+            snprintf(error, CONTROL_ERROR_SIZE, "%s", "invalid replay range");
+            return -1;
+        }
+        pipeline_export_replay(pipeline, seconds * AV_TIME_BASE,
+                               duration * AV_TIME_BASE);
+    }
+    else {
+        snprintf(error, CONTROL_ERROR_SIZE, "unknown command \"%.64s\"", cmd);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+control_dispatch(ControlServerCtx *ctx, const JsonObject *req, JsonWriter *jw,
+                 char *error)
+{
+    DaemonCtx *daemon = ctx->daemon;
+    const char *cmd = json_get_string(req, "cmd");
+    const char *name = json_get_string(req, "pipeline");
+    int ret = 0;
+
+    if (!cmd) {
+        snprintf(error, CONTROL_ERROR_SIZE, "%s", "\"cmd\" is required");
+        return -1;
+    }
+
+    if (strcmp(cmd, "list") == 0
+        || (strcmp(cmd, "stats") == 0 && name == NULL)) {
+        int stats = strcmp(cmd, "stats") == 0;
+
+        daemon_lock(daemon);
+        jw_array_begin(jw, "pipelines");
+        for (int i = 0; i < daemon->nb_pipelines; ++i) {
+            if (stats) {
+                control_write_pipeline(jw, daemon->pipelines[i]);
+            }
+            else {
+                jw_string(jw, NULL, daemon->pipelines[i]->config.name);
+            }
+        }
+        jw_array_end(jw);
+        daemon_unlock(daemon);
+        return 0;
+    }
+
+    if (!name || !strlen(name)) {
+        snprintf(error, CONTROL_ERROR_SIZE, "%s", "\"pipeline\" is required");
+        return -1;
+    }
+
+    if (strcmp(cmd, "add") == 0) {
+        return control_cmd_add(ctx, req, error);
+    }
+
+    if (strcmp(cmd, "remove") == 0) {
+        if (daemon_remove_pipeline(daemon, name) < 0) {
+            snprintf(error, CONTROL_ERROR_SIZE, "%s", daemon->error_str);
+            return -1;
+        }
+        LOG_INFO("control: pipeline \"%s\" removed", name);
+        return 0;
+    }
+
+    daemon_lock(daemon);
+    PipelineCtx *pipeline = daemon_find_pipeline(daemon, name);
+    if (!pipeline) {
+        snprintf(error, CONTROL_ERROR_SIZE, "pipeline \"%.64s\" not found",
+                 name);
+        ret = -1;
+    }
+    else {
+        ret = control_cmd_pipeline(pipeline, cmd, req, jw, error);
+    }
+    daemon_unlock(daemon);
+
+    return ret;
+}
+
+static int
+control_send(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if (poll(&pfd, 1, CONTROL_SEND_TIMEOUT) <= 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (n < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (n > 0) {
+            data += n;
+            len -= n;
+        }
+    }
+    return 0;
+}
+
+static int
+control_handle_line(ControlServerCtx *ctx, int fd, const char *line)
+{
+    JsonObject req;
+    JsonWriter jw;
+    char error[CONTROL_ERROR_SIZE];
+    int ret;
+
+    jw_init(&jw);
+    jw_object_begin(&jw, NULL);
+
+    if (json_parse_object(line, &req) < 0) {
+        snprintf(error, sizeof error, "%s", "malformed request");
+        ret = -1;
+    }
+    else {
+        ret = control_dispatch(ctx, &req, &jw, error);
+        json_free_object(&req);
+    }
+
+    if (ret < 0) {
+        jw_free(&jw);
+        jw_init(&jw);
+        jw_object_begin(&jw, NULL);
+        jw_bool(&jw, "ok", 0);
+        jw_string(&jw, "error", error);
+    }
+    else {
+        jw_bool(&jw, "ok", 1);
+    }
+    jw_object_end(&jw);
+
+    ret = control_send(fd, jw.buf, jw.len);
+    if (ret >= 0) {
+        ret = control_send(fd, "\n", 1);
+    }
+
+    jw_free(&jw);
+    return ret;
+}
+
+static int
+control_client_read(ControlServerCtx *ctx, ControlClient *client)
+{
+    ssize_t n = recv(client->fd, client->buf + client->len,
+                     CONTROL_MAX_REQUEST - client->len - 1, 0);
+    if (n == 0) {
+        return -1;
+    }
+    if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+                       ? 0
+                       : -1;
+    }
+
+    client->len += n;
+    client->buf[client->len] = '\0';
+
+    char *line = client->buf;
+    char *end;
+    while ((end = strchr(line, '\n')) != NULL) {
+        *end = '\0';
+        if (end > line && end[-1] == '\r') {
+            end[-1] = '\0';
+        }
+        if (*line && control_handle_line(ctx, client->fd, line) < 0) {
+            return -1;
+        }
+        line = end + 1;
+    }
+
+    client->len -= line - client->buf;
+    memmove(client->buf, line, client->len);
+
+    // a request that does not fit into the buffer is never going to end
+    return client->len + 1 >= CONTROL_MAX_REQUEST ? -1 : 0;
+}
+
+static void
+control_drop_client(ControlServerCtx *ctx, int index)
+{
+    close(ctx->clients[index].fd);
+    free(ctx->clients[index].buf);
+    ctx->clients[index] = ctx->clients[--ctx->nb_clients];
+}
+
+static void
+control_run(void *arg)
+{
+    ControlServerCtx *ctx = arg;
+    struct pollfd fds[CONTROL_MAX_CLIENTS + 1];
+
+    while (atomic_load(&ctx->running)) {
+        fds[0].fd = ctx->listen_fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < ctx->nb_clients; ++i) {
+            fds[i + 1].fd = ctx->clients[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+
+        int nb_fds = ctx->nb_clients + 1;
+        if (poll(fds, nb_fds, CONTROL_POLL_TIMEOUT) <= 0) {
+            continue;
+        }
+
+        for (int i = nb_fds - 1; i > 0; --i) {
+            if (fds[i].revents
+                && control_client_read(ctx, &ctx->clients[i - 1]) < 0) {
+                control_drop_client(ctx, i - 1);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(ctx->listen_fd, NULL, NULL);
+            if (fd < 0) {
+                continue;
+            }
+            if (ctx->nb_clients == CONTROL_MAX_CLIENTS) {
+                close(fd);
+                continue;
+            }
+
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            ControlClient *client = &ctx->clients[ctx->nb_clients++];
+            client->fd = fd;
+            client->buf = malloc(CONTROL_MAX_REQUEST);
+            client->len = 0;
+        }
+    }
+
+    while (ctx->nb_clients > 0) {
+        control_drop_client(ctx, ctx->nb_clients - 1);
+    }
+}
+
+int
+control_server_start(ControlServerCtx *ctx, const char *socket_path)
+{
+    struct sockaddr_un addr = {};
+
+    if (strlen(socket_path) >= sizeof addr.sun_path) {
+        sprintf(ctx->error_str, "%s", "control socket path is too long");
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        sprintf(ctx->error_str, "could not create control socket (%s)",
+                strerror(errno));
+        return -1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof addr.sun_path, "%s", socket_path);
+    unlink(socket_path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0
+        || listen(fd, CONTROL_MAX_CLIENTS) < 0) {
+        sprintf(ctx->error_str, "could not listen on control socket (%s)",
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    ctx->listen_fd = fd;
+    ctx->path = strdup(socket_path);
+
+    atomic_store(&ctx->running, 1);
+    if (thread_create(&ctx->thread, control_run, ctx) < 0) {
+        atomic_store(&ctx->running, 0);
+        sprintf(ctx->error_str, "%s", "unable to start control thread");
+        return -1;
+    }
+    return 0;
+}
+
+void
+control_server_stop(ControlServerCtx *ctx)
+{
+    if (atomic_exchange(&ctx->running, 0)) {
+        thread_join(ctx->thread);
+    }
+
+    if (ctx->listen_fd >= 0) {
+        close(ctx->listen_fd);
+        unlink(ctx->path);
+        ctx->listen_fd = -1;
+    }
+}
+
+#endif
@@ -0,0 +1,64 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdatomic.h>
+
+#include "daemon.h"
+#include "thread.h"
+
+#define CONTROL_MAX_CLIENTS 8
+#define CONTROL_MAX_REQUEST 65536
+
+typedef struct ControlClient {
+    int fd;
+    char *buf;
+    size_t len;
+} ControlClient;
+
+/* Unix socket speaking newline delimited JSON, one response line per
+ * request line:
+ *
+ *   {"cmd":"list"}
+ *   {"cmd":"stats","pipeline":"camera1"}
+ *   {"cmd":"add","pipeline":"camera3","source":"10.0.0.7:5961",
+ *    "video_codec":"libx264","outputs":["rtmp rtmp://10.0.0.100/live/c3"]}
+ *   {"cmd":"remove","pipeline":"camera3"}
+ *   {"cmd":"set_output","pipeline":"camera1","output":0,"url":"..."}
+ *   {"cmd":"set_bitrate","pipeline":"camera1","video_bitrate":6000000}
+ *   {"cmd":"keyframe","pipeline":"camera1"}
+ *   {"cmd":"switch","pipeline":"studio","source":1}
+ *   {"cmd":"replay","pipeline":"camera1"}
+ *
+ * Responses are {"ok":true,...} or {"ok":false,"error":"..."}. */
+typedef struct ControlServerCtx {
+    DaemonCtx *daemon;
+    int listen_fd;
+    ControlClient clients[CONTROL_MAX_CLIENTS];
+    int nb_clients;
+
+    Thread thread;
+    _Atomic(int) running;
+
+    char *path;
+    char *error_str;
+} ControlServerCtx;
+
+ControlServerCtx *
+new_control_server_ctx(DaemonCtx *daemon);
+
+int
+free_control_server_ctx(ControlServerCtx **ctx);
+
+int
+control_server_start(ControlServerCtx *ctx, const char *socket_path);
+
+void
+control_server_stop(ControlServerCtx *ctx);
+
+#endif
@@ -0,0 +1,176 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "daemon.h"
+
+#include <stdio.h>
+
+#include "common.h"
+
+DaemonCtx *
+new_daemon_ctx(int workers)
+{
+    DaemonCtx *ctx = malloc(sizeof(DaemonCtx));
+    memset(ctx, 0, sizeof(DaemonCtx));
+    ctx->pool = new_worker_pool(workers);
+    mutex_init(&ctx->lock);
+    ctx->error_str = malloc(AV_ERROR_MAX_STRING_SIZE + 100);
+    return ctx;
+}
+
+int
+free_daemon_ctx(DaemonCtx **ctx)
+{
+    DaemonCtx *d = *ctx;
+
+    for (int i = 0; i < d->nb_pipelines; ++i) {
+        free_pipeline_ctx(&d->pipelines[i]);
+    }
+
+    free(d->pipelines);
+    free_worker_pool(&d->pool);
+    mutex_destroy(&d->lock);
+    free(d->error_str);
+    free(d);
+    *ctx = NULL;
+    return 0;
+}
+
+int
+daemon_add_pipeline(DaemonCtx *ctx, const PipelineConfig *config)
+{
+    if (pipeline_config_validate(config, ctx->error_str,
+                                 AV_ERROR_MAX_STRING_SIZE + 100)
+        < 0) {
+        return -1;
+    }
+    if (!avcodec_find_encoder_by_name(config->video_encoder)) {
+        sprintf(ctx->error_str, "codec '%.40s' not found",
+                config->video_encoder);
+        return -1;
+    }
+    if (!avcodec_find_encoder_by_name(config->audio_encoder)) {
+        sprintf(ctx->error_str, "codec '%.40s' not found",
+                config->audio_encoder);
+        return -1;
+    }
+
+    mutex_lock(&ctx->lock);
+    int exists = daemon_find_pipeline(ctx, config->name) != NULL;
+    mutex_unlock(&ctx->lock);
+
+    if (exists) {
+        sprintf(ctx->error_str, "pipeline \"%.64s\" already exists",
+                config->name);
+        return -1;
+    }
+
+    PipelineCtx *pipeline = new_pipeline_ctx(config, ctx->pool);
+    if (pipeline_start(pipeline) < 0) {
+        sprintf(ctx->error_str, "%.64s: %.100s", config->name,
+                pipeline->error_str);
+        free_pipeline_ctx(&pipeline);
+        return -1;
+    }
+
+    mutex_lock(&ctx->lock);
+    size_t size = sizeof(PipelineCtx *) * (ctx->nb_pipelines + 1);
+    ctx->pipelines = realloc(ctx->pipelines, size);
+    ctx->pipelines[ctx->nb_pipelines++] = pipeline;
+    mutex_unlock(&ctx->lock);
+
+    return 0;
+}
+
+int
+daemon_remove_pipeline(DaemonCtx *ctx, const char *name)
+{
+    PipelineCtx *pipeline = NULL;
+
+    mutex_lock(&ctx->lock);
+    for (int i = 0; i < ctx->nb_pipelines; ++i) {
+        if (strcmp(ctx->pipelines[i]->config.name, name) == 0) {
+            pipeline = ctx->pipelines[i];
+            ctx->pipelines[i] = ctx->pipelines[--ctx->nb_pipelines];
+            break;
+        }
+    }
+    mutex_unlock(&ctx->lock);
+
+    if (!pipeline) {
+        sprintf(ctx->error_str, "pipeline \"%.64s\" not found", name);
+        return -1;
+    }
+
+    // stopping drains the output queues, do it without holding the lock
+    free_pipeline_ctx(&pipeline);
+    return 0;
+}
+
+void
+daemon_remove_finished(DaemonCtx *ctx)
+{
+    for (;;) {
+        PipelineCtx *pipeline = NULL;
+
+        mutex_lock(&ctx->lock);
+        for (int i = 0; i < ctx->nb_pipelines; ++i) {
+            if (atomic_load(&ctx->pipelines[i]->finished)) {
+                pipeline = ctx->pipelines[i];
+                ctx->pipelines[i] = ctx->pipelines[--ctx->nb_pipelines];
+                break;
+            }
+        }
+        mutex_unlock(&ctx->lock);
+
+        if (!pipeline) {
+            return;
+        }
+        free_pipeline_ctx(&pipeline);
+    }
+}
+
+int
+daemon_pipeline_count(DaemonCtx *ctx)
+{
+    mutex_lock(&ctx->lock);
+    int count = ctx->nb_pipelines;
+    mutex_unlock(&ctx->lock);
+    return count;
+}
+
+void
+daemon_lock(DaemonCtx *ctx)
+{
+    mutex_lock(&ctx->lock);
+}
+
+void
+daemon_unlock(DaemonCtx *ctx)
+{
+    mutex_unlock(&ctx->lock);
+}
+
+PipelineCtx *
+daemon_find_pipeline(DaemonCtx *ctx, const char *name)
+{
+    for (int i = 0; i < ctx->nb_pipelines; ++i) {
+        if (strcmp(ctx->pipelines[i]->config.name, name) == 0) {
+            return ctx->pipelines[i];
+        }
+    }
+    return NULL;
+}
+
+void
+daemon_export_replay(DaemonCtx *ctx)
+{
+    mutex_lock(&ctx->lock);
+    for (int i = 0; i < ctx->nb_pipelines; ++i) {
+        pipeline_export_replay(ctx->pipelines[i], 0, 0);
+    }
+    mutex_unlock(&ctx->lock);
+}
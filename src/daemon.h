@@ -0,0 +1,56 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "pipeline.h"
+#include "thread.h"
+#include "worker_pool.h"
+
+/* The set of running pipelines. Pipelines may be added and removed while
+ * the others keep running; `lock` must be held while a pipeline returned
+ * by daemon_find_pipeline is used. */
+typedef struct DaemonCtx {
+    WorkerPool *pool;
+    PipelineCtx **pipelines;
+    int nb_pipelines;
+    Mutex lock;
+    char *error_str;
+} DaemonCtx;
+
+DaemonCtx *
+new_daemon_ctx(int workers);
+
+int
+free_daemon_ctx(DaemonCtx **ctx);
+
+int
+daemon_add_pipeline(DaemonCtx *ctx, const PipelineConfig *config);
+
+int
+daemon_remove_pipeline(DaemonCtx *ctx, const char *name);
+
+/* Stops and removes the pipelines whose input has ended. */
+void
+daemon_remove_finished(DaemonCtx *ctx);
+
+int
+daemon_pipeline_count(DaemonCtx *ctx);
+
+void
+daemon_lock(DaemonCtx *ctx);
+
+void
+daemon_unlock(DaemonCtx *ctx);
+
+PipelineCtx *
+daemon_find_pipeline(DaemonCtx *ctx, const char *name);
+
+void
+daemon_export_replay(DaemonCtx *ctx);
+
+#endif
@@ -0,0 +1,203 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "deinterlace.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define DI_SSE2
+#endif
+
+// a line combs when it leaves the range of its neighbours by more than
+// this, in 8-bit steps
+#define DI_COMB_THRESHOLD 10
+
+int
+di_mode_from_name(const char *name, DeinterlaceMode *mode)
+{
+    if (strcmp(name, "off") == 0) {
+        *mode = DEINTERLACE_OFF;
+    }
+    else if (strcmp(name, "bob") == 0) {
+        *mode = DEINTERLACE_BOB;
+    }
+    else if (strcmp(name, "blend") == 0) {
+        *mode = DEINTERLACE_BLEND;
+    }
+    else if (strcmp(name, "adaptive") == 0) {
+        *mode = DEINTERLACE_ADAPTIVE;
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+/* One line from the lines above (a), at (b) and below (c) it. Averages
+ * round up like pavgb/pavgw, so the SIMD and plain C versions agree. */
+
+static inline unsigned
+di_avg(unsigned x, unsigned y)
+{
+    return (x + y + 1) >> 1;
+}
+
+static inline unsigned
+di_pick(unsigned a, unsigned b, unsigned c, unsigned max, unsigned t,
+        DeinterlaceMode mode)
+{
+    unsigned i = di_avg(a, c);
+
+    if (mode == DEINTERLACE_BLEND) {
+        return di_avg(i, b);
+    }
+    if (mode == DEINTERLACE_ADAPTIVE) {
+        unsigned hi = (a > c ? a : c) + t;
+        unsigned lo = a < c ? a : c;
+        lo = lo > t ? lo - t : 0;
+        hi = hi > max ? max : hi;
+        return b > hi || b < lo ? i : b;
+    }
+    return i;
+}
+
+static void
+di_line8(uint8_t *dst, const uint8_t *a, const uint8_t *b, const uint8_t *c,
+         int n, DeinterlaceMode mode)
+{
+    int i = 0;
+
+#ifdef DI_SSE2
+    const __m128i t = _mm_set1_epi8(DI_COMB_THRESHOLD);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vc = _mm_loadu_si128((const __m128i *)(c + i));
+        __m128i res = _mm_avg_epu8(va, vc);
+
+        if (mode != DEINTERLACE_BOB) {
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+
+            if (mode == DEINTERLACE_BLEND) {
+                res = _mm_avg_epu8(res, vb);
+            }
+            else {
+                __m128i hi = _mm_adds_epu8(_mm_max_epu8(va, vc), t);
+                __m128i lo = _mm_subs_epu8(_mm_min_epu8(va, vc), t);
+                __m128i comb = _mm_or_si128(_mm_subs_epu8(vb, hi),
+                                            _mm_subs_epu8(lo, vb));
+                __m128i keep = _mm_cmpeq_epi8(comb, zero);
+                res = _mm_or_si128(_mm_and_si128(keep, vb),
+                                   _mm_andnot_si128(keep, res));
+            }
+        }
+        _mm_storeu_si128((__m128i *)(dst + i), res);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        dst[i] = (uint8_t)di_pick(a[i], b[i], c[i], 0xff, DI_COMB_THRESHOLD,
+                                  mode);
+    }
+}
+
+static void
+di_line16(uint16_t *dst, const uint16_t *a, const uint16_t *b,
+          const uint16_t *c, int n, DeinterlaceMode mode)
+{
+    int i = 0;
+
+#ifdef DI_SSE2
+    const __m128i t = _mm_set1_epi16(DI_COMB_THRESHOLD << 8);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vc = _mm_loadu_si128((const __m128i *)(c + i));
+        __m128i res = _mm_avg_epu16(va, vc);
+
+        if (mode != DEINTERLACE_BOB) {
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+
+            if (mode == DEINTERLACE_BLEND) {
+                res = _mm_avg_epu16(res, vb);
+            }
+            else {
+                // SSE2 has no unsigned 16-bit min and max
+                __m128i d = _mm_subs_epu16(va, vc);
+                __m128i hi = _mm_adds_epu16(_mm_add_epi16(vc, d), t);
+                __m128i lo = _mm_subs_epu16(_mm_sub_epi16(va, d), t);
+                __m128i comb = _mm_or_si128(_mm_subs_epu16(vb, hi),
+                                            _mm_subs_epu16(lo, vb));
+                __m128i keep = _mm_cmpeq_epi16(comb, zero);
+                res = _mm_or_si128(_mm_and_si128(keep, vb),
+                                   _mm_andnot_si128(keep, res));
+            }
+        }
+        _mm_storeu_si128((__m128i *)(dst + i), res);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        dst[i] = (uint16_t)di_pick(a[i], b[i], c[i], 0xffff,
+                                   DI_COMB_THRESHOLD << 8, mode);
+    }
+}
+
+static void
+di_line(uint8_t *dst, const uint8_t *a, const uint8_t *b, const uint8_t *c,
+        int row_bytes, int sample_size, DeinterlaceMode mode)
+{
+    if (sample_size == 2) {
+        di_line16((uint16_t *)dst, (const uint16_t *)a, (const uint16_t *)b,
+                  (const uint16_t *)c, row_bytes / 2, mode);
+    }
+    else {
+        di_line8(dst, a, b, c, row_bytes, mode);
+    }
+}
+
+void
+di_rows(uint8_t *dst, int dst_stride, const uint8_t *src, int src_stride,
+        int row_bytes, int sample_size, int rows, int field,
+        DeinterlaceMode mode, int top, int bottom)
+{
+    for (int y = top; y < bottom; ++y, dst += dst_stride) {
+        if (field >= 0) {
+            // field line k is line 2k + field of the frame
+            int lines = (rows - field + 1) / 2;
+            int above = y > 0 ? (y - 1) / 2 : (y + 1) / 2;
+            int below = (y + 1) / 2 < lines ? (y + 1) / 2 : above;
+            const uint8_t *a = src + (size_t)above * src_stride;
+            const uint8_t *c = src + (size_t)below * src_stride;
+
+            if (y % 2 == field) {
+                memcpy(dst, src + (size_t)(y / 2) * src_stride, row_bytes);
+            }
+            else {
+                di_line(dst, a, a, c, row_bytes, sample_size,
+                        DEINTERLACE_BOB);
+            }
+            continue;
+        }
+
+        int above = y > 0 ? y - 1 : (y + 1 < rows ? y + 1 : y);
+        int below = y + 1 < rows ? y + 1 : above;
+        const uint8_t *a = src + (size_t)above * src_stride;
+        const uint8_t *b = src + (size_t)y * src_stride;
+        const uint8_t *c = src + (size_t)below * src_stride;
+
+        if (mode != DEINTERLACE_BLEND && y % 2 == 0) {
+            memcpy(dst, b, row_bytes);
+        }
+        else {
+            di_line(dst, a, b, c, row_bytes, sample_size, mode);
+        }
+    }
+}
@@ -0,0 +1,32 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef DEINTERLACE_H
+#define DEINTERLACE_H
+
+#include <stdint.h>
+
+typedef enum DeinterlaceMode {
+    DEINTERLACE_OFF,
+    DEINTERLACE_BOB,      // field 0 lines, the others interpolated
+    DEINTERLACE_BLEND,    // [1 2 1] vertical low-pass of every line
+    DEINTERLACE_ADAPTIVE, // field 1 lines kept unless they comb
+} DeinterlaceMode;
+
+int
+di_mode_from_name(const char *name, DeinterlaceMode *mode);
+
+/* Writes rows top to bottom of the progressive picture made of one plane
+ * of an interlaced frame, row `top` goes to `dst`. `field` is -1 for both
+ * fields interleaved in `src`, or 0 or 1 for a single field holding every
+ * other of the `rows` lines, which is always interpolated like bob.
+ * Samples are `sample_size` bytes, 1 or 2. */
+void
+di_rows(uint8_t *dst, int dst_stride, const uint8_t *src, int src_stride,
+        int row_bytes, int sample_size, int rows, int field,
+        DeinterlaceMode mode, int top, int bottom);
+
+#endif
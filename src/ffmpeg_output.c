@@ -10,6 +10,7 @@
 #include <libavutil/channel_layout.h>
 
 #include "common.h"
+#include "trace.h"
 
 FFmpegOutputCtx *
 new_ffmpeg_output_ctx()
@@ -20,15 +21,26 @@ new_ffmpeg_output_ctx()
     return ctx;
 }
 
+static void
+ffmpeg_output_free_audio(FFmpegOutputCtx *ctx)
+{
+    for (int i = 0; i < ctx->nb_audio_tracks; ++i) {
+        if (ctx->audio_codec_ctx[i])
+            avcodec_free_context(&ctx->audio_codec_ctx[i]);
+    }
+    ctx->nb_audio_tracks = 0;
+}
+
 int
 free_ffmpeg_output_ctx(FFmpegOutputCtx **ctx)
 {
-    if ((*ctx)->audio_codec_ctx)
-        avcodec_free_context(&(*ctx)->audio_codec_ctx);
+    ffmpeg_output_free_audio(*ctx);
     if ((*ctx)->video_codec_ctx)
         avcodec_free_context(&(*ctx)->video_codec_ctx);
     if ((*ctx)->o_ctx)
         avformat_close_input(&(*ctx)->o_ctx);
+    if ((*ctx)->replay)
+        free_replay_buffer_ctx(&(*ctx)->replay);
 
     free(*ctx);
     *ctx = NULL;
@@ -43,13 +55,17 @@ ffmpeg_output_init(FFmpegOutputCtx *ctx, const char *format, const char *output)
         av_error_fmt(ctx->error_str,
                      "could not allocate output format context!", ret);
     }
-    else if (!(ctx->o_ctx->oformat->flags & (int)AVFMT_NOFILE)) {
+    else {
+        ctx->o_ctx->interrupt_callback = ctx->interrupt_cb;
 
-        ret = avio_open2(&ctx->o_ctx->pb, output, AVIO_FLAG_WRITE, NULL, NULL);
-        if (ret < 0) {
-            av_error_fmt(ctx->error_str, "could not open output IO context!",
-                         ret);
-            avformat_close_input(&ctx->o_ctx);
+        if (!(ctx->o_ctx->oformat->flags & (int)AVFMT_NOFILE)) {
+            ret = avio_open2(&ctx->o_ctx->pb, output, AVIO_FLAG_WRITE,
+                             &ctx->interrupt_cb, NULL);
+            if (ret < 0) {
+                av_error_fmt(ctx->error_str,
+                             "could not open output IO context!", ret);
+                avformat_close_input(&ctx->o_ctx);
+            }
         }
     }
 
@@ -60,8 +76,7 @@ ffmpeg_output_init(FFmpegOutputCtx *ctx, const char *format, const char *output)
 void
 ffmpeg_output_close(FFmpegOutputCtx *ctx)
 {
-    if (ctx->audio_codec_ctx)
-        avcodec_free_context(&ctx->audio_codec_ctx);
+    ffmpeg_output_free_audio(ctx);
     if (ctx->video_codec_ctx)
         avcodec_free_context(&ctx->video_codec_ctx);
     if (ctx->o_ctx)
@@ -73,16 +88,46 @@ ffmpeg_output_close(FFmpegOutputCtx *ctx)
 void
 ffmpeg_output_close_codecs(FFmpegOutputCtx *ctx)
 {
-    if (ctx->audio_codec_ctx)
-        avcodec_free_context(&ctx->audio_codec_ctx);
+    ffmpeg_output_free_audio(ctx);
     if (ctx->video_codec_ctx)
         avcodec_free_context(&ctx->video_codec_ctx);
 }
 
+enum AVPixelFormat
+ffmpeg_output_video_pix_fmt(const char *encoder_name, int high_depth)
+{
+    const AVCodec *codec = avcodec_find_encoder_by_name(encoder_name);
+
+    // H.264 High 10 has next to no hardware decoders
+    if (!high_depth || !codec || codec->id == AV_CODEC_ID_H264) {
+        return AV_PIX_FMT_YUV420P;
+    }
+
+    const enum AVPixelFormat *pix_fmts = NULL;
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(61, 13, 100)
+    pix_fmts = codec->pix_fmts;
+#else
+    avcodec_get_supported_config(NULL, codec, AV_CODEC_CONFIG_PIX_FORMAT, 0,
+                                 (const void **)&pix_fmts, NULL);
+#endif
+
+    enum AVPixelFormat res = AV_PIX_FMT_YUV420P;
+    for (int i = 0; pix_fmts && pix_fmts[i] != AV_PIX_FMT_NONE; ++i) {
+        if (pix_fmts[i] == AV_PIX_FMT_YUV420P10) {
+            return AV_PIX_FMT_YUV420P10;
+        }
+        if (pix_fmts[i] == AV_PIX_FMT_P010) {
+            res = AV_PIX_FMT_P010;
+        }
+    }
+    return res;
+}
+
 int
 ffmpeg_output_setup_video(FFmpegOutputCtx *ctx, const char *encoder_name,
                           const int width, const int height,
-                          const AVRational framerate, const int64_t bitrate)
+                          const AVRational framerate, const int64_t bitrate,
+                          const enum AVPixelFormat pix_fmt)
 {
     const AVCodec *codec = avcodec_find_encoder_by_name(encoder_name);
     if (!codec) {
@@ -100,7 +145,7 @@ ffmpeg_output_setup_video(FFmpegOutputCtx *ctx, const char *encoder_name,
         sprintf(ctx->error_str, "%s", "could not allocate video codec context");
         return -1;
     }
-    c_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    c_ctx->pix_fmt = pix_fmt;
     c_ctx->time_base.num = 1;
     c_ctx->time_base.den = AV_TIME_BASE;
     c_ctx->width = width;
@@ -112,6 +157,12 @@ ffmpeg_output_setup_video(FFmpegOutputCtx *ctx, const char *encoder_name,
     if (ctx->o_ctx->oformat->flags & AVFMT_GLOBALHEADER)
         c_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
+#ifdef AV_CODEC_FLAG_COPY_OPAQUE
+    // hands FrameTiming from the frame over to its packet
+    if (ctx->metrics)
+        c_ctx->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+#endif
+
     int ret;
     AVDictionary *codec_options = NULL;
 
@@ -126,6 +177,16 @@ ffmpeg_output_setup_video(FFmpegOutputCtx *ctx, const char *encoder_name,
         // av_dict_set(&codec_options, "level", "1.3", 0);
     }
 
+    if (ctx->video_options
+        && (ret = av_dict_parse_string(&codec_options, ctx->video_options,
+                                       "=", ":", 0))
+                   < 0) {
+        av_error_fmt(ctx->error_str, "invalid video encoder options!", ret);
+        av_dict_free(&codec_options);
+        avcodec_free_context(&c_ctx);
+        return ret;
+    }
+
     if ((ret = avcodec_open2(c_ctx, codec, &codec_options)) < 0) {
         av_error_fmt(ctx->error_str, "could not open video codec!", ret);
         avcodec_free_context(&c_ctx);
@@ -147,8 +208,12 @@ ffmpeg_output_setup_video(FFmpegOutputCtx *ctx, const char *encoder_name,
 
 int
 ffmpeg_output_setup_audio(FFmpegOutputCtx *ctx, char *encoder_name,
-                          int64_t bitrate)
+                          int64_t bitrate, int nb_channels)
 {
+    if (ctx->nb_audio_tracks == AUDIO_MAX_TRACKS) {
+        sprintf(ctx->error_str, "%s", "too many audio tracks");
+        return -1;
+    }
     const AVCodec *codec = avcodec_find_encoder_by_name(encoder_name);
     if (!codec) {
         sprintf(ctx->error_str, "%s", "could not find audio codec");
@@ -159,7 +224,8 @@ ffmpeg_output_setup_audio(FFmpegOutputCtx *ctx, char *encoder_name,
         sprintf(ctx->error_str, "%s", "could not create audio stream");
         return -1;
     }
-    ctx->audio_stream_index = (int)(ctx->o_ctx->nb_streams) - 1;
+    int track = ctx->nb_audio_tracks;
+    ctx->audio_stream_index[track] = (int)(ctx->o_ctx->nb_streams) - 1;
 
     AVCodecContext *c_ctx = avcodec_alloc_context3(codec);
     if (!c_ctx) {
@@ -204,7 +270,24 @@ ffmpeg_output_setup_audio(FFmpegOutputCtx *ctx, char *encoder_name,
                                  0, (const void **)&ch_layouts, NULL);
 #endif
 
-    if (ch_layouts != NULL) {
+    if (nb_channels > 0) {
+        // the first layout of that many channels the encoder takes
+        int found = ch_layouts == NULL;
+        av_channel_layout_default(&c_ctx->ch_layout, nb_channels);
+        for (int i = 0; !found && ch_layouts[i].nb_channels != 0; ++i) {
+            if (ch_layouts[i].nb_channels == nb_channels) {
+                c_ctx->ch_layout = ch_layouts[i];
+                found = 1;
+            }
+        }
+        if (!found) {
+            sprintf(ctx->error_str, "audio codec does not take %d channels",
+                    nb_channels);
+            avcodec_free_context(&c_ctx);
+            return -1;
+        }
+    }
+    else if (ch_layouts != NULL) {
         AVChannelLayout ch_layout = {};
         for (int i = 0; ch_layouts[i].nb_channels != 0; ++i) {
             ch_layout = ch_layouts[i];
@@ -245,6 +328,9 @@ ffmpeg_output_setup_audio(FFmpegOutputCtx *ctx, char *encoder_name,
     AVDictionary *codec_options = NULL;
 
     // av_dict_set(&codec_options, "frame_duration", "30", 0);
+    if (ctx->audio_dtx && strcmp(codec->name, "libopus") == 0) {
+        av_dict_set(&codec_options, "dtx", "1", 0);
+    }
 
     if (ctx->o_ctx->oformat->flags & AVFMT_GLOBALHEADER)
         c_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
@@ -262,7 +348,8 @@ ffmpeg_output_setup_audio(FFmpegOutputCtx *ctx, char *encoder_name,
         avcodec_free_context(&c_ctx);
     }
     else {
-        ctx->audio_codec_ctx = c_ctx;
+        ctx->audio_codec_ctx[track] = c_ctx;
+        ctx->nb_audio_tracks++;
     }
     av_dict_free(&codec_options);
     return ret;
@@ -277,6 +364,17 @@ ffmpeg_output_write_header(FFmpegOutputCtx *ctx, AVDictionary **av_opts)
     int ret = avformat_write_header(ctx->o_ctx, av_opts);
     if (ret < 0) {
         av_error_fmt(ctx->error_str, "could not write header!", ret);
+        return ret;
+    }
+
+    if (ctx->replay) {
+        rb_reset(ctx->replay);
+        if (ctx->video_codec_ctx)
+            rb_add_stream(ctx->replay, ctx->video_stream_index,
+                          ctx->video_codec_ctx);
+        for (int i = 0; i < ctx->nb_audio_tracks; ++i)
+            rb_add_stream(ctx->replay, ctx->audio_stream_index[i],
+                          ctx->audio_codec_ctx[i]);
     }
     return ret;
 }
@@ -288,7 +386,17 @@ send_packets(const FFmpegOutputCtx *ctx, AVCodecContext *codec_context,
 int
 ffmpeg_output_send_video_frame(FFmpegOutputCtx *ctx, AVFrame *frame)
 {
+    if (ctx->metrics && frame->opaque_ref
+        && av_buffer_make_writable(&frame->opaque_ref) >= 0) {
+        FrameTiming *timing = (FrameTiming *)frame->opaque_ref->data;
+        timing->submit_ts = get_current_ts_usec();
+        hist_record(&ctx->metrics->stages[LATENCY_STAGE_QUEUE],
+                    timing->submit_ts - timing->converted_ts);
+    }
+
+    TRACE_BEGIN(span);
     int ret = avcodec_send_frame(ctx->video_codec_ctx, frame);
+    TRACE_END(span, "avcodec_send_frame", ctx->trace_label);
     av_frame_unref(frame);
     if (ret < 0) {
         av_error_fmt(ctx->error_str,
@@ -300,16 +408,20 @@ ffmpeg_output_send_video_frame(FFmpegOutputCtx *ctx, AVFrame *frame)
 }
 
 int
-ffmpeg_output_send_audio_frame(FFmpegOutputCtx *ctx, AVFrame *frame)
+ffmpeg_output_send_audio_frame(FFmpegOutputCtx *ctx, int track,
+                               AVFrame *frame)
 {
-    int ret = avcodec_send_frame(ctx->audio_codec_ctx, frame);
+    TRACE_BEGIN(span);
+    int ret = avcodec_send_frame(ctx->audio_codec_ctx[track], frame);
+    TRACE_END(span, "avcodec_send_frame", ctx->trace_label);
     av_frame_unref(frame);
     if (ret < 0) {
         av_error_fmt(ctx->error_str,
                      "error sending frame to audio codec context!", ret);
         return ret;
     }
-    return send_packets(ctx, ctx->audio_codec_ctx, ctx->audio_stream_index);
+    return send_packets(ctx, ctx->audio_codec_ctx[track],
+                        ctx->audio_stream_index[track]);
 }
 
 int
@@ -320,7 +432,9 @@ send_packets(const FFmpegOutputCtx *ctx, AVCodecContext *codec_context,
     AVPacket *pkt = av_packet_alloc();
 
     while (ret >= 0) {
+        TRACE_BEGIN(receive_span);
         ret = avcodec_receive_packet(codec_context, pkt);
+        TRACE_END(receive_span, "avcodec_receive_packet", ctx->trace_label);
 
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
             av_packet_free(&pkt);
@@ -332,7 +446,24 @@ send_packets(const FFmpegOutputCtx *ctx, AVCodecContext *codec_context,
                          "error receiving packet from codec context!", ret);
         }
         else {
+            FrameTiming timing = {};
+            int64_t size = pkt->size;
+            int64_t packet_ts = 0;
+
+            if (ctx->metrics) {
+                packet_ts = get_current_ts_usec();
+                if (pkt->opaque_ref
+                    && (size_t)pkt->opaque_ref->size >= sizeof(FrameTiming)) {
+                    timing = *(FrameTiming *)pkt->opaque_ref->data;
+                    hist_record(&ctx->metrics->stages[LATENCY_STAGE_ENCODE],
+                                packet_ts - timing.submit_ts);
+                }
+            }
+
             pkt->stream_index = stream_index;
+            if (ctx->replay) {
+                rb_push(ctx->replay, pkt);
+            }
             pkt->pts = av_rescale_q(
                     pkt->pts, codec_context->time_base,
                     ctx->o_ctx->streams[stream_index]->time_base);
@@ -340,11 +471,26 @@ send_packets(const FFmpegOutputCtx *ctx, AVCodecContext *codec_context,
                     pkt->dts, codec_context->time_base,
                     ctx->o_ctx->streams[stream_index]->time_base);
 
+            TRACE_BEGIN(write_span);
             ret = av_interleaved_write_frame(ctx->o_ctx, pkt);
+            TRACE_END(write_span, "av_interleaved_write_frame",
+                      ctx->trace_label);
             if (ret < 0) {
                 av_error_fmt(ctx->error_str,
                              "error writing frame to output context!", ret);
             }
+            else if (ctx->metrics) {
+                int64_t now = get_current_ts_usec();
+                if (timing.submit_ts) {
+                    hist_record(&ctx->metrics->stages[LATENCY_STAGE_WRITE],
+                                now - packet_ts);
+                    hist_record(&ctx->metrics->stages[LATENCY_STAGE_TOTAL],
+                                now - timing.capture_ts);
+                }
+                om_packet_written(ctx->metrics, size,
+                                  stream_index == ctx->video_stream_index,
+                                  now);
+            }
         }
 
         av_packet_unref(pkt);
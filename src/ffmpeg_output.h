@@ -8,14 +8,26 @@
 #define FFMPEG_OUTPUT_H
 
 #include <libavcodec/avcodec.h>
+#include <libavformat/avio.h>
+
+#include "audio_router.h"
+#include "latency.h"
+#include "replay_buffer.h"
 
 typedef struct FFmpegOutputCtx {
     struct AVFormatContext *o_ctx;
-    struct AVCodecContext *audio_codec_ctx;
+    struct AVCodecContext *audio_codec_ctx[AUDIO_MAX_TRACKS]; // per track
     struct AVCodecContext *video_codec_ctx;
-    int audio_stream_index;
+    int audio_stream_index[AUDIO_MAX_TRACKS];
+    int nb_audio_tracks;
     int video_stream_index;
     const char *output;
+    AVIOInterruptCB interrupt_cb;
+    ReplayBufferCtx *replay;
+    OutputMetrics *metrics; // not owned, may be NULL
+    const char *trace_label; // see trace_intern, may be NULL
+    const char *video_options; // "key=value:key=value" encoder options
+    int audio_dtx; // skip silence in encoders that can (libopus)
     char *error_str;
 } FFmpegOutputCtx;
 
@@ -38,18 +50,26 @@ ffmpeg_output_close_codecs(FFmpegOutputCtx *ctx);
 int
 ffmpeg_output_write_header(FFmpegOutputCtx *ctx, AVDictionary **av_opts);
 
+/* YUV420P, or with `high_depth` the 10-bit 4:2:0 format the encoder takes
+ * (libx265, libvpx-vp9 profile 2, libsvtav1, hardware P010). */
+enum AVPixelFormat
+ffmpeg_output_video_pix_fmt(const char *encoder_name, int high_depth);
+
 int
 ffmpeg_output_setup_video(FFmpegOutputCtx *ctx, const char *encoder_name,
                           int width, int height, AVRational framerate,
-                          int64_t bitrate);
+                          int64_t bitrate, enum AVPixelFormat pix_fmt);
 
+/* Adds an audio track. `nb_channels` of 0 lets the encoder pick, stereo
+ * where it can. */
 int
 ffmpeg_output_setup_audio(FFmpegOutputCtx *ctx, char *encoder_name,
-                          int64_t bitrate);
+                          int64_t bitrate, int nb_channels);
 int
 ffmpeg_output_send_video_frame(FFmpegOutputCtx *ctx, AVFrame *frame);
 
 int
-ffmpeg_output_send_audio_frame(FFmpegOutputCtx *ctx, AVFrame *frame);
+ffmpeg_output_send_audio_frame(FFmpegOutputCtx *ctx, int track,
+                               AVFrame *frame);
 
 #endif
@@ -7,18 +7,27 @@
 #include "frame_converter.h"
 
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include <libswscale/swscale.h>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FC_SSE2
+#endif
+
 #include "common.h"
+#include "trace.h"
+
+// rows deinterlaced ahead of the scaler, even for 4:2:0 chroma
+#define FC_DI_STRIP 16
 
 enum AVPixelFormat
 ndi_fourcc_to_ffmpeg(NDIlib_FourCC_video_type_e type)
 {
     switch (type) {
     case NDIlib_FourCC_video_type_UYVY:
-        return AV_PIX_FMT_UYVY422;
     case NDIlib_FourCC_video_type_UYVA:
-        return AV_PIX_FMT_YUVA422P12;
+        return AV_PIX_FMT_UYVY422;
     case NDIlib_FourCC_video_type_BGRA:
         return AV_PIX_FMT_BGRA;
     case NDIlib_FourCC_video_type_BGRX:
@@ -30,13 +39,12 @@ ndi_fourcc_to_ffmpeg(NDIlib_FourCC_video_type_e type)
     case NDIlib_FourCC_video_type_NV12:
         return AV_PIX_FMT_NV12;
     case NDIlib_FourCC_video_type_RGBX:
-        return AV_PIX_FMT_RGB444;
+        return AV_PIX_FMT_RGB0;
     case NDIlib_FourCC_video_type_P216:
-        return AV_PIX_FMT_P216;
     case NDIlib_FourCC_video_type_PA16:
-        return AV_PIX_FMT_P016;
+        return AV_PIX_FMT_P216;
     case NDIlib_FourCC_video_type_YV12:
-        return AV_PIX_FMT_UYVY422;
+        return AV_PIX_FMT_YUV420P;
     default:
         return -1;
     }
@@ -49,7 +57,7 @@ new_frame_converter_ctx()
     memset(ctx, 0, sizeof(FrameConverterCtx));
     ctx->error_str = malloc(AV_ERROR_MAX_STRING_SIZE + 100);
     ctx->video_frame = av_frame_alloc();
-    ctx->audio_frame = av_frame_alloc();
+    ctx->src_frame = av_frame_alloc();
     ctx->frame_index = 0;
     ctx->start_ts = get_current_ts_usec();
     return ctx;
@@ -60,12 +68,22 @@ free_frame_converter_ctx(FrameConverterCtx **ctx)
 {
     if ((*ctx)->sws_ctx)
         sws_freeContext((*ctx)->sws_ctx);
+    if ((*ctx)->alpha_sws_ctx)
+        sws_freeContext((*ctx)->alpha_sws_ctx);
+    av_free((*ctx)->di_strip);
     if ((*ctx)->swr_context)
         swr_free(&(*ctx)->swr_context);
-    if ((*ctx)->audio_frame)
-        av_frame_free(&(*ctx)->audio_frame);
+    for (int i = 0; i < AUDIO_MAX_TRACKS; ++i) {
+        if ((*ctx)->track_swr[i])
+            swr_free(&(*ctx)->track_swr[i]);
+        av_frame_free(&(*ctx)->audio_frames[i]);
+    }
+    av_frame_free(&(*ctx)->mix_frame);
+    av_free((*ctx)->route_buf);
     if ((*ctx)->video_frame)
         av_frame_free(&(*ctx)->video_frame);
+    if ((*ctx)->src_frame)
+        av_frame_free(&(*ctx)->src_frame);
 
     free(*ctx);
     *ctx = NULL;
@@ -79,36 +97,487 @@ fc_reset(FrameConverterCtx *ctx)
     ctx->start_ts = get_current_ts_usec();
 }
 
-AVFrame *
-fc_ndi_video_frame_to_avframe(FrameConverterCtx *ctx, AVCodecContext *codec_ctx,
-                              NDIlib_video_frame_v2_t *in_frame)
+static int
+fc_get_scaler(FrameConverterCtx *ctx, NDIlib_video_frame_v2_t *in_frame,
+              enum AVPixelFormat dst_pix_fmt, int width, int height)
 {
+    ctx->sws_ctx = sws_getCachedContext(
+            ctx->sws_ctx, in_frame->xres, in_frame->yres,
+            ndi_fourcc_to_ffmpeg(in_frame->FourCC), width, height, dst_pix_fmt,
+            SWS_BICUBIC, NULL, NULL, NULL);
+    if (!ctx->sws_ctx) {
+        sprintf(ctx->error_str, "%s", "could not create scaler context");
+        return -1;
+    }
+    return 0;
+}
 
-    AVFrame *out_frame = ctx->video_frame;
+// a single field holds every other line of the frame
+static int
+fc_source_lines(NDIlib_video_frame_v2_t *in_frame)
+{
+    if (in_frame->frame_format_type == NDIlib_frame_format_type_field_0
+        || in_frame->frame_format_type == NDIlib_frame_format_type_field_1) {
+        return in_frame->yres / 2;
+    }
+    return in_frame->yres;
+}
 
-    av_frame_make_writable(out_frame);
-    out_frame->format = codec_ctx->pix_fmt;
-    out_frame->width = codec_ctx->width;
-    out_frame->height = codec_ctx->height;
-    av_frame_get_buffer(out_frame, 0);
+/* Interleaved frames are deinterlaced as configured, single fields are
+ * always brought to the frame height. */
+static int
+fc_deinterlaces(FrameConverterCtx *ctx, NDIlib_video_frame_v2_t *in_frame)
+{
+    switch (in_frame->frame_format_type) {
+    case NDIlib_frame_format_type_interleaved:
+        return ctx->deinterlace != DEINTERLACE_OFF;
+    case NDIlib_frame_format_type_field_0:
+    case NDIlib_frame_format_type_field_1:
+        return 1;
+    default:
+        return 0;
+    }
+}
 
-    enum AVPixelFormat src_pix_fmt = ndi_fourcc_to_ffmpeg(in_frame->FourCC);
+/* Points src at the color planes of in_frame as laid out by NDI, returns
+ * the size of the frame data including the alpha plane. */
+static int
+fc_fill_source(NDIlib_video_frame_v2_t *in_frame, uint8_t *src[4],
+               int src_stride[4])
+{
+    uint8_t *data = in_frame->p_data;
+    int w = in_frame->xres;
+    int h = fc_source_lines(in_frame);
+    int s = in_frame->line_stride_in_bytes;
+    int ch = (h + 1) / 2;
 
-    ctx->sws_ctx = sws_getCachedContext(
-            ctx->sws_ctx, in_frame->xres, in_frame->yres, src_pix_fmt,
-            out_frame->width, out_frame->height, out_frame->format, SWS_BICUBIC,
-            NULL, NULL, NULL);
+    switch (in_frame->FourCC) {
+    case NDIlib_FourCC_video_type_UYVY:
+    case NDIlib_FourCC_video_type_UYVA:
+        s = s > 0 ? s : w * 2;
+        src[0] = data;
+        src_stride[0] = s;
+        if (in_frame->FourCC == NDIlib_FourCC_video_type_UYVA) {
+            return s * h + w * h;
+        }
+        return s * h;
+    case NDIlib_FourCC_video_type_I420:
+    case NDIlib_FourCC_video_type_YV12: {
+        s = s > 0 ? s : w;
+        int u = in_frame->FourCC == NDIlib_FourCC_video_type_I420 ? 1 : 2;
+        src[0] = data;
+        src[u] = data + s * h;
+        src[3 - u] = data + s * h + s / 2 * ch;
+        src_stride[0] = s;
+        src_stride[1] = s / 2;
+        src_stride[2] = s / 2;
+        return s * h + s / 2 * ch * 2;
+    }
+    case NDIlib_FourCC_video_type_NV12:
+        s = s > 0 ? s : w;
+        src[0] = data;
+        src[1] = data + s * h;
+        src_stride[0] = s;
+        src_stride[1] = s;
+        return s * h + s * ch;
+    case NDIlib_FourCC_video_type_P216:
+    case NDIlib_FourCC_video_type_PA16:
+        s = s > 0 ? s : w * 2;
+        src[0] = data;
+        src[1] = data + s * h;
+        src_stride[0] = s;
+        src_stride[1] = s;
+        if (in_frame->FourCC == NDIlib_FourCC_video_type_PA16) {
+            return s * h * 3;
+        }
+        return s * h * 2;
+    default:
+        s = s > 0 ? s : w * 4;
+        src[0] = data;
+        src_stride[0] = s;
+        return s * h;
+    }
+}
+
+/* The alpha plane that follows the color planes of UYVA and PA16. */
+static enum AVPixelFormat
+fc_source_alpha(NDIlib_video_frame_v2_t *in_frame, uint8_t **alpha,
+                int *alpha_stride)
+{
+    int w = in_frame->xres;
+    int h = fc_source_lines(in_frame);
+    int s = in_frame->line_stride_in_bytes;
+
+    switch (in_frame->FourCC) {
+    case NDIlib_FourCC_video_type_UYVA:
+        s = s > 0 ? s : w * 2;
+        *alpha = in_frame->p_data + s * h;
+        *alpha_stride = w;
+        return AV_PIX_FMT_GRAY8;
+    case NDIlib_FourCC_video_type_PA16:
+        s = s > 0 ? s : w * 2;
+        *alpha = in_frame->p_data + s * h * 2;
+        *alpha_stride = s;
+        return AV_PIX_FMT_GRAY16LE;
+    default:
+        return AV_PIX_FMT_NONE;
+    }
+}
+
+// only planar destinations have an alpha plane to scale into
+static int
+fc_takes_alpha(NDIlib_video_frame_v2_t *in_frame,
+               enum AVPixelFormat dst_pix_fmt)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(dst_pix_fmt);
+    uint8_t *alpha;
+    int alpha_stride;
+
+    return fc_source_alpha(in_frame, &alpha, &alpha_stride)
+                   != AV_PIX_FMT_NONE
+           && desc && (desc->flags & AV_PIX_FMT_FLAG_ALPHA)
+           && (desc->flags & AV_PIX_FMT_FLAG_PLANAR);
+}
+
+/* Scales the alpha plane of in_frame into the alpha plane of the
+ * destination, destinations without one drop it. */
+static int
+fc_scale_alpha(FrameConverterCtx *ctx, NDIlib_video_frame_v2_t *in_frame,
+               uint8_t *const dst[], const int dst_stride[],
+               enum AVPixelFormat dst_pix_fmt, int width, int height)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(dst_pix_fmt);
+    uint8_t *alpha;
+    int alpha_stride;
+
+    if (!fc_takes_alpha(in_frame, dst_pix_fmt)) {
+        return 0;
+    }
+
+    enum AVPixelFormat src_fmt = fc_source_alpha(in_frame, &alpha,
+                                                 &alpha_stride);
+
+    enum AVPixelFormat dst_fmt;
+    switch (desc->comp[3].depth) {
+    case 8:
+        dst_fmt = AV_PIX_FMT_GRAY8;
+        break;
+    case 10:
+        dst_fmt = AV_PIX_FMT_GRAY10;
+        break;
+    case 12:
+        dst_fmt = AV_PIX_FMT_GRAY12;
+        break;
+    default:
+        dst_fmt = AV_PIX_FMT_GRAY16;
+        break;
+    }
+
+    // the alpha of a single field is stretched, not deinterlaced
+    int lines = fc_source_lines(in_frame);
+    ctx->alpha_sws_ctx = sws_getCachedContext(
+            ctx->alpha_sws_ctx, in_frame->xres, lines, src_fmt, width, height,
+            dst_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+    if (!ctx->alpha_sws_ctx) {
+        sprintf(ctx->error_str, "%s", "could not create alpha scaler context");
+        return -1;
+    }
+
+    int plane = desc->comp[3].plane;
+    return sws_scale(ctx->alpha_sws_ctx, (const uint8_t *const *)&alpha,
+                     &alpha_stride, 0, lines, &dst[plane], &dst_stride[plane]);
+}
+
+/* P216 to 10-bit 4:2:0 without swscale: luma is rounded to 10 bits, chroma
+ * is the rounded average of two 4:2:2 rows. `msb` keeps the 10 bits at the
+ * top of each sample like P010 does. */
+
+static inline uint16_t
+fc_round10(uint32_t v, int msb)
+{
+    v = v + 32 > 0xffff ? 0xffff : v + 32;
+    return (uint16_t)(msb ? v & 0xffc0 : v >> 6);
+}
+
+static void
+fc_p216_luma(uint16_t *dst, const uint16_t *src, int n, int msb)
+{
+    int i = 0;
+
+#ifdef FC_SSE2
+    const __m128i bias = _mm_set1_epi16(32);
+    const __m128i mask = _mm_set1_epi16((short)0xffc0);
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_adds_epu16(
+                _mm_loadu_si128((const __m128i *)(src + i)), bias);
+        v = msb ? _mm_and_si128(v, mask) : _mm_srli_epi16(v, 6);
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        dst[i] = fc_round10(src[i], msb);
+    }
+}
+
+// interleaved UV rows a and b to one interleaved row (dst_v NULL) or to
+// separate U and V rows
+static void
+fc_p216_chroma(uint16_t *dst_u, uint16_t *dst_v, const uint16_t *a,
+               const uint16_t *b, int pairs)
+{
+    int i = 0;
+
+#ifdef FC_SSE2
+    const __m128i bias = _mm_set1_epi16(32);
+    const __m128i mask = _mm_set1_epi16((short)0xffc0);
+
+    for (; i + 8 <= pairs; i += 8) {
+        __m128i lo = _mm_adds_epu16(
+                _mm_avg_epu16(_mm_loadu_si128((const __m128i *)(a + i * 2)),
+                              _mm_loadu_si128((const __m128i *)(b + i * 2))),
+                bias);
+        __m128i hi = _mm_adds_epu16(
+                _mm_avg_epu16(
+                        _mm_loadu_si128((const __m128i *)(a + i * 2 + 8)),
+                        _mm_loadu_si128((const __m128i *)(b + i * 2 + 8))),
+                bias);
+
+        if (!dst_v) {
+            _mm_storeu_si128((__m128i *)(dst_u + i * 2),
+                             _mm_and_si128(lo, mask));
+            _mm_storeu_si128((__m128i *)(dst_u + i * 2 + 8),
+                             _mm_and_si128(hi, mask));
+            continue;
+        }
+
+        // 10-bit values, the signed pack cannot saturate
+        lo = _mm_srli_epi16(lo, 6);
+        hi = _mm_srli_epi16(hi, 6);
+        __m128i u = _mm_packs_epi32(
+                _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16),
+                _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16));
+        __m128i v = _mm_packs_epi32(_mm_srai_epi32(lo, 16),
+                                    _mm_srai_epi32(hi, 16));
+        _mm_storeu_si128((__m128i *)(dst_u + i), u);
+        _mm_storeu_si128((__m128i *)(dst_v + i), v);
+    }
+#endif
+
+    for (; i < pairs; ++i) {
+        uint32_t u = ((uint32_t)a[i * 2] + b[i * 2] + 1) >> 1;
+        uint32_t v = ((uint32_t)a[i * 2 + 1] + b[i * 2 + 1] + 1) >> 1;
+        if (!dst_v) {
+            dst_u[i * 2] = fc_round10(u, 1);
+            dst_u[i * 2 + 1] = fc_round10(v, 1);
+        }
+        else {
+            dst_u[i] = fc_round10(u, 0);
+            dst_v[i] = fc_round10(v, 0);
+        }
+    }
+}
+
+static int
+fc_has_p216_path(NDIlib_video_frame_v2_t *in_frame,
+                 enum AVPixelFormat dst_pix_fmt, int width, int height)
+{
+    return (in_frame->FourCC == NDIlib_FourCC_video_type_P216
+            || in_frame->FourCC == NDIlib_FourCC_video_type_PA16)
+           && (dst_pix_fmt == AV_PIX_FMT_P010
+               || dst_pix_fmt == AV_PIX_FMT_YUV420P10)
+           && width == in_frame->xres && height == in_frame->yres
+           && width % 2 == 0 && height % 2 == 0;
+}
+
+/* Converts rows top to bottom, both even, `src` points at row top. */
+static void
+fc_p216_rows(uint8_t *const src[], const int src_stride[], int width,
+             uint8_t *const dst[], const int dst_stride[],
+             enum AVPixelFormat dst_pix_fmt, int top, int bottom)
+{
+    int msb = dst_pix_fmt == AV_PIX_FMT_P010;
+    int pairs = width / 2;
+
+    for (int y = top; y < bottom; ++y) {
+        size_t sy = y - top;
+        fc_p216_luma((uint16_t *)(dst[0] + (size_t)y * dst_stride[0]),
+                     (const uint16_t *)(src[0] + sy * src_stride[0]), width,
+                     msb);
+    }
+
+    for (int y = top; y < bottom; y += 2) {
+        size_t sy = y - top;
+        const uint16_t *a = (const uint16_t *)(src[1] + sy * src_stride[1]);
+        const uint16_t *b = (const uint16_t *)(src[1]
+                                               + (sy + 1) * src_stride[1]);
+        size_t cy = y / 2;
+
+        if (msb) {
+            fc_p216_chroma((uint16_t *)(dst[1] + cy * dst_stride[1]), NULL, a,
+                           b, pairs);
+        }
+        else {
+            fc_p216_chroma((uint16_t *)(dst[1] + cy * dst_stride[1]),
+                           (uint16_t *)(dst[2] + cy * dst_stride[2]), a, b,
+                           pairs);
+        }
+    }
+}
+
+/* Deinterlaces FC_DI_STRIP rows at a time into a buffer small enough to
+ * stay in cache and hands every strip to the scaler (or the P216 path)
+ * right away, so the frame is read from memory once. */
+static int
+fc_scale_deinterlaced(FrameConverterCtx *ctx,
+                      NDIlib_video_frame_v2_t *in_frame, uint8_t *const dst[],
+                      const int dst_stride[], enum AVPixelFormat dst_pix_fmt,
+                      int width, int height)
+{
+    enum AVPixelFormat src_fmt = ndi_fourcc_to_ffmpeg(in_frame->FourCC);
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src_fmt);
+    int p216 = fc_has_p216_path(in_frame, dst_pix_fmt, width, height);
+    int rows = in_frame->yres;
+    int field = -1;
+
+    if (!desc) {
+        sprintf(ctx->error_str, "%s", "unsupported video format");
+        return -1;
+    }
+    if (in_frame->frame_format_type == NDIlib_frame_format_type_field_0) {
+        field = 0;
+    }
+    else if (in_frame->frame_format_type
+             == NDIlib_frame_format_type_field_1) {
+        field = 1;
+    }
+
+    uint8_t *src[4] = {};
+    int src_stride[4] = {};
+    int row_bytes[4] = {};
+    int strip_stride[4] = {};
+    int nb_planes = av_pix_fmt_count_planes(src_fmt);
+    int sample_size = desc->comp[0].depth > 8 ? 2 : 1;
+    size_t size = 0;
+
+    fc_fill_source(in_frame, src, src_stride);
+    av_image_fill_linesizes(row_bytes, src_fmt, in_frame->xres);
+    for (int i = 0; i < nb_planes; ++i) {
+        strip_stride[i] = FFALIGN(row_bytes[i], 64);
+        size += (size_t)strip_stride[i] * FC_DI_STRIP;
+    }
+
+    if (size > ctx->di_strip_size) {
+        av_free(ctx->di_strip);
+        ctx->di_strip = av_malloc(size);
+        ctx->di_strip_size = ctx->di_strip ? size : 0;
+        if (!ctx->di_strip) {
+            sprintf(ctx->error_str, "%s", "could not allocate strip buffer");
+            return -1;
+        }
+    }
+
+    uint8_t *strip[4] = {};
+    for (int i = 0, offset = 0; i < nb_planes; ++i) {
+        strip[i] = ctx->di_strip + offset;
+        offset += strip_stride[i] * FC_DI_STRIP;
+    }
+
+    if (!p216 && fc_get_scaler(ctx, in_frame, dst_pix_fmt, width, height) < 0) {
+        return -1;
+    }
+
+    TRACE_BEGIN(span);
+    for (int top = 0; top < rows; top += FC_DI_STRIP) {
+        int bottom = FFMIN(top + FC_DI_STRIP, rows);
+
+        for (int i = 0; i < nb_planes; ++i) {
+            int shift = i > 0 ? desc->log2_chroma_h : 0;
+            di_rows(strip[i], strip_stride[i], src[i], src_stride[i],
+                    row_bytes[i], sample_size, AV_CEIL_RSHIFT(rows, shift),
+                    field, ctx->deinterlace, top >> shift,
+                    AV_CEIL_RSHIFT(bottom, shift));
+        }
+
+        if (p216) {
+            fc_p216_rows(strip, strip_stride, width, dst, dst_stride,
+                         dst_pix_fmt, top, bottom);
+        }
+        else if (sws_scale(ctx->sws_ctx, (const uint8_t *const *)strip,
+                           strip_stride, top, bottom - top, dst, dst_stride)
+                 < 0) {
+            sprintf(ctx->error_str, "%s", "could not scale deinterlaced rows");
+            return -1;
+        }
+    }
+    TRACE_END(span, "deinterlace", ctx->trace_label);
+    ctx->deinterlaced++;
+
+    if (fc_scale_alpha(ctx, in_frame, dst, dst_stride, dst_pix_fmt, width,
+                       height)
+        < 0) {
+        return -1;
+    }
+    return height;
+}
+
+int
+fc_ndi_video_frame_scale(FrameConverterCtx *ctx,
+                         NDIlib_video_frame_v2_t *in_frame,
+                         uint8_t *const dst[], const int dst_stride[],
+                         enum AVPixelFormat dst_pix_fmt, int width, int height)
+{
+    if (fc_deinterlaces(ctx, in_frame)) {
+        return fc_scale_deinterlaced(ctx, in_frame, dst, dst_stride,
+                                     dst_pix_fmt, width, height);
+    }
+
+    if (fc_has_p216_path(in_frame, dst_pix_fmt, width, height)) {
+        TRACE_BEGIN(span);
+        uint8_t *src[4] = {};
+        int src_stride[4] = {};
+
+        fc_fill_source(in_frame, src, src_stride);
+        fc_p216_rows(src, src_stride, width, dst, dst_stride, dst_pix_fmt, 0,
+                     height);
+        TRACE_END(span, "p216_convert", ctx->trace_label);
+        if (fc_scale_alpha(ctx, in_frame, dst, dst_stride, dst_pix_fmt,
+                           width, height)
+            < 0) {
+            return -1;
+        }
+        return height;
+    }
+
+    if (fc_get_scaler(ctx, in_frame, dst_pix_fmt, width, height) < 0) {
+        return -1;
+    }
 
     int src_stride[4] = {};
     uint8_t *src[4] = {};
 
-    av_image_fill_linesizes(src_stride, src_pix_fmt, in_frame->xres);
-    av_image_fill_pointers(src, src_pix_fmt, in_frame->yres, in_frame->p_data,
-                           src_stride);
+    fc_fill_source(in_frame, src, src_stride);
 
-    sws_scale(ctx->sws_ctx, (const uint8_t *const *)src, src_stride, 0, in_frame->yres, out_frame->data,
-              out_frame->linesize);
+    TRACE_BEGIN(span);
+    int ret = sws_scale(ctx->sws_ctx, (const uint8_t *const *)src, src_stride,
+                        0, in_frame->yres, dst, dst_stride);
+    TRACE_END(span, "sws_scale", ctx->trace_label);
+    if (ret < 0) {
+        return ret;
+    }
+    if (fc_scale_alpha(ctx, in_frame, dst, dst_stride, dst_pix_fmt, width,
+                       height)
+        < 0) {
+        return -1;
+    }
+    return ret;
+}
 
+static void
+fc_video_frame_timing(FrameConverterCtx *ctx, AVFrame *out_frame,
+                      const NDIlib_video_frame_v2_t *in_frame)
+{
     out_frame->pkt_dts = get_current_ts_usec() - ctx->start_ts;
     out_frame->pts = ctx->frame_index * AV_TIME_BASE * in_frame->frame_rate_D
                      / in_frame->frame_rate_N;
@@ -116,95 +585,451 @@ fc_ndi_video_frame_to_avframe(FrameConverterCtx *ctx, AVCodecContext *codec_ctx,
 
     // AV_PICTURE_TYPE_I; // force infra
     out_frame->pict_type = AV_PICTURE_TYPE_NONE;
+}
+
+AVFrame *
+fc_ndi_video_frame_to_avframe(FrameConverterCtx *ctx, AVCodecContext *codec_ctx,
+                              NDIlib_video_frame_v2_t *in_frame)
+{
+    return fc_ndi_video_frame_convert(ctx, codec_ctx->pix_fmt, codec_ctx->width,
+                                      codec_ctx->height, in_frame);
+}
+
+AVFrame *
+fc_ndi_video_frame_convert(FrameConverterCtx *ctx, enum AVPixelFormat pix_fmt,
+                           int width, int height,
+                           NDIlib_video_frame_v2_t *in_frame)
+{
+
+    AVFrame *out_frame = ctx->video_frame;
+
+    av_frame_make_writable(out_frame);
+    out_frame->format = pix_fmt;
+    out_frame->width = width;
+    out_frame->height = height;
+    av_frame_get_buffer(out_frame, 0);
+
+    fc_ndi_video_frame_scale(ctx, in_frame, out_frame->data,
+                             out_frame->linesize, out_frame->format,
+                             out_frame->width, out_frame->height);
+
+    fc_video_frame_timing(ctx, out_frame, in_frame);
 
     return out_frame;
 }
 
 AVFrame *
-fc_ndi_audio_frame_to_avframe(FrameConverterCtx *ctx, AVCodecContext *codec_ctx,
-                              NDIlib_audio_frame_v2_t *in_frame)
+fc_ndi_video_frame_repeat(FrameConverterCtx *ctx, const AVFrame *last,
+                          NDIlib_video_frame_v2_t *in_frame)
 {
+    AVFrame *out_frame = ctx->video_frame;
+
+    av_frame_unref(out_frame);
+    if (av_frame_ref(out_frame, last) < 0) {
+        sprintf(ctx->error_str, "%s", "could not reference the last frame");
+        return NULL;
+    }
+
+    fc_video_frame_timing(ctx, out_frame, in_frame);
+
+    return out_frame;
+}
+
+static void
+fc_ndi_buffer_free(void *opaque, uint8_t *data)
+{
+    (void)opaque;
+    (void)data;
+}
+
+// runs of marked rows from y on, in pixel rows
+static int
+fc_next_run(const uint8_t *rows, int row_height, int height, int *y,
+            int *top, int *bottom)
+{
+    int nb_rows = (height + row_height - 1) / row_height;
+
+    while (*y < nb_rows && !rows[*y]) {
+        (*y)++;
+    }
+    if (*y == nb_rows) {
+        return 0;
+    }
+
+    *top = *y * row_height;
+    while (*y < nb_rows && rows[*y]) {
+        (*y)++;
+    }
+    *bottom = FFMIN(*y * row_height, height);
+    return 1;
+}
+
+/* Scales the marked rows only. The whole input is sent, so rows at the
+ * edge of a run come out exactly like in a full conversion. */
+static int
+fc_scale_rows(FrameConverterCtx *ctx, NDIlib_video_frame_v2_t *in_frame,
+              AVFrame *out_frame, const uint8_t *rows, int row_height)
+{
+    AVFrame *src_frame = ctx->src_frame;
     int ret;
-    int nb_samples = codec_ctx->frame_size;
 
-    int remaining_pre
-            = ctx->swr_context ? swr_get_out_samples(ctx->swr_context, 0) : 0;
+    src_frame->format = ndi_fourcc_to_ffmpeg(in_frame->FourCC);
+    src_frame->width = in_frame->xres;
+    src_frame->height = in_frame->yres;
 
-    if (!in_frame && remaining_pre < nb_samples) { // wait
-        return NULL;
+    // the NDI frame outlives the conversion, it is wrapped without a copy
+    ret = fc_fill_source(in_frame, src_frame->data, src_frame->linesize);
+    if (ret < 0) {
+        return ret;
+    }
+    src_frame->buf[0] = av_buffer_create(in_frame->p_data, ret,
+                                         fc_ndi_buffer_free, NULL,
+                                         AV_BUFFER_FLAG_READONLY);
+    if (!src_frame->buf[0]) {
+        return AVERROR(ENOMEM);
     }
 
-    AVFrame *out_frame = ctx->audio_frame;
+    ret = sws_frame_start(ctx->sws_ctx, out_frame, src_frame);
+    if (ret >= 0) {
+        ret = sws_send_slice(ctx->sws_ctx, 0, in_frame->yres);
+    }
 
-    av_frame_make_writable(out_frame);
-    out_frame->nb_samples = nb_samples;
-    out_frame->format = codec_ctx->sample_fmt;
-    out_frame->sample_rate = codec_ctx->sample_rate;
-    out_frame->ch_layout = codec_ctx->ch_layout;
-    av_frame_get_buffer(out_frame, 0);
+    int y = 0, top, bottom;
+    while (ret >= 0
+           && fc_next_run(rows, row_height, out_frame->height, &y, &top,
+                          &bottom)) {
+        ret = sws_receive_slice(ctx->sws_ctx, top, bottom - top);
+    }
+
+    sws_frame_end(ctx->sws_ctx);
+    av_frame_unref(src_frame);
+    return ret;
+}
+
+AVFrame *
+fc_ndi_video_frame_update(FrameConverterCtx *ctx, const AVFrame *last,
+                          NDIlib_video_frame_v2_t *in_frame,
+                          const uint8_t *rows, int row_height)
+{
+    AVFrame *out_frame = ctx->video_frame;
+    int ret;
+
+    if (last->width != in_frame->xres || last->height != in_frame->yres) {
+        sprintf(ctx->error_str, "%s",
+                "partial conversion needs frames of the source size");
+        return NULL;
+    }
 
-    if (!in_frame) { // flush
-        out_frame->pkt_dts = get_current_ts_usec() - ctx->start_ts;
-        out_frame->pts = swr_next_pts(ctx->swr_context, INT64_MIN);
+    int p216 = fc_has_p216_path(in_frame, last->format, last->width,
+                                last->height)
+               && row_height % 2 == 0;
 
-        ret = swr_convert(ctx->swr_context, out_frame->data,
-                          out_frame->nb_samples, NULL, 0);
+    // the alpha plane is converted whole, deinterlacing needs the lines
+    // around the dirty ones
+    if (fc_takes_alpha(in_frame, last->format)
+        || fc_deinterlaces(ctx, in_frame)) {
+        return fc_ndi_video_frame_convert(ctx, last->format, last->width,
+                                          last->height, in_frame);
+    }
 
-        if (ret < 0) {
-            av_error_fmt(ctx->error_str, "error converting frame!", ret);
+    if (!p216) {
+        if (fc_get_scaler(ctx, in_frame, last->format, last->width,
+                          last->height)
+            < 0) {
             return NULL;
         }
-        return out_frame;
+
+        // slices have to start on rows the scaler can begin at
+        int align = (int)sws_receive_slice_alignment(ctx->sws_ctx);
+        if (align <= 0 || row_height % align != 0) {
+            return fc_ndi_video_frame_convert(ctx, last->format, last->width,
+                                              last->height, in_frame);
+        }
+    }
+
+    av_frame_unref(out_frame);
+    out_frame->format = last->format;
+    out_frame->width = last->width;
+    out_frame->height = last->height;
+
+    ret = av_frame_get_buffer(out_frame, 0);
+    if (ret >= 0) {
+        ret = av_frame_copy(out_frame, last);
+    }
+    if (ret >= 0 && p216) {
+        uint8_t *src[4] = {};
+        int src_stride[4] = {};
+        int y = 0, top, bottom;
+
+        TRACE_BEGIN(span);
+        fc_fill_source(in_frame, src, src_stride);
+        while (fc_next_run(rows, row_height, out_frame->height, &y, &top,
+                           &bottom)) {
+            uint8_t *run[4] = {
+                src[0] + (size_t)top * src_stride[0],
+                src[1] + (size_t)top * src_stride[1],
+            };
+            fc_p216_rows(run, src_stride, out_frame->width, out_frame->data,
+                         out_frame->linesize, out_frame->format, top, bottom);
+        }
+        TRACE_END(span, "p216_convert", ctx->trace_label);
+    }
+    else if (ret >= 0) {
+        TRACE_BEGIN(span);
+        ret = fc_scale_rows(ctx, in_frame, out_frame, rows, row_height);
+        TRACE_END(span, "sws_scale", ctx->trace_label);
+    }
+    if (ret < 0) {
+        av_error_fmt(ctx->error_str, "could not convert dirty rows", ret);
+        av_frame_unref(out_frame);
+        return NULL;
+    }
+
+    fc_video_frame_timing(ctx, out_frame, in_frame);
+
+    return out_frame;
+}
+
+static void
+fc_unspec_layout(AVChannelLayout *layout, int nb_channels)
+{
+    memset(layout, 0, sizeof(AVChannelLayout));
+    layout->order = AV_CHANNEL_ORDER_UNSPEC;
+    layout->nb_channels = nb_channels;
+}
+
+static AVFrame *
+fc_audio_frame(AVFrame **frame, enum AVSampleFormat sample_fmt,
+               int sample_rate, const AVChannelLayout *ch_layout,
+               int nb_samples)
+{
+    if (!*frame) {
+        *frame = av_frame_alloc();
+    }
+
+    AVFrame *out_frame = *frame;
+    av_frame_unref(out_frame);
+    out_frame->nb_samples = nb_samples;
+    out_frame->format = sample_fmt;
+    out_frame->sample_rate = sample_rate;
+    av_channel_layout_copy(&out_frame->ch_layout, ch_layout);
+
+    if (av_frame_get_buffer(out_frame, 0) < 0) {
+        return NULL;
+    }
+    return out_frame;
+}
+
+/* Routes in_frame and hands it to the resampler. With a single track the
+ * resampler also converts to the encoder format and layout, with several
+ * it keeps every routed channel in planar float. */
+static int
+fc_audio_push(FrameConverterCtx *ctx, const AudioRoute *route,
+              AVCodecContext *codec_ctx, int direct,
+              NDIlib_audio_frame_v2_t *in_frame)
+{
+    const uint8_t *in[AUDIO_MAX_INPUTS];
+    int nb_in = in_frame->no_channels;
+    int ret;
+
+    if (nb_in > AUDIO_MAX_INPUTS && !route) {
+        sprintf(ctx->error_str, "%d audio channels are too many", nb_in);
+        return -1;
+    }
+    nb_in = FFMIN(nb_in, AUDIO_MAX_INPUTS);
+
+    // planes are channel_stride_in_bytes apart, not padded like FFmpeg's
+    for (int c = 0; c < nb_in; ++c) {
+        in[c] = (uint8_t *)in_frame->p_data
+                + (size_t)c * in_frame->channel_stride_in_bytes;
     }
 
     AVChannelLayout in_layout;
-    av_channel_layout_default(&in_layout, in_frame->no_channels);
+    AVChannelLayout out_layout;
+
+    if (route) {
+        size_t plane = (size_t)in_frame->no_samples * sizeof(float);
+        float *routed[AUDIO_MAX_TRACKS * AUDIO_MAX_TRACK_CHANNELS];
+
+        av_fast_malloc(&ctx->route_buf, &ctx->route_buf_size,
+                       plane * route->nb_channels);
+        if (!ctx->route_buf) {
+            sprintf(ctx->error_str, "%s", "could not allocate audio buffer");
+            return -1;
+        }
+        for (int c = 0; c < route->nb_channels; ++c) {
+            routed[c] = (float *)(ctx->route_buf + plane * c);
+        }
 
-    ret = swr_alloc_set_opts2(&ctx->swr_context, &out_frame->ch_layout,
-                              out_frame->format, out_frame->sample_rate,
-                              &in_layout, AV_SAMPLE_FMT_FLTP,
-                              in_frame->sample_rate, 0, NULL);
+        TRACE_BEGIN(mix_span);
+        ar_mix(route, (const float *const *)in, nb_in, routed,
+               in_frame->no_samples);
+        TRACE_END(mix_span, "audio_mix", ctx->trace_label);
+
+        for (int c = 0; c < route->nb_channels; ++c) {
+            in[c] = (const uint8_t *)routed[c];
+        }
+    }
+
+    if (direct) {
+        av_channel_layout_copy(&out_layout, &codec_ctx->ch_layout);
+    }
+    else {
+        fc_unspec_layout(&out_layout, route->nb_channels);
+    }
+    if (route) {
+        // the track already has the channels of the encoder
+        av_channel_layout_copy(&in_layout, &out_layout);
+    }
+    else {
+        av_channel_layout_default(&in_layout, nb_in);
+    }
+
+    ret = swr_alloc_set_opts2(
+            &ctx->swr_context, &out_layout,
+            direct ? codec_ctx->sample_fmt : AV_SAMPLE_FMT_FLTP,
+            codec_ctx->sample_rate, &in_layout, AV_SAMPLE_FMT_FLTP,
+            in_frame->sample_rate, 0, NULL);
+    av_channel_layout_uninit(&in_layout);
+    av_channel_layout_uninit(&out_layout);
     if (ret < 0) {
         av_error_fmt(ctx->error_str, "error converting frame!", ret);
-        return NULL;
+        return ret;
     }
 
     if (!ctx->swr_context) {
         sprintf(ctx->error_str, "%s", "swr_alloc_set_opts returned null");
-        return NULL;
+        return -1;
     }
 
     if (!swr_is_initialized(ctx->swr_context)) {
         swr_init(ctx->swr_context);
     }
 
-    uint8_t *in[8] = {};
+    TRACE_BEGIN(span);
+    ret = swr_convert(ctx->swr_context, NULL, 0, in, in_frame->no_samples);
+    TRACE_END(span, "swr_convert", ctx->trace_label);
+    if (ret < 0) {
+        av_error_fmt(ctx->error_str, "error converting frame!", ret);
+        return ret;
+    }
+    return 0;
+}
+
+// the channels of one track, from planar float to the encoder format
+static int
+fc_audio_track(FrameConverterCtx *ctx, const AudioRoute *route, int track,
+               AVCodecContext *codec_ctx, const AVFrame *mix, AVFrame **frame)
+{
+    int nb_samples = mix->nb_samples;
+    const uint8_t **planes = (const uint8_t **)mix->extended_data
+                             + route->track_offset[track];
 
-    av_samples_fill_arrays(in, NULL, (const uint8_t *)in_frame->p_data,
-                           in_frame->no_channels, in_frame->no_samples,
-                           AV_SAMPLE_FMT_FLTP, 0);
+    AVFrame *out_frame = fc_audio_frame(
+            &ctx->audio_frames[track], codec_ctx->sample_fmt,
+            codec_ctx->sample_rate, &codec_ctx->ch_layout, nb_samples);
+    if (!out_frame) {
+        sprintf(ctx->error_str, "%s", "could not allocate audio frame");
+        return -1;
+    }
 
-    ret = swr_convert(ctx->swr_context, NULL, 0, (const uint8_t **)in,
-                      in_frame->no_samples);
+    // no resampling here, the rates and the layouts are the same
+    int ret = swr_alloc_set_opts2(
+            &ctx->track_swr[track], &codec_ctx->ch_layout,
+            codec_ctx->sample_fmt, codec_ctx->sample_rate,
+            &codec_ctx->ch_layout, AV_SAMPLE_FMT_FLTP, codec_ctx->sample_rate,
+            0, NULL);
+    if (ret >= 0 && !swr_is_initialized(ctx->track_swr[track])) {
+        ret = swr_init(ctx->track_swr[track]);
+    }
+    if (ret >= 0) {
+        ret = swr_convert(ctx->track_swr[track], out_frame->extended_data,
+                          nb_samples, planes, nb_samples);
+    }
     if (ret < 0) {
         av_error_fmt(ctx->error_str, "error converting frame!", ret);
-        return NULL;
+        return ret;
     }
 
-    int remaining = swr_get_out_samples(ctx->swr_context, 0);
-    if (remaining < nb_samples) {
-        return NULL;
+    *frame = out_frame;
+    return 0;
+}
+
+int
+fc_ndi_audio_frame_to_tracks(FrameConverterCtx *ctx, const AudioRoute *route,
+                             AVCodecContext *const *codecs,
+                             NDIlib_audio_frame_v2_t *in_frame,
+                             AVFrame **frames)
+{
+    int ret;
+    int nb_samples = codecs[0]->frame_size;
+    int nb_tracks = route ? route->nb_tracks : 1;
+    int direct = nb_tracks == 1;
+
+    if (in_frame && fc_audio_push(ctx, route, codecs[0], direct, in_frame)
+                            < 0) {
+        return -1;
     }
 
-    out_frame->pkt_dts = get_current_ts_usec() - ctx->start_ts;
-    out_frame->pts = swr_next_pts(ctx->swr_context, INT64_MIN);
+    int remaining
+            = ctx->swr_context ? swr_get_out_samples(ctx->swr_context, 0) : 0;
+    if (remaining < nb_samples) { // wait
+        return 0;
+    }
 
-    ret = swr_convert(ctx->swr_context, out_frame->data, out_frame->nb_samples,
-                      NULL, 0);
+    AVFrame *mix;
+    if (direct) {
+        mix = fc_audio_frame(&ctx->audio_frames[0], codecs[0]->sample_fmt,
+                             codecs[0]->sample_rate, &codecs[0]->ch_layout,
+                             nb_samples);
+    }
+    else {
+        AVChannelLayout layout;
+        fc_unspec_layout(&layout, route->nb_channels);
+        mix = fc_audio_frame(&ctx->mix_frame, AV_SAMPLE_FMT_FLTP,
+                             codecs[0]->sample_rate, &layout, nb_samples);
+    }
+    if (!mix) {
+        sprintf(ctx->error_str, "%s", "could not allocate audio frame");
+        return -1;
+    }
+
+    int64_t pkt_dts = get_current_ts_usec() - ctx->start_ts;
+    int64_t pts = swr_next_pts(ctx->swr_context, INT64_MIN);
+
+    TRACE_BEGIN(drain_span);
+    ret = swr_convert(ctx->swr_context, mix->extended_data, nb_samples, NULL,
+                      0);
+    TRACE_END(drain_span, "swr_convert", ctx->trace_label);
     if (ret < 0) {
         av_error_fmt(ctx->error_str, "error converting frame!", ret);
-        return NULL;
+        return ret;
     }
 
-    return out_frame;
+    frames[0] = mix;
+    for (int t = 0; !direct && t < nb_tracks; ++t) {
+        ret = fc_audio_track(ctx, route, t, codecs[t], mix, &frames[t]);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    for (int t = 0; t < nb_tracks; ++t) {
+        frames[t]->pkt_dts = pkt_dts;
+        frames[t]->pts = pts;
+    }
+    return 1;
+}
+
+AVFrame *
+fc_ndi_audio_frame_to_avframe(FrameConverterCtx *ctx, AVCodecContext *codec_ctx,
+                              NDIlib_audio_frame_v2_t *in_frame)
+{
+    AVFrame *frame = NULL;
+
+    if (fc_ndi_audio_frame_to_tracks(ctx, NULL, &codec_ctx, in_frame, &frame)
+        <= 0) {
+        return NULL;
+    }
+    return frame;
 }
@@ -11,19 +11,39 @@
 #include <libavcodec/avcodec.h>
 #include <libswresample/swresample.h>
 
+#include "audio_router.h"
+#include "deinterlace.h"
+
 typedef struct FrameConverterCtx {
-    SwrContext *swr_context;
+    SwrContext *swr_context; // every routed channel, resampled once
+    SwrContext *track_swr[AUDIO_MAX_TRACKS]; // sample format of each track
     struct SwsContext *sws_ctx;
+    struct SwsContext *alpha_sws_ctx; // UYVA and PA16 alpha plane
 
-    AVFrame *audio_frame;
+    AVFrame *audio_frames[AUDIO_MAX_TRACKS];
+    AVFrame *mix_frame; // the resampled channels of every track
+    uint8_t *route_buf; // the routed channels at the source rate
+    unsigned route_buf_size;
     AVFrame *video_frame;
+    AVFrame *src_frame; // wraps the NDI frame for partial conversion
 
     int64_t frame_index;
     int64_t start_ts;
 
+    DeinterlaceMode deinterlace; // for interleaved frames
+    uint8_t *di_strip;           // rows waiting for the scaler
+    size_t di_strip_size;
+    int64_t deinterlaced;        // frames, single fields included
+
+    const char *trace_label; // see trace_intern, may be NULL
     char *error_str;
 } FrameConverterCtx;
 
+/* The format of the color planes, the alpha plane of UYVA and PA16 is
+ * handled on its own. YV12 maps to yuv420p with U and V swapped. */
+enum AVPixelFormat
+ndi_fourcc_to_ffmpeg(NDIlib_FourCC_video_type_e type);
+
 FrameConverterCtx *
 new_frame_converter_ctx();
 
@@ -33,10 +53,48 @@ free_frame_converter_ctx(FrameConverterCtx **ctx);
 void
 fc_reset(FrameConverterCtx *);
 
+int
+fc_ndi_video_frame_scale(FrameConverterCtx *ctx,
+                         NDIlib_video_frame_v2_t *in_frame,
+                         uint8_t *const dst[], const int dst_stride[],
+                         enum AVPixelFormat dst_pix_fmt, int width, int height);
+
 AVFrame *
 fc_ndi_video_frame_to_avframe(FrameConverterCtx *ctx, AVCodecContext *codec_ctx,
                               NDIlib_video_frame_v2_t *in_frame);
 
+AVFrame *
+fc_ndi_video_frame_convert(FrameConverterCtx *ctx, enum AVPixelFormat pix_fmt,
+                           int width, int height,
+                           NDIlib_video_frame_v2_t *in_frame);
+
+/* Sends `last` again in place of in_frame: the pixels are shared, only
+ * the timestamps move on. */
+AVFrame *
+fc_ndi_video_frame_repeat(FrameConverterCtx *ctx, const AVFrame *last,
+                          NDIlib_video_frame_v2_t *in_frame);
+
+/* Like fc_ndi_video_frame_repeat, but converts the rows marked in `rows`
+ * again, one byte per `row_height` source rows. `last` must have the size
+ * of in_frame. */
+AVFrame *
+fc_ndi_video_frame_update(FrameConverterCtx *ctx, const AVFrame *last,
+                          NDIlib_video_frame_v2_t *in_frame,
+                          const uint8_t *rows, int row_height);
+
+/* Routes the channels of in_frame into the tracks of `route`, resamples
+ * them all in one pass and converts them for `codecs`, one encoder per
+ * track. Without a route every channel goes to a single track. Returns 1
+ * and sets a frame of codecs[0]->frame_size samples per track in `frames`,
+ * 0 while fewer samples are buffered, <0 on error. Call again with a NULL
+ * in_frame for the frames still buffered. */
+int
+fc_ndi_audio_frame_to_tracks(FrameConverterCtx *ctx, const AudioRoute *route,
+                             AVCodecContext *const *codecs,
+                             NDIlib_audio_frame_v2_t *in_frame,
+                             AVFrame **frames);
+
+/* fc_ndi_audio_frame_to_tracks for a single track of every channel. */
 AVFrame *
 fc_ndi_audio_frame_to_avframe(FrameConverterCtx *ctx, AVCodecContext *codec_ctx,
                               NDIlib_audio_frame_v2_t *in_frame);
@@ -0,0 +1,394 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "frame_diff.h"
+
+#include <libavutil/error.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FD_SSE2
+#endif
+
+#define FD_MAX_PLANES 3
+#define FD_PRIME32 0x9E3779B1U
+#define FD_PRIME64 0x9E3779B185EBCA87ULL
+
+typedef struct FrameDiffPlane {
+    size_t offset;
+    int stride;
+    int row_bytes; // bytes of pixels in a row
+    int rows;
+    int mb_bytes; // bytes of one macroblock row
+    int mb_rows;  // rows of one macroblock
+} FrameDiffPlane;
+
+// one key per 16 byte lane of a block row, so that moving pixels
+// sideways within a block changes its hash
+static const uint64_t fd_keys[4][2] = {
+    { 0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL },
+    { 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL },
+    { 0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL },
+    { 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL },
+};
+
+static const uint64_t fd_scramble_key[2] = {
+    0xcb00c391bb52283cULL,
+    0xa32e531b8b65d088ULL,
+};
+
+// a quarter of the encoder's quantizer range coarser, an unchanged area
+// was coded before and only needs skip blocks
+static const AVRational fd_static_qoffset = { 1, 4 };
+
+FrameDiffCtx *
+new_frame_diff_ctx()
+{
+    FrameDiffCtx *ctx = malloc(sizeof(FrameDiffCtx));
+    memset(ctx, 0, sizeof(FrameDiffCtx));
+    return ctx;
+}
+
+int
+free_frame_diff_ctx(FrameDiffCtx **ctx)
+{
+    free((*ctx)->hashes);
+    free((*ctx)->changed);
+    free((*ctx)->changed_rows);
+    free(*ctx);
+    *ctx = NULL;
+    return 0;
+}
+
+void
+fd_reset(FrameDiffCtx *ctx)
+{
+    // looks like a new size to the next fd_update
+    ctx->xres = 0;
+    ctx->yres = 0;
+}
+
+static void
+fd_plane(FrameDiffPlane *plane, size_t offset, int stride, int row_bytes,
+         int rows, int mb_bytes, int mb_rows)
+{
+    plane->offset = offset;
+    plane->stride = stride;
+    plane->row_bytes = row_bytes;
+    plane->rows = rows;
+    plane->mb_bytes = mb_bytes;
+    plane->mb_rows = mb_rows;
+}
+
+// a single field holds every other line, blocks are taken in field lines
+static int
+fd_lines(const NDIlib_video_frame_v2_t *frame)
+{
+    if (frame->frame_format_type == NDIlib_frame_format_type_field_0
+        || frame->frame_format_type == NDIlib_frame_format_type_field_1) {
+        return frame->yres / 2;
+    }
+    return frame->yres;
+}
+
+/* Splits the frame into planes, the layouts follow raw_video_size. */
+static int
+fd_planes(const NDIlib_video_frame_v2_t *frame, FrameDiffPlane *planes)
+{
+    int w = frame->xres;
+    int h = fd_lines(frame);
+    int s = frame->line_stride_in_bytes;
+    int cw = (w + 1) / 2;
+    int ch = (h + 1) / 2;
+
+    switch (frame->FourCC) {
+    case NDIlib_FourCC_video_type_UYVY:
+        s = s > 0 ? s : w * 2;
+        fd_plane(&planes[0], 0, s, w * 2, h, 32, 16);
+        return 1;
+    case NDIlib_FourCC_video_type_UYVA:
+        s = s > 0 ? s : w * 2;
+        fd_plane(&planes[0], 0, s, w * 2, h, 32, 16);
+        fd_plane(&planes[1], (size_t)s * h, w, w, h, 16, 16);
+        return 2;
+    case NDIlib_FourCC_video_type_I420:
+    case NDIlib_FourCC_video_type_YV12:
+        s = s > 0 ? s : w;
+        fd_plane(&planes[0], 0, s, w, h, 16, 16);
+        fd_plane(&planes[1], (size_t)s * h, s / 2, cw, ch, 8, 8);
+        fd_plane(&planes[2], (size_t)s * h + (size_t)(s / 2) * ch, s / 2, cw,
+                 ch, 8, 8);
+        return 3;
+    case NDIlib_FourCC_video_type_NV12:
+        s = s > 0 ? s : w;
+        fd_plane(&planes[0], 0, s, w, h, 16, 16);
+        fd_plane(&planes[1], (size_t)s * h, s, cw * 2, ch, 16, 8);
+        return 2;
+    case NDIlib_FourCC_video_type_P216:
+        s = s > 0 ? s : w * 2;
+        fd_plane(&planes[0], 0, s, w * 2, h, 32, 16);
+        fd_plane(&planes[1], (size_t)s * h, s, cw * 4, h, 32, 16);
+        return 2;
+    case NDIlib_FourCC_video_type_PA16:
+        s = s > 0 ? s : w * 2;
+        fd_plane(&planes[0], 0, s, w * 2, h, 32, 16);
+        fd_plane(&planes[1], (size_t)s * h, s, cw * 4, h, 32, 16);
+        fd_plane(&planes[2], (size_t)s * h * 2, s, w * 2, h, 32, 16);
+        return 3;
+    default:
+        s = s > 0 ? s : w * 4;
+        fd_plane(&planes[0], 0, s, w * 4, h, 64, 16);
+        return 1;
+    }
+}
+
+/* xxh3-style accumulation: every 16 bytes add the swapped input and the
+ * product of the halves of each keyed 64-bit lane, mix after every row so
+ * that the order of rows counts. The SIMD and plain C versions agree. */
+
+#ifdef FD_SSE2
+
+static void
+fd_hash_rows(uint64_t out[2], const uint8_t *p, int stride, int len, int rows)
+{
+    const __m128i prime = _mm_set1_epi32((int)FD_PRIME32);
+    const __m128i scramble = _mm_loadu_si128((const __m128i *)fd_scramble_key);
+    __m128i acc = _mm_loadu_si128((const __m128i *)out);
+
+    for (int y = 0; y < rows; ++y, p += stride) {
+        for (int x = 0; x < len; x += 16) {
+            __m128i d;
+            if (len - x >= 16) {
+                d = _mm_loadu_si128((const __m128i *)(p + x));
+            }
+            else {
+                uint8_t tail[16] = {};
+                memcpy(tail, p + x, len - x);
+                d = _mm_loadu_si128((const __m128i *)tail);
+            }
+
+            __m128i key = _mm_loadu_si128(
+                    (const __m128i *)fd_keys[(x / 16) & 3]);
+            __m128i dk = _mm_xor_si128(d, key);
+            __m128i product = _mm_mul_epu32(
+                    dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+            acc = _mm_add_epi64(acc, _mm_add_epi64(swapped, product));
+        }
+
+        acc = _mm_xor_si128(acc, _mm_srli_epi64(acc, 47));
+        acc = _mm_xor_si128(acc, scramble);
+        __m128i lo = _mm_mul_epu32(acc, prime);
+        __m128i hi = _mm_mul_epu32(_mm_srli_epi64(acc, 32), prime);
+        acc = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+    }
+
+    _mm_storeu_si128((__m128i *)out, acc);
+}
+
+#else
+
+static void
+fd_hash_rows(uint64_t out[2], const uint8_t *p, int stride, int len, int rows)
+{
+    uint64_t acc[2] = { out[0], out[1] };
+
+    for (int y = 0; y < rows; ++y, p += stride) {
+        for (int x = 0; x < len; x += 16) {
+            uint64_t d[2] = {};
+            memcpy(d, p + x, len - x >= 16 ? 16 : len - x);
+
+            const uint64_t *key = fd_keys[(x / 16) & 3];
+            for (int l = 0; l < 2; ++l) {
+                uint64_t dk = d[l] ^ key[l];
+                acc[l] += d[l ^ 1] + (dk & 0xffffffff) * (dk >> 32);
+            }
+        }
+
+        for (int l = 0; l < 2; ++l) {
+            acc[l] ^= acc[l] >> 47;
+            acc[l] ^= fd_scramble_key[l];
+            acc[l] *= FD_PRIME32;
+        }
+    }
+
+    out[0] = acc[0];
+    out[1] = acc[1];
+}
+
+#endif
+
+static uint64_t
+fd_hash_block(const uint8_t *data, const FrameDiffPlane *planes,
+              int nb_planes, int bx, int by)
+{
+    uint64_t acc[2] = { fd_keys[0][0], fd_keys[0][1] };
+
+    for (int i = 0; i < nb_planes; ++i) {
+        const FrameDiffPlane *plane = &planes[i];
+        int x = bx * plane->mb_bytes;
+        int y = by * plane->mb_rows;
+        if (x >= plane->row_bytes || y >= plane->rows) {
+            continue;
+        }
+
+        int len = plane->row_bytes - x;
+        int rows = plane->rows - y;
+        fd_hash_rows(acc, data + plane->offset + (size_t)y * plane->stride + x,
+                     plane->stride,
+                     len < plane->mb_bytes ? len : plane->mb_bytes,
+                     rows < plane->mb_rows ? rows : plane->mb_rows);
+    }
+
+    uint64_t hash = acc[0] ^ (acc[1] * FD_PRIME64);
+    return hash ^ (hash >> 32);
+}
+
+int
+fd_update(FrameDiffCtx *ctx, const NDIlib_video_frame_v2_t *frame)
+{
+    int lines = fd_lines(frame);
+
+    if (!frame->p_data || frame->xres <= 0 || lines <= 0) {
+        fd_reset(ctx);
+        return -1;
+    }
+
+    FrameDiffPlane planes[FD_MAX_PLANES];
+    int nb_planes = fd_planes(frame, planes);
+    int fresh = frame->xres != ctx->xres || lines != ctx->yres
+                || frame->FourCC != ctx->fourcc
+                || planes[0].stride != ctx->stride;
+
+    if (fresh) {
+        ctx->xres = frame->xres;
+        ctx->yres = lines;
+        ctx->fourcc = frame->FourCC;
+        ctx->stride = planes[0].stride;
+        ctx->mb_cols = (frame->xres + FRAME_DIFF_BLOCK - 1) / FRAME_DIFF_BLOCK;
+        ctx->mb_rows = (lines + FRAME_DIFF_BLOCK - 1) / FRAME_DIFF_BLOCK;
+
+        size_t count = (size_t)ctx->mb_cols * ctx->mb_rows;
+        free(ctx->hashes);
+        free(ctx->changed);
+        free(ctx->changed_rows);
+        ctx->hashes = malloc(sizeof(uint64_t) * count);
+        ctx->changed = malloc(count);
+        ctx->changed_rows = malloc(ctx->mb_rows);
+    }
+
+    ctx->nb_changed = 0;
+    ctx->nb_changed_rows = 0;
+
+    for (int by = 0; by < ctx->mb_rows; ++by) {
+        int row_changed = ctx->nb_changed;
+
+        for (int bx = 0; bx < ctx->mb_cols; ++bx) {
+            int i = by * ctx->mb_cols + bx;
+            uint64_t hash = fd_hash_block(frame->p_data, planes, nb_planes,
+                                          bx, by);
+
+            ctx->changed[i] = fresh || ctx->hashes[i] != hash;
+            ctx->nb_changed += ctx->changed[i];
+            ctx->hashes[i] = hash;
+        }
+
+        ctx->changed_rows[by] = ctx->nb_changed > row_changed;
+        ctx->nb_changed_rows += ctx->changed_rows[by];
+    }
+
+    return ctx->nb_changed;
+}
+
+/* One rectangle for every run of block rows whose changes span the same
+ * columns, then the whole frame. Counts them when `regions` is NULL. */
+static int
+fd_regions(const FrameDiffCtx *ctx, AVRegionOfInterest *regions, int width,
+           int height)
+{
+    int nb_regions = 0;
+    int last_left = -1;
+    int last_right = -1;
+
+    for (int by = 0; by < ctx->mb_rows; ++by) {
+        const uint8_t *row = &ctx->changed[by * ctx->mb_cols];
+        int left = 0;
+        int right = ctx->mb_cols - 1;
+
+        if (!ctx->changed_rows[by]) {
+            last_left = -1;
+            continue;
+        }
+        while (!row[left]) {
+            left++;
+        }
+        while (!row[right]) {
+            right--;
+        }
+
+        if (left == last_left && right == last_right) {
+            if (regions) {
+                int bottom = FFMIN((by + 1) * FRAME_DIFF_BLOCK, ctx->yres);
+                regions[nb_regions - 1].bottom = bottom * height / ctx->yres;
+            }
+            continue;
+        }
+        last_left = left;
+        last_right = right;
+
+        if (regions) {
+            AVRegionOfInterest *roi = &regions[nb_regions];
+            int x0 = left * FRAME_DIFF_BLOCK;
+            int x1 = FFMIN((right + 1) * FRAME_DIFF_BLOCK, ctx->xres);
+            int y0 = by * FRAME_DIFF_BLOCK;
+            int y1 = FFMIN(y0 + FRAME_DIFF_BLOCK, ctx->yres);
+
+            roi->self_size = sizeof(AVRegionOfInterest);
+            roi->left = x0 * width / ctx->xres;
+            roi->right = x1 * width / ctx->xres;
+            roi->top = y0 * height / ctx->yres;
+            roi->bottom = y1 * height / ctx->yres;
+            roi->qoffset = (AVRational){ 0, 1 };
+        }
+        nb_regions++;
+    }
+
+    // the first region containing a block applies, the rest is static
+    if (regions) {
+        AVRegionOfInterest *roi = &regions[nb_regions];
+        roi->self_size = sizeof(AVRegionOfInterest);
+        roi->left = 0;
+        roi->right = width;
+        roi->top = 0;
+        roi->bottom = height;
+        roi->qoffset = fd_static_qoffset;
+    }
+    return nb_regions + 1;
+}
+
+int
+fd_add_roi(const FrameDiffCtx *ctx, AVFrame *frame)
+{
+    av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+
+    if (ctx->xres <= 0 || ctx->nb_changed == ctx->mb_cols * ctx->mb_rows) {
+        return 0;
+    }
+
+    int nb_regions = fd_regions(ctx, NULL, frame->width, frame->height);
+    AVFrameSideData *side_data = av_frame_new_side_data(
+            frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+            sizeof(AVRegionOfInterest) * nb_regions);
+    if (!side_data) {
+        return AVERROR(ENOMEM);
+    }
+
+    fd_regions(ctx, (AVRegionOfInterest *)side_data->data, frame->width,
+               frame->height);
+    return 0;
+}
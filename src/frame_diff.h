@@ -0,0 +1,58 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef FRAME_DIFF_H
+#define FRAME_DIFF_H
+
+#include <Processing.NDI.Lib.h>
+#include <libavutil/frame.h>
+#include <stdint.h>
+
+// macroblock size in luma pixels, chroma planes are split alike
+#define FRAME_DIFF_BLOCK 16
+
+/* Finds the macroblocks of an NDI frame that differ from the previous one.
+ * Only a 64-bit hash of every block is kept, so the NDI frame may be freed
+ * right after fd_update. Equal hashes are taken as equal pixels. */
+typedef struct FrameDiffCtx {
+    int xres;
+    int yres; // lines in the frame data, half of them for a field
+    int stride;
+    NDIlib_FourCC_video_type_e fourcc;
+
+    int mb_cols;
+    int mb_rows;
+    uint64_t *hashes;      // mb_cols * mb_rows, of the last frame
+    uint8_t *changed;      // mb_cols * mb_rows, set for blocks that differ
+    uint8_t *changed_rows; // mb_rows, set for rows with a changed block
+    int nb_changed;
+    int nb_changed_rows;
+} FrameDiffCtx;
+
+FrameDiffCtx *
+new_frame_diff_ctx();
+
+int
+free_frame_diff_ctx(FrameDiffCtx **ctx);
+
+/* The next frame counts as changed everywhere. */
+void
+fd_reset(FrameDiffCtx *ctx);
+
+/* Hashes the frame and compares it with the last one, returns the number
+ * of changed macroblocks or -1 for a frame without pixels. A new size or
+ * format changes every block. */
+int
+fd_update(FrameDiffCtx *ctx, const NDIlib_video_frame_v2_t *frame);
+
+/* Replaces the AV_FRAME_DATA_REGIONS_OF_INTEREST side data of `frame` with
+ * the changes found by the last fd_update: rectangles around the changed
+ * blocks keep the quantizer, the static rest of the frame gets a coarser
+ * one. Nothing is attached when every block changed. */
+int
+fd_add_roi(const FrameDiffCtx *ctx, AVFrame *frame);
+
+#endif
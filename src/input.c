@@ -0,0 +1,253 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "input.h"
+
+#include <libavutil/error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "raw_dump.h"
+
+// bounds input_skip_to_latest for inputs that never run dry
+#define INPUT_MAX_SKIP 256
+
+static const InputBackend *const input_backends[] = {
+    &input_ndi_backend,
+    &input_file_backend,
+    &input_raw_backend,
+    &input_composite_backend,
+    NULL,
+};
+
+InputCtx *
+new_input_ctx()
+{
+    InputCtx *ctx = malloc(sizeof(InputCtx));
+    memset(ctx, 0, sizeof(InputCtx));
+    ctx->realtime = 1;
+    ctx->error_str = malloc(AV_ERROR_MAX_STRING_SIZE + 100);
+    return ctx;
+}
+
+int
+free_input_ctx(InputCtx **ctx)
+{
+    input_close(*ctx);
+    free((*ctx)->error_str);
+    free(*ctx);
+    *ctx = NULL;
+    return 0;
+}
+
+int
+input_open(InputCtx *ctx, const char *backend, const char *url,
+           const char *name)
+{
+    input_close(ctx);
+
+    for (int i = 0; input_backends[i]; ++i) {
+        if (strcmp(input_backends[i]->name, backend) == 0) {
+            ctx->backend = input_backends[i];
+            break;
+        }
+    }
+
+    if (!ctx->backend) {
+        sprintf(ctx->error_str, "unknown input \"%.40s\"", backend);
+        return -1;
+    }
+
+    if (ctx->backend->open(ctx, url, name) < 0) {
+        ctx->backend->close(ctx);
+        ctx->backend = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+const char *
+input_backend_for(const char *url)
+{
+    char magic[sizeof RAW_DUMP_MAGIC - 1];
+    FILE *file = fopen(url, "rb");
+    if (!file) {
+        return "file";
+    }
+
+    int raw = fread(magic, 1, sizeof magic, file) == sizeof magic
+              && memcmp(magic, RAW_DUMP_MAGIC, sizeof magic) == 0;
+    fclose(file);
+    return raw ? "raw" : "file";
+}
+
+void
+input_close(InputCtx *ctx)
+{
+    if (ctx->backend) {
+        ctx->backend->close(ctx);
+        ctx->backend = NULL;
+    }
+}
+
+InputFrameType
+input_capture(InputCtx *ctx, NDIlib_video_frame_v2_t *video,
+              NDIlib_audio_frame_v2_t *audio, uint32_t timeout_ms)
+{
+    return ctx->backend->capture(ctx, video, audio, timeout_ms);
+}
+
+void
+input_free_video(InputCtx *ctx, NDIlib_video_frame_v2_t *frame)
+{
+    ctx->backend->free_video(ctx, frame);
+}
+
+void
+input_free_audio(InputCtx *ctx, NDIlib_audio_frame_v2_t *frame)
+{
+    ctx->backend->free_audio(ctx, frame);
+}
+
+int
+input_stats(InputCtx *ctx, InputStats *stats)
+{
+    if (!ctx->backend || !ctx->backend->stats) {
+        return -1;
+    }
+    memset(stats, 0, sizeof(InputStats));
+    return ctx->backend->stats(ctx, stats);
+}
+
+int
+input_select(InputCtx *ctx, int index)
+{
+    if (!ctx->backend || !ctx->backend->select) {
+        sprintf(ctx->error_str, "%s", "the input has a single source");
+        return -1;
+    }
+    return ctx->backend->select(ctx, index);
+}
+
+int
+input_skip_to_latest(InputCtx *ctx, NDIlib_video_frame_v2_t *frame)
+{
+    NDIlib_video_frame_v2_t video;
+    NDIlib_audio_frame_v2_t audio;
+    int skipped = 0;
+
+    // audio that old is as stale as the video, it goes too
+    for (int i = 0; i < INPUT_MAX_SKIP; ++i) {
+        InputFrameType type = input_capture(ctx, &video, &audio, 0);
+        if (type == INPUT_FRAME_VIDEO) {
+            input_free_video(ctx, frame);
+            *frame = video;
+            skipped++;
+        }
+        else if (type == INPUT_FRAME_AUDIO) {
+            input_free_audio(ctx, &audio);
+        }
+        else {
+            break;
+        }
+    }
+    return skipped;
+}
+
+static int
+ndi_open(InputCtx *ctx, const char *url, const char *name)
+{
+    NDIlib_source_t source = {};
+
+    if (name && strlen(name)) {
+        source.p_ndi_name = name;
+    }
+    if (url && strlen(url)) {
+        source.p_url_address = url;
+    }
+
+    NDIlib_recv_create_v3_t recv_create_desc = {
+        .source_to_connect_to = source,
+        .p_ndi_recv_name = "ndi-streamer",
+        .bandwidth = NDIlib_recv_bandwidth_lowest,
+    };
+
+    ctx->priv = NDIlib_recv_create_v3(&recv_create_desc);
+    if (!ctx->priv) {
+        sprintf(ctx->error_str, "%s", "unable to create NDI receiver instance");
+        return -1;
+    }
+
+    ctx->live = 1;
+    return 0;
+}
+
+static InputFrameType
+ndi_capture(InputCtx *ctx, NDIlib_video_frame_v2_t *video,
+            NDIlib_audio_frame_v2_t *audio, uint32_t timeout_ms)
+{
+    switch (NDIlib_recv_capture_v2(ctx->priv, video, audio, NULL,
+                                   timeout_ms)) {
+    case NDIlib_frame_type_video:
+        return INPUT_FRAME_VIDEO;
+    case NDIlib_frame_type_audio:
+        return INPUT_FRAME_AUDIO;
+    default: // errors too, the receiver reconnects by itself
+        return INPUT_FRAME_NONE;
+    }
+}
+
+static void
+ndi_free_video(InputCtx *ctx, NDIlib_video_frame_v2_t *frame)
+{
+    NDIlib_recv_free_video_v2(ctx->priv, frame);
+}
+
+static void
+ndi_free_audio(InputCtx *ctx, NDIlib_audio_frame_v2_t *frame)
+{
+    NDIlib_recv_free_audio_v2(ctx->priv, frame);
+}
+
+static int
+ndi_stats(InputCtx *ctx, InputStats *stats)
+{
+    NDIlib_recv_performance_t total = {};
+    NDIlib_recv_performance_t dropped = {};
+    NDIlib_recv_queue_t queue = {};
+
+    NDIlib_recv_get_performance(ctx->priv, &total, &dropped);
+    NDIlib_recv_get_queue(ctx->priv, &queue);
+
+    stats->video_frames = total.video_frames;
+    stats->audio_frames = total.audio_frames;
+    stats->video_dropped = dropped.video_frames;
+    stats->audio_dropped = dropped.audio_frames;
+    stats->video_queued = queue.video_frames;
+    stats->audio_queued = queue.audio_frames;
+    return 0;
+}
+
+static void
+ndi_close(InputCtx *ctx)
+{
+    if (ctx->priv) {
+        NDIlib_recv_destroy(ctx->priv);
+        ctx->priv = NULL;
+    }
+}
+
+const InputBackend input_ndi_backend = {
+    .name = "ndi",
+    .open = ndi_open,
+    .capture = ndi_capture,
+    .free_video = ndi_free_video,
+    .free_audio = ndi_free_audio,
+    .close = ndi_close,
+    .stats = ndi_stats,
+};
@@ -0,0 +1,112 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <Processing.NDI.Lib.h>
+
+typedef enum InputFrameType {
+    INPUT_FRAME_NONE,
+    INPUT_FRAME_VIDEO,
+    INPUT_FRAME_AUDIO,
+    INPUT_FRAME_END,
+    INPUT_FRAME_ERROR,
+} InputFrameType;
+
+struct InputCtx;
+
+/* Receiver side counters, NDIlib_recv_get_performance and
+ * NDIlib_recv_get_queue for NDI. */
+typedef struct InputStats {
+    int64_t video_frames;  // received since the input was opened
+    int64_t audio_frames;
+    int64_t video_dropped; // lost before they could be captured
+    int64_t audio_dropped;
+    int video_queued;      // received but not captured yet
+    int audio_queued;
+} InputStats;
+
+/* A source of frames. Every backend delivers them in NDI layout (packed
+ * planes as described by FourCC, planar float audio) so that the rest of
+ * the program runs the same conversion and encoding code for all of them.
+ * free_video, free_audio and select may be called from any thread, stats
+ * and select are optional. */
+typedef struct InputBackend {
+    const char *name;
+    int (*open)(struct InputCtx *ctx, const char *url, const char *name);
+    InputFrameType (*capture)(struct InputCtx *ctx,
+                              NDIlib_video_frame_v2_t *video,
+                              NDIlib_audio_frame_v2_t *audio,
+                              uint32_t timeout_ms);
+    void (*free_video)(struct InputCtx *ctx, NDIlib_video_frame_v2_t *frame);
+    void (*free_audio)(struct InputCtx *ctx, NDIlib_audio_frame_v2_t *frame);
+    void (*close)(struct InputCtx *ctx);
+    int (*stats)(struct InputCtx *ctx, InputStats *stats);
+    int (*select)(struct InputCtx *ctx, int index);
+} InputBackend;
+
+typedef struct InputCtx {
+    const InputBackend *backend;
+    void *priv;
+    int realtime; // pace frames by their timestamps, live inputs always are
+    int loop;     // start over at the end of a file
+    int live;     // set by open, frames keep coming whether taken or not
+    char *error_str;
+} InputCtx;
+
+extern const InputBackend input_ndi_backend;
+extern const InputBackend input_file_backend;
+extern const InputBackend input_raw_backend;
+extern const InputBackend input_composite_backend;
+
+InputCtx *
+new_input_ctx();
+
+int
+free_input_ctx(InputCtx **ctx);
+
+/* `backend` is "ndi", "file", "raw" or "composite". NDI takes a source
+ * address and/or name, the file backend a path or any URL libavformat can
+ * read, the raw backend a file written by --dump_raw and the composite
+ * backend a layout of NDI sources, see comp_parse. */
+int
+input_open(InputCtx *ctx, const char *backend, const char *url,
+           const char *name);
+
+/* "raw" for a file written by --dump_raw, "file" for anything else. */
+const char *
+input_backend_for(const char *url);
+
+void
+input_close(InputCtx *ctx);
+
+InputFrameType
+input_capture(InputCtx *ctx, NDIlib_video_frame_v2_t *video,
+              NDIlib_audio_frame_v2_t *audio, uint32_t timeout_ms);
+
+void
+input_free_video(InputCtx *ctx, NDIlib_video_frame_v2_t *frame);
+
+void
+input_free_audio(InputCtx *ctx, NDIlib_audio_frame_v2_t *frame);
+
+/* Returns -1 if the input keeps no statistics. */
+int
+input_stats(InputCtx *ctx, InputStats *stats);
+
+/* Cuts to source `index` of an input with several, from the next frame
+ * on. */
+int
+input_select(InputCtx *ctx, int index);
+
+/* Takes every frame the input already holds without waiting and replaces
+ * `frame` with the newest video frame among them, the rest is freed.
+ * Returns the number of video frames skipped. */
+int
+input_skip_to_latest(InputCtx *ctx, NDIlib_video_frame_v2_t *frame);
+
+#endif
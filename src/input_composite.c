@@ -0,0 +1,631 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "input.h"
+
+#include <libavutil/mem.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "compositor.h"
+#include "frame_converter.h"
+#include "log.h"
+#include "thread.h"
+
+#define COMPOSITE_CAPTURE_TIMEOUT 100
+// audio frames of the program source waiting to be captured
+#define COMPOSITE_MAX_AUDIO 32
+#define COMPOSITE_POOL_SIZE 8
+
+struct CompositeInput;
+
+typedef struct CompositeReceiver {
+    struct CompositeInput *in;
+    int index;
+    NDIlib_recv_instance_t recv;
+    Thread thread;
+    int started;
+
+    Mutex lock;                    // guards frame, received_at and up_since
+    NDIlib_video_frame_v2_t frame; // the newest video, p_data is NULL before
+    int64_t received_at;
+    int64_t up_since; // first frame after the source was last down
+
+    // used by the capturing thread only
+    FrameConverterCtx *fc_ctx;
+    AVFrame *scratch; // yuva422p, sources with alpha are blended from it
+    CompositeRect drawn; // where the last frame went, logged on a change
+} CompositeReceiver;
+
+typedef struct CompositeInput {
+    CompositeSpec spec;
+    CompositeReceiver receivers[COMPOSITE_MAX_SOURCES];
+    _Atomic(int) running;
+    _Atomic(int) program; // the source audio comes from, and the only one
+                          // drawn by the switch and failover layouts
+    int down;             // failover found no source up
+
+    Mutex lock; // guards audio and pool
+    NDIlib_audio_frame_v2_t audio[COMPOSITE_MAX_AUDIO];
+    int audio_head;
+    int nb_audio;
+    int64_t audio_dropped;
+    int sample_rate; // of the last audio frame, for silence
+    int channels;
+    uint8_t *pool[COMPOSITE_POOL_SIZE];
+    int nb_pool;
+
+    int64_t clock;       // wall clock of the next frame, usec
+    int64_t frame_index;
+    int program_up;      // the program source was drawn
+} CompositeInput;
+
+// takes in->lock
+static void
+composite_queue_audio(CompositeInput *in, const NDIlib_audio_frame_v2_t *frame)
+{
+    mutex_lock(&in->lock);
+    if (in->nb_audio == COMPOSITE_MAX_AUDIO) {
+        av_free(in->audio[in->audio_head].p_data);
+        in->audio_head = (in->audio_head + 1) % COMPOSITE_MAX_AUDIO;
+        in->nb_audio--;
+        in->audio_dropped++;
+    }
+    in->audio[(in->audio_head + in->nb_audio) % COMPOSITE_MAX_AUDIO] = *frame;
+    in->nb_audio++;
+    in->sample_rate = frame->sample_rate;
+    in->channels = frame->no_channels;
+    mutex_unlock(&in->lock);
+}
+
+static void
+composite_receive(void *arg)
+{
+    CompositeReceiver *rx = arg;
+    CompositeInput *in = rx->in;
+
+    while (atomic_load(&in->running)) {
+        NDIlib_video_frame_v2_t video;
+        NDIlib_audio_frame_v2_t audio;
+        int program = rx->index == atomic_load(&in->program);
+        NDIlib_frame_type_e type = NDIlib_recv_capture_v2(
+                rx->recv, &video, program ? &audio : NULL, NULL,
+                COMPOSITE_CAPTURE_TIMEOUT);
+
+        if (type == NDIlib_frame_type_video) {
+            int64_t now = get_current_ts_usec();
+
+            mutex_lock(&rx->lock);
+            NDIlib_video_frame_v2_t old = rx->frame;
+            if (!old.p_data
+                || now - rx->received_at > in->spec.lost_ms * INT64_C(1000)) {
+                rx->up_since = now;
+            }
+            rx->frame = video;
+            rx->received_at = now;
+            mutex_unlock(&rx->lock);
+
+            if (old.p_data) {
+                NDIlib_recv_free_video_v2(rx->recv, &old);
+            }
+        }
+        else if (type == NDIlib_frame_type_audio) {
+            // copied, the queue outlives a cut to another receiver
+            NDIlib_audio_frame_v2_t copy = audio;
+            size_t size = (size_t)audio.channel_stride_in_bytes
+                          * audio.no_channels;
+            copy.p_data = av_malloc(size);
+            copy.p_metadata = NULL;
+            if (copy.p_data) {
+                memcpy(copy.p_data, audio.p_data, size);
+            }
+            NDIlib_recv_free_audio_v2(rx->recv, &audio);
+            if (copy.p_data) {
+                composite_queue_audio(in, &copy);
+            }
+        }
+    }
+}
+
+static int
+composite_open(InputCtx *ctx, const char *url, const char *name)
+{
+    (void)name;
+
+    CompositeInput *in = malloc(sizeof(CompositeInput));
+    memset(in, 0, sizeof(CompositeInput));
+    mutex_init(&in->lock);
+    in->clock = INT64_MIN;
+    in->down = 1; // until the first frame
+    atomic_store(&in->running, 1);
+    ctx->priv = in;
+
+    char error_str[200];
+    if (comp_parse(&in->spec, url, error_str, sizeof error_str) < 0) {
+        sprintf(ctx->error_str, "%s", error_str);
+        return -1;
+    }
+
+    for (int i = 0; i < in->spec.nb_sources; ++i) {
+        const CompositeSource *src = &in->spec.sources[i];
+        CompositeReceiver *rx = &in->receivers[i];
+        NDIlib_source_t source = {};
+
+        if (strlen(src->name)) {
+            source.p_ndi_name = src->name;
+        }
+        if (strlen(src->url)) {
+            source.p_url_address = src->url;
+        }
+
+        NDIlib_recv_create_v3_t recv_create_desc = {
+            .source_to_connect_to = source,
+            .p_ndi_recv_name = "ndi-streamer",
+            .bandwidth = NDIlib_recv_bandwidth_lowest,
+        };
+
+        rx->in = in;
+        rx->index = i;
+        mutex_init(&rx->lock);
+        rx->fc_ctx = new_frame_converter_ctx();
+        rx->scratch = av_frame_alloc();
+        rx->recv = NDIlib_recv_create_v3(&recv_create_desc);
+        if (!rx->recv) {
+            sprintf(ctx->error_str,
+                    "unable to create NDI receiver instance for \"%.200s\"",
+                    strlen(src->name) ? src->name : src->url);
+            return -1;
+        }
+
+        if (thread_create(&rx->thread, composite_receive, rx) < 0) {
+            sprintf(ctx->error_str, "%s", "could not start receiver thread");
+            return -1;
+        }
+        rx->started = 1;
+    }
+
+    ctx->live = 1;
+    return 0;
+}
+
+static int
+composite_draw(InputCtx *ctx, CompositeReceiver *rx, uint8_t *canvas,
+               int stride, const CompositeRect *fit)
+{
+    NDIlib_video_frame_v2_t *frame = &rx->frame;
+
+    if (frame->FourCC != NDIlib_FourCC_video_type_UYVA
+        && frame->FourCC != NDIlib_FourCC_video_type_PA16) {
+        uint8_t *dst[4] = {canvas + (size_t)fit->y * stride + fit->x * 2};
+        int dst_stride[4] = {stride};
+
+        if (fc_ndi_video_frame_scale(rx->fc_ctx, frame, dst, dst_stride,
+                                     AV_PIX_FMT_UYVY422, fit->width,
+                                     fit->height)
+            < 0) {
+            sprintf(ctx->error_str, "%s", rx->fc_ctx->error_str);
+            return -1;
+        }
+        return 0;
+    }
+
+    AVFrame *scratch = rx->scratch;
+    if (scratch->width != fit->width || scratch->height != fit->height) {
+        av_frame_unref(scratch);
+        scratch->format = AV_PIX_FMT_YUVA422P;
+        scratch->width = fit->width;
+        scratch->height = fit->height;
+        if (av_frame_get_buffer(scratch, 0) < 0) {
+            av_frame_unref(scratch);
+            sprintf(ctx->error_str, "%s", "could not allocate a blend frame");
+            return -1;
+        }
+    }
+
+    if (fc_ndi_video_frame_scale(rx->fc_ctx, frame, scratch->data,
+                                 scratch->linesize, AV_PIX_FMT_YUVA422P,
+                                 fit->width, fit->height)
+        < 0) {
+        sprintf(ctx->error_str, "%s", rx->fc_ctx->error_str);
+        return -1;
+    }
+
+    comp_blend(canvas, stride, fit, scratch->data, scratch->linesize);
+    return 0;
+}
+
+// takes rx->lock, up_for is how long the source has been up
+static int
+composite_source_up(CompositeInput *in, int i, int64_t now, int64_t *up_for)
+{
+    CompositeReceiver *rx = &in->receivers[i];
+
+    mutex_lock(&rx->lock);
+    int up = rx->frame.p_data
+             && now - rx->received_at <= in->spec.lost_ms * INT64_C(1000);
+    *up_for = now - rx->up_since;
+    mutex_unlock(&rx->lock);
+    return up;
+}
+
+/* Picks the program of the failover layout: the first source that is
+ * up. While the current program is up, an earlier source takes over only
+ * once it has been up for restore_ms, so a flapping primary is not
+ * switched back to; a program that is down gives way to any source. */
+static int
+composite_failover(CompositeInput *in, int64_t now)
+{
+    const CompositeSpec *spec = &in->spec;
+    int program = atomic_load(&in->program);
+    int64_t up_for;
+    int program_up = composite_source_up(in, program, now, &up_for);
+
+    for (int i = 0; i < spec->nb_sources; ++i) {
+        int up = composite_source_up(in, i, now, &up_for);
+
+        if (!up
+            || (program_up && i < program
+                && up_for < spec->restore_ms * INT64_C(1000))) {
+            continue;
+        }
+
+        if (i != program) {
+            LOG_WARNING("composite: switching from source %d to %d", program,
+                        i);
+            atomic_store(&in->program, i);
+        }
+        else if (in->down) {
+            LOG_INFO("composite: source %d is up", i);
+        }
+        in->down = 0;
+        return i;
+    }
+
+    if (!in->down) {
+        LOG_WARNING("composite: every source is lost, sending black");
+        in->down = 1;
+    }
+    return program;
+}
+
+/* Draws every source into its tile, in order, so picture-in-picture
+ * insets land on top of the main source. The switch and failover layouts
+ * draw the program source only, so a cut happens between two frames. */
+static int
+composite_render(InputCtx *ctx, CompositeInput *in, uint8_t *canvas)
+{
+    const CompositeSpec *spec = &in->spec;
+    int stride = spec->width * 2;
+    int64_t now = get_current_ts_usec();
+    int program = spec->layout == COMPOSITE_FAILOVER
+                          ? composite_failover(in, now)
+                          : atomic_load(&in->program);
+    int64_t lost = spec->lost_ms * INT64_C(1000);
+
+    in->program_up = 0;
+
+    for (int i = 0; i < spec->nb_sources; ++i) {
+        CompositeReceiver *rx = &in->receivers[i];
+        CompositeRect tile;
+        CompositeRect fit;
+
+        if ((spec->layout == COMPOSITE_SWITCH
+             || spec->layout == COMPOSITE_FAILOVER)
+            && i != program) {
+            continue;
+        }
+
+        comp_tile(spec, i, &tile);
+        if (tile.width <= 0 || tile.height <= 0) {
+            continue;
+        }
+
+        // insets are drawn without bars and only while they have a picture
+        int opaque = spec->layout != COMPOSITE_PIP || i == 0;
+
+        mutex_lock(&rx->lock);
+        NDIlib_video_frame_v2_t *frame = &rx->frame;
+        if (!frame->p_data || now - rx->received_at > lost) {
+            mutex_unlock(&rx->lock);
+            if (opaque) {
+                comp_fill(canvas, stride, &tile);
+            }
+            continue;
+        }
+        in->program_up |= i == program;
+
+        double aspect = frame->picture_aspect_ratio > 0
+                                ? frame->picture_aspect_ratio
+                                : (double)frame->xres / frame->yres;
+        comp_fit(&tile, aspect, &fit);
+
+        int alpha = frame->FourCC == NDIlib_FourCC_video_type_UYVA
+                    || frame->FourCC == NDIlib_FourCC_video_type_PA16;
+        if (opaque) {
+            comp_fill_around(canvas, stride, &tile, &fit);
+            // whatever an alpha source lets through is black
+            if (alpha) {
+                comp_fill(canvas, stride, &fit);
+            }
+        }
+
+        int ret = composite_draw(ctx, rx, canvas, stride, &fit);
+        mutex_unlock(&rx->lock);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (memcmp(&rx->drawn, &fit, sizeof fit) != 0) {
+            LOG_INFO("composite: source %d %s into %dx%d at %d,%d", i,
+                     alpha ? "blended" : "scaled", fit.width, fit.height,
+                     fit.x, fit.y);
+            rx->drawn = fit;
+        }
+    }
+    return 0;
+}
+
+/* Queues one frame interval of silence in the format of the last audio,
+ * so that the audio track goes on while the program source is down. */
+static void
+composite_silence(CompositeInput *in)
+{
+    const CompositeSpec *spec = &in->spec;
+
+    mutex_lock(&in->lock);
+    int64_t sample_rate = in->sample_rate;
+    int channels = in->channels;
+    mutex_unlock(&in->lock);
+
+    if (sample_rate <= 0 || channels <= 0) {
+        return;
+    }
+
+    // samples up to the next frame, rounding errors do not add up
+    int64_t start = in->frame_index * sample_rate * spec->frame_rate_D
+                    / spec->frame_rate_N;
+    int64_t end = (in->frame_index + 1) * sample_rate * spec->frame_rate_D
+                  / spec->frame_rate_N;
+
+    NDIlib_audio_frame_v2_t frame = {};
+    frame.sample_rate = (int)sample_rate;
+    frame.no_channels = channels;
+    frame.no_samples = (int)(end - start);
+    frame.channel_stride_in_bytes = frame.no_samples * (int)sizeof(float);
+    frame.timecode = in->clock * 10;
+    frame.timestamp = frame.timecode;
+    frame.p_data = av_mallocz((size_t)frame.channel_stride_in_bytes
+                              * channels);
+    if (frame.p_data) {
+        composite_queue_audio(in, &frame);
+    }
+}
+
+static uint8_t *
+composite_get_canvas(CompositeInput *in)
+{
+    uint8_t *canvas = NULL;
+
+    mutex_lock(&in->lock);
+    if (in->nb_pool > 0) {
+        canvas = in->pool[--in->nb_pool];
+    }
+    mutex_unlock(&in->lock);
+
+    if (!canvas) {
+        canvas = av_malloc((size_t)in->spec.width * 2 * in->spec.height);
+    }
+    return canvas;
+}
+
+static InputFrameType
+composite_capture(InputCtx *ctx, NDIlib_video_frame_v2_t *video,
+                  NDIlib_audio_frame_v2_t *audio, uint32_t timeout_ms)
+{
+    CompositeInput *in = ctx->priv;
+    const CompositeSpec *spec = &in->spec;
+
+    if (audio) {
+        int found = 0;
+        mutex_lock(&in->lock);
+        if (in->nb_audio > 0) {
+            *audio = in->audio[in->audio_head];
+            in->audio_head = (in->audio_head + 1) % COMPOSITE_MAX_AUDIO;
+            in->nb_audio--;
+            found = 1;
+        }
+        mutex_unlock(&in->lock);
+        if (found) {
+            return INPUT_FRAME_AUDIO;
+        }
+    }
+
+    // frames go out on a fixed clock whatever rate the sources run at
+    int64_t period = (int64_t)1000000 * spec->frame_rate_D
+                     / spec->frame_rate_N;
+    int64_t now = get_current_ts_usec();
+    if (in->clock == INT64_MIN) {
+        in->clock = now;
+    }
+    else if (now - in->clock >= period) {
+        // ticks that were missed are dropped rather than rendered late
+        int64_t missed = (now - in->clock) / period;
+        in->clock += missed * period;
+        in->frame_index += missed;
+    }
+
+    if (in->clock > now + (int64_t)timeout_ms * 1000) {
+        thread_sleep_ms((int)timeout_ms);
+        return INPUT_FRAME_NONE;
+    }
+    if (in->clock > now) {
+        thread_sleep_ms((int)((in->clock - now + 999) / 1000));
+    }
+
+    if (!video) {
+        return INPUT_FRAME_NONE;
+    }
+
+    uint8_t *canvas = composite_get_canvas(in);
+    if (!canvas) {
+        sprintf(ctx->error_str, "%s", "could not allocate a composite frame");
+        return INPUT_FRAME_ERROR;
+    }
+
+    if (composite_render(ctx, in, canvas) < 0) {
+        av_free(canvas);
+        return INPUT_FRAME_ERROR;
+    }
+    if (!in->program_up) {
+        composite_silence(in);
+    }
+
+    memset(video, 0, sizeof(NDIlib_video_frame_v2_t));
+    video->xres = spec->width;
+    video->yres = spec->height;
+    video->FourCC = NDIlib_FourCC_video_type_UYVY;
+    video->frame_rate_N = spec->frame_rate_N;
+    video->frame_rate_D = spec->frame_rate_D;
+    video->picture_aspect_ratio = (float)spec->width / spec->height;
+    video->frame_format_type = NDIlib_frame_format_type_progressive;
+    video->timecode = in->frame_index * 10000000 * spec->frame_rate_D
+                      / spec->frame_rate_N;
+    video->p_data = canvas;
+    video->line_stride_in_bytes = spec->width * 2;
+    video->timestamp = in->clock * 10; // the tick, in 100 ns since 1970
+
+    in->frame_index++;
+    in->clock += period;
+    return INPUT_FRAME_VIDEO;
+}
+
+static void
+composite_free_video(InputCtx *ctx, NDIlib_video_frame_v2_t *frame)
+{
+    CompositeInput *in = ctx->priv;
+
+    mutex_lock(&in->lock);
+    if (in->nb_pool < COMPOSITE_POOL_SIZE) {
+        in->pool[in->nb_pool++] = frame->p_data;
+        frame->p_data = NULL;
+    }
+    mutex_unlock(&in->lock);
+
+    av_freep(&frame->p_data);
+}
+
+static void
+composite_free_audio(InputCtx *ctx, NDIlib_audio_frame_v2_t *frame)
+{
+    (void)ctx;
+    av_freep(&frame->p_data);
+}
+
+static int
+composite_stats(InputCtx *ctx, InputStats *stats)
+{
+    CompositeInput *in = ctx->priv;
+
+    int program = atomic_load(&in->program);
+
+    // video of every source, audio of the program one
+    for (int i = 0; i < in->spec.nb_sources; ++i) {
+        NDIlib_recv_performance_t total = {};
+        NDIlib_recv_performance_t dropped = {};
+        NDIlib_recv_queue_t queue = {};
+
+        NDIlib_recv_get_performance(in->receivers[i].recv, &total, &dropped);
+        NDIlib_recv_get_queue(in->receivers[i].recv, &queue);
+
+        stats->video_frames += total.video_frames;
+        stats->video_dropped += dropped.video_frames;
+        stats->video_queued += queue.video_frames;
+        if (i == program) {
+            stats->audio_frames = total.audio_frames;
+            stats->audio_dropped = dropped.audio_frames;
+        }
+    }
+
+    mutex_lock(&in->lock);
+    stats->audio_dropped += in->audio_dropped;
+    stats->audio_queued = in->nb_audio;
+    mutex_unlock(&in->lock);
+    return 0;
+}
+
+static int
+composite_select(InputCtx *ctx, int index)
+{
+    CompositeInput *in = ctx->priv;
+
+    if (index < 0 || index >= in->spec.nb_sources) {
+        sprintf(ctx->error_str, "no source with index %d", index);
+        return -1;
+    }
+    atomic_store(&in->program, index);
+    return 0;
+}
+
+static void
+composite_close(InputCtx *ctx)
+{
+    CompositeInput *in = ctx->priv;
+    if (!in) {
+        return;
+    }
+
+    atomic_store(&in->running, 0);
+
+    for (int i = 0; i < COMPOSITE_MAX_SOURCES; ++i) {
+        CompositeReceiver *rx = &in->receivers[i];
+        if (rx->started) {
+            thread_join(rx->thread);
+        }
+    }
+
+    for (; in->nb_audio > 0; in->nb_audio--) {
+        av_free(in->audio[in->audio_head].p_data);
+        in->audio_head = (in->audio_head + 1) % COMPOSITE_MAX_AUDIO;
+    }
+
+    for (int i = 0; i < COMPOSITE_MAX_SOURCES; ++i) {
+        CompositeReceiver *rx = &in->receivers[i];
+        if (!rx->in) {
+            continue;
+        }
+        if (rx->recv) {
+            if (rx->frame.p_data) {
+                NDIlib_recv_free_video_v2(rx->recv, &rx->frame);
+            }
+            NDIlib_recv_destroy(rx->recv);
+        }
+        free_frame_converter_ctx(&rx->fc_ctx);
+        av_frame_free(&rx->scratch);
+        mutex_destroy(&rx->lock);
+    }
+
+    for (int i = 0; i < in->nb_pool; ++i) {
+        av_free(in->pool[i]);
+    }
+
+    mutex_destroy(&in->lock);
+    free(in);
+    ctx->priv = NULL;
+}
+
+const InputBackend input_composite_backend = {
+    .name = "composite",
+    .open = composite_open,
+    .capture = composite_capture,
+    .free_video = composite_free_video,
+    .free_audio = composite_free_audio,
+    .close = composite_close,
+    .stats = composite_stats,
+    .select = composite_select,
+};
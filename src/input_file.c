@@ -0,0 +1,535 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "input.h"
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswresample/swresample.h>
+#include <libswscale/swscale.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "thread.h"
+
+// a realtime input that falls further behind restarts its clock
+#define FILE_MAX_LAG AV_TIME_BASE
+#define FILE_MAX_CHANNELS 64
+
+typedef struct FileInput {
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *video_dec;
+    AVCodecContext *audio_dec;
+    int video_index;
+    int audio_index;
+    AVRational frame_rate;
+    AVPacket *pkt;
+    AVFrame *frame;
+    struct SwsContext *sws_ctx;
+    SwrContext *swr_ctx;
+
+    int eof;             // demuxer drained, decoders are being flushed
+    int64_t start_ts;    // first timestamp of the file, usec
+    int64_t loop_offset; // media time of the current pass, usec
+    int64_t end_ts;      // media time of the latest frame end, usec
+    int64_t clock;       // wall clock of media time 0, usec
+
+    // decoded frame waiting for its presentation time
+    InputFrameType pending;
+    int64_t pending_ts;
+    NDIlib_video_frame_v2_t video;
+    NDIlib_audio_frame_v2_t audio;
+} FileInput;
+
+// decoder formats passed through as they are, everything else is
+// converted to UYVY like most NDI senders send it, or to P216 when it has
+// more than 8 bits
+static const struct {
+    enum AVPixelFormat pix_fmt;
+    NDIlib_FourCC_video_type_e fourcc;
+} file_fourccs[] = {
+    { AV_PIX_FMT_UYVY422, NDIlib_FourCC_video_type_UYVY },
+    { AV_PIX_FMT_YUV420P, NDIlib_FourCC_video_type_I420 },
+    { AV_PIX_FMT_NV12, NDIlib_FourCC_video_type_NV12 },
+    { AV_PIX_FMT_BGRA, NDIlib_FourCC_video_type_BGRA },
+    { AV_PIX_FMT_BGR0, NDIlib_FourCC_video_type_BGRX },
+    { AV_PIX_FMT_RGBA, NDIlib_FourCC_video_type_RGBA },
+    { AV_PIX_FMT_RGB0, NDIlib_FourCC_video_type_RGBX },
+    { AV_PIX_FMT_P216, NDIlib_FourCC_video_type_P216 },
+};
+
+static int
+file_open_decoder(InputCtx *ctx, FileInput *in, enum AVMediaType type,
+                  AVCodecContext **dec, int *index)
+{
+    const AVCodec *codec = NULL;
+
+    *index = av_find_best_stream(in->fmt_ctx, type, -1, -1, &codec, 0);
+    if (*index < 0) {
+        *index = -1;
+        return 0;
+    }
+
+    AVStream *stream = in->fmt_ctx->streams[*index];
+
+    *dec = avcodec_alloc_context3(codec);
+    if (!*dec) {
+        sprintf(ctx->error_str, "%s", "could not allocate decoder context");
+        return -1;
+    }
+
+    int ret = avcodec_parameters_to_context(*dec, stream->codecpar);
+    if (ret >= 0) {
+        (*dec)->pkt_timebase = stream->time_base;
+        (*dec)->thread_count = 0;
+        ret = avcodec_open2(*dec, codec, NULL);
+    }
+    if (ret < 0) {
+        av_error_fmt(ctx->error_str, "could not open decoder", ret);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+file_open(InputCtx *ctx, const char *url, const char *name)
+{
+    (void)name;
+
+    FileInput *in = calloc(1, sizeof(FileInput));
+    ctx->priv = in;
+    in->start_ts = AV_NOPTS_VALUE;
+    in->clock = AV_NOPTS_VALUE;
+
+    int ret = avformat_open_input(&in->fmt_ctx, url, NULL, NULL);
+    if (ret < 0) {
+        av_error_fmt(ctx->error_str, "could not open input", ret);
+        return -1;
+    }
+
+    ret = avformat_find_stream_info(in->fmt_ctx, NULL);
+    if (ret < 0) {
+        av_error_fmt(ctx->error_str, "could not read stream info", ret);
+        return -1;
+    }
+
+    if (file_open_decoder(ctx, in, AVMEDIA_TYPE_VIDEO, &in->video_dec,
+                          &in->video_index)
+                < 0
+        || file_open_decoder(ctx, in, AVMEDIA_TYPE_AUDIO, &in->audio_dec,
+                             &in->audio_index)
+                   < 0) {
+        return -1;
+    }
+
+    if (in->video_index < 0) {
+        sprintf(ctx->error_str, "\"%.200s\" has no video stream", url);
+        return -1;
+    }
+
+    in->frame_rate = av_guess_frame_rate(
+            in->fmt_ctx, in->fmt_ctx->streams[in->video_index], NULL);
+    if (in->frame_rate.num <= 0 || in->frame_rate.den <= 0) {
+        in->frame_rate = (AVRational){ 25, 1 };
+    }
+    if (in->fmt_ctx->start_time != AV_NOPTS_VALUE) {
+        in->start_ts = in->fmt_ctx->start_time;
+    }
+
+    in->pkt = av_packet_alloc();
+    in->frame = av_frame_alloc();
+
+    // paced like a live source it is also dropped like one when the
+    // pipeline falls behind, otherwise the pipeline waits for it
+    ctx->live = ctx->realtime;
+    return 0;
+}
+
+static int64_t
+file_frame_ts(FileInput *in, int stream_index)
+{
+    int64_t ts = in->frame->best_effort_timestamp;
+    if (ts == AV_NOPTS_VALUE) {
+        return in->end_ts;
+    }
+
+    ts = av_rescale_q(ts, in->fmt_ctx->streams[stream_index]->time_base,
+                      AV_TIME_BASE_Q);
+    if (in->start_ts == AV_NOPTS_VALUE) {
+        in->start_ts = ts;
+    }
+    return ts - in->start_ts + in->loop_offset;
+}
+
+static InputFrameType
+file_video_frame(InputCtx *ctx, FileInput *in)
+{
+    AVFrame *frame = in->frame;
+    enum AVPixelFormat pix_fmt = AV_PIX_FMT_UYVY422;
+    NDIlib_FourCC_video_type_e fourcc = NDIlib_FourCC_video_type_UYVY;
+    int passthrough = 0;
+
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    if (desc && desc->comp[0].depth > 8) {
+        pix_fmt = AV_PIX_FMT_P216;
+        fourcc = NDIlib_FourCC_video_type_P216;
+    }
+
+    for (size_t i = 0; i < sizeof file_fourccs / sizeof file_fourccs[0];
+         ++i) {
+        if (file_fourccs[i].pix_fmt == frame->format) {
+            pix_fmt = frame->format;
+            fourcc = file_fourccs[i].fourcc;
+            passthrough = 1;
+            break;
+        }
+    }
+
+    // NDI frames are packed without padding
+    int size = av_image_get_buffer_size(pix_fmt, frame->width, frame->height,
+                                        1);
+    uint8_t *data = size > 0 ? av_malloc(size) : NULL;
+    if (!data) {
+        sprintf(ctx->error_str, "%s", "could not allocate video frame");
+        return INPUT_FRAME_ERROR;
+    }
+
+    if (passthrough) {
+        av_image_copy_to_buffer(data, size, (const uint8_t *const *)frame->data,
+                                frame->linesize, pix_fmt, frame->width,
+                                frame->height, 1);
+    }
+    else {
+        uint8_t *dst[4];
+        int dst_stride[4];
+
+        in->sws_ctx = sws_getCachedContext(
+                in->sws_ctx, frame->width, frame->height, frame->format,
+                frame->width, frame->height, pix_fmt, SWS_BICUBIC, NULL, NULL,
+                NULL);
+        if (!in->sws_ctx) {
+            av_free(data);
+            sprintf(ctx->error_str, "%s", "could not create scaler context");
+            return INPUT_FRAME_ERROR;
+        }
+
+        av_image_fill_arrays(dst, dst_stride, data, pix_fmt, frame->width,
+                             frame->height, 1);
+        sws_scale(in->sws_ctx, (const uint8_t *const *)frame->data,
+                  frame->linesize, 0, frame->height, dst, dst_stride);
+    }
+
+    int64_t ts = file_frame_ts(in, in->video_index);
+    int64_t end = ts + av_rescale_q(1, av_inv_q(in->frame_rate),
+                                    AV_TIME_BASE_Q);
+
+    NDIlib_video_frame_v2_t *video = &in->video;
+    memset(video, 0, sizeof(NDIlib_video_frame_v2_t));
+    video->xres = frame->width;
+    video->yres = frame->height;
+    video->FourCC = fourcc;
+    video->frame_rate_N = in->frame_rate.num;
+    video->frame_rate_D = in->frame_rate.den;
+    video->frame_format_type = NDIlib_frame_format_type_progressive;
+    video->timecode = ts * 10; // NDI counts in 100 ns
+    video->timestamp = video->timecode;
+    video->p_data = data;
+    video->line_stride_in_bytes = av_image_get_linesize(pix_fmt,
+                                                        frame->width, 0);
+
+    in->pending_ts = ts;
+    if (end > in->end_ts) {
+        in->end_ts = end;
+    }
+    return INPUT_FRAME_VIDEO;
+}
+
+static InputFrameType
+file_audio_frame(InputCtx *ctx, FileInput *in)
+{
+    AVFrame *frame = in->frame;
+    int channels = frame->ch_layout.nb_channels;
+
+    if (channels > FILE_MAX_CHANNELS) {
+        sprintf(ctx->error_str, "%d audio channels are not supported",
+                channels);
+        return INPUT_FRAME_ERROR;
+    }
+
+    if (!in->swr_ctx) {
+        int ret = swr_alloc_set_opts2(
+                &in->swr_ctx, &frame->ch_layout, AV_SAMPLE_FMT_FLTP,
+                frame->sample_rate, &frame->ch_layout, frame->format,
+                frame->sample_rate, 0, NULL);
+        if (ret >= 0) {
+            ret = swr_init(in->swr_ctx);
+        }
+        if (ret < 0) {
+            av_error_fmt(ctx->error_str, "could not create resampler", ret);
+            return INPUT_FRAME_ERROR;
+        }
+    }
+
+    int nb_samples = swr_get_out_samples(in->swr_ctx, frame->nb_samples);
+    if (nb_samples <= 0) {
+        return INPUT_FRAME_NONE;
+    }
+
+    // planar float, one channel after another
+    float *data = av_malloc(sizeof(float) * nb_samples * channels);
+    uint8_t *planes[FILE_MAX_CHANNELS];
+    for (int c = 0; c < channels; ++c) {
+        planes[c] = (uint8_t *)(data + (size_t)c * nb_samples);
+    }
+
+    int ret = swr_convert(in->swr_ctx, planes, nb_samples,
+                          (const uint8_t **)frame->extended_data,
+                          frame->nb_samples);
+    if (ret <= 0) {
+        av_free(data);
+        if (ret < 0) {
+            av_error_fmt(ctx->error_str, "error converting audio", ret);
+            return INPUT_FRAME_ERROR;
+        }
+        return INPUT_FRAME_NONE;
+    }
+
+    int64_t ts = file_frame_ts(in, in->audio_index);
+    int64_t end = ts + (int64_t)ret * AV_TIME_BASE / frame->sample_rate;
+
+    NDIlib_audio_frame_v2_t *audio = &in->audio;
+    memset(audio, 0, sizeof(NDIlib_audio_frame_v2_t));
+    audio->sample_rate = frame->sample_rate;
+    audio->no_channels = channels;
+    audio->no_samples = ret;
+    audio->timecode = ts * 10;
+    audio->timestamp = audio->timecode;
+    audio->p_data = data;
+    audio->channel_stride_in_bytes = (int)sizeof(float) * nb_samples;
+
+    in->pending_ts = ts;
+    if (end > in->end_ts) {
+        in->end_ts = end;
+    }
+    return INPUT_FRAME_AUDIO;
+}
+
+/* Decodes the next frame of either stream into `video` or `audio`. */
+static InputFrameType
+file_decode(InputCtx *ctx, FileInput *in)
+{
+    AVCodecContext *decoders[2] = { in->video_dec, in->audio_dec };
+
+    for (;;) {
+        int drained = 1;
+
+        for (int i = 0; i < 2; ++i) {
+            if (!decoders[i]) {
+                continue;
+            }
+
+            int ret = avcodec_receive_frame(decoders[i], in->frame);
+            if (ret >= 0) {
+                InputFrameType type = i == 0 ? file_video_frame(ctx, in)
+                                             : file_audio_frame(ctx, in);
+                av_frame_unref(in->frame);
+                if (type != INPUT_FRAME_NONE) {
+                    return type;
+                }
+                drained = 0;
+            }
+            else if (ret == AVERROR(EAGAIN)) {
+                drained = 0;
+            }
+            else if (ret != AVERROR_EOF) {
+                av_error_fmt(ctx->error_str, "error decoding frame", ret);
+                return INPUT_FRAME_ERROR;
+            }
+        }
+
+        if (in->eof) {
+            if (drained) {
+                return INPUT_FRAME_END;
+            }
+            continue;
+        }
+
+        int ret = av_read_frame(in->fmt_ctx, in->pkt);
+        if (ret == AVERROR_EOF) {
+            in->eof = 1;
+            for (int i = 0; i < 2; ++i) {
+                if (decoders[i]) {
+                    avcodec_send_packet(decoders[i], NULL);
+                }
+            }
+            continue;
+        }
+        if (ret < 0) {
+            av_error_fmt(ctx->error_str, "error reading input", ret);
+            return INPUT_FRAME_ERROR;
+        }
+
+        AVCodecContext *dec = NULL;
+        if (in->pkt->stream_index == in->video_index) {
+            dec = in->video_dec;
+        }
+        else if (in->pkt->stream_index == in->audio_index) {
+            dec = in->audio_dec;
+        }
+
+        // corrupt packets are skipped, the decoder resyncs by itself
+        if (dec) {
+            avcodec_send_packet(dec, in->pkt);
+        }
+        av_packet_unref(in->pkt);
+    }
+}
+
+/* Seeks back to the start, the next pass continues the media time where
+ * this one ended. Returns 1 if the last pass played nothing. */
+static int
+file_rewind(InputCtx *ctx, FileInput *in)
+{
+    if (in->end_ts <= in->loop_offset) {
+        return 1;
+    }
+
+    int64_t ts = in->fmt_ctx->start_time != AV_NOPTS_VALUE
+                         ? in->fmt_ctx->start_time
+                         : 0;
+    int ret = avformat_seek_file(in->fmt_ctx, -1, INT64_MIN, ts, ts, 0);
+    if (ret < 0) {
+        av_error_fmt(ctx->error_str, "could not seek to the start", ret);
+        return -1;
+    }
+
+    if (in->video_dec) {
+        avcodec_flush_buffers(in->video_dec);
+    }
+    if (in->audio_dec) {
+        avcodec_flush_buffers(in->audio_dec);
+    }
+    in->eof = 0;
+    in->loop_offset = in->end_ts;
+    return 0;
+}
+
+static InputFrameType
+file_capture(InputCtx *ctx, NDIlib_video_frame_v2_t *video,
+             NDIlib_audio_frame_v2_t *audio, uint32_t timeout_ms)
+{
+    FileInput *in = ctx->priv;
+    int64_t deadline = get_current_ts_usec() + (int64_t)timeout_ms * 1000;
+
+    if (in->pending == INPUT_FRAME_NONE) {
+        InputFrameType type = file_decode(ctx, in);
+        if (type == INPUT_FRAME_END && ctx->loop) {
+            int ret = file_rewind(ctx, in);
+            type = ret < 0    ? INPUT_FRAME_ERROR
+                   : ret == 0 ? file_decode(ctx, in)
+                              : type;
+        }
+        if (type != INPUT_FRAME_VIDEO && type != INPUT_FRAME_AUDIO) {
+            return type;
+        }
+        in->pending = type;
+    }
+
+    if (ctx->realtime) {
+        int64_t now = get_current_ts_usec();
+        if (in->clock == AV_NOPTS_VALUE
+            || now - (in->clock + in->pending_ts) > FILE_MAX_LAG) {
+            in->clock = now - in->pending_ts;
+        }
+
+        int64_t due = in->clock + in->pending_ts;
+        if (due > deadline) {
+            thread_sleep_ms((int)timeout_ms);
+            return INPUT_FRAME_NONE;
+        }
+        if (due > now) {
+            thread_sleep_ms((int)((due - now + 999) / 1000));
+        }
+    }
+
+    InputFrameType type = in->pending;
+    in->pending = INPUT_FRAME_NONE;
+
+    if (type == INPUT_FRAME_VIDEO && video) {
+        *video = in->video;
+        return type;
+    }
+    if (type == INPUT_FRAME_AUDIO && audio) {
+        *audio = in->audio;
+        return type;
+    }
+
+    // the caller does not take this kind of frame
+    if (type == INPUT_FRAME_VIDEO) {
+        av_free(in->video.p_data);
+    }
+    else {
+        av_free(in->audio.p_data);
+    }
+    return INPUT_FRAME_NONE;
+}
+
+static void
+file_free_video(InputCtx *ctx, NDIlib_video_frame_v2_t *frame)
+{
+    (void)ctx;
+    av_free(frame->p_data);
+}
+
+static void
+file_free_audio(InputCtx *ctx, NDIlib_audio_frame_v2_t *frame)
+{
+    (void)ctx;
+    av_free(frame->p_data);
+}
+
+static void
+file_close(InputCtx *ctx)
+{
+    FileInput *in = ctx->priv;
+    if (!in) {
+        return;
+    }
+
+    if (in->pending == INPUT_FRAME_VIDEO) {
+        av_free(in->video.p_data);
+    }
+    else if (in->pending == INPUT_FRAME_AUDIO) {
+        av_free(in->audio.p_data);
+    }
+
+    if (in->video_dec)
+        avcodec_free_context(&in->video_dec);
+    if (in->audio_dec)
+        avcodec_free_context(&in->audio_dec);
+    if (in->fmt_ctx)
+        avformat_close_input(&in->fmt_ctx);
+    if (in->sws_ctx)
+        sws_freeContext(in->sws_ctx);
+    if (in->swr_ctx)
+        swr_free(&in->swr_ctx);
+    av_packet_free(&in->pkt);
+    av_frame_free(&in->frame);
+
+    free(in);
+    ctx->priv = NULL;
+}
+
+const InputBackend input_file_backend = {
+    .name = "file",
+    .open = file_open,
+    .capture = file_capture,
+    .free_video = file_free_video,
+    .free_audio = file_free_audio,
+    .close = file_close,
+};
@@ -0,0 +1,319 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "input.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "common.h"
+#include "raw_dump.h"
+#include "thread.h"
+
+// a realtime replay that falls further behind restarts its clock
+#define RAW_MAX_LAG 1000000
+#define RAW_DEFAULT_DURATION 20000
+// larger pictures are taken as a corrupt index, NDI stops far below
+#define RAW_MAX_DIMENSION 65536
+
+typedef struct RawInput {
+    uint8_t *map;
+    size_t map_size;
+    const RawIndexEntry *index;
+    int64_t nb_frames;
+
+    int64_t pos;
+    int64_t pass_duration; // capture time of one pass, usec
+    int64_t loop_offset;   // capture time of the current pass, usec
+    int64_t clock;         // wall clock of capture time 0, usec
+} RawInput;
+
+#ifdef _WIN32
+
+static int
+raw_map(InputCtx *ctx, RawInput *in, const char *path)
+{
+    sprintf(ctx->error_str, "%s", "raw replay is not supported on windows");
+    return -1;
+}
+
+static void
+raw_unmap(RawInput *in)
+{
+}
+
+#else
+
+static int
+raw_map(InputCtx *ctx, RawInput *in, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        sprintf(ctx->error_str, "could not open \"%.200s\"", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        sprintf(ctx->error_str, "could not stat \"%.200s\"", path);
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        sprintf(ctx->error_str, "could not map \"%.200s\"", path);
+        return -1;
+    }
+
+    in->map = map;
+    in->map_size = st.st_size;
+    return 0;
+}
+
+static void
+raw_unmap(RawInput *in)
+{
+    if (in->map) {
+        munmap(in->map, in->map_size);
+        in->map = NULL;
+    }
+}
+
+#endif
+
+// whether the payload holds everything the entry says it does
+static int
+raw_entry_fits(const RawIndexEntry *entry)
+{
+    if (entry->type == RAW_FRAME_VIDEO) {
+        if (entry->xres <= 0 || entry->yres <= 0
+            || entry->xres > RAW_MAX_DIMENSION
+            || entry->yres > RAW_MAX_DIMENSION
+            || entry->line_stride_in_bytes < 0) {
+            return 0;
+        }
+
+        NDIlib_video_frame_v2_t frame = {};
+        frame.xres = entry->xres;
+        frame.yres = entry->yres;
+        frame.FourCC = entry->fourcc;
+        frame.frame_format_type = entry->frame_format_type;
+        frame.line_stride_in_bytes = entry->line_stride_in_bytes;
+        int64_t size = raw_video_size(&frame);
+
+        // a stride shorter than a row would still read past the end
+        frame.line_stride_in_bytes = 0;
+        int64_t packed = raw_video_size(&frame);
+        return entry->size >= (uint64_t)(size > packed ? size : packed);
+    }
+    if (entry->type == RAW_FRAME_AUDIO) {
+        return entry->no_channels >= 0 && entry->no_samples >= 0
+               && (int64_t)entry->no_samples * (int64_t)sizeof(float)
+                          <= entry->channel_stride_in_bytes
+               && (uint64_t)((int64_t)entry->channel_stride_in_bytes
+                             * entry->no_channels)
+                          <= entry->size;
+    }
+    return 1; // not handed out
+}
+
+static int
+raw_check(InputCtx *ctx, RawInput *in)
+{
+    RawFileHeader header;
+    RawFileTrailer trailer;
+
+    if (in->map_size < sizeof header + sizeof trailer) {
+        sprintf(ctx->error_str, "%s", "raw dump is truncated");
+        return -1;
+    }
+
+    memcpy(&header, in->map, sizeof header);
+    memcpy(&trailer, in->map + in->map_size - sizeof trailer,
+           sizeof trailer);
+
+    if (memcmp(header.magic, RAW_DUMP_MAGIC, sizeof header.magic) != 0
+        || header.version != 1) {
+        sprintf(ctx->error_str, "%s", "not a raw dump");
+        return -1;
+    }
+    if (memcmp(trailer.magic, RAW_DUMP_MAGIC, sizeof trailer.magic) != 0) {
+        sprintf(ctx->error_str, "%s", "raw dump has no index, was it closed?");
+        return -1;
+    }
+
+    size_t index_end = in->map_size - sizeof trailer;
+    if (trailer.index_offset > index_end
+        || trailer.nb_frames
+                   > (index_end - trailer.index_offset)
+                             / sizeof(RawIndexEntry)) {
+        sprintf(ctx->error_str, "%s", "raw dump index is corrupt");
+        return -1;
+    }
+
+    in->index = (const RawIndexEntry *)(in->map + trailer.index_offset);
+    in->nb_frames = (int64_t)trailer.nb_frames;
+
+    for (int64_t i = 0; i < in->nb_frames; ++i) {
+        const RawIndexEntry *entry = &in->index[i];
+        if (entry->offset > trailer.index_offset
+            || entry->size > trailer.index_offset - entry->offset
+            || !raw_entry_fits(entry)) {
+            sprintf(ctx->error_str, "raw dump frame %lld is corrupt",
+                    (long long)i);
+            return -1;
+        }
+    }
+
+    // a pass lasts until the last frame ends
+    if (in->nb_frames > 0) {
+        int64_t duration = RAW_DEFAULT_DURATION;
+        for (int64_t i = in->nb_frames - 1; i >= 0; --i) {
+            const RawIndexEntry *entry = &in->index[i];
+            if (entry->type == RAW_FRAME_VIDEO && entry->frame_rate_N > 0) {
+                duration = (int64_t)1000000 * entry->frame_rate_D
+                           / entry->frame_rate_N;
+                break;
+            }
+        }
+        in->pass_duration = in->index[in->nb_frames - 1].capture_ts
+                            + duration;
+    }
+    return 0;
+}
+
+static int
+raw_open(InputCtx *ctx, const char *url, const char *name)
+{
+    (void)name;
+
+    RawInput *in = malloc(sizeof(RawInput));
+    memset(in, 0, sizeof(RawInput));
+    in->clock = INT64_MIN;
+    ctx->priv = in;
+
+    if (raw_map(ctx, in, url) < 0 || raw_check(ctx, in) < 0) {
+        return -1;
+    }
+
+    ctx->live = ctx->realtime;
+    return 0;
+}
+
+static InputFrameType
+raw_capture(InputCtx *ctx, NDIlib_video_frame_v2_t *video,
+            NDIlib_audio_frame_v2_t *audio, uint32_t timeout_ms)
+{
+    RawInput *in = ctx->priv;
+
+    if (in->pos == in->nb_frames) {
+        if (!ctx->loop || in->nb_frames == 0) {
+            return INPUT_FRAME_END;
+        }
+        in->pos = 0;
+        in->loop_offset += in->pass_duration;
+    }
+
+    const RawIndexEntry *entry = &in->index[in->pos];
+
+    if (ctx->realtime) {
+        int64_t ts = entry->capture_ts + in->loop_offset;
+        int64_t now = get_current_ts_usec();
+        if (in->clock == INT64_MIN || now - (in->clock + ts) > RAW_MAX_LAG) {
+            in->clock = now - ts;
+        }
+
+        int64_t due = in->clock + ts;
+        if (due > now + (int64_t)timeout_ms * 1000) {
+            thread_sleep_ms((int)timeout_ms);
+            return INPUT_FRAME_NONE;
+        }
+        if (due > now) {
+            thread_sleep_ms((int)((due - now + 999) / 1000));
+        }
+    }
+
+    in->pos++;
+
+    // payloads are handed out in place, the mapping outlives the frames
+    uint8_t *data = in->map + entry->offset;
+
+    if (entry->type == RAW_FRAME_VIDEO && video) {
+        memset(video, 0, sizeof(NDIlib_video_frame_v2_t));
+        video->xres = entry->xres;
+        video->yres = entry->yres;
+        video->FourCC = entry->fourcc;
+        video->frame_rate_N = entry->frame_rate_N;
+        video->frame_rate_D = entry->frame_rate_D;
+        video->picture_aspect_ratio = entry->picture_aspect_ratio;
+        video->frame_format_type = entry->frame_format_type;
+        video->timecode = entry->timecode;
+        video->p_data = data;
+        video->line_stride_in_bytes = entry->line_stride_in_bytes;
+        video->timestamp = entry->timestamp;
+        return INPUT_FRAME_VIDEO;
+    }
+    if (entry->type == RAW_FRAME_AUDIO && audio) {
+        memset(audio, 0, sizeof(NDIlib_audio_frame_v2_t));
+        audio->sample_rate = entry->sample_rate;
+        audio->no_channels = entry->no_channels;
+        audio->no_samples = entry->no_samples;
+        audio->timecode = entry->timecode;
+        audio->p_data = (float *)data;
+        audio->channel_stride_in_bytes = entry->channel_stride_in_bytes;
+        audio->timestamp = entry->timestamp;
+        return INPUT_FRAME_AUDIO;
+    }
+
+    // the caller does not take this kind of frame
+    return INPUT_FRAME_NONE;
+}
+
+static void
+raw_free_video(InputCtx *ctx, NDIlib_video_frame_v2_t *frame)
+{
+    (void)ctx;
+    (void)frame;
+}
+
+static void
+raw_free_audio(InputCtx *ctx, NDIlib_audio_frame_v2_t *frame)
+{
+    (void)ctx;
+    (void)frame;
+}
+
+static void
+raw_close(InputCtx *ctx)
+{
+    RawInput *in = ctx->priv;
+    if (!in) {
+        return;
+    }
+
+    raw_unmap(in);
+    free(in);
+    ctx->priv = NULL;
+}
+
+const InputBackend input_raw_backend = {
+    .name = "raw",
+    .open = raw_open,
+    .capture = raw_capture,
+    .free_video = raw_free_video,
+    .free_audio = raw_free_audio,
+    .close = raw_close,
+};
@@ -0,0 +1,422 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "json.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *
+json_skip_ws(const char *p)
+{
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    return p;
+}
+
+static const char *
+json_parse_string(const char *p, char **out)
+{
+    if (*p != '"') {
+        return NULL;
+    }
+    p++;
+
+    size_t cap = 32, len = 0;
+    char *str = malloc(cap);
+
+    while (*p && *p != '"') {
+        char c = *p++;
+        if (c == '\\') {
+            switch (*p++) {
+            case '"':
+                c = '"';
+                break;
+            case '\\':
+                c = '\\';
+                break;
+            case '/':
+                c = '/';
+                break;
+            case 'n':
+                c = '\n';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            default:
+                free(str);
+                return NULL;
+            }
+        }
+        if (len + 1 >= cap) {
+            cap *= 2;
+            str = realloc(str, cap);
+        }
+        str[len++] = c;
+    }
+
+    if (*p != '"') {
+        free(str);
+        return NULL;
+    }
+
+    str[len] = '\0';
+    *out = str;
+    return p + 1;
+}
+
+static const char *
+json_skip_digits(const char *p)
+{
+    if (!isdigit((unsigned char)*p)) {
+        return NULL;
+    }
+    while (isdigit((unsigned char)*p)) {
+        p++;
+    }
+    return p;
+}
+
+// end of a number in JSON syntax, strtod alone also takes nan, inf and hex
+static const char *
+json_scan_number(const char *p)
+{
+    if (*p == '-') {
+        p++;
+    }
+    if (*p == '0') {
+        p++;
+    }
+    else if (!(p = json_skip_digits(p))) {
+        return NULL;
+    }
+    if (*p == '.' && !(p = json_skip_digits(p + 1))) {
+        return NULL;
+    }
+    if (*p == 'e' || *p == 'E') {
+        p++;
+        if (*p == '+' || *p == '-') {
+            p++;
+        }
+        p = json_skip_digits(p);
+    }
+    return p;
+}
+
+static void
+json_free_field(JsonField *field)
+{
+    free(field->key);
+    free(field->str);
+    for (int i = 0; i < field->nb_items; ++i) {
+        free(field->items[i]);
+    }
+    free(field->items);
+}
+
+static const char *
+json_parse_value(const char *p, JsonField *field)
+{
+    if (*p == '"') {
+        field->type = JSON_STRING;
+        return json_parse_string(p, &field->str);
+    }
+    if (*p == '[') {
+        field->type = JSON_ARRAY;
+        p = json_skip_ws(p + 1);
+        while (*p != ']') {
+            char *item;
+            if (!(p = json_parse_string(p, &item))) {
+                return NULL;
+            }
+            field->items = realloc(field->items,
+                                   sizeof(char *) * (field->nb_items + 1));
+            field->items[field->nb_items++] = item;
+
+            p = json_skip_ws(p);
+            if (*p == ',') {
+                p = json_skip_ws(p + 1);
+            }
+            else if (*p != ']') {
+                return NULL;
+            }
+        }
+        return p + 1;
+    }
+    if (strncmp(p, "true", 4) == 0 || strncmp(p, "false", 5) == 0) {
+        field->type = JSON_BOOL;
+        field->num = *p == 't';
+        return p + (*p == 't' ? 4 : 5);
+    }
+    if (strncmp(p, "null", 4) == 0) {
+        field->type = JSON_NULL;
+        return p + 4;
+    }
+
+    const char *end = json_scan_number(p);
+    if (!end) {
+        return NULL;
+    }
+
+    field->type = JSON_NUMBER;
+    field->num = strtod(p, NULL);
+    return isfinite(field->num) ? end : NULL;
+}
+
+int
+json_parse_object(const char *text, JsonObject *obj)
+{
+    memset(obj, 0, sizeof(JsonObject));
+
+    const char *p = json_skip_ws(text);
+    if (*p++ != '{') {
+        return -1;
+    }
+
+    p = json_skip_ws(p);
+    while (*p != '}') {
+        JsonField field = {};
+
+        if (!(p = json_parse_string(p, &field.key))) {
+            json_free_object(obj);
+            return -1;
+        }
+        p = json_skip_ws(p);
+        if (*p++ != ':') {
+            json_free_field(&field);
+            json_free_object(obj);
+            return -1;
+        }
+        p = json_skip_ws(p);
+        if (!(p = json_parse_value(p, &field))) {
+            json_free_field(&field);
+            json_free_object(obj);
+            return -1;
+        }
+
+        obj->fields = realloc(obj->fields,
+                              sizeof(JsonField) * (obj->nb_fields + 1));
+        obj->fields[obj->nb_fields++] = field;
+
+        p = json_skip_ws(p);
+        if (*p == ',') {
+            p = json_skip_ws(p + 1);
+        }
+        else if (*p != '}') {
+            json_free_object(obj);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void
+json_free_object(JsonObject *obj)
+{
+    for (int i = 0; i < obj->nb_fields; ++i) {
+        json_free_field(&obj->fields[i]);
+    }
+    free(obj->fields);
+    obj->fields = NULL;
+    obj->nb_fields = 0;
+}
+
+const JsonField *
+json_get(const JsonObject *obj, const char *key)
+{
+    for (int i = 0; i < obj->nb_fields; ++i) {
+        if (strcmp(obj->fields[i].key, key) == 0) {
+            return &obj->fields[i];
+        }
+    }
+    return NULL;
+}
+
+const char *
+json_get_string(const JsonObject *obj, const char *key)
+{
+    const JsonField *field = json_get(obj, key);
+    return field && field->type == JSON_STRING ? field->str : NULL;
+}
+
+int
+json_field_int64(const JsonField *field, int64_t *out)
+{
+    // 2^63 as a double, the bounds of int64_t are exact there
+    const double limit = 9223372036854775808.0;
+
+    if (field->type != JSON_NUMBER || !(field->num >= -limit)
+        || !(field->num < limit)) {
+        return -1;
+    }
+
+    int64_t value = (int64_t)field->num;
+    if ((double)value != field->num) {
+        return -1; // fractional
+    }
+    *out = value;
+    return 0;
+}
+
+int
+json_get_int64(const JsonObject *obj, const char *key, int64_t *out)
+{
+    const JsonField *field = json_get(obj, key);
+    return field ? json_field_int64(field, out) : -1;
+}
+
+void
+jw_init(JsonWriter *jw)
+{
+    memset(jw, 0, sizeof(JsonWriter));
+    jw->cap = 256;
+    jw->buf = malloc(jw->cap);
+    jw->buf[0] = '\0';
+}
+
+void
+jw_free(JsonWriter *jw)
+{
+    free(jw->buf);
+    jw->buf = NULL;
+}
+
+static void
+jw_printf(JsonWriter *jw, const char *fmt, ...)
+{
+    va_list args;
+
+    for (;;) {
+        va_start(args, fmt);
+        int n = vsnprintf(jw->buf + jw->len, jw->cap - jw->len, fmt, args);
+        va_end(args);
+
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n < jw->cap - jw->len) {
+            jw->len += n;
+            return;
+        }
+        jw->cap = (jw->cap + n) * 2;
+        jw->buf = realloc(jw->buf, jw->cap);
+    }
+}
+
+static void
+jw_escaped(JsonWriter *jw, const char *str)
+{
+    jw_printf(jw, "\"");
+    for (const char *c = str; *c; ++c) {
+        switch (*c) {
+        case '"':
+            jw_printf(jw, "\\\"");
+            break;
+        case '\\':
+            jw_printf(jw, "\\\\");
+            break;
+        case '\n':
+            jw_printf(jw, "\\n");
+            break;
+        default:
+            if ((unsigned char)*c < 0x20) {
+                jw_printf(jw, "\\u%04x", *c);
+            }
+            else {
+                jw_printf(jw, "%c", *c);
+            }
+        }
+    }
+    jw_printf(jw, "\"");
+}
+
+static void
+jw_key(JsonWriter *jw, const char *key)
+{
+    if (jw->count[jw->depth]++ > 0) {
+        jw_printf(jw, ",");
+    }
+    if (key) {
+        jw_escaped(jw, key);
+        jw_printf(jw, ":");
+    }
+}
+
+void
+jw_object_begin(JsonWriter *jw, const char *key)
+{
+    jw_key(jw, key);
+    jw_printf(jw, "{");
+    if (jw->depth < JSON_WRITER_MAX_DEPTH - 1) {
+        jw->count[++jw->depth] = 0;
+    }
+}
+
+void
+jw_object_end(JsonWriter *jw)
+{
+    jw_printf(jw, "}");
+    if (jw->depth > 0) {
+        jw->depth--;
+    }
+}
+
+void
+jw_array_begin(JsonWriter *jw, const char *key)
+{
+    jw_key(jw, key);
+    jw_printf(jw, "[");
+    if (jw->depth < JSON_WRITER_MAX_DEPTH - 1) {
+        jw->count[++jw->depth] = 0;
+    }
+}
+
+void
+jw_array_end(JsonWriter *jw)
+{
+    jw_printf(jw, "]");
+    if (jw->depth > 0) {
+        jw->depth--;
+    }
+}
+
+void
+jw_string(JsonWriter *jw, const char *key, const char *value)
+{
+    jw_key(jw, key);
+    jw_escaped(jw, value);
+}
+
+void
+jw_int(JsonWriter *jw, const char *key, int64_t value)
+{
+    jw_key(jw, key);
+    jw_printf(jw, "%lld", (long long)value);
+}
+
+void
+jw_double(JsonWriter *jw, const char *key, double value)
+{
+    jw_key(jw, key);
+    jw_printf(jw, "%.3f", value);
+}
+
+void
+jw_bool(JsonWriter *jw, const char *key, int value)
+{
+    jw_key(jw, key);
+    jw_printf(jw, value ? "true" : "false");
+}
@@ -0,0 +1,97 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef JSON_H
+#define JSON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Just enough JSON for the control protocol: a flat object whose values
+ * are strings, numbers, booleans, null or arrays of strings. */
+
+typedef enum JsonType {
+    JSON_NULL,
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_BOOL,
+    JSON_ARRAY,
+} JsonType;
+
+typedef struct JsonField {
+    char *key;
+    JsonType type;
+    char *str;
+    double num;
+    char **items;
+    int nb_items;
+} JsonField;
+
+typedef struct JsonObject {
+    JsonField *fields;
+    int nb_fields;
+} JsonObject;
+
+int
+json_parse_object(const char *text, JsonObject *obj);
+
+void
+json_free_object(JsonObject *obj);
+
+const JsonField *
+json_get(const JsonObject *obj, const char *key);
+
+const char *
+json_get_string(const JsonObject *obj, const char *key);
+
+/* Integral numbers that fit int64_t, anything else is an error. */
+int
+json_field_int64(const JsonField *field, int64_t *out);
+
+int
+json_get_int64(const JsonObject *obj, const char *key, int64_t *out);
+
+#define JSON_WRITER_MAX_DEPTH 16
+
+typedef struct JsonWriter {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int depth;
+    int count[JSON_WRITER_MAX_DEPTH];
+} JsonWriter;
+
+void
+jw_init(JsonWriter *jw);
+
+void
+jw_free(JsonWriter *jw);
+
+void
+jw_object_begin(JsonWriter *jw, const char *key);
+
+void
+jw_object_end(JsonWriter *jw);
+
+void
+jw_array_begin(JsonWriter *jw, const char *key);
+
+void
+jw_array_end(JsonWriter *jw);
+
+void
+jw_string(JsonWriter *jw, const char *key, const char *value);
+
+void
+jw_int(JsonWriter *jw, const char *key, int64_t value);
+
+void
+jw_double(JsonWriter *jw, const char *key, double value);
+
+void
+jw_bool(JsonWriter *jw, const char *key, int value);
+
+#endif
@@ -0,0 +1,163 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "latency.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define METRICS_WINDOW 1000000
+
+static int
+hist_log2(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (int)index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+static int
+hist_bucket_index(int64_t value)
+{
+    if (value < HIST_SUB_BUCKETS) {
+        return value < 0 ? 0 : (int)value;
+    }
+
+    int exponent = hist_log2((uint64_t)value);
+    if (exponent > HIST_MAX_EXPONENT) {
+        return HIST_BUCKETS - 1;
+    }
+
+    int sub = (int)(value >> (exponent - HIST_SUB_BITS))
+              & (HIST_SUB_BUCKETS - 1);
+    return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+int64_t
+hist_bucket_upper(int index)
+{
+    if (index < HIST_SUB_BUCKETS) {
+        return index;
+    }
+
+    int exponent = index / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    int64_t sub = index % HIST_SUB_BUCKETS;
+    int shift = exponent - HIST_SUB_BITS;
+    return ((HIST_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void
+hist_record(Histogram *hist, int64_t value)
+{
+    if (value < 0) {
+        value = 0;
+    }
+
+    atomic_fetch_add_explicit(&hist->counts[hist_bucket_index(value)], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum, value, memory_order_relaxed);
+
+    int64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+    while (value > max
+           && !atomic_compare_exchange_weak_explicit(&hist->max, &max, value,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed)) {
+    }
+}
+
+int64_t
+hist_quantile(const Histogram *hist, double q)
+{
+    uint64_t total = atomic_load_explicit(&hist->total, memory_order_relaxed);
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(q * (double)total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+        if (seen >= rank) {
+            int64_t max = atomic_load_explicit(&hist->max,
+                                               memory_order_relaxed);
+            int64_t upper = hist_bucket_upper(i);
+            return upper < max ? upper : max;
+        }
+    }
+    return atomic_load_explicit(&hist->max, memory_order_relaxed);
+}
+
+const char *
+latency_stage_name(LatencyStage stage)
+{
+    switch (stage) {
+    case LATENCY_STAGE_QUEUE:
+        return "queue";
+    case LATENCY_STAGE_ENCODE:
+        return "encode";
+    case LATENCY_STAGE_WRITE:
+        return "write";
+    case LATENCY_STAGE_TOTAL:
+        return "total";
+    default:
+        return "unknown";
+    }
+}
+
+OutputMetrics *
+new_output_metrics()
+{
+    OutputMetrics *metrics = malloc(sizeof(OutputMetrics));
+    memset(metrics, 0, sizeof(OutputMetrics));
+    return metrics;
+}
+
+int
+free_output_metrics(OutputMetrics **metrics)
+{
+    free(*metrics);
+    *metrics = NULL;
+    return 0;
+}
+
+void
+om_packet_written(OutputMetrics *metrics, int64_t size, int is_video,
+                  int64_t now)
+{
+    atomic_fetch_add_explicit(&metrics->bytes, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics->packets, 1, memory_order_relaxed);
+
+    if (metrics->window_start == 0) {
+        metrics->window_start = now;
+    }
+
+    metrics->window_bytes += size;
+    metrics->window_frames += is_video;
+
+    int64_t elapsed = now - metrics->window_start;
+    if (elapsed >= METRICS_WINDOW) {
+        atomic_store(&metrics->fps_milli,
+                     metrics->window_frames * 1000 * 1000000 / elapsed);
+        atomic_store(&metrics->bitrate,
+                     metrics->window_bytes * 8 * 1000000 / elapsed);
+        metrics->window_start = now;
+        metrics->window_frames = 0;
+        metrics->window_bytes = 0;
+    }
+}
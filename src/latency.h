@@ -0,0 +1,82 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Log-linear histogram of microsecond values: values below 2^HIST_SUB_BITS
+ * get exact buckets, larger ones HIST_SUB_BUCKETS buckets per power of two,
+ * so every recorded value is known to within ~3%. Recording is a single
+ * relaxed atomic add and never blocks. */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXPONENT 40
+#define HIST_BUCKETS                                                         \
+    ((HIST_MAX_EXPONENT - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS)
+
+typedef struct Histogram {
+    _Atomic(uint64_t) counts[HIST_BUCKETS];
+    _Atomic(uint64_t) total;
+    _Atomic(int64_t) sum;
+    _Atomic(int64_t) max;
+} Histogram;
+
+void
+hist_record(Histogram *hist, int64_t value);
+
+int64_t
+hist_bucket_upper(int index);
+
+int64_t
+hist_quantile(const Histogram *hist, double q);
+
+typedef enum LatencyStage {
+    LATENCY_STAGE_QUEUE,  // conversion end -> encoder submit
+    LATENCY_STAGE_ENCODE, // encoder submit -> packet out
+    LATENCY_STAGE_WRITE,  // packet out -> muxer write complete
+    LATENCY_STAGE_TOTAL,  // capture -> muxer write complete
+    LATENCY_STAGE_COUNT,
+} LatencyStage;
+
+/* Travels with a video frame as AVFrame.opaque_ref, and with its packet
+ * as AVPacket.opaque_ref once the encoder copies it over. */
+typedef struct FrameTiming {
+    int64_t capture_ts;
+    int64_t converted_ts;
+    int64_t submit_ts;
+} FrameTiming;
+
+/* Written from the output's own work queue only, read by the metrics
+ * endpoint. */
+typedef struct OutputMetrics {
+    Histogram stages[LATENCY_STAGE_COUNT];
+    _Atomic(int64_t) bytes;
+    _Atomic(int64_t) packets;
+
+    _Atomic(int64_t) fps_milli;
+    _Atomic(int64_t) bitrate;
+    int64_t window_start;
+    int64_t window_frames;
+    int64_t window_bytes;
+} OutputMetrics;
+
+const char *
+latency_stage_name(LatencyStage stage);
+
+OutputMetrics *
+new_output_metrics();
+
+int
+free_output_metrics(OutputMetrics **metrics);
+
+void
+om_packet_written(OutputMetrics *metrics, int64_t size, int is_video,
+                  int64_t now);
+
+#endif
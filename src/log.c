@@ -0,0 +1,447 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "log.h"
+
+#include <libavutil/log.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "json.h"
+#include "thread.h"
+
+#define LOG_RING_SIZE 1024 // power of two
+#define LOG_MAX_MESSAGE 1024
+#define LOG_SITES 256
+#define LOG_BURST 10
+#define LOG_WINDOW 1000000 // usec
+#define LOG_POLL_MS 10
+
+typedef struct LogSlot {
+    _Atomic(uint64_t) seq;
+    LogLevel level;
+    int64_t ts;
+    char text[LOG_MAX_MESSAGE];
+} LogSlot;
+
+/* Rate limit state of one call site. Sites whose format strings hash to a
+ * taken entry are not limited. */
+typedef struct LogSite {
+    const char *_Atomic fmt;
+    _Atomic(int64_t) window; // start of the current window
+    _Atomic(int) count;      // messages in the current window
+    _Atomic(int) suppressed;
+    _Atomic(int) level;
+} LogSite;
+
+/* Bounded MPMC queue after Dmitry Vyukov with a single consumer: a slot
+ * is free for position p when seq == p and holds a message when
+ * seq == p + 1. */
+static LogSlot log_ring[LOG_RING_SIZE];
+static _Atomic(uint64_t) log_head;
+static uint64_t log_tail;
+
+static LogSite log_sites[LOG_SITES];
+
+static _Atomic(int) log_running;
+static _Atomic(int) log_level = LOG_LEVEL_INFO;
+static _Atomic(int) log_format = LOG_FORMAT_TEXT;
+static _Atomic(int64_t) log_nb_dropped;
+static Thread log_thread;
+
+static const char *const log_level_names[] = {
+    "error",
+    "warning",
+    "info",
+    "debug",
+};
+
+static const char *const log_level_tags[] = {
+    "ERROR",
+    "WARNING",
+    "INFO",
+    "DEBUG",
+};
+
+static const char *const log_format_names[] = {
+    "text",
+    "logfmt",
+    "json",
+};
+
+void
+log_set_level(LogLevel level)
+{
+    atomic_store(&log_level, level);
+}
+
+void
+log_set_format(LogFormat format)
+{
+    atomic_store(&log_format, format);
+}
+
+int
+log_level_from_name(const char *name, LogLevel *level)
+{
+    for (int i = 0; i <= LOG_LEVEL_DEBUG; ++i) {
+        if (strcmp(name, log_level_names[i]) == 0) {
+            *level = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int
+log_format_from_name(const char *name, LogFormat *format)
+{
+    for (int i = 0; i <= LOG_FORMAT_JSON; ++i) {
+        if (strcmp(name, log_format_names[i]) == 0) {
+            *format = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int64_t
+log_dropped()
+{
+    return atomic_load(&log_nb_dropped);
+}
+
+static void
+log_timestamp(char *buf, size_t size, int64_t ts)
+{
+    time_t seconds = (time_t)(ts / 1000000);
+    struct tm tm;
+#ifdef _WIN32
+    gmtime_s(&tm, &seconds);
+#else
+    gmtime_r(&seconds, &tm);
+#endif
+    snprintf(buf, size, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+             tm.tm_min, tm.tm_sec, (int)(ts / 1000 % 1000));
+}
+
+static void
+log_output(LogLevel level, int64_t ts, const char *text)
+{
+    char time_str[32];
+
+    switch (atomic_load_explicit(&log_format, memory_order_relaxed)) {
+    case LOG_FORMAT_LOGFMT:
+        log_timestamp(time_str, sizeof time_str, ts);
+        printf("ts=%s level=%s msg=\"", time_str, log_level_names[level]);
+        for (const char *c = text; *c; ++c) {
+            if (*c == '"' || *c == '\\') {
+                putchar('\\');
+                putchar(*c);
+            }
+            else if (*c == '\n') {
+                fputs("\\n", stdout);
+            }
+            else {
+                putchar(*c);
+            }
+        }
+        fputs("\"\n", stdout);
+        break;
+    case LOG_FORMAT_JSON: {
+        JsonWriter jw;
+        log_timestamp(time_str, sizeof time_str, ts);
+        jw_init(&jw);
+        jw_object_begin(&jw, NULL);
+        jw_string(&jw, "ts", time_str);
+        jw_string(&jw, "level", log_level_names[level]);
+        jw_string(&jw, "msg", text);
+        jw_object_end(&jw);
+        puts(jw.buf);
+        jw_free(&jw);
+        break;
+    }
+    default:
+        printf("[%s] %s\n", log_level_tags[level], text);
+    }
+}
+
+static LogSite *
+log_site(const char *fmt)
+{
+    LogSite *site = &log_sites[((uintptr_t)fmt >> 3) % LOG_SITES];
+    const char *expected = NULL;
+
+    if (atomic_load_explicit(&site->fmt, memory_order_relaxed) == fmt
+        || atomic_compare_exchange_strong(&site->fmt, &expected, fmt)) {
+        return site;
+    }
+    return expected == fmt ? site : NULL;
+}
+
+/* Returns 0 if the message is over the limit of its site. A message that
+ * opens a new window gets the count suppressed in the last one. */
+static int
+log_admit(LogSite *site, LogLevel level, int64_t now, int *suppressed)
+{
+    int64_t window = atomic_load(&site->window);
+
+    if (now - window >= LOG_WINDOW
+        && atomic_compare_exchange_strong(&site->window, &window, now)) {
+        atomic_store(&site->count, 1);
+        *suppressed = atomic_exchange(&site->suppressed, 0);
+        return 1;
+    }
+
+    if (atomic_fetch_add(&site->count, 1) < LOG_BURST) {
+        return 1;
+    }
+    atomic_store(&site->level, level);
+    atomic_fetch_add(&site->suppressed, 1);
+    return 0;
+}
+
+static LogSlot *
+log_claim()
+{
+    uint64_t pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+
+    for (;;) {
+        LogSlot *slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                        &log_head, &pos, pos + 1, memory_order_relaxed,
+                        memory_order_relaxed)) {
+                return slot;
+            }
+        }
+        else if (diff < 0) {
+            return NULL; // full
+        }
+        else {
+            pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+    }
+}
+
+static void
+log_vwrite(LogLevel level, const char *site_key, const char *fmt,
+           va_list args)
+{
+    if ((int)level > atomic_load_explicit(&log_level, memory_order_relaxed)) {
+        return;
+    }
+
+    int64_t now = get_current_ts_usec();
+    int suppressed = 0;
+    LogSite *site = log_site(site_key);
+    if (site && !log_admit(site, level, now, &suppressed)) {
+        return;
+    }
+
+    char local[LOG_MAX_MESSAGE];
+    LogSlot *slot = NULL;
+    char *text = local;
+
+    if (atomic_load_explicit(&log_running, memory_order_acquire)) {
+        slot = log_claim();
+        if (!slot) {
+            atomic_fetch_add(&log_nb_dropped, 1);
+            return;
+        }
+        text = slot->text;
+    }
+
+    int len = vsnprintf(text, LOG_MAX_MESSAGE, fmt, args);
+    if (len < 0) {
+        len = 0;
+        text[0] = '\0';
+    }
+    else if (len >= LOG_MAX_MESSAGE) {
+        len = LOG_MAX_MESSAGE - 1;
+    }
+    while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) {
+        text[--len] = '\0';
+    }
+    if (suppressed > 0) {
+        snprintf(text + len, LOG_MAX_MESSAGE - len,
+                 " (%d similar messages suppressed)", suppressed);
+    }
+
+    if (!slot) {
+        log_output(level, now, text);
+        fflush(stdout);
+        return;
+    }
+
+    slot->level = level;
+    slot->ts = now;
+    uint64_t pos = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+void
+log_write(LogLevel level, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    log_vwrite(level, fmt, fmt, args);
+    va_end(args);
+}
+
+static void
+log_write_site(LogLevel level, const char *site_key, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    log_vwrite(level, site_key, fmt, args);
+    va_end(args);
+}
+
+static void
+log_av_callback(void *avcl, int level, const char *fmt, va_list vl)
+{
+    if (level > av_log_get_level()) {
+        return;
+    }
+
+    LogLevel log_lvl = level <= AV_LOG_ERROR     ? LOG_LEVEL_ERROR
+                       : level <= AV_LOG_WARNING ? LOG_LEVEL_WARNING
+                       : level <= AV_LOG_INFO    ? LOG_LEVEL_INFO
+                                                 : LOG_LEVEL_DEBUG;
+    if ((int)log_lvl
+        > atomic_load_explicit(&log_level, memory_order_relaxed)) {
+        return;
+    }
+
+    char line[LOG_MAX_MESSAGE];
+    int print_prefix = 1;
+    av_log_format_line2(avcl, level, fmt, vl, line, sizeof line,
+                        &print_prefix);
+    log_write_site(log_lvl, fmt, "%s", line);
+}
+
+/* Writes out every complete slot, returns the number written. */
+static int
+log_drain()
+{
+    int n = 0;
+
+    for (;;) {
+        LogSlot *slot = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire)
+            != log_tail + 1) {
+            break;
+        }
+
+        log_output(slot->level, slot->ts, slot->text);
+        atomic_store_explicit(&slot->seq, log_tail + LOG_RING_SIZE,
+                              memory_order_release);
+        log_tail++;
+        n++;
+    }
+    return n;
+}
+
+/* Reports suppressed messages of sites that went quiet, nothing else
+ * would. `all` reports every site, for the end. */
+static int
+log_flush_sites(int64_t now, int all)
+{
+    int n = 0;
+
+    for (int i = 0; i < LOG_SITES; ++i) {
+        LogSite *site = &log_sites[i];
+        const char *fmt = atomic_load_explicit(&site->fmt,
+                                               memory_order_relaxed);
+        if (!fmt || atomic_load(&site->suppressed) == 0
+            || (!all && now - atomic_load(&site->window) < 2 * LOG_WINDOW)) {
+            continue;
+        }
+
+        int suppressed = atomic_exchange(&site->suppressed, 0);
+        if (suppressed > 0) {
+            char text[200];
+            snprintf(text, sizeof text,
+                     "%d more messages like \"%.*s\" suppressed", suppressed,
+                     (int)strcspn(fmt, "\r\n"), fmt);
+            log_output(atomic_load(&site->level), now, text);
+            n++;
+        }
+    }
+    return n;
+}
+
+static void
+log_run(void *arg)
+{
+    (void)arg;
+    int64_t sites_at = 0;
+
+    while (atomic_load(&log_running)) {
+        int n = log_drain();
+
+        int64_t now = get_current_ts_usec();
+        if (now >= sites_at) {
+            n += log_flush_sites(now, 0);
+            sites_at = now + LOG_WINDOW;
+        }
+
+        if (n > 0) {
+            fflush(stdout);
+        }
+        else {
+            thread_sleep_ms(LOG_POLL_MS);
+        }
+    }
+}
+
+int
+log_start()
+{
+    if (atomic_load(&log_running)) {
+        return 0;
+    }
+
+    for (uint64_t i = 0; i < LOG_RING_SIZE; ++i) {
+        atomic_store_explicit(&log_ring[i].seq, i, memory_order_relaxed);
+    }
+    atomic_store(&log_head, 0);
+    log_tail = 0;
+
+    atomic_store_explicit(&log_running, 1, memory_order_release);
+    if (thread_create(&log_thread, log_run, NULL) < 0) {
+        atomic_store(&log_running, 0);
+        return -1;
+    }
+
+    av_log_set_callback(log_av_callback);
+    return 0;
+}
+
+void
+log_stop()
+{
+    if (!atomic_exchange(&log_running, 0)) {
+        return;
+    }
+
+    av_log_set_callback(av_log_default_callback);
+    thread_join(log_thread);
+
+    // messages that claimed a slot just before the stop
+    log_drain();
+    log_flush_sites(get_current_ts_usec(), 1);
+    fflush(stdout);
+}
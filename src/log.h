@@ -0,0 +1,73 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+/* Asynchronous logging. A caller formats its message into a slot of a
+ * bounded lock-free ring and returns, a background thread writes the slots
+ * to stdout. Nothing ever waits: when the ring is full the message is
+ * dropped and counted.
+ *
+ *   LOG_ERROR("%s: %s", config->name, ctx->error_str);
+ *
+ * Every call site, told apart by its format string, may log LOG_BURST
+ * messages per second. Further ones are suppressed and their number is
+ * reported with the next message of that site or once it goes quiet.
+ * Trailing newlines are stripped. Before log_start and after log_stop
+ * messages are written directly. */
+
+typedef enum LogLevel {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+} LogLevel;
+
+typedef enum LogFormat {
+    LOG_FORMAT_TEXT,   // [INFO] message
+    LOG_FORMAT_LOGFMT, // ts=... level=info msg="message"
+    LOG_FORMAT_JSON,   // {"ts":"...","level":"info","msg":"message"}
+} LogFormat;
+
+#define LOG_ERROR(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARNING(...) log_write(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_INFO(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/* Starts the writer thread and routes av_log through it. */
+int
+log_start();
+
+/* Writes out what is queued and stops the writer thread. */
+void
+log_stop();
+
+void
+log_set_level(LogLevel level);
+
+void
+log_set_format(LogFormat format);
+
+int
+log_level_from_name(const char *name, LogLevel *level);
+
+int
+log_format_from_name(const char *name, LogFormat *format);
+
+/* Messages lost to a full ring so far. */
+int64_t
+log_dropped();
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((format(printf, 2, 3)))
+#endif
+void
+log_write(LogLevel level, const char *fmt, ...);
+
+#endif
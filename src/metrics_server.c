@@ -0,0 +1,465 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "metrics_server.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+#define METRICS_POLL_TIMEOUT 200
+#define METRICS_MAX_REQUEST 4096
+
+// histogram bucket bounds exported to prometheus, in microseconds
+static const int64_t metrics_buckets[] = {
+    500,    1000,   2000,   5000,    10000,   20000,  50000,
+    100000, 200000, 500000, 1000000, 2000000, 5000000,
+};
+
+static const double metrics_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+MetricsServerCtx *
+new_metrics_server_ctx(DaemonCtx *daemon)
+{
+    MetricsServerCtx *ctx = malloc(sizeof(MetricsServerCtx));
+    memset(ctx, 0, sizeof(MetricsServerCtx));
+    ctx->daemon = daemon;
+    ctx->listen_fd = -1;
+    ctx->error_str = malloc(AV_ERROR_MAX_STRING_SIZE + 100);
+    return ctx;
+}
+
+int
+free_metrics_server_ctx(MetricsServerCtx **ctx)
+{
+    metrics_server_stop(*ctx);
+    free((*ctx)->error_str);
+    free(*ctx);
+    *ctx = NULL;
+    return 0;
+}
+
+#ifdef _WIN32
+
+int
+metrics_server_start(MetricsServerCtx *ctx, int port)
+{
+    sprintf(ctx->error_str, "%s",
+            "metrics endpoint is not supported on windows");
+    return -1;
+}
+
+void
+metrics_server_stop(MetricsServerCtx *ctx)
+{
+}
+
+#else
+
+typedef struct MetricsBuf {
+    char *data;
+    size_t len;
+    size_t cap;
+} MetricsBuf;
+
+static void
+mb_printf(MetricsBuf *buf, const char *fmt, ...)
+{
+    va_list args;
+
+    for (;;) {
+        va_start(args, fmt);
+        int n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+        va_end(args);
+
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n < buf->cap - buf->len) {
+            buf->len += n;
+            return;
+        }
+        buf->cap = (buf->cap + n) * 2;
+        buf->data = realloc(buf->data, buf->cap);
+    }
+}
+
+// label values may contain '"', '\' and newlines
+static void
+metrics_escape(char *dst, size_t size, const char *src)
+{
+    size_t n = 0;
+    for (; *src && n + 2 < size; ++src) {
+        if (*src == '"' || *src == '\\') {
+            dst[n++] = '\\';
+            dst[n++] = *src;
+        }
+        else if (*src == '\n') {
+            dst[n++] = '\\';
+            dst[n++] = 'n';
+        }
+        else {
+            dst[n++] = *src;
+        }
+    }
+    dst[n] = '\0';
+}
+
+static void
+metrics_write_histogram(MetricsBuf *buf, const char *name,
+                        const char *labels, const Histogram *hist)
+{
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    int nb_bounds = sizeof metrics_buckets / sizeof metrics_buckets[0];
+
+    for (int i = 0; i < nb_bounds; ++i) {
+        while (bucket < HIST_BUCKETS
+               && hist_bucket_upper(bucket) <= metrics_buckets[i]) {
+            cumulative += atomic_load_explicit(&hist->counts[bucket],
+                                               memory_order_relaxed);
+            bucket++;
+        }
+        mb_printf(buf, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels,
+                  (double)metrics_buckets[i] / AV_TIME_BASE,
+                  (unsigned long long)cumulative);
+    }
+
+    uint64_t total = atomic_load_explicit(&hist->total, memory_order_relaxed);
+    mb_printf(buf, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels,
+              (unsigned long long)total);
+    mb_printf(buf, "%s_sum{%s} %.6f\n", name, labels,
+              (double)atomic_load(&hist->sum) / AV_TIME_BASE);
+    mb_printf(buf, "%s_count{%s} %llu\n", name, labels,
+              (unsigned long long)total);
+}
+
+static void
+metrics_write_quantiles(MetricsBuf *buf, const char *labels,
+                        const Histogram *hist)
+{
+    int nb_quantiles = sizeof metrics_quantiles / sizeof metrics_quantiles[0];
+
+    for (int i = 0; i < nb_quantiles; ++i) {
+        mb_printf(buf,
+                  "ndi_streamer_stage_latency_quantile_seconds{%s,"
+                  "quantile=\"%g\"} %.6f\n",
+                  labels, metrics_quantiles[i],
+                  (double)hist_quantile(hist, metrics_quantiles[i])
+                          / AV_TIME_BASE);
+    }
+    mb_printf(buf, "ndi_streamer_stage_latency_max_seconds{%s} %.6f\n",
+              labels, (double)atomic_load(&hist->max) / AV_TIME_BASE);
+}
+
+static void
+metrics_write_input(MetricsBuf *buf, const char *labels, const char *kind,
+                    int64_t frames, int64_t dropped, int queued)
+{
+    mb_printf(buf, "ndi_streamer_input_frames_total{%s,kind=\"%s\"} %lld\n",
+              labels, kind, (long long)frames);
+    mb_printf(buf,
+              "ndi_streamer_input_dropped_frames_total{%s,kind=\"%s\"} "
+              "%lld\n",
+              labels, kind, (long long)dropped);
+    mb_printf(buf, "ndi_streamer_input_queue_depth{%s,kind=\"%s\"} %d\n",
+              labels, kind, queued);
+}
+
+static void
+metrics_write_audio(MetricsBuf *buf, const char *labels,
+                    const AudioLevels *levels)
+{
+    for (int c = 0; c < levels->nb_channels; ++c) {
+        char channel_labels[340];
+        snprintf(channel_labels, sizeof channel_labels, "%s,channel=\"%d\"",
+                 labels, c + 1);
+
+        mb_printf(buf, "ndi_streamer_audio_peak_dbfs{%s} %.1f\n",
+                  channel_labels, levels->peak[c]);
+        mb_printf(buf, "ndi_streamer_audio_rms_dbfs{%s} %.1f\n",
+                  channel_labels, levels->rms[c]);
+        mb_printf(buf, "ndi_streamer_audio_momentary_lufs{%s} %.1f\n",
+                  channel_labels, levels->momentary[c]);
+    }
+}
+
+static void
+metrics_write_pipeline(MetricsBuf *buf, PipelineCtx *pipeline)
+{
+    char name[200];
+    char labels[300];
+
+    metrics_escape(name, sizeof name, pipeline->config.name);
+    snprintf(labels, sizeof labels, "pipeline=\"%s\"", name);
+
+    mutex_lock(&pipeline->lock);
+    AVRational frame_rate = pipeline->frame_rate;
+    InputStats stats = pipeline->input_stats;
+    int has_stats = pipeline->has_input_stats;
+    AudioLevels levels = pipeline->audio_levels;
+    int has_levels = pipeline->has_audio_levels;
+    mutex_unlock(&pipeline->lock);
+
+    mb_printf(buf, "ndi_streamer_source_fps{%s} %.3f\n", labels,
+              frame_rate.den ? av_q2d(frame_rate) : 0);
+    mb_printf(buf, "ndi_streamer_capture_dropped_frames_total{%s} %lld\n",
+              labels, (long long)atomic_load(&pipeline->dropped_frames));
+    mb_printf(buf, "ndi_streamer_capture_skipped_frames_total{%s} %lld\n",
+              labels, (long long)atomic_load(&pipeline->skipped_frames));
+    mb_printf(buf, "ndi_streamer_static_frames_total{%s} %lld\n", labels,
+              (long long)atomic_load(&pipeline->static_frames));
+    mb_printf(buf, "ndi_streamer_partial_frames_total{%s} %lld\n", labels,
+              (long long)atomic_load(&pipeline->partial_frames));
+    mb_printf(buf, "ndi_streamer_repeated_frames_total{%s} %lld\n", labels,
+              (long long)atomic_load(&pipeline->cfr_repeated));
+    mb_printf(buf, "ndi_streamer_cfr_dropped_frames_total{%s} %lld\n",
+              labels, (long long)atomic_load(&pipeline->cfr_dropped));
+    mb_printf(buf, "ndi_streamer_cfr_cut_audio_frames_total{%s} %lld\n",
+              labels, (long long)atomic_load(&pipeline->cfr_audio_cut));
+    mb_printf(buf, "ndi_streamer_audio_silent_frames_total{%s} %lld\n",
+              labels, (long long)atomic_load(&pipeline->silent_frames));
+    mb_printf(buf, "ndi_streamer_dump_dropped_frames_total{%s} %lld\n",
+              labels, (long long)atomic_load(&pipeline->dump_dropped));
+    mb_printf(buf, "ndi_streamer_convert_queue_depth{%s} %d\n", labels,
+              wq_depth(pipeline->convert_queue));
+
+    if (has_stats) {
+        metrics_write_input(buf, labels, "video", stats.video_frames,
+                            stats.video_dropped, stats.video_queued);
+        metrics_write_input(buf, labels, "audio", stats.audio_frames,
+                            stats.audio_dropped, stats.audio_queued);
+    }
+    if (has_levels) {
+        metrics_write_audio(buf, labels, &levels);
+    }
+    metrics_write_histogram(buf, "ndi_streamer_convert_latency_seconds",
+                            labels, &pipeline->convert_latency);
+
+    for (int i = 0; i < pipeline->nb_outputs; ++i) {
+        PipelineOutput *out = &pipeline->outputs[i];
+        OutputMetrics *m = out->metrics;
+        char out_labels[340];
+
+        snprintf(out_labels, sizeof out_labels, "%s,output=\"%d\"", labels, i);
+
+        mb_printf(buf, "ndi_streamer_output_up{%s} %d\n", out_labels,
+                  atomic_load(&out->state) == PIPELINE_OUTPUT_ACTIVE);
+        mb_printf(buf, "ndi_streamer_output_frames_total{%s} %lld\n",
+                  out_labels, (long long)atomic_load(&out->frames));
+        mb_printf(buf, "ndi_streamer_output_dropped_frames_total{%s} %lld\n",
+                  out_labels, (long long)atomic_load(&out->dropped_frames));
+        mb_printf(buf, "ndi_streamer_output_errors_total{%s} %lld\n",
+                  out_labels, (long long)atomic_load(&out->errors));
+        mb_printf(buf, "ndi_streamer_output_bytes_total{%s} %lld\n",
+                  out_labels, (long long)atomic_load(&m->bytes));
+        mb_printf(buf, "ndi_streamer_output_fps{%s} %.3f\n", out_labels,
+                  (double)atomic_load(&m->fps_milli) / 1000);
+        mb_printf(buf, "ndi_streamer_output_bitrate_bps{%s} %lld\n",
+                  out_labels, (long long)atomic_load(&m->bitrate));
+        mb_printf(buf, "ndi_streamer_output_queue_depth{%s} %d\n",
+                  out_labels, wq_depth(out->queue));
+
+        for (int s = 0; s < LATENCY_STAGE_COUNT; ++s) {
+            char stage_labels[380];
+            snprintf(stage_labels, sizeof stage_labels, "%s,stage=\"%s\"",
+                     out_labels, latency_stage_name(s));
+            metrics_write_histogram(buf, "ndi_streamer_stage_latency_seconds",
+                                    stage_labels, &m->stages[s]);
+            metrics_write_quantiles(buf, stage_labels, &m->stages[s]);
+        }
+    }
+}
+
+static void
+metrics_render(MetricsServerCtx *ctx, MetricsBuf *buf)
+{
+    DaemonCtx *daemon = ctx->daemon;
+
+    mb_printf(buf, "# TYPE ndi_streamer_convert_latency_seconds histogram\n"
+                   "# TYPE ndi_streamer_stage_latency_seconds histogram\n"
+                   "# TYPE ndi_streamer_stage_latency_quantile_seconds gauge\n"
+                   "# TYPE ndi_streamer_stage_latency_max_seconds gauge\n"
+                   "# TYPE ndi_streamer_capture_dropped_frames_total counter\n"
+                   "# TYPE ndi_streamer_capture_skipped_frames_total counter\n"
+                   "# TYPE ndi_streamer_static_frames_total counter\n"
+                   "# TYPE ndi_streamer_partial_frames_total counter\n"
+                   "# TYPE ndi_streamer_repeated_frames_total counter\n"
+                   "# TYPE ndi_streamer_cfr_dropped_frames_total counter\n"
+                   "# TYPE ndi_streamer_cfr_cut_audio_frames_total counter\n"
+                   "# TYPE ndi_streamer_audio_silent_frames_total counter\n"
+                   "# TYPE ndi_streamer_dump_dropped_frames_total counter\n"
+                   "# TYPE ndi_streamer_input_frames_total counter\n"
+                   "# TYPE ndi_streamer_input_dropped_frames_total counter\n"
+                   "# TYPE ndi_streamer_output_frames_total counter\n"
+                   "# TYPE ndi_streamer_output_dropped_frames_total counter\n"
+                   "# TYPE ndi_streamer_output_errors_total counter\n"
+                   "# TYPE ndi_streamer_output_bytes_total counter\n");
+
+    daemon_lock(daemon);
+    for (int i = 0; i < daemon->nb_pipelines; ++i) {
+        metrics_write_pipeline(buf, daemon->pipelines[i]);
+    }
+    daemon_unlock(daemon);
+}
+
+static int
+metrics_send(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void
+metrics_serve_client(MetricsServerCtx *ctx, int fd)
+{
+    char request[METRICS_MAX_REQUEST];
+    size_t len = 0;
+
+    // scrapers send tiny requests, do not let a stuck one hold the thread
+    struct timeval timeout = { .tv_sec = 1 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+    while (len < sizeof request - 1) {
+        ssize_t n = recv(fd, request + len, sizeof request - 1 - len, 0);
+        if (n <= 0) {
+            return;
+        }
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+
+    MetricsBuf body = { .cap = 16384 };
+    body.data = malloc(body.cap);
+    body.data[0] = '\0';
+
+    const char *status = "200 OK";
+    if (strncmp(request, "GET /metrics ", 13) == 0
+        || strncmp(request, "GET /metrics?", 13) == 0) {
+        metrics_render(ctx, &body);
+    }
+    else {
+        status = "404 Not Found";
+        mb_printf(&body, "not found\n");
+    }
+
+    char header[200];
+    int header_len = snprintf(header, sizeof header,
+                              "HTTP/1.1 %s\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Connection: close\r\n\r\n",
+                              status, body.len);
+
+    if (metrics_send(fd, header, header_len) == 0) {
+        metrics_send(fd, body.data, body.len);
+    }
+    free(body.data);
+}
+
+static void
+metrics_run(void *arg)
+{
+    MetricsServerCtx *ctx = arg;
+    struct pollfd pfd = { .fd = ctx->listen_fd, .events = POLLIN };
+
+    while (atomic_load(&ctx->running)) {
+        if (poll(&pfd, 1, METRICS_POLL_TIMEOUT) <= 0) {
+            continue;
+        }
+
+        int fd = accept(ctx->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        metrics_serve_client(ctx, fd);
+        close(fd);
+    }
+}
+
+int
+metrics_server_start(MetricsServerCtx *ctx, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        sprintf(ctx->error_str, "could not create metrics socket (%s)",
+                strerror(errno));
+        return -1;
+    }
+
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons((uint16_t)port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0
+        || listen(fd, 16) < 0) {
+        sprintf(ctx->error_str, "could not listen on 127.0.0.1:%d (%s)", port,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    ctx->listen_fd = fd;
+
+    atomic_store(&ctx->running, 1);
+    if (thread_create(&ctx->thread, metrics_run, ctx) < 0) {
+        atomic_store(&ctx->running, 0);
+        sprintf(ctx->error_str, "%s", "unable to start metrics thread");
+        return -1;
+    }
+    return 0;
+}
+
+void
+metrics_server_stop(MetricsServerCtx *ctx)
+{
+    if (atomic_exchange(&ctx->running, 0)) {
+        thread_join(ctx->thread);
+    }
+
+    if (ctx->listen_fd >= 0) {
+        close(ctx->listen_fd);
+        ctx->listen_fd = -1;
+    }
+}
+
+#endif
@@ -0,0 +1,40 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include <stdatomic.h>
+
+#include "daemon.h"
+#include "thread.h"
+
+/* Serves GET /metrics in the Prometheus text format on 127.0.0.1: per
+ * stage latency histograms, frame, drop and error counters, fps, bitrate
+ * and queue depths of every pipeline output. */
+typedef struct MetricsServerCtx {
+    DaemonCtx *daemon;
+    int listen_fd;
+
+    Thread thread;
+    _Atomic(int) running;
+
+    char *error_str;
+} MetricsServerCtx;
+
+MetricsServerCtx *
+new_metrics_server_ctx(DaemonCtx *daemon);
+
+int
+free_metrics_server_ctx(MetricsServerCtx **ctx);
+
+int
+metrics_server_start(MetricsServerCtx *ctx, int port);
+
+void
+metrics_server_stop(MetricsServerCtx *ctx);
+
+#endif
@@ -7,21 +7,59 @@
 #include <stdio.h>
 
 #include <Processing.NDI.Lib.h>
-
-#include "ffmpeg_output.h"
+#include <libavutil/cpu.h>
+#include <libavutil/pixdesc.h>
+
+#include "audio_router.h"
+#include "common.h"
+#include "compositor.h"
+#include "config.h"
+#include "control.h"
+#include "daemon.h"
 #include "frame_converter.h"
+#include "input.h"
+#include "log.h"
+#include "metrics_server.h"
+#include "pipeline.h"
+#include "shm_output.h"
+#include "thread.h"
+#include "trace.h"
 #include "util.h"
 
 #define NDI_RECV_TIMEOUT 2000
 
 typedef struct AppOptions {
     char ndi_input_addr[255];
+    char input[512];
+    int input_fast;
+    int input_loop;
+    char composite[512];
+    char audio_tracks[256];
+    char dump_raw[512];
+    StaticFrameMode static_frames;
+    int static_keepalive_ms;
+    int dirty_regions;
+    DeinterlaceMode deinterlace;
+    int cfr;
+    int silence_gate_db;
     char output[255];
     char output_format[30];
     char video_encoder[40];
     char audio_encoder[40];
     int video_bitrate;
     int audio_bitrate;
+    int replay_seconds;
+    int64_t replay_max_bytes;
+    char replay_dir[255];
+    int shm_slots;
+    char shm_pix_fmt[30];
+    char config_path[255];
+    char control_socket[255];
+    int metrics_port;
+    char trace_path[255];
+    int trace_seconds;
+    char log_level[16];
+    char log_format[16];
 } AppOptions;
 
 AppOptions
@@ -30,169 +68,293 @@ read_params(int argc, char **argv);
 void
 find_ndi_source(NDIlib_source_t *source);
 
+int
+check_encoders(const PipelineConfig *config);
+
+int
+run_pipelines(const PipelineConfig *configs, int nb_configs, int workers,
+              const char *control_socket, int metrics_port);
+
+int
+run_shm_output(InputCtx *input, FrameConverterCtx *fc_ctx,
+               const AppOptions *opts);
+
+void
+check_trace(int finish);
+
+void
+apply_log_options(const char *level, const char *format);
+
 int
 main(int argc, char **argv)
 {
     AppOptions opts = read_params(argc, argv);
+    int ret;
+
+    apply_log_options(opts.log_level, opts.log_format);
+    if (log_start() == 0) {
+        atexit(log_stop);
+    }
+
+    if (strlen(opts.trace_path)
+        && trace_start(opts.trace_path, opts.trace_seconds) < 0) {
+        LOG_ERROR("%s", trace_error());
+        return 1;
+    }
+
+    if (strlen(opts.config_path)) {
+        DaemonConfig *daemon_config = new_daemon_config();
+        if (config_load(daemon_config, opts.config_path) < 0) {
+            LOG_ERROR("%s", daemon_config->error_str);
+            free_daemon_config(&daemon_config);
+            return 1;
+        }
+
+        // the command line wins over the config file
+        apply_log_options(
+                strlen(opts.log_level) ? "" : daemon_config->log_level,
+                strlen(opts.log_format) ? "" : daemon_config->log_format);
 
-    if (!avcodec_find_encoder_by_name(opts.video_encoder)) {
-        printf("[ERROR] codec '%s' not found\n", opts.video_encoder);
+        for (int i = 0; i < daemon_config->nb_pipelines; ++i) {
+            if (check_encoders(&daemon_config->pipelines[i]) < 0) {
+                free_daemon_config(&daemon_config);
+                return 1;
+            }
+        }
+
+        if (!NDIlib_initialize()) {
+            LOG_ERROR("Unable to initialize NDI library");
+            free_daemon_config(&daemon_config);
+            return 1;
+        }
+
+        int workers = daemon_config->workers > 0 ? daemon_config->workers
+                                                 : av_cpu_count();
+        const char *control_socket = strlen(opts.control_socket)
+                                             ? opts.control_socket
+                                             : daemon_config->control_socket;
+        int metrics_port = opts.metrics_port > 0 ? opts.metrics_port
+                                                 : daemon_config->metrics_port;
+        ret = run_pipelines(daemon_config->pipelines,
+                            daemon_config->nb_pipelines, workers,
+                            control_socket, metrics_port);
+
+        free_daemon_config(&daemon_config);
+        NDIlib_destroy();
+        return ret;
+    }
+
+    PipelineConfig config;
+    pipeline_config_defaults(&config);
+    snprintf(config.video_encoder, sizeof config.video_encoder, "%s",
+             opts.video_encoder);
+    snprintf(config.audio_encoder, sizeof config.audio_encoder, "%s",
+             opts.audio_encoder);
+    config.video_bitrate = opts.video_bitrate;
+    config.audio_bitrate = opts.audio_bitrate;
+    config.replay_seconds = opts.replay_seconds;
+    config.replay_max_bytes = opts.replay_max_bytes;
+    snprintf(config.replay_dir, sizeof config.replay_dir, "%s",
+             opts.replay_dir);
+    snprintf(config.input_url, sizeof config.input_url, "%s", opts.input);
+    config.input_fast = opts.input_fast;
+    config.input_loop = opts.input_loop;
+    snprintf(config.composite, sizeof config.composite, "%s",
+             opts.composite);
+    snprintf(config.dump_raw, sizeof config.dump_raw, "%s", opts.dump_raw);
+    snprintf(config.audio_tracks, sizeof config.audio_tracks, "%s",
+             opts.audio_tracks);
+    config.static_frames = opts.static_frames;
+    config.static_keepalive_ms = opts.static_keepalive_ms;
+    config.dirty_regions = opts.dirty_regions;
+    config.deinterlace = opts.deinterlace;
+    config.cfr = opts.cfr;
+    config.silence_gate_db = opts.silence_gate_db;
+
+    if (strcmp(opts.output_format, "shm") == 0 && strlen(opts.dump_raw)) {
+        LOG_ERROR("--dump_raw is not supported with shm output");
+        return 1;
+    }
+    if (strcmp(opts.output_format, "shm") == 0
+        && (opts.static_frames != STATIC_FRAMES_OFF || opts.dirty_regions)) {
+        LOG_ERROR("--static_frames and --dirty_regions are not supported "
+                  "with shm output");
+        return 1;
+    }
+    if (strcmp(opts.output_format, "shm") == 0 && strlen(opts.audio_tracks)) {
+        LOG_ERROR("--audio_tracks is not supported with shm output");
         return 1;
     }
-    if (!avcodec_find_encoder_by_name(opts.audio_encoder)) {
-        printf("[ERROR] codec '%s' not found\n", opts.audio_encoder);
+    if (strcmp(opts.output_format, "shm") == 0 && opts.cfr) {
+        LOG_ERROR("--cfr is not supported with shm output");
         return 1;
     }
+    if (strcmp(opts.output_format, "shm") == 0 && opts.silence_gate_db) {
+        LOG_ERROR("--silence_gate_db is not supported with shm output");
+        return 1;
+    }
+    if (opts.cfr && opts.input_fast) {
+        LOG_ERROR("--cfr needs a realtime input, not --input_fast");
+        return 1;
+    }
+
+    if (strcmp(opts.output_format, "shm") != 0
+        && check_encoders(&config) < 0) {
+        return 1;
+    }
+
+    // a file input needs no NDI runtime
+    int use_ndi = !strlen(opts.input);
 
-    if (!NDIlib_initialize()) {
-        printf("[ERROR] Unable to initialize NDI library");
+    if (use_ndi && !NDIlib_initialize()) {
+        LOG_ERROR("Unable to initialize NDI library");
         return 1;
     }
 
     NDIlib_source_t source = {};
 
-    if (!strlen(opts.ndi_input_addr)) {
+    // the composite input connects to its own sources
+    int use_source = use_ndi && !strlen(opts.composite);
+
+    if (use_source && !strlen(opts.ndi_input_addr)) {
         find_ndi_source(&source);
     }
-    else {
+    else if (use_source) {
         source.p_url_address = opts.ndi_input_addr;
     }
 
-    NDIlib_recv_create_v3_t recv_create_desc = {
-        .source_to_connect_to = source,
-        .p_ndi_recv_name = "ndi-streamer",
-        .bandwidth = NDIlib_recv_bandwidth_lowest,
-    };
+    if (strcmp(opts.output_format, "shm") == 0) {
+        InputCtx *input = new_input_ctx();
+        input->realtime = !opts.input_fast;
+        input->loop = opts.input_loop;
 
-    NDIlib_recv_instance_t recv = NDIlib_recv_create_v3(&recv_create_desc);
+        if (use_ndi && strlen(opts.composite)) {
+            ret = input_open(input, "composite", opts.composite, NULL);
+        }
+        else if (use_ndi) {
+            ret = input_open(input, "ndi", source.p_url_address,
+                             source.p_ndi_name);
+        }
+        else {
+            ret = input_open(input, input_backend_for(opts.input),
+                             opts.input, NULL);
+        }
 
-    if (!recv) {
-        printf("[ERROR] Unable to create NDI receiver instance");
-        return 1;
+        if (ret < 0) {
+            LOG_ERROR("%s", input->error_str);
+            free_input_ctx(&input);
+            return 1;
+        }
+
+        FrameConverterCtx *fc_ctx = new_frame_converter_ctx();
+        fc_ctx->deinterlace = opts.deinterlace;
+        ret = run_shm_output(input, fc_ctx, &opts);
+        free_frame_converter_ctx(&fc_ctx);
+        free_input_ctx(&input);
+        if (use_ndi) {
+            NDIlib_destroy();
+        }
+        return ret;
     }
 
-    char ffmpeg_output_format[30];
-    if (strcmp(opts.output_format, "rtmp") == 0) {
-        snprintf(ffmpeg_output_format, sizeof ffmpeg_output_format, "flv");
+    if (source.p_ndi_name) {
+        snprintf(config.source_name, sizeof config.source_name, "%s",
+                 source.p_ndi_name);
     }
-    else {
-        snprintf(ffmpeg_output_format, sizeof ffmpeg_output_format, "%s",
-                 opts.output_format);
+    if (source.p_url_address) {
+        snprintf(config.source_url, sizeof config.source_url, "%s",
+                 source.p_url_address);
     }
 
-    FFmpegOutputCtx *fa_ctx = new_ffmpeg_output_ctx();
-    FrameConverterCtx *fc_ctx = new_frame_converter_ctx();
+    snprintf(config.outputs[0].format, sizeof config.outputs[0].format, "%s",
+             opts.output_format);
+    snprintf(config.outputs[0].url, sizeof config.outputs[0].url, "%s",
+             opts.output);
+    config.nb_outputs = 1;
 
-    AVDictionary *output_options = NULL;
-    av_dict_set(&output_options, "max_interleave_delta", "0", 0);
+    ret = run_pipelines(&config, 1, 1, opts.control_socket, opts.metrics_port);
 
-    if (strcmp(opts.output_format, "rtsp") == 0) {
-        av_dict_set(&output_options, "rtsp_transport", "tcp", 0);
+    if (use_ndi) {
+        NDIlib_destroy();
     }
+    return ret;
+}
 
-    eh_init();
-    while (eh_alive()) {
-        if (fa_ctx->output != NULL) {
-            ffmpeg_output_close(fa_ctx);
-#ifdef _WIN32
-            Sleep(2000);
-#else
-            sleep(2);
-#endif
-        }
+int
+check_encoders(const PipelineConfig *config)
+{
+    if (!avcodec_find_encoder_by_name(config->video_encoder)) {
+        LOG_ERROR("codec '%s' not found", config->video_encoder);
+        return -1;
+    }
+    if (!avcodec_find_encoder_by_name(config->audio_encoder)) {
+        LOG_ERROR("codec '%s' not found", config->audio_encoder);
+        return -1;
+    }
+    return 0;
+}
 
-        if (ffmpeg_output_init(fa_ctx, ffmpeg_output_format, opts.output) < 0) {
-            printf("[ERROR] %s", fa_ctx->error_str);
+int
+run_pipelines(const PipelineConfig *configs, int nb_configs, int workers,
+              const char *control_socket, int metrics_port)
+{
+    DaemonCtx *daemon = new_daemon_ctx(workers);
+    ControlServerCtx *control = NULL;
+    MetricsServerCtx *metrics = NULL;
+    int started = 0;
+
+    for (int i = 0; i < nb_configs; ++i) {
+        if (daemon_add_pipeline(daemon, &configs[i]) < 0) {
+            LOG_ERROR("%s", daemon->error_str);
             continue;
         }
+        started++;
+    }
 
-        NDIlib_video_frame_v2_t v_frame;
-        NDIlib_audio_frame_v2_t a_frame;
-
-        int width = 0, height = 0;
-        AVRational frame_rate = {};
-
-        while (eh_alive()) {
-            if (NDIlib_recv_capture_v2(recv, &v_frame, NULL, NULL,
-                                       NDI_RECV_TIMEOUT)
-                == NDIlib_frame_type_video) {
-                width = v_frame.xres;
-                height = v_frame.yres;
-                frame_rate.num = v_frame.frame_rate_N;
-                frame_rate.den = v_frame.frame_rate_D;
-                NDIlib_recv_free_video_v2(recv, &v_frame);
-                break;
-            }
+    if (strlen(control_socket)) {
+        control = new_control_server_ctx(daemon);
+        if (control_server_start(control, control_socket) < 0) {
+            LOG_ERROR("%s", control->error_str);
+            free_control_server_ctx(&control);
         }
-
-        ffmpeg_output_close_codecs(fa_ctx);
-
-        ffmpeg_output_setup_video(fa_ctx, opts.video_encoder, width, height,
-                                  frame_rate, opts.video_bitrate);
-        ffmpeg_output_setup_audio(fa_ctx, opts.audio_encoder,
-                                  opts.audio_bitrate);
-
-        if (ffmpeg_output_write_header(fa_ctx, &output_options) < 0) {
-            printf("[ERROR] %s", fa_ctx->error_str);
-            continue;
+        else {
+            LOG_INFO("control socket listening on %s", control_socket);
         }
+    }
 
-        fc_reset(fc_ctx);
-
-        while (eh_alive()) {
-            NDIlib_frame_type_e res = NDIlib_recv_capture_v2(
-                    recv, &v_frame, &a_frame, NULL, NDI_RECV_TIMEOUT);
-
-            if (res == NDIlib_frame_type_video) {
-                if (width != v_frame.xres || height != v_frame.yres) {
-                    break;
-                }
-
-                AVFrame *frame = fc_ndi_video_frame_to_avframe(
-                        fc_ctx, fa_ctx->video_codec_ctx, &v_frame);
-
-                NDIlib_recv_free_video_v2(recv, &v_frame);
-
-                if (ffmpeg_output_send_video_frame(fa_ctx, frame) < 0) {
-                    printf("[ERROR] %s", fa_ctx->error_str);
-                    break;
-                }
-            }
-            else if (res == NDIlib_frame_type_audio) {
-                AVFrame *frame = fc_ndi_audio_frame_to_avframe(
-                        fc_ctx, fa_ctx->audio_codec_ctx, &a_frame);
-
-                if (!frame) {
-                    continue;
-                }
-                if (ffmpeg_output_send_audio_frame(fa_ctx, frame) < 0) {
-                    printf("[ERROR] %s", fa_ctx->error_str);
-                    break;
-                }
-                NDIlib_recv_free_audio_v2(recv, &a_frame);
-
-                while ((frame = fc_ndi_audio_frame_to_avframe(
-                                fc_ctx, fa_ctx->audio_codec_ctx, NULL))
-                       != NULL) {
-                    if (ffmpeg_output_send_audio_frame(fa_ctx, frame) < 0) {
-                        printf("[ERROR] %s", fa_ctx->error_str);
-                        break;
-                    }
-                }
-            }
+    if (metrics_port > 0) {
+        metrics = new_metrics_server_ctx(daemon);
+        if (metrics_server_start(metrics, metrics_port) < 0) {
+            LOG_ERROR("%s", metrics->error_str);
+            free_metrics_server_ctx(&metrics);
+        }
+        else {
+            LOG_INFO("metrics available at http://127.0.0.1:%d/metrics",
+                     metrics_port);
         }
     }
 
-    av_dict_free(&output_options);
+    eh_init();
+    while (eh_alive() && (control || daemon_pipeline_count(daemon) > 0)) {
+        thread_sleep_ms(200);
 
-    free_ffmpeg_output_ctx(&fa_ctx);
+        if (eh_take_replay_request()) {
+            daemon_export_replay(daemon);
+        }
+        daemon_remove_finished(daemon);
+        check_trace(0);
+    }
+    check_trace(1);
 
-    free_frame_converter_ctx(&fc_ctx);
+    int ret = started > 0 || control ? 0 : 1;
 
-    NDIlib_recv_destroy(recv);
+    if (control)
+        free_control_server_ctx(&control);
+    if (metrics)
+        free_metrics_server_ctx(&metrics);
+    free_daemon_ctx(&daemon);
 
-    NDIlib_destroy();
-    return 0;
+    return ret;
 }
 
 void
@@ -264,14 +426,158 @@ find_ndi_source(NDIlib_source_t *source)
     }
 }
 
+int
+run_shm_output(InputCtx *input, FrameConverterCtx *fc_ctx,
+               const AppOptions *opts)
+{
+    enum AVPixelFormat pix_fmt = av_get_pix_fmt(opts->shm_pix_fmt);
+    if (pix_fmt == AV_PIX_FMT_NONE) {
+        LOG_ERROR("pixel format '%s' not found", opts->shm_pix_fmt);
+        return 1;
+    }
+
+    ShmOutputCtx *shm_ctx = new_shm_output_ctx();
+    if (shm_output_init(shm_ctx, opts->output, opts->shm_slots) < 0) {
+        LOG_ERROR("%s", shm_ctx->error_str);
+        free_shm_output_ctx(&shm_ctx);
+        return 1;
+    }
+
+    int ret = 0;
+    NDIlib_video_frame_v2_t v_frame;
+
+    eh_init();
+    while (eh_alive()) {
+        shm_output_poll_clients(shm_ctx);
+
+        InputFrameType type = input_capture(input, &v_frame, NULL,
+                                            NDI_RECV_TIMEOUT);
+        if (type == INPUT_FRAME_END || type == INPUT_FRAME_ERROR) {
+            if (type == INPUT_FRAME_ERROR) {
+                LOG_ERROR("%s", input->error_str);
+                ret = 1;
+            }
+            break;
+        }
+        if (type != INPUT_FRAME_VIDEO) {
+            continue;
+        }
+
+        int64_t capture_ts = get_current_ts_usec();
+        uint8_t *data[4];
+        int linesize[4];
+
+        if (shm_output_setup(shm_ctx, v_frame.xres, v_frame.yres, pix_fmt) < 0
+            || shm_output_begin_frame(shm_ctx, data, linesize) < 0) {
+            LOG_ERROR("%s", shm_ctx->error_str);
+            input_free_video(input, &v_frame);
+            ret = 1;
+            break;
+        }
+
+        if (fc_ndi_video_frame_scale(fc_ctx, &v_frame, data, linesize,
+                                     pix_fmt, v_frame.xres, v_frame.yres)
+            < 0) {
+            LOG_ERROR("%s", fc_ctx->error_str);
+        }
+
+        shm_output_end_frame(shm_ctx, v_frame.timestamp, capture_ts);
+        input_free_video(input, &v_frame);
+        check_trace(0);
+    }
+    check_trace(1);
+
+    free_shm_output_ctx(&shm_ctx);
+    return ret;
+}
+
+void
+check_trace(int finish)
+{
+    if (!trace_active() || (!finish && !trace_expired())) {
+        return;
+    }
+    if (trace_stop() < 0) {
+        LOG_ERROR("%s", trace_error());
+    }
+    else {
+        LOG_INFO("trace written");
+    }
+}
+
+void
+apply_log_options(const char *level, const char *format)
+{
+    LogLevel log_level;
+    LogFormat log_format;
+
+    // both are validated when read
+    if (strlen(level) && log_level_from_name(level, &log_level) == 0) {
+        log_set_level(log_level);
+    }
+    if (strlen(format) && log_format_from_name(format, &log_format) == 0) {
+        log_set_format(log_format);
+    }
+}
+
 const ProgramOption options[] = {
     { "n,ndi_input",
       "NDI Source address (optional, by default found ndi sources are "
       "suggested)",
       0 },
-    { "f,output_format", "rtsp, rtmp (optional, by default 'rtsp')", 0 },
+    { "i,input",
+      "media file or url played instead of an NDI source, through the same "
+      "conversion and encoding (optional)",
+      0 },
+    { "input_fast",
+      "read --input as fast as the outputs take it instead of in real time",
+      1 },
+    { "input_loop", "start --input over when it ends", 1 },
+    { "composite",
+      "\"LAYOUT WxH N/D [lost_ms=N] [restore_ms=N] | SOURCE | SOURCE ...\": "
+      "use several NDI sources laid out as grid or pip, cut between with "
+      "switch or with failover to the first one that is up (optional)",
+      0 },
+    { "audio_tracks",
+      "\"TRACK | TRACK ...\", each TRACK a comma separated list of source "
+      "channels from 1: N, a range N-M, a mix G*N+N or a downmix "
+      "N-M>LAYOUT; every TRACK is encoded as its own audio stream "
+      "(optional, by default every channel in one track)",
+      0 },
+    { "dump_raw",
+      "write every captured frame uncompressed to FILE, --input plays it "
+      "back (optional)",
+      0 },
+    { "static_frames",
+      "off, repeat or drop: skip the conversion of unchanged frames and "
+      "repeat the last one, or also leave them out of the stream where "
+      "timestamps allow (optional, by default 'off')",
+      0 },
+    { "static_keepalive_ms",
+      "with --static_frames drop, send a static picture at least every N ms "
+      "(optional, by default '1000')",
+      0 },
+    { "dirty_regions",
+      "convert only the rows of a frame that changed and pass the changed "
+      "areas to the encoder as regions of interest",
+      1 },
+    { "cfr",
+      "send video at the source frame rate: repeat the last frame for "
+      "frames the source misses and drop frames that come too early",
+      1 },
+    { "silence_gate_db",
+      "send audio that stays below N dBFS for 400 ms as silence and turn on "
+      "DTX for libopus (optional, by default '0' - disabled)",
+      0 },
+    { "deinterlace",
+      "off, bob, blend or adaptive: deinterlace interleaved NDI frames, "
+      "single fields are always line doubled (optional, by default 'off')",
+      0 },
+    { "f,output_format", "rtsp, rtmp, shm (optional, by default 'rtsp')", 0 },
     { "o,output",
-      "output url (optional, by default 'rtsp://127.0.0.1:8554/live.sdp')", 0 },
+      "output url or shm socket path (optional, by default "
+      "'rtsp://127.0.0.1:8554/live.sdp' or '/tmp/ndi-streamer.sock' for shm)",
+      0 },
     { "v,video_codec", "ffmpeg video encoder (optional, by default 'libvpx')",
       0 },
     { "a,audio_codec", "ffmpeg audio encoder (optional, by default 'libopus')",
@@ -279,6 +585,39 @@ const ProgramOption options[] = {
     { "h,help", "show help", 1 },
     { "video_bitrate", "video bitrate (optional, by default '30000000')", 0 },
     { "audio_bitrate", "audio bitrate (optional, by default '320000')", 0 },
+    { "replay_seconds",
+      "keep the last N seconds of encoded packets in memory, SIGUSR1 saves "
+      "them to replay_dir (optional, by default '0' - disabled)",
+      0 },
+    { "replay_max_bytes",
+      "replay buffer memory cap in bytes (optional, by default '536870912')",
+      0 },
+    { "replay_dir",
+      "directory for saved replay clips (optional, by default '.')", 0 },
+    { "config",
+      "daemon mode: run every pipeline from the config file, other options "
+      "are ignored",
+      0 },
+    { "control_socket",
+      "unix socket accepting json commands to add, remove and retune "
+      "pipelines at runtime (optional)",
+      0 },
+    { "metrics_port",
+      "serve prometheus metrics on http://127.0.0.1:PORT/metrics (optional)",
+      0 },
+    { "trace",
+      "write chrome trace-event json with per-frame spans to the file "
+      "(optional)",
+      0 },
+    { "trace_seconds",
+      "stop tracing after N seconds (optional, by default on exit)", 0 },
+    { "log_level",
+      "error, warning, info or debug (optional, by default 'info')", 0 },
+    { "log_format",
+      "text, logfmt or json (optional, by default 'text')", 0 },
+    { "shm_slots", "shm output ring size (optional, by default '4')", 0 },
+    { "shm_pix_fmt",
+      "shm output pixel format (optional, by default 'yuv420p')", 0 },
     { NULL, NULL, 0 },
 };
 
@@ -298,6 +637,13 @@ read_params(int argc, char **argv)
     sprintf(res.output, "rtsp://127.0.0.1:8554/live.sdp");
     res.video_bitrate = 30000000;
     res.audio_bitrate = 320000;
+    res.replay_seconds = 0;
+    res.replay_max_bytes = 512 * 1024 * 1024;
+    sprintf(res.replay_dir, ".");
+    res.shm_slots = 4;
+    res.static_keepalive_ms = 1000;
+    sprintf(res.shm_pix_fmt, "yuv420p");
+    int output_set = 0;
 
     for (; (c = op_parse(argc, argv, op_ctx, &opt)) != -1;) {
         switch (c) {
@@ -306,15 +652,20 @@ read_params(int argc, char **argv)
                      optarg);
             break;
         case 'f':
-            if (strcmp(optarg, "rtsp") != 0 && strcmp(optarg, "rtmp") != 0) {
+            if (strcmp(optarg, "rtsp") != 0 && strcmp(optarg, "rtmp") != 0
+                && strcmp(optarg, "shm") != 0) {
                 printf("output \"%s\" is not supported\n", optarg);
                 op_free(&op_ctx);
                 exit(0);
             }
             snprintf(res.output_format, sizeof res.output_format, "%s", optarg);
             break;
+        case 'i':
+            snprintf(res.input, sizeof res.input, "%s", optarg);
+            break;
         case 'o':
             snprintf(res.output, sizeof res.output, "%s", optarg);
+            output_set = 1;
             break;
         case 'v':
             snprintf(res.video_encoder, sizeof res.video_encoder, "%s", optarg);
@@ -330,7 +681,84 @@ read_params(int argc, char **argv)
             if (opt == NULL) {
                 break;
             }
-            if (strcmp(opt->name, "video_bitrate") == 0) {
+            if (strcmp(opt->name, "input_fast") == 0) {
+                res.input_fast = 1;
+            }
+            else if (strcmp(opt->name, "input_loop") == 0) {
+                res.input_loop = 1;
+            }
+            else if (strcmp(opt->name, "composite") == 0) {
+                CompositeSpec spec;
+                char reason[200];
+                if (comp_parse(&spec, optarg, reason, sizeof reason) < 0) {
+                    printf("%s\n", reason);
+                    op_free(&op_ctx);
+                    exit(0);
+                }
+                snprintf(res.composite, sizeof res.composite, "%s", optarg);
+            }
+            else if (strcmp(opt->name, "audio_tracks") == 0) {
+                AudioRoute route;
+                char reason[200];
+                if (ar_parse(&route, optarg, reason, sizeof reason) < 0) {
+                    printf("%s\n", reason);
+                    op_free(&op_ctx);
+                    exit(0);
+                }
+                snprintf(res.audio_tracks, sizeof res.audio_tracks, "%s",
+                         optarg);
+            }
+            else if (strcmp(opt->name, "dump_raw") == 0) {
+                snprintf(res.dump_raw, sizeof res.dump_raw, "%s", optarg);
+            }
+            else if (strcmp(opt->name, "static_frames") == 0) {
+                if (pipeline_static_mode_from_name(optarg, &res.static_frames)
+                    < 0) {
+                    printf("static frames mode \"%s\" is not supported\n",
+                           optarg);
+                    op_free(&op_ctx);
+                    exit(0);
+                }
+            }
+            else if (strcmp(opt->name, "static_keepalive_ms") == 0) {
+                long si = strtol(optarg, &end, 10);
+                if (end == optarg || si < 0) {
+                    printf("couldn't convert \"%s\" to number\n", optarg);
+                    op_free(&op_ctx);
+                    exit(0);
+                }
+                else {
+                    res.static_keepalive_ms = (int)si;
+                }
+            }
+            else if (strcmp(opt->name, "dirty_regions") == 0) {
+                res.dirty_regions = 1;
+            }
+            else if (strcmp(opt->name, "cfr") == 0) {
+                res.cfr = 1;
+            }
+            else if (strcmp(opt->name, "silence_gate_db") == 0) {
+                long si = strtol(optarg, &end, 10);
+                if (end == optarg || si > 0 || si < AUDIO_METER_FLOOR) {
+                    printf("silence gate \"%s\" is not a level from %d to "
+                           "0 dBFS\n",
+                           optarg, (int)AUDIO_METER_FLOOR);
+                    op_free(&op_ctx);
+                    exit(0);
+                }
+                else {
+                    res.silence_gate_db = (int)si;
+                }
+            }
+            else if (strcmp(opt->name, "deinterlace") == 0) {
+                if (di_mode_from_name(optarg, &res.deinterlace) < 0) {
+                    printf("deinterlace mode \"%s\" is not supported\n",
+                           optarg);
+                    op_free(&op_ctx);
+                    exit(0);
+                }
+            }
+            else if (strcmp(opt->name, "video_bitrate") == 0) {
                 long si = strtol(optarg, &end, 10);
                 if (end == optarg) {
                     printf("couldn't convert \"%s\" to number\n", optarg);
@@ -352,10 +780,105 @@ read_params(int argc, char **argv)
                     res.audio_bitrate = (int)si;
                 }
             }
+            else if (strcmp(opt->name, "replay_seconds") == 0) {
+                long si = strtol(optarg, &end, 10);
+                if (end == optarg) {
+                    printf("couldn't convert \"%s\" to number\n", optarg);
+                    op_free(&op_ctx);
+                    exit(0);
+                }
+                else {
+                    res.replay_seconds = (int)si;
+                }
+            }
+            else if (strcmp(opt->name, "replay_max_bytes") == 0) {
+                long long si = strtoll(optarg, &end, 10);
+                if (end == optarg) {
+                    printf("couldn't convert \"%s\" to number\n", optarg);
+                    op_free(&op_ctx);
+                    exit(0);
+                }
+                else {
+                    res.replay_max_bytes = (int64_t)si;
+                }
+            }
+            else if (strcmp(opt->name, "replay_dir") == 0) {
+                snprintf(res.replay_dir, sizeof res.replay_dir, "%s", optarg);
+            }
+            else if (strcmp(opt->name, "config") == 0) {
+                snprintf(res.config_path, sizeof res.config_path, "%s",
+                         optarg);
+            }
+            else if (strcmp(opt->name, "control_socket") == 0) {
+                snprintf(res.control_socket, sizeof res.control_socket, "%s",
+                         optarg);
+            }
+            else if (strcmp(opt->name, "metrics_port") == 0) {
+                long si = strtol(optarg, &end, 10);
+                if (end == optarg || si <= 0 || si > 65535) {
+                    printf("invalid port \"%s\"\n", optarg);
+                    op_free(&op_ctx);
+                    exit(0);
+                }
+                else {
+                    res.metrics_port = (int)si;
+                }
+            }
+            else if (strcmp(opt->name, "trace") == 0) {
+                snprintf(res.trace_path, sizeof res.trace_path, "%s", optarg);
+            }
+            else if (strcmp(opt->name, "trace_seconds") == 0) {
+                long si = strtol(optarg, &end, 10);
+                if (end == optarg) {
+                    printf("couldn't convert \"%s\" to number\n", optarg);
+                    op_free(&op_ctx);
+                    exit(0);
+                }
+                else {
+                    res.trace_seconds = (int)si;
+                }
+            }
+            else if (strcmp(opt->name, "log_level") == 0) {
+                LogLevel level;
+                if (log_level_from_name(optarg, &level) < 0) {
+                    printf("log level \"%s\" is not supported\n", optarg);
+                    op_free(&op_ctx);
+                    exit(0);
+                }
+                snprintf(res.log_level, sizeof res.log_level, "%s", optarg);
+            }
+            else if (strcmp(opt->name, "log_format") == 0) {
+                LogFormat format;
+                if (log_format_from_name(optarg, &format) < 0) {
+                    printf("log format \"%s\" is not supported\n", optarg);
+                    op_free(&op_ctx);
+                    exit(0);
+                }
+                snprintf(res.log_format, sizeof res.log_format, "%s", optarg);
+            }
+            else if (strcmp(opt->name, "shm_slots") == 0) {
+                long si = strtol(optarg, &end, 10);
+                if (end == optarg) {
+                    printf("couldn't convert \"%s\" to number\n", optarg);
+                    op_free(&op_ctx);
+                    exit(0);
+                }
+                else {
+                    res.shm_slots = (int)si;
+                }
+            }
+            else if (strcmp(opt->name, "shm_pix_fmt") == 0) {
+                snprintf(res.shm_pix_fmt, sizeof res.shm_pix_fmt, "%s",
+                         optarg);
+            }
             break;
         }
     }
     op_free(&op_ctx);
 
+    if (!output_set && strcmp(res.output_format, "shm") == 0) {
+        sprintf(res.output, "/tmp/ndi-streamer.sock");
+    }
+
     return res;
 }
@@ -0,0 +1,1503 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "pipeline.h"
+
+#include <libavutil/pixdesc.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "compositor.h"
+#include "log.h"
+#include "trace.h"
+
+#define PIPELINE_CAPTURE_TIMEOUT 500
+#define PIPELINE_RETRY_DELAY (2 * AV_TIME_BASE)
+#define PIPELINE_MAX_QUEUE_DEPTH 32
+#define PIPELINE_MAX_CONVERT_DEPTH 4
+#define PIPELINE_STATS_INTERVAL (AV_TIME_BASE / 4)
+// frames waiting in the receiver before capture skips to the newest one
+#define PIPELINE_MAX_INPUT_QUEUE 2
+// longest source gap a cfr pipeline fills with repeats, longer ones are
+// left as a gap and the frame grid starts over
+#define PIPELINE_CFR_MAX_GAP (5 * AV_TIME_BASE)
+// missing audio a cfr pipeline fills with silence while it repeats video
+#define PIPELINE_CFR_AUDIO_GAP (AV_TIME_BASE / 10)
+// audio a cfr pipeline lets run ahead of its capture time before cutting it,
+// frames only ever arrive late so this is small
+#define PIPELINE_CFR_AUDIO_LEAD (AV_TIME_BASE / 50)
+
+typedef struct OutputOpenJob {
+    PipelineOutput *out;
+    int width;
+    int height;
+    AVRational frame_rate;
+    enum AVPixelFormat pix_fmt;
+} OutputOpenJob;
+
+typedef struct ConvertVideoJob {
+    PipelineCtx *ctx;
+    NDIlib_video_frame_v2_t frame;
+    int64_t capture_ts;
+    int width;
+    int height;
+    enum AVPixelFormat pix_fmt;
+    int reset;
+    int repeat; // a cfr slot without a frame, `frame` has no picture
+} ConvertVideoJob;
+
+typedef struct OutputVideoJob {
+    PipelineOutput *out;
+    AVFrame *frame;
+} OutputVideoJob;
+
+typedef struct InputAudioRef {
+    InputCtx *input;
+    NDIlib_audio_frame_v2_t frame;
+    int owned; // p_data is av_malloc'd by the pipeline, not by the input
+    _Atomic(int) refs;
+} InputAudioRef;
+
+typedef struct OutputAudioJob {
+    PipelineOutput *out;
+    InputAudioRef *ref;
+} OutputAudioJob;
+
+typedef struct OutputConfigJob {
+    PipelineOutput *out;
+    OutputConfig config;
+} OutputConfigJob;
+
+typedef struct OutputReplayJob {
+    PipelineOutput *out;
+    int64_t from_ts; // wall clock range of the clip
+    int64_t to_ts;
+    ReplayClip *clip;
+} OutputReplayJob;
+
+// encoders that pick up a new AVCodecContext.bit_rate between frames,
+// everything else is reopened
+static const char *const reconfigurable_encoders[] = {
+    "libx264",
+    "h264_nvenc",
+    "hevc_nvenc",
+    "av1_nvenc",
+    NULL,
+};
+
+void
+pipeline_config_defaults(PipelineConfig *config)
+{
+    memset(config, 0, sizeof(PipelineConfig));
+    sprintf(config->name, "default");
+    sprintf(config->audio_encoder, "libopus");
+    sprintf(config->video_encoder, "libvpx");
+    config->video_bitrate = 30000000;
+    config->audio_bitrate = 320000;
+    config->replay_seconds = 0;
+    config->replay_max_bytes = 512 * 1024 * 1024;
+    sprintf(config->replay_dir, ".");
+    config->static_frames = STATIC_FRAMES_OFF;
+    config->static_keepalive_ms = 1000;
+}
+
+int
+pipeline_static_mode_from_name(const char *name, StaticFrameMode *mode)
+{
+    if (strcmp(name, "off") == 0) {
+        *mode = STATIC_FRAMES_OFF;
+    }
+    else if (strcmp(name, "repeat") == 0) {
+        *mode = STATIC_FRAMES_REPEAT;
+    }
+    else if (strcmp(name, "drop") == 0) {
+        *mode = STATIC_FRAMES_DROP;
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+int
+pipeline_config_validate(const PipelineConfig *config, char *error_str,
+                         size_t size)
+{
+    if (!strlen(config->source_url) && !strlen(config->source_name)
+        && !strlen(config->input_url) && !strlen(config->composite)) {
+        snprintf(error_str, size, "pipeline \"%s\" has no source",
+                 config->name);
+        return -1;
+    }
+    if (strlen(config->composite)) {
+        CompositeSpec spec;
+        char reason[200];
+        if (comp_parse(&spec, config->composite, reason, sizeof reason) < 0) {
+            snprintf(error_str, size, "pipeline \"%s\": %s", config->name,
+                     reason);
+            return -1;
+        }
+    }
+    if (strlen(config->audio_tracks)) {
+        AudioRoute route;
+        char reason[200];
+        if (ar_parse(&route, config->audio_tracks, reason, sizeof reason)
+            < 0) {
+            snprintf(error_str, size, "pipeline \"%s\": %s", config->name,
+                     reason);
+            return -1;
+        }
+    }
+    if (config->silence_gate_db > 0
+        || config->silence_gate_db < AUDIO_METER_FLOOR) {
+        snprintf(error_str, size,
+                 "pipeline \"%s\": silence_gate_db must be from %d to 0",
+                 config->name, (int)AUDIO_METER_FLOOR);
+        return -1;
+    }
+    if (config->cfr && strlen(config->input_url) && config->input_fast) {
+        snprintf(error_str, size,
+                 "pipeline \"%s\": cfr needs a realtime input, not "
+                 "input_fast",
+                 config->name);
+        return -1;
+    }
+    if (config->nb_outputs == 0) {
+        snprintf(error_str, size, "pipeline \"%s\" has no outputs",
+                 config->name);
+        return -1;
+    }
+    return 0;
+}
+
+static const char *
+pipeline_ffmpeg_format(const char *output_format)
+{
+    if (strcmp(output_format, "rtmp") == 0) {
+        return "flv";
+    }
+    return output_format;
+}
+
+static int
+pipeline_interrupt_cb(void *opaque)
+{
+    PipelineCtx *ctx = opaque;
+    return !atomic_load(&ctx->running);
+}
+
+PipelineCtx *
+new_pipeline_ctx(const PipelineConfig *config, WorkerPool *pool)
+{
+    PipelineCtx *ctx = malloc(sizeof(PipelineCtx));
+    memset(ctx, 0, sizeof(PipelineCtx));
+    ctx->config = *config;
+    ctx->pool = pool;
+    ctx->fc_ctx = new_frame_converter_ctx();
+    ctx->fc_ctx->trace_label = trace_intern(config->name);
+    ctx->fc_ctx->deinterlace = config->deinterlace;
+    ctx->input = new_input_ctx();
+    ctx->input->realtime = !config->input_fast;
+    ctx->input->loop = config->input_loop;
+    ctx->meter = new_audio_meter_ctx();
+    ctx->error_str = malloc(AV_ERROR_MAX_STRING_SIZE + 100);
+    ctx->nb_outputs = config->nb_outputs;
+    mutex_init(&ctx->lock);
+
+    if (strlen(config->audio_tracks)) {
+        ctx->audio_route = malloc(sizeof(AudioRoute));
+        if (ar_parse(ctx->audio_route, config->audio_tracks, ctx->error_str,
+                     AV_ERROR_MAX_STRING_SIZE + 100)
+            < 0) {
+            LOG_WARNING("%s: %s, one audio track", config->name,
+                        ctx->error_str);
+            free(ctx->audio_route);
+            ctx->audio_route = NULL;
+        }
+    }
+
+    // conversion feeds every output, it runs with the most urgent of them
+    WorkPriority convert_priority = WORK_PRIORITY_LOW;
+
+    for (int i = 0; i < ctx->nb_outputs; ++i) {
+        PipelineOutput *out = &ctx->outputs[i];
+        out->pipeline = ctx;
+        out->config = config->outputs[i];
+        out->fa_ctx = new_ffmpeg_output_ctx();
+        out->fa_ctx->interrupt_cb.callback = pipeline_interrupt_cb;
+        out->fa_ctx->interrupt_cb.opaque = ctx;
+        out->metrics = new_output_metrics();
+        out->fa_ctx->metrics = out->metrics;
+        out->fa_ctx->audio_dtx = config->silence_gate_db != 0;
+
+        char label[sizeof(config->name) + 16];
+        snprintf(label, sizeof label, "%s/%d", config->name, i);
+        out->fa_ctx->trace_label = trace_intern(label);
+        out->fc_ctx = new_frame_converter_ctx();
+        out->queue = new_work_queue(pool, out->config.priority);
+        atomic_store(&out->state, PIPELINE_OUTPUT_CLOSED);
+        atomic_store(&out->video_bitrate, config->video_bitrate);
+        atomic_store(&out->audio_bitrate, config->audio_bitrate);
+
+        if (out->config.priority < convert_priority) {
+            convert_priority = out->config.priority;
+        }
+    }
+
+    ctx->convert_queue = new_work_queue(pool, convert_priority);
+    ctx->replay_queue = new_work_queue(pool, WORK_PRIORITY_LOW);
+
+    if (config->static_frames != STATIC_FRAMES_OFF || config->dirty_regions) {
+        ctx->diff = new_frame_diff_ctx();
+    }
+    if (ctx->diff || config->cfr) {
+        ctx->static_frame = av_frame_alloc();
+    }
+
+    if (ctx->nb_outputs > 0 && config->replay_seconds > 0) {
+        ctx->outputs[0].fa_ctx->replay = new_replay_buffer_ctx(
+                config->replay_max_bytes,
+                (int64_t)config->replay_seconds * AV_TIME_BASE);
+    }
+
+    return ctx;
+}
+
+int
+free_pipeline_ctx(PipelineCtx **ctx)
+{
+    PipelineCtx *p = *ctx;
+
+    pipeline_stop(p);
+    free_work_queue(&p->convert_queue);
+    free_work_queue(&p->replay_queue);
+
+    for (int i = 0; i < p->nb_outputs; ++i) {
+        free_work_queue(&p->outputs[i].queue);
+        free_ffmpeg_output_ctx(&p->outputs[i].fa_ctx);
+        free_frame_converter_ctx(&p->outputs[i].fc_ctx);
+        free_output_metrics(&p->outputs[i].metrics);
+    }
+
+    free_input_ctx(&p->input);
+    if (p->dump) {
+        free_raw_dump_ctx(&p->dump);
+    }
+    if (p->diff) {
+        free_frame_diff_ctx(&p->diff);
+    }
+    av_frame_free(&p->static_frame);
+    free_frame_converter_ctx(&p->fc_ctx);
+    free_audio_meter_ctx(&p->meter);
+    free(p->audio_route);
+    mutex_destroy(&p->lock);
+    free(p->error_str);
+    free(p);
+    *ctx = NULL;
+    return 0;
+}
+
+static void
+output_fail(PipelineOutput *out)
+{
+    if (atomic_load(&out->pipeline->running)) {
+        LOG_ERROR("%s (%s): %s", out->pipeline->config.name, out->config.url,
+                  out->fa_ctx->error_str);
+    }
+    atomic_fetch_add(&out->errors, 1);
+    atomic_store(&out->retry_at, get_current_ts_usec() + PIPELINE_RETRY_DELAY);
+    atomic_store(&out->state, PIPELINE_OUTPUT_FAILED);
+}
+
+static void
+output_open_job(void *arg)
+{
+    OutputOpenJob *job = arg;
+    PipelineOutput *out = job->out;
+    PipelineCtx *ctx = out->pipeline;
+    FFmpegOutputCtx *fa_ctx = out->fa_ctx;
+
+    if (fa_ctx->output != NULL) {
+        ffmpeg_output_close(fa_ctx);
+    }
+
+    if (!atomic_load(&ctx->running)) {
+        atomic_store(&out->state, PIPELINE_OUTPUT_CLOSED);
+        free(job);
+        return;
+    }
+
+    AVDictionary *output_options = NULL;
+    av_dict_set(&output_options, "max_interleave_delta", "0", 0);
+
+    if (strcmp(out->config.format, "rtsp") == 0) {
+        av_dict_set(&output_options, "rtsp_transport", "tcp", 0);
+    }
+
+    int ret = ffmpeg_output_init(
+            fa_ctx, pipeline_ffmpeg_format(out->config.format),
+            out->config.url);
+    if (ret >= 0) {
+        ret = ffmpeg_output_setup_video(
+                fa_ctx, ctx->config.video_encoder, job->width, job->height,
+                job->frame_rate, atomic_load(&out->video_bitrate),
+                job->pix_fmt);
+    }
+    const AudioRoute *route = ctx->audio_route;
+    for (int i = 0; ret >= 0 && i < (route ? route->nb_tracks : 1); ++i) {
+        ret = ffmpeg_output_setup_audio(fa_ctx, ctx->config.audio_encoder,
+                                        atomic_load(&out->audio_bitrate),
+                                        route ? route->track_channels[i] : 0);
+    }
+    if (ret >= 0) {
+        ret = ffmpeg_output_write_header(fa_ctx, &output_options);
+    }
+
+    av_dict_free(&output_options);
+
+    if (ret < 0) {
+        ffmpeg_output_close(fa_ctx);
+        output_fail(out);
+    }
+    else {
+        fc_reset(out->fc_ctx);
+        out->pts_offset = AV_NOPTS_VALUE;
+        atomic_store(&out->gapless,
+                     (fa_ctx->o_ctx->oformat->flags & AVFMT_NOTIMESTAMPS) != 0);
+        atomic_store(&out->video_sent_at, 0);
+        atomic_store(&out->state, PIPELINE_OUTPUT_ACTIVE);
+
+        if (route) {
+            char tracks[AUDIO_MAX_TRACKS * 12] = "";
+            for (int i = 0, len = 0; i < fa_ctx->nb_audio_tracks; ++i) {
+                len += snprintf(
+                        tracks + len, sizeof tracks - len, "%s%d",
+                        i > 0 ? ", " : "",
+                        fa_ctx->audio_codec_ctx[i]->ch_layout.nb_channels);
+            }
+            LOG_INFO("%s (%s): audio tracks of %s channels", ctx->config.name,
+                     out->config.url, tracks);
+        }
+    }
+
+    free(job);
+}
+
+static void
+output_video_job(void *arg)
+{
+    OutputVideoJob *job = arg;
+    PipelineOutput *out = job->out;
+
+    AVCodecContext *codec_ctx = out->fa_ctx->video_codec_ctx;
+
+    // frames converted before a format change may still be in flight
+    if (atomic_load(&out->state) == PIPELINE_OUTPUT_ACTIVE
+        && job->frame->width == codec_ctx->width
+        && job->frame->height == codec_ctx->height
+        && job->frame->format == codec_ctx->pix_fmt) {
+        if (out->pts_offset == AV_NOPTS_VALUE) {
+            out->pts_offset = job->frame->pts;
+        }
+        job->frame->pts -= out->pts_offset;
+
+        if (atomic_exchange(&out->force_keyframe, 0)) {
+            job->frame->pict_type = AV_PICTURE_TYPE_I;
+        }
+
+        if (ffmpeg_output_send_video_frame(out->fa_ctx, job->frame) < 0) {
+            output_fail(out);
+        }
+        else {
+            atomic_fetch_add(&out->frames, 1);
+        }
+    }
+
+    av_frame_free(&job->frame);
+    free(job);
+}
+
+static void
+input_audio_release(InputAudioRef *ref)
+{
+    if (atomic_fetch_sub(&ref->refs, 1) == 1) {
+        if (ref->owned) {
+            av_free(ref->frame.p_data);
+        }
+        else {
+            input_free_audio(ref->input, &ref->frame);
+        }
+        free(ref);
+    }
+}
+
+static void
+output_audio_job(void *arg)
+{
+    OutputAudioJob *job = arg;
+    PipelineOutput *out = job->out;
+
+    if (atomic_load(&out->state) == PIPELINE_OUTPUT_ACTIVE) {
+        FFmpegOutputCtx *fa_ctx = out->fa_ctx;
+        const AudioRoute *route = out->pipeline->audio_route;
+        AVFrame *frames[AUDIO_MAX_TRACKS];
+
+        // the tracks are resampled together and sent frame by frame
+        int ret = fc_ndi_audio_frame_to_tracks(out->fc_ctx, route,
+                                               fa_ctx->audio_codec_ctx,
+                                               &job->ref->frame, frames);
+        while (ret > 0) {
+            int i = 0;
+            while (i < fa_ctx->nb_audio_tracks
+                   && ffmpeg_output_send_audio_frame(fa_ctx, i, frames[i])
+                              >= 0) {
+                i++;
+            }
+            if (i < fa_ctx->nb_audio_tracks) {
+                output_fail(out);
+                break;
+            }
+            ret = fc_ndi_audio_frame_to_tracks(out->fc_ctx, route,
+                                               fa_ctx->audio_codec_ctx, NULL,
+                                               frames);
+        }
+    }
+
+    input_audio_release(job->ref);
+    free(job);
+}
+
+static void
+replay_write_job(void *arg)
+{
+    OutputReplayJob *job = arg;
+    const PipelineConfig *config = &job->out->pipeline->config;
+    char path[600];
+
+    snprintf(path, sizeof path, "%s/replay-%s-%lld.mp4", config->replay_dir,
+             config->name, (long long)(job->to_ts / AV_TIME_BASE));
+
+    if (rb_clip_write(job->clip, path) < 0) {
+        LOG_ERROR("%s: %s", config->name, job->clip->error_str);
+    }
+    else {
+        LOG_INFO("%s: replay saved to %s", config->name, path);
+    }
+    free_replay_clip(&job->clip);
+    free(job);
+}
+
+/* Takes references to the packets of the clip on the output queue, which
+ * owns the replay buffer, and leaves the file to replay_queue, so that
+ * the output goes on encoding meanwhile. */
+static void
+output_replay_job(void *arg)
+{
+    OutputReplayJob *job = arg;
+    PipelineCtx *ctx = job->out->pipeline;
+    ReplayBufferCtx *replay = job->out->fa_ctx->replay;
+
+    job->clip = new_replay_clip();
+    if (rb_clip(replay, job->clip, job->from_ts, job->to_ts) < 0) {
+        LOG_ERROR("%s: %s", ctx->config.name, replay->error_str);
+        free_replay_clip(&job->clip);
+        free(job);
+        return;
+    }
+    wq_submit(ctx->replay_queue, replay_write_job, job);
+}
+
+/* Closes the output so that the capture thread reopens it with the current
+ * settings. An output that is being opened picks them up by itself. */
+static void
+output_restart(PipelineOutput *out)
+{
+    if (atomic_load(&out->state) == PIPELINE_OUTPUT_OPENING) {
+        return;
+    }
+    ffmpeg_output_close(out->fa_ctx);
+    atomic_store(&out->state, PIPELINE_OUTPUT_CLOSED);
+}
+
+static void
+output_config_job(void *arg)
+{
+    OutputConfigJob *job = arg;
+    PipelineOutput *out = job->out;
+
+    mutex_lock(&out->pipeline->lock);
+    out->config = job->config;
+    mutex_unlock(&out->pipeline->lock);
+
+    output_restart(out);
+    free(job);
+}
+
+static void
+output_bitrate_job(void *arg)
+{
+    PipelineOutput *out = arg;
+    FFmpegOutputCtx *fa_ctx = out->fa_ctx;
+
+    if (atomic_load(&out->state) != PIPELINE_OUTPUT_ACTIVE) {
+        return;
+    }
+
+    int64_t video_bitrate = atomic_load(&out->video_bitrate);
+    int64_t audio_bitrate = atomic_load(&out->audio_bitrate);
+    int restart = fa_ctx->nb_audio_tracks > 0
+                  && fa_ctx->audio_codec_ctx[0]->bit_rate != audio_bitrate;
+
+    if (fa_ctx->video_codec_ctx
+        && fa_ctx->video_codec_ctx->bit_rate != video_bitrate) {
+        const char *name = fa_ctx->video_codec_ctx->codec->name;
+        int reconfigurable = 0;
+
+        for (int i = 0; reconfigurable_encoders[i]; ++i) {
+            if (strcmp(name, reconfigurable_encoders[i]) == 0) {
+                reconfigurable = 1;
+                break;
+            }
+        }
+
+        if (reconfigurable) {
+            fa_ctx->video_codec_ctx->bit_rate = video_bitrate;
+        }
+        else {
+            restart = 1;
+        }
+    }
+
+    if (restart) {
+        output_restart(out);
+    }
+}
+
+static int
+output_accepts(PipelineOutput *out)
+{
+    if (atomic_load(&out->state) != PIPELINE_OUTPUT_ACTIVE) {
+        return 0;
+    }
+    if (wq_depth(out->queue) >= PIPELINE_MAX_QUEUE_DEPTH) {
+        atomic_fetch_add(&out->dropped_frames, 1);
+        return 0;
+    }
+    return 1;
+}
+
+static void
+pipeline_service_outputs(PipelineCtx *ctx, int reopen)
+{
+    if (ctx->width == 0) {
+        return;
+    }
+
+    int64_t now = get_current_ts_usec();
+
+    for (int i = 0; i < ctx->nb_outputs; ++i) {
+        PipelineOutput *out = &ctx->outputs[i];
+        int state = atomic_load(&out->state);
+
+        if (reopen || state == PIPELINE_OUTPUT_CLOSED
+            || (state == PIPELINE_OUTPUT_FAILED
+                && now >= atomic_load(&out->retry_at))) {
+            OutputOpenJob *job = malloc(sizeof(OutputOpenJob));
+            job->out = out;
+            job->width = ctx->width;
+            job->height = ctx->height;
+            job->frame_rate = ctx->frame_rate;
+            job->pix_fmt = ctx->pix_fmt;
+
+            atomic_store(&out->state, PIPELINE_OUTPUT_OPENING);
+            wq_submit(out->queue, output_open_job, job);
+        }
+    }
+}
+
+/* Converts the frame, or hands out the last conversion again when no
+ * macroblock changed since. With dirty_regions only the changed block rows
+ * are converted on top of the last conversion, as long as that is at most
+ * half of them, and the encoders learn where the changes are. */
+static AVFrame *
+convert_video_frame(ConvertVideoJob *job, int *unchanged)
+{
+    PipelineCtx *ctx = job->ctx;
+    const PipelineConfig *config = &ctx->config;
+    FrameDiffCtx *diff = ctx->diff;
+    AVFrame *frame = NULL;
+    int changed = -1;
+
+    *unchanged = 0;
+    if (diff) {
+        TRACE_BEGIN(span);
+        changed = fd_update(diff, &job->frame);
+        TRACE_END(span, "frame_diff", ctx->fc_ctx->trace_label);
+    }
+    int has_last = changed >= 0 && ctx->static_frame->buf[0] != NULL;
+
+    if (has_last && changed == 0
+        && config->static_frames != STATIC_FRAMES_OFF) {
+        frame = fc_ndi_video_frame_repeat(ctx->fc_ctx, ctx->static_frame,
+                                          &job->frame);
+        if (frame) {
+            atomic_fetch_add(&ctx->static_frames, 1);
+            *unchanged = 1;
+        }
+    }
+    else if (has_last && config->dirty_regions
+             && diff->nb_changed_rows * 2 <= diff->mb_rows) {
+        frame = fc_ndi_video_frame_update(ctx->fc_ctx, ctx->static_frame,
+                                          &job->frame, diff->changed_rows,
+                                          FRAME_DIFF_BLOCK);
+        if (frame) {
+            atomic_fetch_add(&ctx->partial_frames, 1);
+        }
+        else {
+            LOG_WARNING("%s: %s", config->name, ctx->fc_ctx->error_str);
+        }
+    }
+
+    if (!frame) {
+        frame = fc_ndi_video_frame_convert(ctx->fc_ctx, job->pix_fmt,
+                                           job->width, job->height,
+                                           &job->frame);
+    }
+
+    if (ctx->static_frame && !*unchanged) {
+        av_frame_unref(ctx->static_frame);
+        av_frame_ref(ctx->static_frame, frame);
+    }
+    if (config->dirty_regions && changed >= 0) {
+        fd_add_roi(diff, frame);
+    }
+    return frame;
+}
+
+/* A static picture is left out for outputs that keep timestamps, until
+ * the keepalive interval runs out. */
+static int
+output_takes_static(PipelineOutput *out, int64_t capture_ts)
+{
+    const PipelineConfig *config = &out->pipeline->config;
+
+    if (config->static_frames != STATIC_FRAMES_DROP
+        || atomic_load(&out->gapless)) {
+        return 1;
+    }
+    return capture_ts - atomic_load(&out->video_sent_at)
+           >= (int64_t)config->static_keepalive_ms * 1000;
+}
+
+static void
+convert_video_job(void *arg)
+{
+    ConvertVideoJob *job = arg;
+    PipelineCtx *ctx = job->ctx;
+    AVFrame *frame = NULL;
+    int unchanged = 0;
+
+    if (job->reset) {
+        fc_reset(ctx->fc_ctx);
+        if (ctx->diff) {
+            fd_reset(ctx->diff);
+        }
+        if (ctx->static_frame) {
+            av_frame_unref(ctx->static_frame);
+        }
+    }
+
+    // nothing to repeat before the first conversion
+    int skip = job->repeat && !ctx->static_frame->buf[0];
+
+    for (int i = 0; i < ctx->nb_outputs && !skip; ++i) {
+        PipelineOutput *out = &ctx->outputs[i];
+        if (!output_accepts(out)) {
+            continue;
+        }
+
+        if (!frame) {
+            frame = job->repeat ? fc_ndi_video_frame_repeat(ctx->fc_ctx,
+                                                            ctx->static_frame,
+                                                            &job->frame)
+                                : convert_video_frame(job, &unchanged);
+            if (!frame) {
+                LOG_WARNING("%s: %s", ctx->config.name,
+                            ctx->fc_ctx->error_str);
+                break;
+            }
+
+            frame->opaque_ref = av_buffer_allocz(sizeof(FrameTiming));
+            if (frame->opaque_ref) {
+                FrameTiming *timing = (FrameTiming *)frame->opaque_ref->data;
+                timing->capture_ts = job->capture_ts;
+                timing->converted_ts = get_current_ts_usec();
+                hist_record(&ctx->convert_latency,
+                            timing->converted_ts - timing->capture_ts);
+            }
+        }
+
+        if (unchanged && !output_takes_static(out, job->capture_ts)) {
+            continue;
+        }
+        atomic_store(&out->video_sent_at, job->capture_ts);
+
+        OutputVideoJob *video_job = malloc(sizeof(OutputVideoJob));
+        video_job->out = out;
+        video_job->frame = av_frame_clone(frame);
+        wq_submit(out->queue, output_video_job, video_job);
+    }
+
+    if (!job->repeat) {
+        input_free_video(ctx->input, &job->frame);
+    }
+
+    if (frame) {
+        av_frame_unref(frame);
+    }
+    free(job);
+}
+
+static void
+pipeline_submit_convert(PipelineCtx *ctx, const NDIlib_video_frame_v2_t *frame,
+                        int64_t capture_ts, int reset, int repeat)
+{
+    ConvertVideoJob *job = malloc(sizeof(ConvertVideoJob));
+    job->ctx = ctx;
+    job->frame = *frame;
+    job->capture_ts = capture_ts;
+    job->width = ctx->width;
+    job->height = ctx->height;
+    job->pix_fmt = ctx->pix_fmt;
+    job->reset = reset;
+    job->repeat = repeat;
+    wq_submit(ctx->convert_queue, convert_video_job, job);
+}
+
+static void
+pipeline_dispatch_video(PipelineCtx *ctx, NDIlib_video_frame_v2_t *v_frame,
+                        int64_t capture_ts, int reset)
+{
+    // a reset must not be lost with a dropped frame
+    if (!reset && wq_depth(ctx->convert_queue) >= PIPELINE_MAX_CONVERT_DEPTH) {
+        atomic_fetch_add(&ctx->dropped_frames, 1);
+        input_free_video(ctx->input, v_frame);
+        // the slot is kept, a repeat only takes a reference
+        if (ctx->config.cfr) {
+            pipeline_submit_convert(ctx, &ctx->cfr_format, capture_ts, 0, 1);
+        }
+        return;
+    }
+
+    pipeline_submit_convert(ctx, v_frame, capture_ts, reset, 0);
+}
+
+static void
+pipeline_free_audio(PipelineCtx *ctx, NDIlib_audio_frame_v2_t *a_frame,
+                    int owned)
+{
+    if (owned) {
+        av_free(a_frame->p_data);
+    }
+    else {
+        input_free_audio(ctx->input, a_frame);
+    }
+}
+
+static void
+pipeline_dispatch_audio(PipelineCtx *ctx, NDIlib_audio_frame_v2_t *a_frame,
+                        int owned)
+{
+    PipelineOutput *targets[PIPELINE_MAX_OUTPUTS];
+    int nb_targets = 0;
+
+    for (int i = 0; i < ctx->nb_outputs; ++i) {
+        if (output_accepts(&ctx->outputs[i])) {
+            targets[nb_targets++] = &ctx->outputs[i];
+        }
+    }
+
+    if (nb_targets == 0) {
+        pipeline_free_audio(ctx, a_frame, owned);
+        return;
+    }
+
+    InputAudioRef *ref = malloc(sizeof(InputAudioRef));
+    ref->input = ctx->input;
+    ref->frame = *a_frame;
+    ref->owned = owned;
+    atomic_store(&ref->refs, nb_targets);
+
+    for (int i = 0; i < nb_targets; ++i) {
+        OutputAudioJob *job = malloc(sizeof(OutputAudioJob));
+        job->out = targets[i];
+        job->ref = ref;
+        wq_submit(targets[i]->queue, output_audio_job, job);
+    }
+}
+
+/* A cfr pipeline sends video on a grid of slots, one frame period apart
+ * from the first frame on. A frame takes the slot nearest to its capture
+ * time, a slot with no frame by the end of its period gets the last frame
+ * again and a frame for a slot that is already sent is dropped. The grid
+ * only follows the wall clock, and so does the audio: it is placed by the
+ * samples sent, gaps are filled with silence and audio for time that is
+ * already filled is cut, so that it stays in step with the slots. */
+static int64_t
+pipeline_cfr_slot_ts(PipelineCtx *ctx, int64_t slot)
+{
+    return ctx->cfr_origin
+           + slot * AV_TIME_BASE * ctx->cfr_format.frame_rate_D
+                     / ctx->cfr_format.frame_rate_N;
+}
+
+// the slot whose period, centered on its time, holds `ts`
+static int64_t
+pipeline_cfr_slot_at(PipelineCtx *ctx, int64_t ts)
+{
+    int64_t unit = (int64_t)AV_TIME_BASE * ctx->cfr_format.frame_rate_D;
+    return ((ts - ctx->cfr_origin) * ctx->cfr_format.frame_rate_N
+            + unit / 2)
+           / unit;
+}
+
+// wall clock the audio sent so far reaches
+static int64_t
+pipeline_cfr_audio_until(PipelineCtx *ctx)
+{
+    return ctx->cfr_audio_start
+           + ctx->cfr_audio_samples * AV_TIME_BASE / ctx->cfr_sample_rate;
+}
+
+/* Audio missing up to `now` is made up with silence of the last audio
+ * format, so that it does not fall behind the repeated frames. */
+static void
+pipeline_cfr_silence(PipelineCtx *ctx, int64_t now)
+{
+    if (ctx->cfr_sample_rate <= 0) {
+        return;
+    }
+
+    int64_t gap = now - pipeline_cfr_audio_until(ctx);
+
+    if (gap < PIPELINE_CFR_AUDIO_GAP) {
+        return;
+    }
+
+    NDIlib_audio_frame_v2_t frame = {};
+    frame.sample_rate = ctx->cfr_sample_rate;
+    frame.no_channels = ctx->cfr_channels;
+    frame.no_samples = (int)(gap * ctx->cfr_sample_rate / AV_TIME_BASE);
+    frame.channel_stride_in_bytes = frame.no_samples * (int)sizeof(float);
+    frame.timecode = NDIlib_send_timecode_synthesize;
+    frame.p_data = av_mallocz((size_t)frame.channel_stride_in_bytes
+                              * frame.no_channels);
+    if (!frame.p_data) {
+        return;
+    }
+
+    ctx->cfr_audio_samples += frame.no_samples;
+    pipeline_dispatch_audio(ctx, &frame, 1);
+}
+
+static void
+pipeline_cfr_repeat(PipelineCtx *ctx, int64_t now)
+{
+    atomic_fetch_add(&ctx->cfr_repeated, 1);
+    pipeline_submit_convert(ctx, &ctx->cfr_format, now, 0, 1);
+    ctx->cfr_slot++;
+    pipeline_cfr_silence(ctx, now);
+}
+
+// repeats the slots whose period ended without a frame
+static void
+pipeline_cfr_fill(PipelineCtx *ctx, int64_t now)
+{
+    if (ctx->cfr_origin == INT64_MIN) {
+        return;
+    }
+
+    int64_t last_ts = pipeline_cfr_slot_ts(ctx, ctx->cfr_last);
+    int64_t max_slot = pipeline_cfr_slot_at(ctx,
+                                            last_ts + PIPELINE_CFR_MAX_GAP);
+
+    while (ctx->cfr_slot <= max_slot
+           && pipeline_cfr_slot_at(ctx, now) > ctx->cfr_slot) {
+        pipeline_cfr_repeat(ctx, now);
+    }
+}
+
+static void
+pipeline_cfr_video(PipelineCtx *ctx, NDIlib_video_frame_v2_t *v_frame,
+                   int64_t capture_ts, int reset)
+{
+    if (!reset && ctx->cfr_origin != INT64_MIN) {
+        pipeline_cfr_fill(ctx, capture_ts);
+    }
+
+    ctx->cfr_format = *v_frame;
+    ctx->cfr_format.p_data = NULL;
+    ctx->cfr_format.p_metadata = NULL;
+
+    if (reset || ctx->cfr_origin == INT64_MIN) {
+        ctx->cfr_origin = capture_ts;
+        ctx->cfr_slot = 0;
+    }
+
+    int64_t slot = pipeline_cfr_slot_at(ctx, capture_ts);
+
+    if (slot < ctx->cfr_slot) {
+        atomic_fetch_add(&ctx->cfr_dropped, 1);
+        input_free_video(ctx->input, v_frame);
+        return;
+    }
+    if (slot > ctx->cfr_slot) {
+        // back from a gap too long to fill, the grid starts at this frame
+        ctx->cfr_origin = capture_ts
+                          - (pipeline_cfr_slot_ts(ctx, ctx->cfr_slot)
+                             - ctx->cfr_origin);
+        slot = ctx->cfr_slot;
+    }
+
+    ctx->cfr_last = slot;
+    ctx->cfr_slot = slot + 1;
+    pipeline_dispatch_video(ctx, v_frame, capture_ts, reset);
+}
+
+// keeps the last `keep` samples of every channel, in a copy that is owned
+static int
+pipeline_cfr_cut(PipelineCtx *ctx, NDIlib_audio_frame_v2_t *a_frame,
+                 int keep, int *owned)
+{
+    int skip = a_frame->no_samples - keep;
+    int stride = keep * (int)sizeof(float);
+    uint8_t *data = av_malloc((size_t)stride * a_frame->no_channels);
+
+    if (!data) {
+        return -1;
+    }
+    for (int c = 0; c < a_frame->no_channels; ++c) {
+        memcpy(data + (size_t)c * stride,
+               (const uint8_t *)a_frame->p_data
+                       + (size_t)c * a_frame->channel_stride_in_bytes
+                       + (size_t)skip * sizeof(float),
+               stride);
+    }
+
+    pipeline_free_audio(ctx, a_frame, *owned);
+    *owned = 1;
+    a_frame->p_data = (float *)data;
+    a_frame->p_metadata = NULL;
+    a_frame->no_samples = keep;
+    a_frame->channel_stride_in_bytes = stride;
+    if (a_frame->timecode != NDIlib_send_timecode_synthesize) {
+        a_frame->timecode += (int64_t)skip * 10000000
+                             / a_frame->sample_rate;
+    }
+    return 0;
+}
+
+/* An audio frame is taken to end at its capture time. Audio that comes
+ * late, in a burst after a dropout that was filled with silence, would run
+ * ahead of the slots by the length of the dropout, it is cut to the part
+ * after what was sent. Returns <0 when nothing is left of a_frame, it is
+ * freed then. */
+static int
+pipeline_cfr_audio(PipelineCtx *ctx, NDIlib_audio_frame_v2_t *a_frame,
+                   int64_t capture_ts, int *owned)
+{
+    int rate = a_frame->sample_rate;
+    if (rate <= 0 || a_frame->no_samples <= 0) {
+        return 0;
+    }
+
+    int64_t duration = (int64_t)a_frame->no_samples * AV_TIME_BASE / rate;
+
+    if (rate != ctx->cfr_sample_rate
+        || a_frame->no_channels != ctx->cfr_channels) {
+        ctx->cfr_sample_rate = rate;
+        ctx->cfr_channels = a_frame->no_channels;
+        ctx->cfr_audio_start = capture_ts - duration;
+        ctx->cfr_audio_samples = 0;
+    }
+
+    // audio that dropped out on its own is filled up to this frame
+    pipeline_cfr_silence(ctx, capture_ts - duration);
+
+    int64_t until = pipeline_cfr_audio_until(ctx);
+    if (until + duration - capture_ts > PIPELINE_CFR_AUDIO_LEAD) {
+        int64_t keep = (capture_ts - until) * rate / AV_TIME_BASE;
+
+        atomic_fetch_add(&ctx->cfr_audio_cut, 1);
+        if (keep <= 0
+            || pipeline_cfr_cut(ctx, a_frame, (int)keep, owned) < 0) {
+            pipeline_free_audio(ctx, a_frame, *owned);
+            return -1;
+        }
+    }
+
+    ctx->cfr_audio_samples += a_frame->no_samples;
+    return 0;
+}
+
+// returns whether the frame is below silence_gate_db
+static int
+pipeline_meter_audio(PipelineCtx *ctx, const NDIlib_audio_frame_v2_t *a_frame)
+{
+    const float *planes[AUDIO_METER_MAX_CHANNELS];
+    const uint8_t *data = (const uint8_t *)a_frame->p_data;
+    size_t stride = (size_t)a_frame->channel_stride_in_bytes;
+    int nb_channels = FFMIN(a_frame->no_channels, AUDIO_METER_MAX_CHANNELS);
+    float peak;
+
+    for (int c = 0; c < nb_channels; ++c) {
+        planes[c] = (const float *)(data + c * stride);
+    }
+
+    TRACE_BEGIN(span);
+    int updated = am_process(ctx->meter, planes, nb_channels,
+                             a_frame->no_samples, a_frame->sample_rate, &peak);
+    TRACE_END(span, "audio_meter", ctx->fc_ctx->trace_label);
+
+    if (updated) {
+        mutex_lock(&ctx->lock);
+        ctx->audio_levels = ctx->meter->levels;
+        ctx->has_audio_levels = 1;
+        mutex_unlock(&ctx->lock);
+    }
+
+    int gate = ctx->config.silence_gate_db;
+    // channels past the meter could be anything
+    if (gate == 0 || a_frame->no_channels > AUDIO_METER_MAX_CHANNELS
+        || peak >= gate) {
+        return 0;
+    }
+
+    // the gate closes after a whole window below it, not in every pause
+    if (ctx->meter->nb_blocks < AUDIO_METER_BLOCKS) {
+        return 0;
+    }
+    const AudioLevels *levels = &ctx->meter->levels;
+    for (int c = 0; c < levels->nb_channels; ++c) {
+        if (levels->peak[c] >= gate) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Audio below the silence gate goes on as digital silence, which costs the
+ * encoders next to nothing and lets libopus stop sending packets (DTX). */
+static void
+pipeline_audio(PipelineCtx *ctx, NDIlib_audio_frame_v2_t *a_frame,
+               int64_t capture_ts)
+{
+    NDIlib_audio_frame_v2_t silence;
+    int owned = 0;
+
+    if (pipeline_meter_audio(ctx, a_frame) && a_frame->no_samples > 0) {
+        silence = *a_frame;
+        silence.channel_stride_in_bytes = silence.no_samples
+                                          * (int)sizeof(float);
+        silence.p_metadata = NULL;
+        silence.p_data = av_mallocz((size_t)silence.channel_stride_in_bytes
+                                    * silence.no_channels);
+        if (silence.p_data) {
+            atomic_fetch_add(&ctx->silent_frames, 1);
+            input_free_audio(ctx->input, a_frame);
+            a_frame = &silence;
+            owned = 1;
+        }
+    }
+
+    if (ctx->config.cfr
+        && pipeline_cfr_audio(ctx, a_frame, capture_ts, &owned) < 0) {
+        return;
+    }
+    pipeline_dispatch_audio(ctx, a_frame, owned);
+}
+
+// a cfr pipeline wakes up for the end of the next slot
+static int
+pipeline_capture_timeout(PipelineCtx *ctx, int64_t now)
+{
+    if (!ctx->config.cfr || ctx->cfr_origin == INT64_MIN) {
+        return PIPELINE_CAPTURE_TIMEOUT;
+    }
+
+    int64_t end = pipeline_cfr_slot_ts(ctx, ctx->cfr_slot)
+                  + (pipeline_cfr_slot_ts(ctx, ctx->cfr_slot + 1)
+                     - pipeline_cfr_slot_ts(ctx, ctx->cfr_slot))
+                            / 2;
+    int64_t ms = (end - now) / 1000 + 1;
+
+    return (int)FFMAX(1, FFMIN(ms, PIPELINE_CAPTURE_TIMEOUT));
+}
+
+/* Inputs that are not live wait for the pipeline instead of losing frames
+ * to full queues or to outputs that are still being opened. */
+static void
+pipeline_wait_ready(PipelineCtx *ctx)
+{
+    while (atomic_load(&ctx->running)) {
+        int busy = wq_depth(ctx->convert_queue) >= PIPELINE_MAX_CONVERT_DEPTH;
+
+        for (int i = 0; !busy && i < ctx->nb_outputs; ++i) {
+            PipelineOutput *out = &ctx->outputs[i];
+            int state = atomic_load(&out->state);
+            // every queued conversion may still add a frame
+            busy = state == PIPELINE_OUTPUT_OPENING
+                   || (state == PIPELINE_OUTPUT_ACTIVE
+                       && wq_depth(out->queue)
+                                  >= PIPELINE_MAX_QUEUE_DEPTH
+                                             - PIPELINE_MAX_CONVERT_DEPTH);
+        }
+
+        if (!busy) {
+            return;
+        }
+        thread_sleep_ms(1);
+    }
+}
+
+static void
+pipeline_dump_frame(PipelineCtx *ctx, InputFrameType type,
+                    const NDIlib_video_frame_v2_t *v_frame,
+                    const NDIlib_audio_frame_v2_t *a_frame, int64_t capture_ts)
+{
+    TRACE_BEGIN(span);
+    int ret = type == INPUT_FRAME_VIDEO
+                      ? raw_dump_video(ctx->dump, v_frame, capture_ts)
+                      : raw_dump_audio(ctx->dump, a_frame, capture_ts);
+    TRACE_END(span, "dump_raw", ctx->fc_ctx->trace_label);
+
+    if (ret == 1 && atomic_fetch_add(&ctx->dump_dropped, 1) == 0) {
+        LOG_WARNING("%s: the disk is behind, raw dump drops frames",
+                    ctx->config.name);
+    }
+    else if (ret < 0) {
+        // keep what was written readable and carry on streaming
+        LOG_ERROR("%s: %s, raw dump stopped", ctx->config.name,
+                  ctx->dump->error_str);
+        free_raw_dump_ctx(&ctx->dump);
+    }
+}
+
+static void
+pipeline_sample_input(PipelineCtx *ctx)
+{
+    InputStats stats;
+    if (input_stats(ctx->input, &stats) < 0) {
+        return;
+    }
+
+    mutex_lock(&ctx->lock);
+    ctx->input_stats = stats;
+    ctx->has_input_stats = 1;
+    mutex_unlock(&ctx->lock);
+
+    // a backlog in the receiver is latency, the next video frame catches up
+    if (stats.video_queued > PIPELINE_MAX_INPUT_QUEUE && !ctx->catch_up) {
+        LOG_INFO("%s: %d frames queued in the receiver, skipping to "
+                 "the latest",
+                 ctx->config.name, stats.video_queued);
+        ctx->catch_up = 1;
+    }
+}
+
+static void
+pipeline_run(void *arg)
+{
+    PipelineCtx *ctx = arg;
+    NDIlib_video_frame_v2_t v_frame;
+    NDIlib_audio_frame_v2_t a_frame;
+
+    TRACE_THREAD_NAME("capture %s", ctx->config.name);
+
+    while (atomic_load(&ctx->running)) {
+        TRACE_BEGIN(span);
+        InputFrameType res = input_capture(
+                ctx->input, &v_frame, &a_frame,
+                pipeline_capture_timeout(ctx, get_current_ts_usec()));
+        TRACE_END(span, "input_capture", ctx->fc_ctx->trace_label);
+        int64_t capture_ts = get_current_ts_usec();
+
+        if (capture_ts >= ctx->stats_at) {
+            pipeline_sample_input(ctx);
+            ctx->stats_at = capture_ts + PIPELINE_STATS_INTERVAL;
+        }
+        if (res == INPUT_FRAME_NONE) {
+            // late frames tend to arrive in a burst after a gap
+            ctx->stats_at = 0;
+        }
+
+        if (res == INPUT_FRAME_VIDEO && ctx->catch_up) {
+            TRACE_BEGIN(skip_span);
+            int skipped = input_skip_to_latest(ctx->input, &v_frame);
+            TRACE_END(skip_span, "skip_to_latest", ctx->fc_ctx->trace_label);
+            atomic_fetch_add(&ctx->skipped_frames, skipped);
+            ctx->catch_up = 0;
+        }
+
+        if (res == INPUT_FRAME_END || res == INPUT_FRAME_ERROR) {
+            if (res == INPUT_FRAME_ERROR) {
+                LOG_ERROR("%s: %s", ctx->config.name, ctx->input->error_str);
+            }
+            else {
+                LOG_INFO("%s: end of input", ctx->config.name);
+            }
+            atomic_store(&ctx->finished, 1);
+            break;
+        }
+
+        if (ctx->dump && res != INPUT_FRAME_NONE) {
+            pipeline_dump_frame(ctx, res, &v_frame, &a_frame, capture_ts);
+        }
+
+        int reopen = 0;
+
+        if (res == INPUT_FRAME_VIDEO) {
+            // 16-bit sources are encoded with 10 bits where the encoder can
+            int high_depth = v_frame.FourCC == NDIlib_FourCC_video_type_P216
+                             || v_frame.FourCC == NDIlib_FourCC_video_type_PA16;
+
+            if (ctx->pix_fmt == AV_PIX_FMT_NONE
+                || ctx->high_depth != high_depth) {
+                enum AVPixelFormat pix_fmt = ffmpeg_output_video_pix_fmt(
+                        ctx->config.video_encoder, high_depth);
+                if (ctx->pix_fmt != pix_fmt) {
+                    LOG_INFO("%s: encoding %s", ctx->config.name,
+                             av_get_pix_fmt_name(pix_fmt));
+                    reopen = 1;
+                }
+                ctx->high_depth = high_depth;
+                ctx->pix_fmt = pix_fmt;
+            }
+
+            if (ctx->width != v_frame.xres || ctx->height != v_frame.yres
+                || ctx->frame_rate.num != v_frame.frame_rate_N
+                || ctx->frame_rate.den != v_frame.frame_rate_D) {
+                mutex_lock(&ctx->lock);
+                ctx->width = v_frame.xres;
+                ctx->height = v_frame.yres;
+                ctx->frame_rate.num = v_frame.frame_rate_N;
+                ctx->frame_rate.den = v_frame.frame_rate_D;
+                mutex_unlock(&ctx->lock);
+                LOG_INFO("%s: source format %dx%d @ %d/%d",
+                         ctx->config.name, v_frame.xres, v_frame.yres,
+                         v_frame.frame_rate_N, v_frame.frame_rate_D);
+                reopen = 1;
+            }
+        }
+
+        pipeline_service_outputs(ctx, reopen);
+
+        if (!ctx->input->live && res != INPUT_FRAME_NONE) {
+            pipeline_wait_ready(ctx);
+        }
+
+        if (res == INPUT_FRAME_VIDEO && ctx->config.cfr) {
+            pipeline_cfr_video(ctx, &v_frame, capture_ts, reopen);
+        }
+        else if (res == INPUT_FRAME_VIDEO) {
+            pipeline_dispatch_video(ctx, &v_frame, capture_ts, reopen);
+        }
+        else if (res == INPUT_FRAME_AUDIO) {
+            pipeline_audio(ctx, &a_frame, capture_ts);
+        }
+
+        if (res != INPUT_FRAME_VIDEO && ctx->config.cfr) {
+            pipeline_cfr_fill(ctx, capture_ts);
+        }
+    }
+}
+
+int
+pipeline_start(PipelineCtx *ctx)
+{
+    const PipelineConfig *config = &ctx->config;
+    int ret;
+
+    if (strlen(config->input_url)) {
+        ret = input_open(ctx->input, input_backend_for(config->input_url),
+                         config->input_url, NULL);
+    }
+    else if (strlen(config->composite)) {
+        ret = input_open(ctx->input, "composite", config->composite, NULL);
+    }
+    else {
+        ret = input_open(ctx->input, "ndi", config->source_url,
+                         config->source_name);
+    }
+    if (ret < 0) {
+        sprintf(ctx->error_str, "%.200s", ctx->input->error_str);
+        return -1;
+    }
+
+    if (strlen(config->dump_raw)) {
+        ctx->dump = new_raw_dump_ctx();
+        if (raw_dump_open(ctx->dump, config->dump_raw) < 0) {
+            sprintf(ctx->error_str, "%.200s", ctx->dump->error_str);
+            free_raw_dump_ctx(&ctx->dump);
+            input_close(ctx->input);
+            return -1;
+        }
+    }
+
+    mutex_lock(&ctx->lock);
+    ctx->has_input_stats = 0;
+    ctx->has_audio_levels = 0;
+    mutex_unlock(&ctx->lock);
+    ctx->stats_at = 0;
+    ctx->catch_up = 0;
+    ctx->pix_fmt = AV_PIX_FMT_NONE;
+    ctx->cfr_origin = INT64_MIN;
+    ctx->cfr_sample_rate = 0;
+
+    atomic_store(&ctx->running, 1);
+    if (thread_create(&ctx->thread, pipeline_run, ctx) < 0) {
+        atomic_store(&ctx->running, 0);
+        sprintf(ctx->error_str, "%s", "unable to start capture thread");
+        if (ctx->dump) {
+            free_raw_dump_ctx(&ctx->dump);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+void
+pipeline_stop(PipelineCtx *ctx)
+{
+    if (!atomic_exchange(&ctx->running, 0)) {
+        return;
+    }
+
+    thread_join(ctx->thread);
+    wq_drain(ctx->convert_queue);
+
+    if (ctx->diff) {
+        fd_reset(ctx->diff);
+    }
+    if (ctx->static_frame) {
+        av_frame_unref(ctx->static_frame);
+    }
+
+    if (ctx->dump) {
+        if (raw_dump_close(ctx->dump) < 0) {
+            LOG_ERROR("%s: %s", ctx->config.name, ctx->dump->error_str);
+        }
+        free_raw_dump_ctx(&ctx->dump);
+    }
+
+    for (int i = 0; i < ctx->nb_outputs; ++i) {
+        PipelineOutput *out = &ctx->outputs[i];
+        wq_drain(out->queue);
+        ffmpeg_output_close(out->fa_ctx);
+        atomic_store(&out->state, PIPELINE_OUTPUT_CLOSED);
+    }
+    wq_drain(ctx->replay_queue);
+
+    // the converter is idle now that the convert queue is drained
+    LOG_INFO("%s: stopped, repeated %lld, cfr dropped %lld, cut audio %lld, "
+             "silent audio %lld, deinterlaced %lld",
+             ctx->config.name, (long long)atomic_load(&ctx->cfr_repeated),
+             (long long)atomic_load(&ctx->cfr_dropped),
+             (long long)atomic_load(&ctx->cfr_audio_cut),
+             (long long)atomic_load(&ctx->silent_frames),
+             (long long)ctx->fc_ctx->deinterlaced);
+}
+
+void
+pipeline_export_replay(PipelineCtx *ctx, int64_t back, int64_t duration)
+{
+    if (ctx->nb_outputs == 0 || !ctx->outputs[0].fa_ctx->replay) {
+        return;
+    }
+
+    OutputReplayJob *job = malloc(sizeof(OutputReplayJob));
+    int64_t now = get_current_ts_usec();
+
+    if (back <= 0) {
+        back = ctx->outputs[0].fa_ctx->replay->max_duration;
+    }
+    job->out = &ctx->outputs[0];
+    job->from_ts = now - back;
+    job->to_ts = duration > 0 && duration < back ? job->from_ts + duration
+                                                 : now;
+    wq_submit(ctx->outputs[0].queue, output_replay_job, job);
+}
+
+int
+pipeline_set_output(PipelineCtx *ctx, int index, const char *format,
+                    const char *url)
+{
+    if (index < 0 || index >= ctx->nb_outputs) {
+        sprintf(ctx->error_str, "no output with index %d", index);
+        return -1;
+    }
+
+    PipelineOutput *out = &ctx->outputs[index];
+    OutputConfigJob *job = malloc(sizeof(OutputConfigJob));
+    job->out = out;
+    pipeline_get_output_config(ctx, index, &job->config);
+
+    if (format) {
+        snprintf(job->config.format, sizeof job->config.format, "%s", format);
+    }
+    if (url) {
+        snprintf(job->config.url, sizeof job->config.url, "%s", url);
+    }
+
+    wq_submit(out->queue, output_config_job, job);
+    return 0;
+}
+
+void
+pipeline_set_bitrate(PipelineCtx *ctx, int64_t video_bitrate,
+                     int64_t audio_bitrate)
+{
+    for (int i = 0; i < ctx->nb_outputs; ++i) {
+        PipelineOutput *out = &ctx->outputs[i];
+        if (video_bitrate > 0) {
+            atomic_store(&out->video_bitrate, video_bitrate);
+        }
+        if (audio_bitrate > 0) {
+            atomic_store(&out->audio_bitrate, audio_bitrate);
+        }
+        wq_submit(out->queue, output_bitrate_job, out);
+    }
+}
+
+void
+pipeline_force_keyframe(PipelineCtx *ctx)
+{
+    for (int i = 0; i < ctx->nb_outputs; ++i) {
+        atomic_store(&ctx->outputs[i].force_keyframe, 1);
+    }
+}
+
+int
+pipeline_switch_source(PipelineCtx *ctx, int index)
+{
+    if (input_select(ctx->input, index) < 0) {
+        sprintf(ctx->error_str, "%.200s", ctx->input->error_str);
+        return -1;
+    }
+
+    // viewers joining after the cut start from its first frames
+    pipeline_force_keyframe(ctx);
+    LOG_INFO("%s: switched to source %d", ctx->config.name, index);
+    return 0;
+}
+
+void
+pipeline_get_output_config(PipelineCtx *ctx, int index, OutputConfig *config)
+{
+    mutex_lock(&ctx->lock);
+    *config = ctx->outputs[index].config;
+    mutex_unlock(&ctx->lock);
+}
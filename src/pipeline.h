@@ -0,0 +1,206 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdatomic.h>
+
+#include "audio_meter.h"
+#include "ffmpeg_output.h"
+#include "frame_converter.h"
+#include "frame_diff.h"
+#include "input.h"
+#include "raw_dump.h"
+#include "thread.h"
+#include "worker_pool.h"
+
+#define PIPELINE_MAX_OUTPUTS 8
+
+typedef enum StaticFrameMode {
+    STATIC_FRAMES_OFF,
+    STATIC_FRAMES_REPEAT, // reuse the last conversion for unchanged frames
+    STATIC_FRAMES_DROP,   // and leave them out where timestamps allow gaps
+} StaticFrameMode;
+
+typedef struct OutputConfig {
+    char format[30];
+    char url[512];
+    WorkPriority priority;
+} OutputConfig;
+
+typedef struct PipelineConfig {
+    char name[64];
+    char source_url[255];
+    char source_name[255];
+    char input_url[512]; // media file or URL played instead of NDI
+    int input_fast;      // read input_url as fast as the outputs take it
+    int input_loop;      // start input_url over at the end
+    char composite[512]; // NDI sources laid out as one, see comp_parse
+    char dump_raw[512];  // file every captured frame is written to
+    char video_encoder[40];
+    char audio_encoder[40];
+    char audio_tracks[256]; // channel routing, see ar_parse
+    int64_t video_bitrate;
+    int64_t audio_bitrate;
+    int replay_seconds;
+    int64_t replay_max_bytes;
+    char replay_dir[255];
+    StaticFrameMode static_frames;
+    int static_keepalive_ms; // longest gap of a dropped static picture
+    int dirty_regions;       // convert changed rows only, mark them as ROI
+    DeinterlaceMode deinterlace;
+    int cfr; // video on a fixed frame grid, gaps filled with repeats
+    int silence_gate_db; // audio below it is sent as silence, 0 is off
+    OutputConfig outputs[PIPELINE_MAX_OUTPUTS];
+    int nb_outputs;
+} PipelineConfig;
+
+typedef enum PipelineOutputState {
+    PIPELINE_OUTPUT_CLOSED,
+    PIPELINE_OUTPUT_OPENING,
+    PIPELINE_OUTPUT_ACTIVE,
+    PIPELINE_OUTPUT_FAILED,
+} PipelineOutputState;
+
+/* One muxer with its own encoders. Everything that touches fa_ctx and
+ * fc_ctx runs on `queue`, so a slow or failing output only stalls its own
+ * queue; the capture thread merely drops frames for it. */
+typedef struct PipelineOutput {
+    struct PipelineCtx *pipeline;
+    OutputConfig config;
+    FFmpegOutputCtx *fa_ctx;
+    FrameConverterCtx *fc_ctx;
+    WorkQueue *queue;
+
+    _Atomic(int) state;
+    _Atomic(int64_t) retry_at;
+    int64_t pts_offset;
+
+    _Atomic(int64_t) video_bitrate;
+    _Atomic(int64_t) audio_bitrate;
+    _Atomic(int) force_keyframe;
+    _Atomic(int) gapless;           // the muxer needs every frame
+    _Atomic(int64_t) video_sent_at; // capture time of the last video frame
+
+    _Atomic(int64_t) frames;
+    _Atomic(int64_t) dropped_frames;
+    _Atomic(int64_t) errors;
+    OutputMetrics *metrics;
+} PipelineOutput;
+
+/* The capture thread only receives input frames. Video conversion runs on
+ * `convert_queue`, encoding and muxing on the queue of each output, and
+ * replay clips are written on `replay_queue`. */
+typedef struct PipelineCtx {
+    PipelineConfig config;
+    InputCtx *input;
+    RawDumpCtx *dump; // writes captured frames, closed on a write error
+    FrameConverterCtx *fc_ctx;
+    AudioRoute *audio_route; // NULL for one track of every channel
+    WorkerPool *pool;
+    WorkQueue *convert_queue;
+    WorkQueue *replay_queue;
+    _Atomic(int64_t) dropped_frames;
+    _Atomic(int64_t) skipped_frames; // stale input frames dropped to catch up
+    _Atomic(int64_t) static_frames;  // unchanged input frames not converted
+    _Atomic(int64_t) partial_frames; // frames converted where they changed
+    _Atomic(int64_t) cfr_repeated;   // empty cfr slots given the last frame
+    _Atomic(int64_t) cfr_dropped;    // frames early for an already filled slot
+    _Atomic(int64_t) cfr_audio_cut;  // audio for time filled with silence
+    _Atomic(int64_t) silent_frames;  // audio the silence gate replaced
+    _Atomic(int64_t) dump_dropped;   // frames dump_raw could not keep up with
+    Histogram convert_latency;       // capture -> conversion end
+
+    // convert queue only, diff is set with config.static_frames or
+    // dirty_regions, static_frame with those or config.cfr
+    FrameDiffCtx *diff;
+    AVFrame *static_frame; // the last conversion
+
+    PipelineOutput outputs[PIPELINE_MAX_OUTPUTS];
+    int nb_outputs;
+
+    // guards width, height, frame_rate, input_stats, audio_levels and
+    // outputs[].config against readers outside of the capture thread and
+    // the output queues
+    Mutex lock;
+    int width;
+    int height;
+    AVRational frame_rate;
+    InputStats input_stats;
+    int has_input_stats;
+    AudioLevels audio_levels;
+    int has_audio_levels;
+
+    // capture thread only
+    int64_t stats_at;
+    int catch_up;
+    int high_depth;             // the source is P216 or PA16
+    enum AVPixelFormat pix_fmt; // of the encoders, 10-bit for high_depth
+    int64_t cfr_origin;         // wall clock of slot 0, usec
+    int64_t cfr_slot;           // the next slot to fill
+    int64_t cfr_last;           // slot of the last input frame
+    NDIlib_video_frame_v2_t cfr_format; // of the last frame, no picture
+    int64_t cfr_audio_start;    // wall clock of the first audio sample
+    int64_t cfr_audio_samples;  // sent since, silence included
+    int cfr_sample_rate;        // of the last audio, for silence
+    int cfr_channels;
+    AudioMeterCtx *meter;
+
+    Thread thread;
+    _Atomic(int) running;
+    _Atomic(int) finished; // the input has ended
+
+    char *error_str;
+} PipelineCtx;
+
+void
+pipeline_config_defaults(PipelineConfig *config);
+
+int
+pipeline_static_mode_from_name(const char *name, StaticFrameMode *mode);
+
+int
+pipeline_config_validate(const PipelineConfig *config, char *error_str,
+                         size_t size);
+
+PipelineCtx *
+new_pipeline_ctx(const PipelineConfig *config, WorkerPool *pool);
+
+int
+free_pipeline_ctx(PipelineCtx **ctx);
+
+int
+pipeline_start(PipelineCtx *ctx);
+
+void
+pipeline_stop(PipelineCtx *ctx);
+
+/* Saves `duration` usec of the replay buffer from `back` usec ago, 0 for
+ * the whole buffer and for up to now. */
+void
+pipeline_export_replay(PipelineCtx *ctx, int64_t back, int64_t duration);
+
+int
+pipeline_set_output(PipelineCtx *ctx, int index, const char *format,
+                    const char *url);
+
+void
+pipeline_set_bitrate(PipelineCtx *ctx, int64_t video_bitrate,
+                     int64_t audio_bitrate);
+
+void
+pipeline_force_keyframe(PipelineCtx *ctx);
+
+/* Cuts the program to another source of a composite input, the encoders
+ * and outputs keep running. */
+int
+pipeline_switch_source(PipelineCtx *ctx, int index);
+
+void
+pipeline_get_output_config(PipelineCtx *ctx, int index, OutputConfig *config);
+
+#endif
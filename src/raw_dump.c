@@ -0,0 +1,321 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "raw_dump.h"
+
+#include <libavutil/error.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const uint8_t raw_zeros[RAW_DUMP_ALIGN];
+
+RawDumpCtx *
+new_raw_dump_ctx()
+{
+    RawDumpCtx *ctx = malloc(sizeof(RawDumpCtx));
+    memset(ctx, 0, sizeof(RawDumpCtx));
+    ctx->error_str = malloc(AV_ERROR_MAX_STRING_SIZE + 100);
+    mutex_init(&ctx->lock);
+    cond_init(&ctx->cond);
+    return ctx;
+}
+
+int
+free_raw_dump_ctx(RawDumpCtx **ctx)
+{
+    raw_dump_close(*ctx);
+    mutex_destroy(&(*ctx)->lock);
+    cond_destroy(&(*ctx)->cond);
+    free((*ctx)->error_str);
+    free(*ctx);
+    *ctx = NULL;
+    return 0;
+}
+
+int64_t
+raw_video_size(const NDIlib_video_frame_v2_t *frame)
+{
+    int64_t stride = frame->line_stride_in_bytes;
+    int64_t yres = frame->yres;
+
+    // a single field holds every other line
+    if (frame->frame_format_type == NDIlib_frame_format_type_field_0
+        || frame->frame_format_type == NDIlib_frame_format_type_field_1) {
+        yres /= 2;
+    }
+
+    switch (frame->FourCC) {
+    case NDIlib_FourCC_video_type_UYVY:
+        return (stride > 0 ? stride : frame->xres * 2) * yres;
+    case NDIlib_FourCC_video_type_UYVA:
+        // alpha plane follows at one byte per pixel
+        return (stride > 0 ? stride : frame->xres * 2) * yres
+               + (int64_t)frame->xres * yres;
+    case NDIlib_FourCC_video_type_I420:
+    case NDIlib_FourCC_video_type_YV12:
+    case NDIlib_FourCC_video_type_NV12:
+        return (stride > 0 ? stride : frame->xres) * yres * 3 / 2;
+    case NDIlib_FourCC_video_type_P216:
+        return (stride > 0 ? stride : frame->xres * 2) * yres * 2;
+    case NDIlib_FourCC_video_type_PA16:
+        return (stride > 0 ? stride : frame->xres * 2) * yres * 3;
+    default:
+        return (stride > 0 ? stride : frame->xres * 4) * yres;
+    }
+}
+
+static int
+raw_write(RawDumpCtx *ctx, const void *data, size_t size)
+{
+    if (size > 0 && fwrite(data, 1, size, ctx->file) != size) {
+        sprintf(ctx->error_str, "%s", "could not write raw dump");
+        return -1;
+    }
+    ctx->offset += size;
+    return 0;
+}
+
+static int
+raw_pad(RawDumpCtx *ctx)
+{
+    size_t rem = ctx->offset % RAW_DUMP_ALIGN;
+    return rem ? raw_write(ctx, raw_zeros, RAW_DUMP_ALIGN - rem) : 0;
+}
+
+static RawIndexEntry *
+raw_append(RawDumpCtx *ctx, const RawDumpJob *job)
+{
+    if (ctx->nb_frames == ctx->capacity) {
+        int64_t capacity = ctx->capacity ? ctx->capacity * 2 : 1024;
+        RawIndexEntry *index = realloc(ctx->index,
+                                       sizeof(RawIndexEntry) * capacity);
+        if (!index) {
+            sprintf(ctx->error_str, "%s", "could not grow raw dump index");
+            return NULL;
+        }
+        ctx->index = index;
+        ctx->capacity = capacity;
+    }
+
+    RawIndexEntry *entry = &ctx->index[ctx->nb_frames];
+    *entry = job->entry;
+    entry->offset = ctx->offset;
+
+    if (raw_write(ctx, job->data, job->entry.size) < 0 || raw_pad(ctx) < 0) {
+        return NULL;
+    }
+
+    ctx->nb_frames++;
+    return entry;
+}
+
+static void
+raw_writer(void *arg)
+{
+    RawDumpCtx *ctx = arg;
+
+    mutex_lock(&ctx->lock);
+    for (;;) {
+        while (!ctx->head && !ctx->stop) {
+            cond_wait(&ctx->cond, &ctx->lock);
+        }
+
+        // stop writes what is queued first
+        RawDumpJob *job = ctx->head;
+        if (!job) {
+            break;
+        }
+        ctx->head = job->next;
+        if (!ctx->head) {
+            ctx->tail = NULL;
+        }
+        int failed = ctx->failed;
+        mutex_unlock(&ctx->lock);
+
+        // after a failure the rest is only dropped
+        int ret = !failed && !raw_append(ctx, job) ? -1 : 0;
+        int64_t size = (int64_t)job->entry.size;
+        free(job->data);
+        free(job);
+
+        mutex_lock(&ctx->lock);
+        ctx->queued_bytes -= size;
+        if (ret < 0) {
+            ctx->failed = 1;
+        }
+    }
+    mutex_unlock(&ctx->lock);
+}
+
+int
+raw_dump_open(RawDumpCtx *ctx, const char *path)
+{
+    raw_dump_close(ctx);
+
+    ctx->file = fopen(path, "wb");
+    if (!ctx->file) {
+        sprintf(ctx->error_str, "could not open \"%.200s\" for writing",
+                path);
+        return -1;
+    }
+
+    RawFileHeader header = {};
+    memcpy(header.magic, RAW_DUMP_MAGIC, sizeof header.magic);
+    header.version = 1;
+    header.align = RAW_DUMP_ALIGN;
+
+    ctx->offset = 0;
+    ctx->nb_frames = 0;
+    ctx->first_ts = INT64_MIN;
+    ctx->stop = 0;
+    ctx->failed = 0;
+
+    if (raw_write(ctx, &header, sizeof header) < 0 || raw_pad(ctx) < 0) {
+        fclose(ctx->file);
+        ctx->file = NULL;
+        return -1;
+    }
+    if (thread_create(&ctx->thread, raw_writer, ctx) < 0) {
+        sprintf(ctx->error_str, "%s", "unable to start raw dump writer");
+        fclose(ctx->file);
+        ctx->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int
+raw_dump_close(RawDumpCtx *ctx)
+{
+    if (!ctx->file) {
+        return 0;
+    }
+
+    mutex_lock(&ctx->lock);
+    ctx->stop = 1;
+    cond_signal(&ctx->cond);
+    mutex_unlock(&ctx->lock);
+    thread_join(ctx->thread);
+
+    RawFileTrailer trailer = {};
+    trailer.index_offset = ctx->offset;
+    trailer.nb_frames = ctx->nb_frames;
+    memcpy(trailer.magic, RAW_DUMP_MAGIC, sizeof trailer.magic);
+
+    // the index of what was written before a failure keeps it readable
+    int ret = raw_write(ctx, ctx->index,
+                        sizeof(RawIndexEntry) * ctx->nb_frames);
+    if (ret >= 0) {
+        ret = raw_write(ctx, &trailer, sizeof trailer);
+    }
+    if (fclose(ctx->file) != 0 && ret >= 0) {
+        sprintf(ctx->error_str, "%s", "could not write raw dump");
+        ret = -1;
+    }
+    if (ctx->failed) {
+        ret = -1; // a frame could not be written
+    }
+
+    ctx->file = NULL;
+    free(ctx->index);
+    ctx->index = NULL;
+    ctx->capacity = 0;
+    return ret;
+}
+
+static int
+raw_queue(RawDumpCtx *ctx, RawIndexEntry *entry, const void *data,
+          int64_t size, int64_t capture_ts)
+{
+    if (ctx->first_ts == INT64_MIN) {
+        ctx->first_ts = capture_ts;
+    }
+    entry->size = size;
+    entry->capture_ts = capture_ts - ctx->first_ts;
+
+    // the bytes are taken before the copy, so the queue never goes over
+    mutex_lock(&ctx->lock);
+    int failed = ctx->failed;
+    int full = ctx->queued_bytes + size > RAW_DUMP_MAX_QUEUED;
+    if (!failed && !full) {
+        ctx->queued_bytes += size;
+    }
+    mutex_unlock(&ctx->lock);
+
+    if (failed) {
+        return -1;
+    }
+    if (full) {
+        return 1;
+    }
+
+    RawDumpJob *job = malloc(sizeof(RawDumpJob));
+    void *copy = malloc(size > 0 ? size : 1);
+    if (!job || !copy) {
+        free(job);
+        free(copy);
+        mutex_lock(&ctx->lock);
+        ctx->queued_bytes -= size;
+        mutex_unlock(&ctx->lock);
+        return 1;
+    }
+    memcpy(copy, data, size);
+    job->next = NULL;
+    job->entry = *entry;
+    job->data = copy;
+
+    mutex_lock(&ctx->lock);
+    if (ctx->tail) {
+        ctx->tail->next = job;
+    }
+    else {
+        ctx->head = job;
+    }
+    ctx->tail = job;
+    cond_signal(&ctx->cond);
+    mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+int
+raw_dump_video(RawDumpCtx *ctx, const NDIlib_video_frame_v2_t *frame,
+               int64_t capture_ts)
+{
+    RawIndexEntry entry = {};
+
+    entry.type = RAW_FRAME_VIDEO;
+    entry.timecode = frame->timecode;
+    entry.timestamp = frame->timestamp;
+    entry.fourcc = frame->FourCC;
+    entry.xres = frame->xres;
+    entry.yres = frame->yres;
+    entry.frame_rate_N = frame->frame_rate_N;
+    entry.frame_rate_D = frame->frame_rate_D;
+    entry.picture_aspect_ratio = frame->picture_aspect_ratio;
+    entry.frame_format_type = frame->frame_format_type;
+    entry.line_stride_in_bytes = frame->line_stride_in_bytes;
+    return raw_queue(ctx, &entry, frame->p_data, raw_video_size(frame),
+                     capture_ts);
+}
+
+int
+raw_dump_audio(RawDumpCtx *ctx, const NDIlib_audio_frame_v2_t *frame,
+               int64_t capture_ts)
+{
+    RawIndexEntry entry = {};
+
+    entry.type = RAW_FRAME_AUDIO;
+    entry.timecode = frame->timecode;
+    entry.timestamp = frame->timestamp;
+    entry.sample_rate = frame->sample_rate;
+    entry.no_channels = frame->no_channels;
+    entry.no_samples = frame->no_samples;
+    entry.channel_stride_in_bytes = frame->channel_stride_in_bytes;
+    return raw_queue(ctx, &entry, frame->p_data,
+                     (int64_t)frame->channel_stride_in_bytes
+                             * frame->no_channels,
+                     capture_ts);
+}
@@ -0,0 +1,136 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef RAW_DUMP_H
+#define RAW_DUMP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <Processing.NDI.Lib.h>
+
+#include "thread.h"
+
+/* Captured NDI frames as they came off the receiver, laid out so that a
+ * reader can mmap the file and use the payloads in place:
+ *
+ *   RawFileHeader                padded to RAW_DUMP_ALIGN
+ *   payload of frame 0           padded to RAW_DUMP_ALIGN
+ *   ...
+ *   RawIndexEntry[nb_frames]
+ *   RawFileTrailer
+ *
+ * Integers are in host byte order. The index is written when the dump is
+ * closed, a file without the trailer is incomplete. */
+
+#define RAW_DUMP_MAGIC "NDIRAW01"
+#define RAW_DUMP_ALIGN 4096
+// payloads waiting for the writer, about a second of 1080p60 UYVY
+#define RAW_DUMP_MAX_QUEUED (256 << 20)
+
+enum {
+    RAW_FRAME_VIDEO = 1,
+    RAW_FRAME_AUDIO = 2,
+};
+
+typedef struct RawFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t align;
+} RawFileHeader;
+
+typedef struct RawIndexEntry {
+    uint64_t offset;
+    uint64_t size;
+    int64_t capture_ts; // usec since the first frame
+    int64_t timecode;
+    int64_t timestamp;
+    uint32_t type;
+
+    // video
+    uint32_t fourcc;
+    int32_t xres;
+    int32_t yres;
+    int32_t frame_rate_N;
+    int32_t frame_rate_D;
+    float picture_aspect_ratio;
+    int32_t frame_format_type;
+    int32_t line_stride_in_bytes;
+
+    // audio
+    int32_t sample_rate;
+    int32_t no_channels;
+    int32_t no_samples;
+    int32_t channel_stride_in_bytes;
+} RawIndexEntry;
+
+typedef struct RawFileTrailer {
+    uint64_t index_offset;
+    uint64_t nb_frames;
+    char magic[8];
+} RawFileTrailer;
+
+// a copied payload, its entry gets the offset when it is written
+typedef struct RawDumpJob {
+    struct RawDumpJob *next;
+    RawIndexEntry entry;
+    void *data;
+} RawDumpJob;
+
+/* Frames are copied into a queue bounded by RAW_DUMP_MAX_QUEUED and written
+ * by a thread of their own, so a slow disk never holds up capture. When
+ * the queue is full frames are dropped. */
+typedef struct RawDumpCtx {
+    // writer thread, and the closing thread after it has been joined
+    FILE *file;
+    uint64_t offset;
+    RawIndexEntry *index;
+    int64_t nb_frames;
+    int64_t capacity;
+
+    int64_t first_ts; // capture side
+
+    Thread thread;
+    Mutex lock; // guards the queue, stop and failed
+    Cond cond;
+    RawDumpJob *head;
+    RawDumpJob *tail;
+    int64_t queued_bytes;
+    int stop;
+    int failed; // set with error_str, nothing is written afterwards
+
+    char *error_str;
+} RawDumpCtx;
+
+RawDumpCtx *
+new_raw_dump_ctx();
+
+int
+free_raw_dump_ctx(RawDumpCtx **ctx);
+
+int
+raw_dump_open(RawDumpCtx *ctx, const char *path);
+
+/* Writes the queued frames and the index, the file is complete
+ * afterwards. */
+int
+raw_dump_close(RawDumpCtx *ctx);
+
+/* Queues a copy of the frame. Returns 1 when the frame was dropped because
+ * the writer is behind, <0 once writing has failed. */
+int
+raw_dump_video(RawDumpCtx *ctx, const NDIlib_video_frame_v2_t *frame,
+               int64_t capture_ts);
+
+int
+raw_dump_audio(RawDumpCtx *ctx, const NDIlib_audio_frame_v2_t *frame,
+               int64_t capture_ts);
+
+/* Bytes behind p_data of an NDI video frame. */
+int64_t
+raw_video_size(const NDIlib_video_frame_v2_t *frame);
+
+#endif
@@ -0,0 +1,416 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "replay_buffer.h"
+
+#include <libavformat/avformat.h>
+
+#include "common.h"
+
+#define RB_INITIAL_CAPACITY 1024
+#define RB_INITIAL_KF_CAPACITY 64
+
+ReplayBufferCtx *
+new_replay_buffer_ctx(int64_t max_bytes, int64_t max_duration)
+{
+    ReplayBufferCtx *ctx = malloc(sizeof(ReplayBufferCtx));
+    memset(ctx, 0, sizeof(ReplayBufferCtx));
+    ctx->error_str = malloc(AV_ERROR_MAX_STRING_SIZE + 100);
+    ctx->capacity = RB_INITIAL_CAPACITY;
+    ctx->entries = calloc(ctx->capacity, sizeof(ReplayEntry));
+    ctx->kf_capacity = RB_INITIAL_KF_CAPACITY;
+    ctx->keyframes = calloc(ctx->kf_capacity, sizeof(ReplayKeyframe));
+    ctx->max_bytes = max_bytes;
+    ctx->max_duration = max_duration;
+    return ctx;
+}
+
+static void
+rb_clear_streams(ReplayBufferCtx *ctx)
+{
+    for (int i = 0; i < RB_MAX_STREAMS; ++i) {
+        if (ctx->streams[i].codecpar)
+            avcodec_parameters_free(&ctx->streams[i].codecpar);
+        ctx->streams[i].is_video = 0;
+    }
+}
+
+int
+free_replay_buffer_ctx(ReplayBufferCtx **ctx)
+{
+    rb_reset(*ctx);
+    rb_clear_streams(*ctx);
+    free((*ctx)->entries);
+    free((*ctx)->keyframes);
+    free((*ctx)->error_str);
+    free(*ctx);
+    *ctx = NULL;
+    return 0;
+}
+
+static void
+rb_pop_head(ReplayBufferCtx *ctx)
+{
+    ReplayEntry *e = &ctx->entries[ctx->head % ctx->capacity];
+    ctx->bytes -= e->pkt->size;
+    av_packet_free(&e->pkt);
+    ctx->head++;
+
+    while (ctx->kf_head < ctx->kf_tail
+           && ctx->keyframes[ctx->kf_head % ctx->kf_capacity].seq
+                      < ctx->head) {
+        ctx->kf_head++;
+    }
+}
+
+void
+rb_reset(ReplayBufferCtx *ctx)
+{
+    while (ctx->head < ctx->tail) {
+        rb_pop_head(ctx);
+    }
+    ctx->head = ctx->tail = 0;
+    ctx->kf_head = ctx->kf_tail = 0;
+    ctx->bytes = 0;
+}
+
+int
+rb_add_stream(ReplayBufferCtx *ctx, const int stream_index,
+              const AVCodecContext *codec_ctx)
+{
+    if (stream_index < 0 || stream_index >= RB_MAX_STREAMS) {
+        sprintf(ctx->error_str, "%s", "replay buffer stream index out of range");
+        return -1;
+    }
+
+    ReplayStream *st = &ctx->streams[stream_index];
+    if (!st->codecpar)
+        st->codecpar = avcodec_parameters_alloc();
+
+    int ret = avcodec_parameters_from_context(st->codecpar, codec_ctx);
+    if (ret < 0) {
+        av_error_fmt(ctx->error_str,
+                     "could not copy replay stream codec parameters!", ret);
+        return ret;
+    }
+    st->time_base = codec_ctx->time_base;
+    st->is_video = codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO;
+    return 0;
+}
+
+static void
+rb_grow_entries(ReplayBufferCtx *ctx)
+{
+    int64_t new_capacity = ctx->capacity * 2;
+    ReplayEntry *entries = calloc(new_capacity, sizeof(ReplayEntry));
+
+    for (int64_t seq = ctx->head; seq < ctx->tail; ++seq) {
+        entries[seq % new_capacity] = ctx->entries[seq % ctx->capacity];
+    }
+
+    free(ctx->entries);
+    ctx->entries = entries;
+    ctx->capacity = new_capacity;
+}
+
+static void
+rb_grow_keyframes(ReplayBufferCtx *ctx)
+{
+    int64_t new_capacity = ctx->kf_capacity * 2;
+    ReplayKeyframe *keyframes = calloc(new_capacity, sizeof(ReplayKeyframe));
+
+    for (int64_t i = ctx->kf_head; i < ctx->kf_tail; ++i) {
+        keyframes[i % new_capacity] = ctx->keyframes[i % ctx->kf_capacity];
+    }
+
+    free(ctx->keyframes);
+    ctx->keyframes = keyframes;
+    ctx->kf_capacity = new_capacity;
+}
+
+int
+rb_push(ReplayBufferCtx *ctx, const AVPacket *pkt)
+{
+    if (pkt->stream_index < 0 || pkt->stream_index >= RB_MAX_STREAMS
+        || !ctx->streams[pkt->stream_index].codecpar) {
+        return 0;
+    }
+
+    AVPacket *ref = av_packet_clone(pkt);
+    if (!ref) {
+        sprintf(ctx->error_str, "%s", "could not reference replay packet");
+        return AVERROR(ENOMEM);
+    }
+
+    int64_t now = get_current_ts_usec();
+
+    if (ctx->tail - ctx->head == ctx->capacity) {
+        rb_grow_entries(ctx);
+    }
+
+    int64_t seq = ctx->tail++;
+    ReplayEntry *e = &ctx->entries[seq % ctx->capacity];
+    e->pkt = ref;
+    e->arrival_ts = now;
+    ctx->bytes += ref->size;
+
+    if (ctx->streams[pkt->stream_index].is_video
+        && (pkt->flags & AV_PKT_FLAG_KEY)) {
+        if (ctx->kf_tail - ctx->kf_head == ctx->kf_capacity) {
+            rb_grow_keyframes(ctx);
+        }
+        ReplayKeyframe *kf = &ctx->keyframes[ctx->kf_tail++ % ctx->kf_capacity];
+        kf->arrival_ts = now;
+        kf->seq = seq;
+    }
+
+    while (ctx->tail - ctx->head > 1
+           && (ctx->bytes > ctx->max_bytes
+               || now - ctx->entries[ctx->head % ctx->capacity].arrival_ts
+                          > ctx->max_duration)) {
+        rb_pop_head(ctx);
+    }
+
+    return 0;
+}
+
+int64_t
+rb_find_gop(const ReplayBufferCtx *ctx, const int64_t ts)
+{
+    int64_t lo = ctx->kf_head, hi = ctx->kf_tail;
+
+    if (lo == hi) {
+        return -1;
+    }
+
+    // first keyframe that arrived after ts
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        if (ctx->keyframes[mid % ctx->kf_capacity].arrival_ts <= ts) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    if (lo > ctx->kf_head) {
+        lo--;
+    }
+
+    return ctx->keyframes[lo % ctx->kf_capacity].seq;
+}
+
+ReplayClip *
+new_replay_clip()
+{
+    ReplayClip *clip = malloc(sizeof(ReplayClip));
+    memset(clip, 0, sizeof(ReplayClip));
+    clip->error_str = malloc(AV_ERROR_MAX_STRING_SIZE + 100);
+    return clip;
+}
+
+int
+free_replay_clip(ReplayClip **clip)
+{
+    ReplayClip *c = *clip;
+
+    for (int64_t i = 0; i < c->nb_packets; ++i) {
+        av_packet_free(&c->packets[i]);
+    }
+    for (int i = 0; i < RB_MAX_STREAMS; ++i) {
+        if (c->streams[i].codecpar)
+            avcodec_parameters_free(&c->streams[i].codecpar);
+    }
+    free(c->packets);
+    free(c->error_str);
+    free(c);
+    *clip = NULL;
+    return 0;
+}
+
+int
+rb_clip(ReplayBufferCtx *ctx, ReplayClip *clip, const int64_t from_ts,
+        const int64_t to_ts)
+{
+    int64_t start = rb_find_gop(ctx, from_ts);
+    if (start < 0) {
+        sprintf(ctx->error_str, "%s", "replay buffer has no keyframes");
+        return -1;
+    }
+
+    // the clip starts at the keyframe's pts in every stream, so that the
+    // streams keep the offsets they were encoded with
+    const AVPacket *key = ctx->entries[start % ctx->capacity].pkt;
+    int key_index = key->stream_index;
+    AVRational key_tb = ctx->streams[key_index].time_base;
+    int64_t key_pts = key->pts != AV_NOPTS_VALUE ? key->pts : key->dts;
+    if (key_pts == AV_NOPTS_VALUE) {
+        sprintf(ctx->error_str, "%s", "replay keyframe has no timestamp");
+        return -1;
+    }
+
+    // end of the exported video, the other streams are cut there
+    int64_t end_pts = key_pts;
+    for (int64_t seq = start; seq < ctx->tail; ++seq) {
+        const ReplayEntry *e = &ctx->entries[seq % ctx->capacity];
+        if (e->arrival_ts > to_ts)
+            break;
+        if (e->pkt->stream_index == key_index
+            && e->pkt->pts != AV_NOPTS_VALUE) {
+            end_pts = FFMAX(end_pts, e->pkt->pts + e->pkt->duration);
+        }
+    }
+
+    int64_t origin[RB_MAX_STREAMS];
+
+    for (int i = 0; i < RB_MAX_STREAMS; ++i) {
+        if (!ctx->streams[i].codecpar)
+            continue;
+
+        ReplayStream *st = &clip->streams[i];
+        st->codecpar = avcodec_parameters_alloc();
+        if (!st->codecpar
+            || avcodec_parameters_copy(st->codecpar, ctx->streams[i].codecpar)
+                       < 0) {
+            sprintf(ctx->error_str, "%s",
+                    "could not copy replay stream codec parameters");
+            return AVERROR(ENOMEM);
+        }
+        st->time_base = ctx->streams[i].time_base;
+        st->is_video = ctx->streams[i].is_video;
+        origin[i] = av_rescale_q(key_pts, key_tb, st->time_base);
+    }
+
+    clip->packets = calloc(ctx->tail - ctx->head, sizeof(AVPacket *));
+    if (!clip->packets) {
+        sprintf(ctx->error_str, "%s", "could not allocate replay clip");
+        return AVERROR(ENOMEM);
+    }
+
+    /* Video is taken in arrival order from the keyframe on. The other
+     * streams are taken by pts: an encoder with lookahead hands out video
+     * long after the audio of the same time, so that audio arrived before
+     * the keyframe. Audio from before the keyframe is left out. */
+    for (int64_t seq = ctx->head; seq < ctx->tail; ++seq) {
+        const ReplayEntry *e = &ctx->entries[seq % ctx->capacity];
+        int si = e->pkt->stream_index;
+        if (!clip->streams[si].codecpar)
+            continue;
+
+        if (si == key_index) {
+            if (seq < start || e->arrival_ts > to_ts)
+                continue;
+        }
+        else if (e->pkt->pts == AV_NOPTS_VALUE || e->pkt->pts < origin[si]
+                 || av_compare_ts(e->pkt->pts, ctx->streams[si].time_base,
+                                  end_pts, key_tb)
+                            >= 0) {
+            continue;
+        }
+
+        // a reference, the data is shared with the buffer
+        AVPacket *pkt = av_packet_clone(e->pkt);
+        if (!pkt) {
+            sprintf(ctx->error_str, "%s", "could not reference replay packet");
+            return AVERROR(ENOMEM);
+        }
+
+        // negative dts of reordered video are shifted by the muxer, with
+        // every other stream
+        if (pkt->pts != AV_NOPTS_VALUE)
+            pkt->pts -= origin[si];
+        if (pkt->dts != AV_NOPTS_VALUE)
+            pkt->dts -= origin[si];
+
+        clip->packets[clip->nb_packets++] = pkt;
+    }
+
+    return 0;
+}
+
+int
+rb_clip_write(ReplayClip *clip, const char *path)
+{
+    AVFormatContext *o_ctx = NULL;
+    int ret = avformat_alloc_output_context2(&o_ctx, NULL, NULL, path);
+    if (ret < 0) {
+        ret = avformat_alloc_output_context2(&o_ctx, NULL, "mp4", path);
+    }
+    if (ret < 0) {
+        av_error_fmt(clip->error_str,
+                     "could not allocate replay output format context!", ret);
+        return ret;
+    }
+
+    int out_index[RB_MAX_STREAMS];
+
+    for (int i = 0; i < RB_MAX_STREAMS; ++i) {
+        out_index[i] = -1;
+
+        if (!clip->streams[i].codecpar)
+            continue;
+
+        AVStream *stream = avformat_new_stream(o_ctx, NULL);
+        if (!stream) {
+            sprintf(clip->error_str, "%s", "could not create replay stream");
+            ret = -1;
+            goto end;
+        }
+        ret = avcodec_parameters_copy(stream->codecpar,
+                                      clip->streams[i].codecpar);
+        if (ret < 0) {
+            av_error_fmt(clip->error_str,
+                         "could not copy replay stream codec parameters!", ret);
+            goto end;
+        }
+        stream->codecpar->codec_tag = 0;
+        stream->time_base = clip->streams[i].time_base;
+        out_index[i] = stream->index;
+    }
+
+    ret = avio_open2(&o_ctx->pb, path, AVIO_FLAG_WRITE, NULL, NULL);
+    if (ret < 0) {
+        av_error_fmt(clip->error_str, "could not open replay output file!",
+                     ret);
+        goto end;
+    }
+
+    ret = avformat_write_header(o_ctx, NULL);
+    if (ret < 0) {
+        av_error_fmt(clip->error_str, "could not write replay header!", ret);
+        goto end;
+    }
+
+    // the muxer takes the packets, they are left blank
+    for (int64_t i = 0; i < clip->nb_packets; ++i) {
+        AVPacket *pkt = clip->packets[i];
+        int si = pkt->stream_index;
+
+        pkt->stream_index = out_index[si];
+        av_packet_rescale_ts(pkt, clip->streams[si].time_base,
+                             o_ctx->streams[out_index[si]]->time_base);
+
+        ret = av_interleaved_write_frame(o_ctx, pkt);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    if (ret < 0) {
+        av_error_fmt(clip->error_str, "error writing replay packet!", ret);
+        av_write_trailer(o_ctx);
+    }
+    else if ((ret = av_write_trailer(o_ctx)) < 0) {
+        av_error_fmt(clip->error_str, "could not write replay trailer!", ret);
+    }
+
+end:
+    if (o_ctx->pb)
+        avio_closep(&o_ctx->pb);
+    avformat_free_context(o_ctx);
+    return ret;
+}
@@ -0,0 +1,100 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef REPLAY_BUFFER_H
+#define REPLAY_BUFFER_H
+
+#include <libavcodec/avcodec.h>
+
+#define RB_MAX_STREAMS 16 // video and every audio track
+
+typedef struct ReplayEntry {
+    AVPacket *pkt;
+    int64_t arrival_ts;
+} ReplayEntry;
+
+typedef struct ReplayKeyframe {
+    int64_t arrival_ts;
+    int64_t seq;
+} ReplayKeyframe;
+
+typedef struct ReplayStream {
+    AVCodecParameters *codecpar;
+    AVRational time_base;
+    int is_video;
+} ReplayStream;
+
+/* Time- and byte-bounded ring of encoded packets. Entries and keyframes are
+ * addressed by monotonically increasing sequence numbers, slot is
+ * seq % capacity. Keyframes are stored in arrival order, so a GOP can be
+ * located with a binary search. */
+typedef struct ReplayBufferCtx {
+    ReplayEntry *entries;
+    int64_t capacity;
+    int64_t head;
+    int64_t tail;
+
+    ReplayKeyframe *keyframes;
+    int64_t kf_capacity;
+    int64_t kf_head;
+    int64_t kf_tail;
+
+    ReplayStream streams[RB_MAX_STREAMS];
+
+    int64_t bytes;
+    int64_t max_bytes;
+    int64_t max_duration;
+
+    char *error_str;
+} ReplayBufferCtx;
+
+/* The packets of one exported range in arrival order, referenced from the
+ * buffer with timestamps from its keyframe on, so that the file can be
+ * written while the buffer goes on taking packets. */
+typedef struct ReplayClip {
+    AVPacket **packets;
+    int64_t nb_packets;
+    ReplayStream streams[RB_MAX_STREAMS];
+
+    char *error_str;
+} ReplayClip;
+
+ReplayBufferCtx *
+new_replay_buffer_ctx(int64_t max_bytes, int64_t max_duration);
+
+int
+free_replay_buffer_ctx(ReplayBufferCtx **ctx);
+
+void
+rb_reset(ReplayBufferCtx *ctx);
+
+int
+rb_add_stream(ReplayBufferCtx *ctx, int stream_index,
+              const AVCodecContext *codec_ctx);
+
+int
+rb_push(ReplayBufferCtx *ctx, const AVPacket *pkt);
+
+int64_t
+rb_find_gop(const ReplayBufferCtx *ctx, int64_t ts);
+
+ReplayClip *
+new_replay_clip();
+
+int
+free_replay_clip(ReplayClip **clip);
+
+/* Fills `clip` with the GOPs from the one before from_ts to the packets
+ * that arrived by to_ts, the error is left in ctx->error_str. */
+int
+rb_clip(ReplayBufferCtx *ctx, ReplayClip *clip, int64_t from_ts,
+        int64_t to_ts);
+
+/* Remuxes the clip to `path`, its packets are used up. */
+int
+rb_clip_write(ReplayClip *clip, const char *path);
+
+#endif
@@ -0,0 +1,349 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "shm_output.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/imgutils.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+ShmOutputCtx *
+new_shm_output_ctx()
+{
+    ShmOutputCtx *ctx = malloc(sizeof(ShmOutputCtx));
+    memset(ctx, 0, sizeof(ShmOutputCtx));
+    ctx->fd = -1;
+    ctx->listen_fd = -1;
+    ctx->error_str = malloc(AV_ERROR_MAX_STRING_SIZE + 100);
+    return ctx;
+}
+
+#ifdef _WIN32
+
+int
+free_shm_output_ctx(ShmOutputCtx **ctx)
+{
+    free((*ctx)->error_str);
+    free(*ctx);
+    *ctx = NULL;
+    return 0;
+}
+
+int
+shm_output_init(ShmOutputCtx *ctx, const char *socket_path, int slot_count)
+{
+    sprintf(ctx->error_str, "%s", "shm output is not supported on windows");
+    return -1;
+}
+
+int
+shm_output_setup(ShmOutputCtx *ctx, int width, int height,
+                 enum AVPixelFormat pix_fmt)
+{
+    sprintf(ctx->error_str, "%s", "shm output is not supported on windows");
+    return -1;
+}
+
+int
+shm_output_begin_frame(ShmOutputCtx *ctx, uint8_t *data[4], int linesize[4])
+{
+    return -1;
+}
+
+void
+shm_output_end_frame(ShmOutputCtx *ctx, int64_t ndi_timestamp,
+                     int64_t capture_ts)
+{
+}
+
+void
+shm_output_poll_clients(ShmOutputCtx *ctx)
+{
+}
+
+#else
+
+static void
+shm_output_unmap(ShmOutputCtx *ctx)
+{
+    if (ctx->map) {
+        atomic_store_explicit(&ctx->header->state, SHM_STATE_CLOSED,
+                              memory_order_release);
+        munmap(ctx->map, ctx->map_size);
+        ctx->map = NULL;
+        ctx->header = NULL;
+        ctx->current = NULL;
+    }
+    if (ctx->fd >= 0) {
+        close(ctx->fd);
+        ctx->fd = -1;
+    }
+}
+
+int
+free_shm_output_ctx(ShmOutputCtx **ctx)
+{
+    shm_output_unmap(*ctx);
+    if ((*ctx)->listen_fd >= 0) {
+        close((*ctx)->listen_fd);
+        unlink((*ctx)->path);
+    }
+    free((*ctx)->path);
+    free((*ctx)->error_str);
+    free(*ctx);
+    *ctx = NULL;
+    return 0;
+}
+
+int
+shm_output_init(ShmOutputCtx *ctx, const char *socket_path,
+                const int slot_count)
+{
+    struct sockaddr_un addr = {};
+
+    if (strlen(socket_path) >= sizeof addr.sun_path) {
+        sprintf(ctx->error_str, "%s", "shm socket path is too long");
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        sprintf(ctx->error_str, "could not create shm socket (%s)",
+                strerror(errno));
+        return -1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof addr.sun_path, "%s", socket_path);
+    unlink(socket_path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0
+        || listen(fd, 16) < 0) {
+        sprintf(ctx->error_str, "could not listen on shm socket (%s)",
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    ctx->listen_fd = fd;
+    ctx->path = strdup(socket_path);
+    ctx->slot_count = slot_count > 1 ? slot_count : 2;
+    return 0;
+}
+
+static int
+shm_output_create_fd(ShmOutputCtx *ctx)
+{
+#ifdef __linux__
+    (void)ctx;
+    return memfd_create("ndi-streamer", MFD_CLOEXEC);
+#else
+    char name[64];
+    snprintf(name, sizeof name, "/ndi-streamer-%d-%p", (int)getpid(),
+             (void *)ctx);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        shm_unlink(name);
+    }
+    return fd;
+#endif
+}
+
+int
+shm_output_setup(ShmOutputCtx *ctx, const int width, const int height,
+                 const enum AVPixelFormat pix_fmt)
+{
+    if (ctx->map && ctx->width == width && ctx->height == height
+        && ctx->pix_fmt == pix_fmt) {
+        return 0;
+    }
+
+    shm_output_unmap(ctx);
+
+    int linesize[4] = {};
+    uint8_t *data[4] = {};
+    int frame_size = av_image_fill_linesizes(linesize, pix_fmt, width);
+    if (frame_size >= 0) {
+        for (int p = 0; p < 4; ++p) {
+            linesize[p] = FFALIGN(linesize[p], SHM_DATA_ALIGN);
+        }
+        frame_size
+                = av_image_fill_pointers(data, pix_fmt, height, NULL, linesize);
+    }
+    if (frame_size < 0) {
+        sprintf(ctx->error_str, "%s", "unsupported shm pixel format");
+        return frame_size;
+    }
+
+    size_t header_size = FFALIGN(sizeof(ShmHeader), SHM_DATA_ALIGN);
+    size_t slot_header_size = FFALIGN(sizeof(ShmSlotHeader), SHM_DATA_ALIGN);
+    size_t slot_size = FFALIGN(slot_header_size + frame_size, 4096);
+    size_t map_size = header_size + slot_size * ctx->slot_count;
+
+    int fd = shm_output_create_fd(ctx);
+    if (fd < 0) {
+        sprintf(ctx->error_str, "could not create shm memory (%s)",
+                strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, (off_t)map_size) < 0) {
+        sprintf(ctx->error_str, "could not resize shm memory (%s)",
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    uint8_t *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        fd, 0);
+    if (map == MAP_FAILED) {
+        sprintf(ctx->error_str, "could not map shm memory (%s)",
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    ShmHeader *header = (ShmHeader *)map;
+    header->magic = SHM_MAGIC;
+    header->version = SHM_VERSION;
+    header->slot_count = ctx->slot_count;
+    header->slot_size = slot_size;
+    header->header_size = header_size;
+    header->width = width;
+    header->height = height;
+    header->pix_fmt = pix_fmt;
+    atomic_store_explicit(&header->latest, 0, memory_order_relaxed);
+
+    for (int i = 0; i < ctx->slot_count; ++i) {
+        uint8_t *slot_ptr = map + header_size + slot_size * i;
+        ShmSlotHeader *slot = (ShmSlotHeader *)slot_ptr;
+
+        av_image_fill_pointers(data, pix_fmt, height,
+                               slot_ptr + slot_header_size, linesize);
+
+        atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+        for (int p = 0; p < 4; ++p) {
+            slot->linesize[p] = data[p] ? linesize[p] : 0;
+            slot->offset[p] = data[p] ? (uint64_t)(data[p] - slot_ptr) : 0;
+        }
+    }
+
+    atomic_store_explicit(&header->state, SHM_STATE_ACTIVE,
+                          memory_order_release);
+
+    ctx->fd = fd;
+    ctx->map = map;
+    ctx->map_size = map_size;
+    ctx->header = header;
+    ctx->width = width;
+    ctx->height = height;
+    ctx->pix_fmt = pix_fmt;
+    ctx->frame_number = 0;
+    return 0;
+}
+
+int
+shm_output_begin_frame(ShmOutputCtx *ctx, uint8_t *data[4], int linesize[4])
+{
+    if (!ctx->map) {
+        sprintf(ctx->error_str, "%s", "shm output is not set up");
+        return -1;
+    }
+
+    uint64_t n = ctx->frame_number + 1;
+    uint8_t *slot_ptr = ctx->map + ctx->header->header_size
+                        + ctx->header->slot_size * (n % ctx->slot_count);
+    ShmSlotHeader *slot = (ShmSlotHeader *)slot_ptr;
+
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    for (int p = 0; p < 4; ++p) {
+        data[p] = slot->offset[p] ? slot_ptr + slot->offset[p] : NULL;
+        linesize[p] = slot->linesize[p];
+    }
+
+    ctx->current = slot;
+    return 0;
+}
+
+void
+shm_output_end_frame(ShmOutputCtx *ctx, const int64_t ndi_timestamp,
+                     const int64_t capture_ts)
+{
+    ShmSlotHeader *slot = ctx->current;
+    if (!slot) {
+        return;
+    }
+
+    ctx->frame_number++;
+    slot->frame_number = ctx->frame_number;
+    slot->ndi_timestamp = ndi_timestamp;
+    slot->capture_ts = capture_ts;
+
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+    atomic_store_explicit(&ctx->header->latest, ctx->frame_number,
+                          memory_order_release);
+    ctx->current = NULL;
+}
+
+void
+shm_output_poll_clients(ShmOutputCtx *ctx)
+{
+    int client;
+
+    while (ctx->listen_fd >= 0
+           && (client = accept(ctx->listen_fd, NULL, NULL)) >= 0) {
+        if (ctx->fd >= 0) {
+            char tag = 'S';
+            struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+            union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(sizeof(int))];
+            } control = {};
+            struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = control.buf,
+                .msg_controllen = sizeof control.buf,
+            };
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &ctx->fd, sizeof(int));
+
+            sendmsg(client, &msg, MSG_NOSIGNAL);
+        }
+        close(client);
+    }
+}
+
+#endif
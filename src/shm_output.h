@@ -0,0 +1,100 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef SHM_OUTPUT_H
+#define SHM_OUTPUT_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavutil/pixfmt.h>
+
+#define SHM_MAGIC 0x5344494e /* "NIDS" */
+#define SHM_VERSION 1
+#define SHM_DATA_ALIGN 64
+
+#define SHM_STATE_ACTIVE 1
+#define SHM_STATE_CLOSED 2
+
+/* Shared memory layout, readers include this header:
+ *
+ *   ShmHeader | ShmSlotHeader + planes | ShmSlotHeader + planes | ...
+ *
+ * The ring is a memfd received over the unix socket passed as the output
+ * (SCM_RIGHTS). Every slot is guarded by a seqlock: `seq` is odd while the
+ * writer fills the slot. A reader loads `latest`, picks the slot
+ * latest % slot_count, reads `seq`, uses the planes in place and re-reads
+ * `seq`; if it changed, the frame was overwritten and the reader simply
+ * retries with the new `latest`. The writer never waits for readers.
+ * When `state` becomes SHM_STATE_CLOSED (e.g. the source resolution
+ * changed) readers should reconnect to get the new ring. */
+typedef struct ShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    _Atomic(uint32_t) state;
+    uint32_t slot_count;
+    uint64_t slot_size;
+    uint64_t header_size;
+    int32_t width;
+    int32_t height;
+    int32_t pix_fmt;
+    int32_t reserved;
+    _Atomic(uint64_t) latest;
+} ShmHeader;
+
+typedef struct ShmSlotHeader {
+    _Atomic(uint32_t) seq;
+    uint32_t reserved;
+    uint64_t frame_number;
+    int64_t ndi_timestamp; /* NDI sender timestamp, 100 ns units */
+    int64_t capture_ts;    /* local capture time, microseconds */
+    int32_t linesize[4];
+    uint64_t offset[4];
+} ShmSlotHeader;
+
+typedef struct ShmOutputCtx {
+    int fd;
+    int listen_fd;
+    uint8_t *map;
+    size_t map_size;
+    ShmHeader *header;
+    ShmSlotHeader *current;
+
+    int slot_count;
+    int width;
+    int height;
+    enum AVPixelFormat pix_fmt;
+    uint64_t frame_number;
+
+    char *path;
+    char *error_str;
+} ShmOutputCtx;
+
+ShmOutputCtx *
+new_shm_output_ctx();
+
+int
+free_shm_output_ctx(ShmOutputCtx **ctx);
+
+int
+shm_output_init(ShmOutputCtx *ctx, const char *socket_path, int slot_count);
+
+int
+shm_output_setup(ShmOutputCtx *ctx, int width, int height,
+                 enum AVPixelFormat pix_fmt);
+
+int
+shm_output_begin_frame(ShmOutputCtx *ctx, uint8_t *data[4], int linesize[4]);
+
+void
+shm_output_end_frame(ShmOutputCtx *ctx, int64_t ndi_timestamp,
+                     int64_t capture_ts);
+
+void
+shm_output_poll_clients(ShmOutputCtx *ctx);
+
+#endif
@@ -0,0 +1,449 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "synthetic_source.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#define SS_TONE_HZ 1000.0
+#define SS_PI 3.14159265358979323846
+#define SS_NDI_TIME_BASE 10000000 // timecodes are in 100 ns units
+#define SS_STAMP_COLUMNS 32
+#define SS_STAMP_BITS 64
+#define SS_STAMP_VALUE_MASK ((UINT64_C(1) << 56) - 1)
+
+static const struct {
+    const char *name;
+    NDIlib_FourCC_video_type_e fourcc;
+} ss_fourccs[] = {
+    { "UYVY", NDIlib_FourCC_video_type_UYVY },
+    { "UYVA", NDIlib_FourCC_video_type_UYVA },
+    { "BGRA", NDIlib_FourCC_video_type_BGRA },
+    { "BGRX", NDIlib_FourCC_video_type_BGRX },
+    { "RGBA", NDIlib_FourCC_video_type_RGBA },
+    { "RGBX", NDIlib_FourCC_video_type_RGBX },
+    { "I420", NDIlib_FourCC_video_type_I420 },
+    { "YV12", NDIlib_FourCC_video_type_YV12 },
+    { "NV12", NDIlib_FourCC_video_type_NV12 },
+    { "P216", NDIlib_FourCC_video_type_P216 },
+    { "PA16", NDIlib_FourCC_video_type_PA16 },
+};
+
+SyntheticSourceCtx *
+new_synthetic_source_ctx()
+{
+    SyntheticSourceCtx *ctx = malloc(sizeof(SyntheticSourceCtx));
+    memset(ctx, 0, sizeof(SyntheticSourceCtx));
+    ctx->error_str = malloc(AV_ERROR_MAX_STRING_SIZE + 100);
+    ctx->frame_format = NDIlib_frame_format_type_progressive;
+    return ctx;
+}
+
+int
+free_synthetic_source_ctx(SyntheticSourceCtx **ctx)
+{
+    av_free((*ctx)->video_data);
+    av_free((*ctx)->audio_data);
+    free((*ctx)->error_str);
+    free(*ctx);
+    *ctx = NULL;
+    return 0;
+}
+
+int
+ss_fourcc_from_name(const char *name, NDIlib_FourCC_video_type_e *fourcc)
+{
+    for (size_t i = 0; i < sizeof ss_fourccs / sizeof *ss_fourccs; ++i) {
+        if (strcmp(ss_fourccs[i].name, name) == 0) {
+            *fourcc = ss_fourccs[i].fourcc;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int
+ss_frame_size(NDIlib_FourCC_video_type_e fourcc, int width, int height,
+              int *stride)
+{
+    switch (fourcc) {
+    case NDIlib_FourCC_video_type_UYVY:
+        *stride = width * 2;
+        return width * height * 2;
+    case NDIlib_FourCC_video_type_UYVA:
+        *stride = width * 2;
+        return width * height * 3;
+    case NDIlib_FourCC_video_type_I420:
+    case NDIlib_FourCC_video_type_YV12:
+    case NDIlib_FourCC_video_type_NV12:
+        *stride = width;
+        return width * height * 3 / 2;
+    case NDIlib_FourCC_video_type_P216:
+        *stride = width * 2;
+        return width * height * 4;
+    case NDIlib_FourCC_video_type_PA16:
+        *stride = width * 2;
+        return width * height * 6;
+    default:
+        *stride = width * 4;
+        return width * height * 4;
+    }
+}
+
+int
+ss_setup_video(SyntheticSourceCtx *ctx, NDIlib_FourCC_video_type_e fourcc,
+               int width, int height, int frame_rate_N, int frame_rate_D)
+{
+    if (width <= 0 || height <= 0 || width % 2 || height % 2) {
+        sprintf(ctx->error_str, "invalid frame size %dx%d", width, height);
+        return -1;
+    }
+    if (frame_rate_N <= 0 || frame_rate_D <= 0) {
+        sprintf(ctx->error_str, "invalid frame rate %d/%d", frame_rate_N,
+                frame_rate_D);
+        return -1;
+    }
+
+    int size = ss_frame_size(fourcc, width, height, &ctx->video_stride);
+
+    av_free(ctx->video_data);
+    ctx->video_data = av_mallocz(size);
+    if (!ctx->video_data) {
+        sprintf(ctx->error_str, "%s", "could not allocate video frame");
+        return -1;
+    }
+
+    ctx->video_size = size;
+    ctx->fourcc = fourcc;
+    ctx->width = width;
+    ctx->height = height;
+    ctx->frame_rate_N = frame_rate_N;
+    ctx->frame_rate_D = frame_rate_D;
+    ctx->video_index = 0;
+    return 0;
+}
+
+int
+ss_setup_audio(SyntheticSourceCtx *ctx, int sample_rate, int channels)
+{
+    if (sample_rate <= 0 || channels <= 0) {
+        sprintf(ctx->error_str, "invalid audio format %d Hz, %d channels",
+                sample_rate, channels);
+        return -1;
+    }
+
+    // one video frame worth of samples, at least 1/10 s without video
+    ctx->audio_capacity = sample_rate / 10 + 1;
+    av_free(ctx->audio_data);
+    ctx->audio_data = av_malloc(sizeof(float) * channels * ctx->audio_capacity);
+    if (!ctx->audio_data) {
+        sprintf(ctx->error_str, "%s", "could not allocate audio frame");
+        return -1;
+    }
+
+    ctx->sample_rate = sample_rate;
+    ctx->channels = channels;
+    ctx->audio_samples = 0;
+    ctx->audio_index = 0;
+    return 0;
+}
+
+/* Pattern values at (x, y) of frame t: a diagonal ramp scrolling right and
+ * a bright box bouncing across the picture. Chroma drifts slowly. */
+static inline uint8_t
+ss_luma(int x, int y, int t, int bx, int by, int bs)
+{
+    if (x >= bx && x < bx + bs && y >= by && y < by + bs) {
+        return 235;
+    }
+    return (uint8_t)(16 + ((x + y / 2 + t * 4) & 0xff) * 219 / 255);
+}
+
+static inline uint8_t
+ss_chroma_u(int x, int t)
+{
+    return (uint8_t)(64 + ((x / 4 + t) & 0x7f));
+}
+
+static inline uint8_t
+ss_chroma_v(int y, int t)
+{
+    return (uint8_t)(64 + ((y / 4 + t * 2) & 0x7f));
+}
+
+static void
+ss_render(SyntheticSourceCtx *ctx)
+{
+    const int w = ctx->width, h = ctx->height;
+    const int t = (int)(ctx->video_index & 0x7fffffff);
+    const int bs = h / 8;
+    const int bx = (int)((int64_t)t * 7 % (2 * (w - bs)));
+    const int by = (int)((int64_t)t * 5 % (2 * (h - bs)));
+    const int box_x = bx < w - bs ? bx : 2 * (w - bs) - bx;
+    const int box_y = by < h - bs ? by : 2 * (h - bs) - by;
+    uint8_t *data = ctx->video_data;
+
+    switch (ctx->fourcc) {
+    case NDIlib_FourCC_video_type_UYVY:
+    case NDIlib_FourCC_video_type_UYVA:
+        for (int y = 0; y < h; ++y) {
+            uint8_t *row = data + (size_t)y * ctx->video_stride;
+            for (int x = 0; x < w; x += 2) {
+                row[x * 2] = ss_chroma_u(x, t);
+                row[x * 2 + 1] = ss_luma(x, y, t, box_x, box_y, bs);
+                row[x * 2 + 2] = ss_chroma_v(y, t);
+                row[x * 2 + 3] = ss_luma(x + 1, y, t, box_x, box_y, bs);
+            }
+        }
+        if (ctx->fourcc == NDIlib_FourCC_video_type_UYVA) {
+            memset(data + (size_t)w * h * 2, 0xff, (size_t)w * h);
+        }
+        break;
+    case NDIlib_FourCC_video_type_I420:
+    case NDIlib_FourCC_video_type_YV12:
+    case NDIlib_FourCC_video_type_NV12: {
+        for (int y = 0; y < h; ++y) {
+            uint8_t *row = data + (size_t)y * w;
+            for (int x = 0; x < w; ++x) {
+                row[x] = ss_luma(x, y, t, box_x, box_y, bs);
+            }
+        }
+        uint8_t *chroma = data + (size_t)w * h;
+        int u_first = ctx->fourcc != NDIlib_FourCC_video_type_YV12;
+        for (int y = 0; y < h / 2; ++y) {
+            for (int x = 0; x < w / 2; ++x) {
+                uint8_t u = ss_chroma_u(x * 2, t), v = ss_chroma_v(y * 2, t);
+                if (ctx->fourcc == NDIlib_FourCC_video_type_NV12) {
+                    chroma[(size_t)y * w + x * 2] = u;
+                    chroma[(size_t)y * w + x * 2 + 1] = v;
+                }
+                else {
+                    size_t plane = (size_t)w * h / 4;
+                    size_t i = (size_t)y * (w / 2) + x;
+                    chroma[i + (u_first ? 0 : plane)] = u;
+                    chroma[i + (u_first ? plane : 0)] = v;
+                }
+            }
+        }
+        break;
+    }
+    case NDIlib_FourCC_video_type_P216:
+    case NDIlib_FourCC_video_type_PA16: {
+        uint16_t *luma = (uint16_t *)data;
+        uint16_t *chroma = luma + (size_t)w * h;
+        for (int y = 0; y < h; ++y) {
+            for (int x = 0; x < w; x += 2) {
+                size_t i = (size_t)y * w + x;
+                luma[i] = ss_luma(x, y, t, box_x, box_y, bs) << 8;
+                luma[i + 1] = ss_luma(x + 1, y, t, box_x, box_y, bs) << 8;
+                chroma[i] = ss_chroma_u(x, t) << 8;
+                chroma[i + 1] = ss_chroma_v(y, t) << 8;
+            }
+        }
+        if (ctx->fourcc == NDIlib_FourCC_video_type_PA16) {
+            memset(chroma + (size_t)w * h, 0xff, (size_t)w * h * 2);
+        }
+        break;
+    }
+    default: {
+        int bgr = ctx->fourcc == NDIlib_FourCC_video_type_BGRA
+                  || ctx->fourcc == NDIlib_FourCC_video_type_BGRX;
+        for (int y = 0; y < h; ++y) {
+            uint8_t *row = data + (size_t)y * ctx->video_stride;
+            for (int x = 0; x < w; ++x) {
+                uint8_t l = ss_luma(x, y, t, box_x, box_y, bs);
+                uint8_t r = (uint8_t)(l + ss_chroma_v(y, t) - 128);
+                uint8_t b = (uint8_t)(l + ss_chroma_u(x, t) - 128);
+                row[x * 4] = bgr ? b : r;
+                row[x * 4 + 1] = l;
+                row[x * 4 + 2] = bgr ? r : b;
+                row[x * 4 + 3] = 0xff;
+            }
+        }
+        break;
+    }
+    }
+}
+
+void
+ss_next_video(SyntheticSourceCtx *ctx, NDIlib_video_frame_v2_t *frame)
+{
+    ss_render(ctx);
+
+    memset(frame, 0, sizeof(NDIlib_video_frame_v2_t));
+    frame->xres = ctx->width;
+    frame->yres = ctx->height;
+    frame->FourCC = ctx->fourcc;
+    frame->frame_rate_N = ctx->frame_rate_N;
+    frame->frame_rate_D = ctx->frame_rate_D;
+    frame->picture_aspect_ratio = (float)ctx->width / (float)ctx->height;
+    frame->frame_format_type = ctx->frame_format;
+    frame->timecode = ctx->video_index * SS_NDI_TIME_BASE * ctx->frame_rate_D
+                      / ctx->frame_rate_N;
+    frame->timestamp = frame->timecode;
+    frame->p_data = ctx->video_data;
+    frame->line_stride_in_bytes = ctx->video_stride;
+
+    ctx->video_index++;
+}
+
+void
+ss_next_audio(SyntheticSourceCtx *ctx, NDIlib_audio_frame_v2_t *frame)
+{
+    int64_t end;
+    if (ctx->frame_rate_N > 0) {
+        // one frame per video frame, so 1601/1602 samples at 29.97 fps
+        end = (ctx->audio_index + 1) * ctx->sample_rate * ctx->frame_rate_D
+              / ctx->frame_rate_N;
+    }
+    else {
+        end = ctx->audio_samples + ctx->sample_rate / 50;
+    }
+
+    int nb_samples = (int)(end - ctx->audio_samples);
+    if (nb_samples > ctx->audio_capacity) {
+        nb_samples = ctx->audio_capacity;
+    }
+
+    for (int c = 0; c < ctx->channels; ++c) {
+        float *plane = ctx->audio_data + (size_t)c * nb_samples;
+        for (int i = 0; i < nb_samples; ++i) {
+            double s = (double)(ctx->audio_samples + i) / ctx->sample_rate;
+            plane[i] = (float)(0.25 * sin(2 * SS_PI * SS_TONE_HZ * s));
+        }
+    }
+
+    memset(frame, 0, sizeof(NDIlib_audio_frame_v2_t));
+    frame->sample_rate = ctx->sample_rate;
+    frame->no_channels = ctx->channels;
+    frame->no_samples = nb_samples;
+    frame->timecode = ctx->audio_samples * SS_NDI_TIME_BASE / ctx->sample_rate;
+    frame->timestamp = frame->timecode;
+    frame->p_data = ctx->audio_data;
+    frame->channel_stride_in_bytes = (int)sizeof(float) * nb_samples;
+
+    ctx->audio_samples += nb_samples;
+    ctx->audio_index++;
+}
+
+static void
+ss_fill_rect(SyntheticSourceCtx *ctx, int x0, int y0, int w, int h,
+             uint8_t luma)
+{
+    uint8_t *data = ctx->video_data;
+    const int width = ctx->width, height = ctx->height;
+
+    for (int y = y0; y < y0 + h && y < height; ++y) {
+        for (int x = x0; x < x0 + w && x < width; ++x) {
+            size_t i = (size_t)y * width + x;
+            switch (ctx->fourcc) {
+            case NDIlib_FourCC_video_type_UYVY:
+            case NDIlib_FourCC_video_type_UYVA: {
+                uint8_t *row = data + (size_t)y * ctx->video_stride;
+                row[x * 2 + 1] = luma;
+                row[(x & ~1) * 2] = 128;
+                row[(x & ~1) * 2 + 2] = 128;
+                break;
+            }
+            case NDIlib_FourCC_video_type_I420:
+            case NDIlib_FourCC_video_type_YV12: {
+                size_t plane = (size_t)width * height;
+                size_t c = (size_t)(y / 2) * (width / 2) + x / 2;
+                data[i] = luma;
+                data[plane + c] = 128;
+                data[plane + plane / 4 + c] = 128;
+                break;
+            }
+            case NDIlib_FourCC_video_type_NV12: {
+                size_t c = (size_t)width * height + (size_t)(y / 2) * width
+                           + (x & ~1);
+                data[i] = luma;
+                data[c] = 128;
+                data[c + 1] = 128;
+                break;
+            }
+            case NDIlib_FourCC_video_type_P216:
+            case NDIlib_FourCC_video_type_PA16: {
+                uint16_t *plane = (uint16_t *)data;
+                size_t c = (size_t)width * height + (size_t)y * width
+                           + (x & ~1);
+                plane[i] = luma << 8;
+                plane[c] = 128 << 8;
+                plane[c + 1] = 128 << 8;
+                break;
+            }
+            default: {
+                uint8_t *px = data + (size_t)y * ctx->video_stride + x * 4;
+                px[0] = px[1] = px[2] = luma;
+                break;
+            }
+            }
+        }
+    }
+}
+
+static uint8_t
+ss_stamp_checksum(uint64_t value)
+{
+    uint8_t sum = 0x5a;
+    for (int i = 0; i < 7; ++i) {
+        sum = (uint8_t)((sum << 1 | sum >> 7) ^ (value >> (i * 8)));
+    }
+    return sum;
+}
+
+void
+ss_stamp(SyntheticSourceCtx *ctx, uint64_t value)
+{
+    int size = ctx->width / SS_STAMP_COLUMNS;
+    value &= SS_STAMP_VALUE_MASK;
+    uint64_t bits = value << 8 | ss_stamp_checksum(value);
+
+    for (int i = 0; i < SS_STAMP_BITS; ++i) {
+        int bit = (int)(bits >> (SS_STAMP_BITS - 1 - i)) & 1;
+        ss_fill_rect(ctx, (i % SS_STAMP_COLUMNS) * size,
+                     (i / SS_STAMP_COLUMNS) * size, size, size,
+                     bit ? 235 : 16);
+    }
+}
+
+int
+ss_read_stamp(const uint8_t *luma, int linesize, int width, int height,
+              uint64_t *value)
+{
+    int size = width / SS_STAMP_COLUMNS;
+    if (size < 4 || height < size * 2) {
+        return -1;
+    }
+
+    uint64_t bits = 0;
+    for (int i = 0; i < SS_STAMP_BITS; ++i) {
+        // average the middle of the block, edges get smeared by the encoder
+        int x0 = (i % SS_STAMP_COLUMNS) * size + size / 4;
+        int y0 = (i / SS_STAMP_COLUMNS) * size + size / 4;
+        int sum = 0, n = 0;
+        for (int y = y0; y < y0 + size / 2; ++y) {
+            for (int x = x0; x < x0 + size / 2; ++x) {
+                sum += luma[(size_t)y * linesize + x];
+                n++;
+            }
+        }
+        bits = bits << 1 | (sum / n > 125);
+    }
+
+    uint64_t v = bits >> 8;
+    if ((uint8_t)(bits & 0xff) != ss_stamp_checksum(v)) {
+        return -1;
+    }
+    *value = v;
+    return 0;
+}
@@ -0,0 +1,76 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef SYNTHETIC_SOURCE_H
+#define SYNTHETIC_SOURCE_H
+
+#include <Processing.NDI.Lib.h>
+
+/* Generates NDI-shaped frames without a sender: a scrolling ramp with a
+ * moving box in any FourCC the converter knows, and a sine tone in NDI's
+ * planar float layout. Frames point into buffers owned by the context and
+ * stay valid until the next call. */
+typedef struct SyntheticSourceCtx {
+    NDIlib_FourCC_video_type_e fourcc;
+    int width;
+    int height;
+    int frame_rate_N;
+    int frame_rate_D;
+    NDIlib_frame_format_type_e frame_format; // progressive by default
+    uint8_t *video_data;
+    int video_size;
+    int video_stride;
+    int64_t video_index;
+
+    int sample_rate;
+    int channels;
+    float *audio_data;
+    int audio_capacity;
+    int64_t audio_samples;
+    int64_t audio_index;
+
+    char *error_str;
+} SyntheticSourceCtx;
+
+SyntheticSourceCtx *
+new_synthetic_source_ctx();
+
+int
+free_synthetic_source_ctx(SyntheticSourceCtx **ctx);
+
+int
+ss_fourcc_from_name(const char *name, NDIlib_FourCC_video_type_e *fourcc);
+
+int
+ss_frame_size(NDIlib_FourCC_video_type_e fourcc, int width, int height,
+              int *stride);
+
+int
+ss_setup_video(SyntheticSourceCtx *ctx, NDIlib_FourCC_video_type_e fourcc,
+               int width, int height, int frame_rate_N, int frame_rate_D);
+
+int
+ss_setup_audio(SyntheticSourceCtx *ctx, int sample_rate, int channels);
+
+void
+ss_next_video(SyntheticSourceCtx *ctx, NDIlib_video_frame_v2_t *frame);
+
+void
+ss_next_audio(SyntheticSourceCtx *ctx, NDIlib_audio_frame_v2_t *frame);
+
+/* Burns a 56-bit value with an 8-bit checksum into the top of the current
+ * video frame as two rows of 32 black/white blocks, each 1/32 of the frame
+ * width, so it survives scaling and lossy encoding. */
+void
+ss_stamp(SyntheticSourceCtx *ctx, uint64_t value);
+
+/* Reads a stamp back from an 8-bit luma plane of any size, returns -1 when
+ * the checksum does not match. */
+int
+ss_read_stamp(const uint8_t *luma, int linesize, int width, int height,
+              uint64_t *value);
+
+#endif
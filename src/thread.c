@@ -0,0 +1,224 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "thread.h"
+
+#include <stdlib.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+typedef struct ThreadStart {
+    ThreadFn fn;
+    void *arg;
+} ThreadStart;
+
+#ifdef _WIN32
+
+static DWORD WINAPI
+thread_start(LPVOID param)
+{
+    ThreadStart start = *(ThreadStart *)param;
+    free(param);
+    start.fn(start.arg);
+    return 0;
+}
+
+int
+thread_create(Thread *thread, ThreadFn fn, void *arg)
+{
+    ThreadStart *start = malloc(sizeof(ThreadStart));
+    start->fn = fn;
+    start->arg = arg;
+    *thread = CreateThread(NULL, 0, thread_start, start, 0, NULL);
+    if (*thread == NULL) {
+        free(start);
+        return -1;
+    }
+    return 0;
+}
+
+void
+thread_join(Thread thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+void
+thread_sleep_ms(int ms)
+{
+    Sleep(ms);
+}
+
+void
+mutex_init(Mutex *mu)
+{
+    InitializeSRWLock(mu);
+}
+
+void
+mutex_destroy(Mutex *mu)
+{
+}
+
+void
+mutex_lock(Mutex *mu)
+{
+    AcquireSRWLockExclusive(mu);
+}
+
+void
+mutex_unlock(Mutex *mu)
+{
+    ReleaseSRWLockExclusive(mu);
+}
+
+void
+cond_init(Cond *cv)
+{
+    InitializeConditionVariable(cv);
+}
+
+void
+cond_destroy(Cond *cv)
+{
+}
+
+void
+cond_wait(Cond *cv, Mutex *mu)
+{
+    SleepConditionVariableSRW(cv, mu, INFINITE, 0);
+}
+
+int
+cond_timedwait_ms(Cond *cv, Mutex *mu, int ms)
+{
+    return SleepConditionVariableSRW(cv, mu, ms, 0) ? 0 : 1;
+}
+
+void
+cond_signal(Cond *cv)
+{
+    WakeConditionVariable(cv);
+}
+
+void
+cond_broadcast(Cond *cv)
+{
+    WakeAllConditionVariable(cv);
+}
+
+#else
+
+static void *
+thread_start(void *param)
+{
+    ThreadStart start = *(ThreadStart *)param;
+    free(param);
+    start.fn(start.arg);
+    return NULL;
+}
+
+int
+thread_create(Thread *thread, ThreadFn fn, void *arg)
+{
+    ThreadStart *start = malloc(sizeof(ThreadStart));
+    start->fn = fn;
+    start->arg = arg;
+    if (pthread_create(thread, NULL, thread_start, start) != 0) {
+        free(start);
+        return -1;
+    }
+    return 0;
+}
+
+void
+thread_join(Thread thread)
+{
+    pthread_join(thread, NULL);
+}
+
+void
+thread_sleep_ms(int ms)
+{
+    struct timespec ts = { .tv_sec = ms / 1000,
+                           .tv_nsec = (long)(ms % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+void
+mutex_init(Mutex *mu)
+{
+    pthread_mutex_init(mu, NULL);
+}
+
+void
+mutex_destroy(Mutex *mu)
+{
+    pthread_mutex_destroy(mu);
+}
+
+void
+mutex_lock(Mutex *mu)
+{
+    pthread_mutex_lock(mu);
+}
+
+void
+mutex_unlock(Mutex *mu)
+{
+    pthread_mutex_unlock(mu);
+}
+
+void
+cond_init(Cond *cv)
+{
+    pthread_cond_init(cv, NULL);
+}
+
+void
+cond_destroy(Cond *cv)
+{
+    pthread_cond_destroy(cv);
+}
+
+void
+cond_wait(Cond *cv, Mutex *mu)
+{
+    pthread_cond_wait(cv, mu);
+}
+
+int
+cond_timedwait_ms(Cond *cv, Mutex *mu, int ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return pthread_cond_timedwait(cv, mu, &ts) == ETIMEDOUT;
+}
+
+void
+cond_signal(Cond *cv)
+{
+    pthread_cond_signal(cv);
+}
+
+void
+cond_broadcast(Cond *cv)
+{
+    pthread_cond_broadcast(cv);
+}
+
+#endif
@@ -0,0 +1,73 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+typedef SRWLOCK Mutex;
+typedef CONDITION_VARIABLE Cond;
+#else
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+#endif
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+typedef void (*ThreadFn)(void *arg);
+
+int
+thread_create(Thread *thread, ThreadFn fn, void *arg);
+
+void
+thread_join(Thread thread);
+
+void
+thread_sleep_ms(int ms);
+
+void
+mutex_init(Mutex *mu);
+
+void
+mutex_destroy(Mutex *mu);
+
+void
+mutex_lock(Mutex *mu);
+
+void
+mutex_unlock(Mutex *mu);
+
+void
+cond_init(Cond *cv);
+
+void
+cond_destroy(Cond *cv);
+
+void
+cond_wait(Cond *cv, Mutex *mu);
+
+int
+cond_timedwait_ms(Cond *cv, Mutex *mu, int ms);
+
+void
+cond_signal(Cond *cv);
+
+void
+cond_broadcast(Cond *cv);
+
+#endif
@@ -0,0 +1,310 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "trace.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define TRACE_CHUNK_EVENTS 4096
+#define TRACE_MAX_EVENTS (4 * 1024 * 1024)
+
+typedef struct TraceEvent {
+    const char *name;
+    const char *label;
+    int64_t ts;
+    int64_t dur;
+} TraceEvent;
+
+typedef struct TraceChunk {
+    TraceEvent events[TRACE_CHUNK_EVENTS];
+    _Atomic(int) count;
+    struct TraceChunk *_Atomic next;
+} TraceChunk;
+
+/* Only the owning thread appends; the writer walks the chunks and reads
+ * `count` to see which events are complete. Buffers are never freed, a
+ * thread may still hold its pointer after trace_stop. */
+typedef struct TraceBuffer {
+    int tid;
+    const char *_Atomic name;
+    TraceChunk *head;
+    TraceChunk *tail;
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+typedef struct TraceString {
+    struct TraceString *next;
+    char str[];
+} TraceString;
+
+static _Atomic(int) trace_enabled;
+static _Atomic(int64_t) trace_nb_events;
+static _Atomic(int) trace_next_tid;
+static TraceBuffer *_Atomic trace_buffers;
+static THREAD_LOCAL TraceBuffer *trace_local;
+
+static FILE *trace_file;
+static int64_t trace_start_ts;
+static int64_t trace_deadline;
+static char trace_error_str[300];
+
+static Mutex trace_strings_mu;
+static TraceString *trace_strings;
+
+static int64_t
+trace_clock()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (int64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static TraceBuffer *
+trace_buffer()
+{
+    if (trace_local) {
+        return trace_local;
+    }
+
+    TraceBuffer *buf = calloc(1, sizeof(TraceBuffer));
+    buf->tid = atomic_fetch_add(&trace_next_tid, 1) + 1;
+    buf->head = buf->tail = calloc(1, sizeof(TraceChunk));
+
+    buf->next = atomic_load(&trace_buffers);
+    while (!atomic_compare_exchange_weak(&trace_buffers, &buf->next, buf)) {
+    }
+
+    trace_local = buf;
+    return buf;
+}
+
+int
+trace_start(const char *path, int max_seconds)
+{
+#ifndef NDI_STREAMER_TRACE
+    (void)path;
+    (void)max_seconds;
+    snprintf(trace_error_str, sizeof trace_error_str, "%s",
+             "tracing is disabled in this build (NDI_STREAMER_TRACE=OFF)");
+    return -1;
+#else
+    trace_file = fopen(path, "w");
+    if (!trace_file) {
+        snprintf(trace_error_str, sizeof trace_error_str,
+                 "could not open trace file \"%.200s\" (%s)", path,
+                 strerror(errno));
+        return -1;
+    }
+
+    mutex_init(&trace_strings_mu);
+    trace_start_ts = trace_clock();
+    trace_deadline = 0;
+    if (max_seconds > 0) {
+        trace_deadline = trace_start_ts + (int64_t)max_seconds * 1000000000;
+    }
+    atomic_store(&trace_enabled, 1);
+    return 0;
+#endif
+}
+
+int
+trace_active()
+{
+    return atomic_load(&trace_enabled);
+}
+
+int
+trace_expired()
+{
+    return atomic_load(&trace_enabled) && trace_deadline
+           && trace_clock() >= trace_deadline;
+}
+
+const char *
+trace_error()
+{
+    return trace_error_str;
+}
+
+int64_t
+trace_now()
+{
+    if (!atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+        return 0;
+    }
+    return trace_clock();
+}
+
+void
+trace_span(const char *name, const char *label, int64_t start)
+{
+    if (start == 0
+        || !atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+        return;
+    }
+    if (atomic_fetch_add_explicit(&trace_nb_events, 1, memory_order_relaxed)
+        >= TRACE_MAX_EVENTS) {
+        return;
+    }
+
+    TraceBuffer *buf = trace_buffer();
+    TraceChunk *chunk = buf->tail;
+    int count = atomic_load_explicit(&chunk->count, memory_order_relaxed);
+
+    if (count == TRACE_CHUNK_EVENTS) {
+        TraceChunk *next = calloc(1, sizeof(TraceChunk));
+        if (!next) {
+            return;
+        }
+        atomic_store_explicit(&chunk->next, next, memory_order_release);
+        buf->tail = chunk = next;
+        count = 0;
+    }
+
+    TraceEvent *event = &chunk->events[count];
+    event->name = name;
+    event->label = label;
+    event->ts = start;
+    event->dur = trace_clock() - start;
+    atomic_store_explicit(&chunk->count, count + 1, memory_order_release);
+}
+
+void
+trace_thread_name(const char *fmt, ...)
+{
+    if (!atomic_load(&trace_enabled)) {
+        return;
+    }
+
+    char name[128];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(name, sizeof name, fmt, args);
+    va_end(args);
+
+    atomic_store(&trace_buffer()->name, trace_intern(name));
+}
+
+const char *
+trace_intern(const char *str)
+{
+    if (!atomic_load(&trace_enabled) || !str) {
+        return NULL;
+    }
+
+    size_t len = strlen(str);
+    TraceString *node = malloc(sizeof(TraceString) + len + 1);
+    memcpy(node->str, str, len + 1);
+
+    mutex_lock(&trace_strings_mu);
+    node->next = trace_strings;
+    trace_strings = node;
+    mutex_unlock(&trace_strings_mu);
+
+    return node->str;
+}
+
+static void
+trace_write_string(const char *str)
+{
+    fputc('"', trace_file);
+    for (const char *c = str; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', trace_file);
+            fputc(*c, trace_file);
+        }
+        else if ((unsigned char)*c < 0x20) {
+            fprintf(trace_file, "\\u%04x", *c);
+        }
+        else {
+            fputc(*c, trace_file);
+        }
+    }
+    fputc('"', trace_file);
+}
+
+int
+trace_stop()
+{
+    if (!atomic_exchange(&trace_enabled, 0)) {
+        return 0;
+    }
+
+    int first = 1;
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    for (TraceBuffer *buf = atomic_load(&trace_buffers); buf;
+         buf = buf->next) {
+        const char *name = atomic_load(&buf->name);
+        if (name) {
+            fprintf(trace_file,
+                    "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                    "\"tid\":%d,\"args\":{\"name\":",
+                    first ? "" : ",\n", buf->tid);
+            trace_write_string(name);
+            fprintf(trace_file, "}}");
+            first = 0;
+        }
+
+        for (TraceChunk *chunk = buf->head; chunk;
+             chunk = atomic_load_explicit(&chunk->next,
+                                          memory_order_acquire)) {
+            int count = atomic_load_explicit(&chunk->count,
+                                             memory_order_acquire);
+            for (int i = 0; i < count; ++i) {
+                TraceEvent *event = &chunk->events[i];
+                fprintf(trace_file,
+                        "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                        "\"ts\":%.3f,\"dur\":%.3f",
+                        first ? "" : ",\n", event->name, buf->tid,
+                        (double)(event->ts - trace_start_ts) / 1000,
+                        (double)event->dur / 1000);
+                if (event->label) {
+                    fprintf(trace_file, ",\"args\":{\"pipeline\":");
+                    trace_write_string(event->label);
+                    fprintf(trace_file, "}");
+                }
+                fprintf(trace_file, "}");
+                first = 0;
+            }
+        }
+    }
+
+    fprintf(trace_file, "\n]}\n");
+
+    int ret = 0;
+    if (ferror(trace_file)) {
+        snprintf(trace_error_str, sizeof trace_error_str,
+                 "error writing trace file (%s)", strerror(errno));
+        ret = -1;
+    }
+    fclose(trace_file);
+    trace_file = NULL;
+    return ret;
+}
@@ -0,0 +1,59 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Span tracing in the Chrome trace-event format (chrome://tracing,
+ * ui.perfetto.dev). Every thread appends to its own buffer without locks;
+ * the buffers are written out by trace_stop.
+ *
+ *   TRACE_BEGIN(t);
+ *   sws_scale(...);
+ *   TRACE_END(t, "sws_scale", ctx->trace_label);
+ *
+ * Without NDI_STREAMER_TRACE the macros compile to nothing. Names must be
+ * string literals, labels come from trace_intern. */
+#ifdef NDI_STREAMER_TRACE
+#define TRACE_BEGIN(var) int64_t var = trace_now()
+#define TRACE_END(var, name, label) trace_span(name, label, var)
+#define TRACE_THREAD_NAME(...) trace_thread_name(__VA_ARGS__)
+#else
+#define TRACE_BEGIN(var) (void)0
+#define TRACE_END(var, name, label) (void)0
+#define TRACE_THREAD_NAME(...) (void)0
+#endif
+
+int
+trace_start(const char *path, int max_seconds);
+
+int
+trace_stop();
+
+int
+trace_active();
+
+int
+trace_expired();
+
+const char *
+trace_error();
+
+int64_t
+trace_now();
+
+void
+trace_span(const char *name, const char *label, int64_t start);
+
+void
+trace_thread_name(const char *fmt, ...);
+
+const char *
+trace_intern(const char *str);
+
+#endif
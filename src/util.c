@@ -28,6 +28,7 @@ pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
 
 int eh_initialized = 0;
 _Atomic(int) eh_got_signal = 0;
+_Atomic(int) eh_got_replay_request = 0;
 
 typedef struct OPInternalCtx {
     char *short_options;
@@ -81,6 +82,12 @@ eh_signal_handler(__attribute__((unused)) int _)
     pthread_cond_signal(&cv);
 }
 
+void
+eh_replay_signal_handler(__attribute__((unused)) int _)
+{
+    atomic_store(&eh_got_replay_request, 1);
+}
+
 void
 eh_init()
 {
@@ -91,6 +98,12 @@ eh_init()
         sigemptyset(&action.sa_mask);
         action.sa_flags = 0;
         sigaction(SIGINT, &action, NULL);
+
+        struct sigaction replay_action = {};
+        replay_action.sa_handler = &eh_replay_signal_handler;
+        sigemptyset(&replay_action.sa_mask);
+        replay_action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &replay_action, NULL);
         eh_initialized = 1;
     }
 }
@@ -116,6 +129,12 @@ eh_alive()
     return !atomic_load(&eh_got_signal);
 }
 
+int
+eh_take_replay_request()
+{
+    return atomic_exchange(&eh_got_replay_request, 0);
+}
+
 OptionParserCtx *
 op_init(const ProgramOption *options)
 {
@@ -154,7 +173,7 @@ op_init(const ProgramOption *options)
         }
 
         raw_options[i].has_arg
-                = options[n].is_flag ? no_argument : required_argument;
+                = options[i].is_flag ? no_argument : required_argument;
         raw_options[i].val = i;
         raw_options[i].flag = NULL;
     }
@@ -25,6 +25,9 @@ eh_alive();
 void
 eh_wait();
 
+int
+eh_take_replay_request();
+
 OptionParserCtx *
 op_init(const ProgramOption *options);
 
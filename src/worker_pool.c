@@ -0,0 +1,314 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "worker_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define WORK_DEQUE_INITIAL_CAPACITY 16
+
+static THREAD_LOCAL Worker *current_worker;
+
+static void
+wd_init(WorkDeque *deque)
+{
+    mutex_init(&deque->mu);
+    deque->capacity = WORK_DEQUE_INITIAL_CAPACITY;
+    deque->items = malloc(sizeof(WorkQueue *) * deque->capacity);
+    deque->head = 0;
+    deque->size = 0;
+}
+
+static void
+wd_destroy(WorkDeque *deque)
+{
+    mutex_destroy(&deque->mu);
+    free(deque->items);
+}
+
+static void
+wd_push(WorkDeque *deque, WorkQueue *queue)
+{
+    mutex_lock(&deque->mu);
+    if (deque->size == deque->capacity) {
+        WorkQueue **items = malloc(sizeof(WorkQueue *) * deque->capacity * 2);
+        for (int i = 0; i < deque->size; ++i) {
+            items[i] = deque->items[(deque->head + i) % deque->capacity];
+        }
+        free(deque->items);
+        deque->items = items;
+        deque->head = 0;
+        deque->capacity *= 2;
+    }
+    deque->items[(deque->head + deque->size) % deque->capacity] = queue;
+    deque->size++;
+    mutex_unlock(&deque->mu);
+}
+
+static WorkQueue *
+wd_take(WorkDeque *deque, int steal)
+{
+    WorkQueue *queue = NULL;
+
+    mutex_lock(&deque->mu);
+    if (deque->size > 0) {
+        deque->size--;
+        if (steal) {
+            queue = deque->items[(deque->head + deque->size) % deque->capacity];
+        }
+        else {
+            queue = deque->items[deque->head];
+            deque->head = (deque->head + 1) % deque->capacity;
+        }
+    }
+    mutex_unlock(&deque->mu);
+    return queue;
+}
+
+static void
+wp_schedule(WorkerPool *pool, WorkQueue *queue)
+{
+    Worker *worker = current_worker;
+    if (!worker || worker->pool != pool) {
+        unsigned n = atomic_fetch_add(&pool->next_worker, 1);
+        worker = &pool->workers[n % pool->nb_workers];
+    }
+
+    wd_push(&worker->deques[queue->priority], queue);
+    atomic_fetch_add(&pool->ready, 1);
+
+    // pairs with the idle check in wp_worker: either the sleeping worker
+    // sees `ready` or we see it in `idle` and wake it up
+    if (atomic_load(&pool->idle) > 0) {
+        mutex_lock(&pool->mu);
+        cond_signal(&pool->cv);
+        mutex_unlock(&pool->mu);
+    }
+}
+
+static WorkQueue *
+wp_find_work(Worker *worker)
+{
+    WorkerPool *pool = worker->pool;
+
+    for (int p = 0; p < WORK_PRIORITY_COUNT; ++p) {
+        WorkQueue *queue = wd_take(&worker->deques[p], 0);
+
+        for (int i = 1; !queue && i < pool->nb_workers; ++i) {
+            Worker *victim = &pool->workers[(worker->index + i)
+                                            % pool->nb_workers];
+            queue = wd_take(&victim->deques[p], 1);
+        }
+
+        if (queue) {
+            atomic_fetch_sub(&pool->ready, 1);
+            return queue;
+        }
+    }
+    return NULL;
+}
+
+static void
+wp_run(WorkerPool *pool, WorkQueue *queue)
+{
+    mutex_lock(&queue->mu);
+    WorkItem *item = queue->head;
+    queue->head = item->next;
+    if (!queue->head) {
+        queue->tail = NULL;
+    }
+    queue->depth--;
+    mutex_unlock(&queue->mu);
+
+    item->fn(item->arg);
+    free(item);
+
+    mutex_lock(&queue->mu);
+    int pending = queue->head != NULL;
+    if (!pending) {
+        queue->scheduled = 0;
+        cond_broadcast(&queue->idle_cv);
+    }
+    mutex_unlock(&queue->mu);
+
+    // one job at a time so that a busy queue does not starve the others
+    if (pending) {
+        wp_schedule(pool, queue);
+    }
+}
+
+static void
+wp_worker(void *arg)
+{
+    Worker *worker = arg;
+    WorkerPool *pool = worker->pool;
+
+    current_worker = worker;
+    TRACE_THREAD_NAME("worker %d", worker->index);
+
+    for (;;) {
+        WorkQueue *queue = wp_find_work(worker);
+        if (queue) {
+            wp_run(pool, queue);
+            continue;
+        }
+
+        mutex_lock(&pool->mu);
+        atomic_fetch_add(&pool->idle, 1);
+        while (atomic_load(&pool->ready) == 0 && !atomic_load(&pool->stop)) {
+            cond_wait(&pool->cv, &pool->mu);
+        }
+        atomic_fetch_sub(&pool->idle, 1);
+        int done = atomic_load(&pool->ready) == 0 && atomic_load(&pool->stop);
+        mutex_unlock(&pool->mu);
+
+        if (done) {
+            break;
+        }
+    }
+
+    current_worker = NULL;
+}
+
+WorkerPool *
+new_worker_pool(int nb_threads)
+{
+    WorkerPool *pool = malloc(sizeof(WorkerPool));
+    memset(pool, 0, sizeof(WorkerPool));
+    mutex_init(&pool->mu);
+    cond_init(&pool->cv);
+
+    if (nb_threads < 1) {
+        nb_threads = 1;
+    }
+
+    pool->workers = malloc(sizeof(Worker) * nb_threads);
+    pool->nb_workers = nb_threads;
+
+    for (int i = 0; i < nb_threads; ++i) {
+        Worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        for (int p = 0; p < WORK_PRIORITY_COUNT; ++p) {
+            wd_init(&worker->deques[p]);
+        }
+    }
+
+    // deques must exist before any worker may try to steal from them
+    for (int i = 0; i < nb_threads; ++i) {
+        if (thread_create(&pool->workers[i].thread, wp_worker,
+                          &pool->workers[i])
+            < 0) {
+            pool->nb_workers = i;
+            break;
+        }
+    }
+
+    return pool;
+}
+
+int
+free_worker_pool(WorkerPool **pool)
+{
+    WorkerPool *p = *pool;
+
+    mutex_lock(&p->mu);
+    atomic_store(&p->stop, 1);
+    cond_broadcast(&p->cv);
+    mutex_unlock(&p->mu);
+
+    for (int i = 0; i < p->nb_workers; ++i) {
+        thread_join(p->workers[i].thread);
+    }
+    for (int i = 0; i < p->nb_workers; ++i) {
+        for (int j = 0; j < WORK_PRIORITY_COUNT; ++j) {
+            wd_destroy(&p->workers[i].deques[j]);
+        }
+    }
+
+    cond_destroy(&p->cv);
+    mutex_destroy(&p->mu);
+    free(p->workers);
+    free(p);
+    *pool = NULL;
+    return 0;
+}
+
+WorkQueue *
+new_work_queue(WorkerPool *pool, WorkPriority priority)
+{
+    WorkQueue *queue = malloc(sizeof(WorkQueue));
+    memset(queue, 0, sizeof(WorkQueue));
+    queue->pool = pool;
+    queue->priority = priority;
+    mutex_init(&queue->mu);
+    cond_init(&queue->idle_cv);
+    return queue;
+}
+
+int
+free_work_queue(WorkQueue **queue)
+{
+    wq_drain(*queue);
+    cond_destroy(&(*queue)->idle_cv);
+    mutex_destroy(&(*queue)->mu);
+    free(*queue);
+    *queue = NULL;
+    return 0;
+}
+
+int
+wq_submit(WorkQueue *queue, WorkFn fn, void *arg)
+{
+    WorkItem *item = malloc(sizeof(WorkItem));
+    if (!item) {
+        return -1;
+    }
+    item->fn = fn;
+    item->arg = arg;
+    item->next = NULL;
+
+    mutex_lock(&queue->mu);
+    if (queue->tail) {
+        queue->tail->next = item;
+    }
+    else {
+        queue->head = item;
+    }
+    queue->tail = item;
+    queue->depth++;
+
+    int schedule = !queue->scheduled;
+    queue->scheduled = 1;
+    mutex_unlock(&queue->mu);
+
+    if (schedule) {
+        wp_schedule(queue->pool, queue);
+    }
+    return 0;
+}
+
+int
+wq_depth(WorkQueue *queue)
+{
+    mutex_lock(&queue->mu);
+    int depth = queue->depth;
+    mutex_unlock(&queue->mu);
+    return depth;
+}
+
+void
+wq_drain(WorkQueue *queue)
+{
+    mutex_lock(&queue->mu);
+    while (queue->scheduled) {
+        cond_wait(&queue->idle_cv, &queue->mu);
+    }
+    mutex_unlock(&queue->mu);
+}
@@ -0,0 +1,99 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stdatomic.h>
+
+#include "thread.h"
+
+typedef void (*WorkFn)(void *arg);
+
+typedef enum WorkPriority {
+    WORK_PRIORITY_HIGH, // program outputs
+    WORK_PRIORITY_LOW,  // preview outputs
+    WORK_PRIORITY_COUNT,
+} WorkPriority;
+
+typedef struct WorkItem {
+    WorkFn fn;
+    void *arg;
+    struct WorkItem *next;
+} WorkItem;
+
+/* Serial queue: jobs submitted to one queue run one at a time in
+ * submission order, jobs of different queues run in parallel on the
+ * pool threads. */
+typedef struct WorkQueue {
+    struct WorkerPool *pool;
+    WorkPriority priority;
+
+    Mutex mu;
+    Cond idle_cv;
+    WorkItem *head;
+    WorkItem *tail;
+    int depth;
+    int scheduled;
+} WorkQueue;
+
+/* Ring of queues that have pending jobs. The owning worker takes the
+ * oldest queue so pipelines are served in turn, idle workers steal the
+ * newest one. */
+typedef struct WorkDeque {
+    Mutex mu;
+    WorkQueue **items;
+    int capacity;
+    int head;
+    int size;
+} WorkDeque;
+
+typedef struct Worker {
+    struct WorkerPool *pool;
+    int index;
+    Thread thread;
+    WorkDeque deques[WORK_PRIORITY_COUNT];
+} Worker;
+
+/* Work-stealing pool: every worker has a deque per priority class, a
+ * queue that still has jobs after running one goes back to the deque of
+ * the worker that ran it. Higher priority queues are looked up on every
+ * worker before lower priority ones. */
+typedef struct WorkerPool {
+    Worker *workers;
+    int nb_workers;
+
+    _Atomic(int) ready;
+    _Atomic(int) idle;
+    _Atomic(unsigned) next_worker;
+    _Atomic(int) stop;
+
+    Mutex mu;
+    Cond cv;
+} WorkerPool;
+
+WorkerPool *
+new_worker_pool(int nb_threads);
+
+int
+free_worker_pool(WorkerPool **pool);
+
+WorkQueue *
+new_work_queue(WorkerPool *pool, WorkPriority priority);
+
+int
+free_work_queue(WorkQueue **queue);
+
+int
+wq_submit(WorkQueue *queue, WorkFn fn, void *arg);
+
+int
+wq_depth(WorkQueue *queue);
+
+void
+wq_drain(WorkQueue *queue);
+
+#endif
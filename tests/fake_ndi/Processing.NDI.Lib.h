@@ -0,0 +1,199 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef PROCESSING_NDI_LIB_H
+#define PROCESSING_NDI_LIB_H
+
+/* Stand-in for the NDI SDK header with the subset of declarations that
+ * ndi-streamer uses, implemented by fake_ndi.c. Names and layouts follow
+ * the SDK so the sources compile unchanged against either. */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NDIlib_send_timecode_synthesize INT64_MAX
+#define NDIlib_recv_timestamp_undefined INT64_MAX
+
+#define NDI_LIB_FOURCC(ch0, ch1, ch2, ch3)                                   \
+    ((uint32_t)(uint8_t)(ch0) | ((uint32_t)(uint8_t)(ch1) << 8)             \
+     | ((uint32_t)(uint8_t)(ch2) << 16) | ((uint32_t)(uint8_t)(ch3) << 24))
+
+typedef enum NDIlib_frame_type_e {
+    NDIlib_frame_type_none = 0,
+    NDIlib_frame_type_video = 1,
+    NDIlib_frame_type_audio = 2,
+    NDIlib_frame_type_metadata = 3,
+    NDIlib_frame_type_error = 4,
+    NDIlib_frame_type_status_change = 100,
+    NDIlib_frame_type_max = 0x7fffffff
+} NDIlib_frame_type_e;
+
+typedef enum NDIlib_FourCC_video_type_e {
+    NDIlib_FourCC_video_type_UYVY = NDI_LIB_FOURCC('U', 'Y', 'V', 'Y'),
+    NDIlib_FourCC_video_type_UYVA = NDI_LIB_FOURCC('U', 'Y', 'V', 'A'),
+    NDIlib_FourCC_video_type_P216 = NDI_LIB_FOURCC('P', '2', '1', '6'),
+    NDIlib_FourCC_video_type_PA16 = NDI_LIB_FOURCC('P', 'A', '1', '6'),
+    NDIlib_FourCC_video_type_YV12 = NDI_LIB_FOURCC('Y', 'V', '1', '2'),
+    NDIlib_FourCC_video_type_I420 = NDI_LIB_FOURCC('I', '4', '2', '0'),
+    NDIlib_FourCC_video_type_NV12 = NDI_LIB_FOURCC('N', 'V', '1', '2'),
+    NDIlib_FourCC_video_type_BGRA = NDI_LIB_FOURCC('B', 'G', 'R', 'A'),
+    NDIlib_FourCC_video_type_BGRX = NDI_LIB_FOURCC('B', 'G', 'R', 'X'),
+    NDIlib_FourCC_video_type_RGBA = NDI_LIB_FOURCC('R', 'G', 'B', 'A'),
+    NDIlib_FourCC_video_type_RGBX = NDI_LIB_FOURCC('R', 'G', 'B', 'X'),
+    NDIlib_FourCC_video_type_max = 0x7fffffff
+} NDIlib_FourCC_video_type_e;
+
+typedef enum NDIlib_frame_format_type_e {
+    NDIlib_frame_format_type_progressive = 1,
+    NDIlib_frame_format_type_interleaved = 0,
+    NDIlib_frame_format_type_field_0 = 2,
+    NDIlib_frame_format_type_field_1 = 3,
+    NDIlib_frame_format_type_max = 0x7fffffff
+} NDIlib_frame_format_type_e;
+
+typedef enum NDIlib_recv_bandwidth_e {
+    NDIlib_recv_bandwidth_metadata_only = -10,
+    NDIlib_recv_bandwidth_audio_only = 10,
+    NDIlib_recv_bandwidth_lowest = 0,
+    NDIlib_recv_bandwidth_highest = 100,
+    NDIlib_recv_bandwidth_max = 0x7fffffff
+} NDIlib_recv_bandwidth_e;
+
+typedef enum NDIlib_recv_color_format_e {
+    NDIlib_recv_color_format_BGRX_BGRA = 0,
+    NDIlib_recv_color_format_UYVY_BGRA = 1,
+    NDIlib_recv_color_format_RGBX_RGBA = 2,
+    NDIlib_recv_color_format_UYVY_RGBA = 3,
+    NDIlib_recv_color_format_fastest = 100,
+    NDIlib_recv_color_format_best = 101,
+    NDIlib_recv_color_format_max = 0x7fffffff
+} NDIlib_recv_color_format_e;
+
+typedef struct NDIlib_source_t {
+    const char *p_ndi_name;
+    union {
+        const char *p_url_address;
+        const char *p_ip_address;
+    };
+} NDIlib_source_t;
+
+typedef struct NDIlib_video_frame_v2_t {
+    int xres, yres;
+    NDIlib_FourCC_video_type_e FourCC;
+    int frame_rate_N, frame_rate_D;
+    float picture_aspect_ratio;
+    NDIlib_frame_format_type_e frame_format_type;
+    int64_t timecode;
+    uint8_t *p_data;
+    union {
+        int line_stride_in_bytes;
+        int data_size_in_bytes;
+    };
+    const char *p_metadata;
+    int64_t timestamp;
+} NDIlib_video_frame_v2_t;
+
+typedef struct NDIlib_audio_frame_v2_t {
+    int sample_rate;
+    int no_channels;
+    int no_samples;
+    int64_t timecode;
+    float *p_data;
+    int channel_stride_in_bytes;
+    const char *p_metadata;
+    int64_t timestamp;
+} NDIlib_audio_frame_v2_t;
+
+typedef struct NDIlib_metadata_frame_t {
+    int length;
+    int64_t timecode;
+    char *p_data;
+} NDIlib_metadata_frame_t;
+
+typedef struct NDIlib_find_create_t {
+    bool show_local_sources;
+    const char *p_groups;
+    const char *p_extra_ips;
+} NDIlib_find_create_t;
+
+typedef struct NDIlib_recv_create_v3_t {
+    NDIlib_source_t source_to_connect_to;
+    NDIlib_recv_color_format_e color_format;
+    NDIlib_recv_bandwidth_e bandwidth;
+    bool allow_video_fields;
+    const char *p_ndi_recv_name;
+} NDIlib_recv_create_v3_t;
+
+typedef struct NDIlib_recv_performance_t {
+    int64_t video_frames;
+    int64_t audio_frames;
+    int64_t metadata_frames;
+} NDIlib_recv_performance_t;
+
+typedef struct NDIlib_recv_queue_t {
+    int video_frames;
+    int audio_frames;
+    int metadata_frames;
+} NDIlib_recv_queue_t;
+
+typedef void *NDIlib_find_instance_t;
+typedef void *NDIlib_recv_instance_t;
+
+bool
+NDIlib_initialize(void);
+
+void
+NDIlib_destroy(void);
+
+NDIlib_find_instance_t
+NDIlib_find_create_v2(const NDIlib_find_create_t *p_create_settings);
+
+void
+NDIlib_find_destroy(NDIlib_find_instance_t p_instance);
+
+const NDIlib_source_t *
+NDIlib_find_get_current_sources(NDIlib_find_instance_t p_instance,
+                                uint32_t *p_no_sources);
+
+bool
+NDIlib_find_wait_for_sources(NDIlib_find_instance_t p_instance,
+                             uint32_t timeout_in_ms);
+
+NDIlib_recv_instance_t
+NDIlib_recv_create_v3(const NDIlib_recv_create_v3_t *p_create_settings);
+
+void
+NDIlib_recv_destroy(NDIlib_recv_instance_t p_instance);
+
+NDIlib_frame_type_e
+NDIlib_recv_capture_v2(NDIlib_recv_instance_t p_instance,
+                       NDIlib_video_frame_v2_t *p_video_data,
+                       NDIlib_audio_frame_v2_t *p_audio_data,
+                       NDIlib_metadata_frame_t *p_metadata,
+                       uint32_t timeout_in_ms);
+
+void
+NDIlib_recv_free_video_v2(NDIlib_recv_instance_t p_instance,
+                          const NDIlib_video_frame_v2_t *p_video_data);
+
+void
+NDIlib_recv_free_audio_v2(NDIlib_recv_instance_t p_instance,
+                          const NDIlib_audio_frame_v2_t *p_audio_data);
+
+void
+NDIlib_recv_free_metadata(NDIlib_recv_instance_t p_instance,
+                          const NDIlib_metadata_frame_t *p_metadata);
+
+void
+NDIlib_recv_get_performance(NDIlib_recv_instance_t p_instance,
+                            NDIlib_recv_performance_t *p_total,
+                            NDIlib_recv_performance_t *p_dropped);
+
+void
+NDIlib_recv_get_queue(NDIlib_recv_instance_t p_instance,
+                      NDIlib_recv_queue_t *p_total);
+
+#endif
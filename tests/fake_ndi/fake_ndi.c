@@ -0,0 +1,611 @@
+// Copyright 2022 Alim Zanibekov
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+/* Offline stand-in for libndi. Every receiver plays the script named by the
+ * FAKE_NDI_SCRIPT environment variable as an in-process loopback sender,
+ * generating frames with the synthetic source. Script lines:
+ *
+ *   source NAME            name reported by the finder
+ *   url ADDRESS            address reported by the finder
+ *   receiver ADDRESS       the following lines are played by receivers of
+ *                          the source with this name or address only, the
+ *                          lines before the first receiver line by the rest
+ *   video FOURCC WxH N/D [interleaved]
+ *                          format of the following frames
+ *   audio RATE CHANNELS    audio with every video frame, 0 0 disables
+ *   jitter MS              deliver each frame up to MS late
+ *   speed realtime|fast    pace frames by their rate or as fast as asked
+ *   seed N                 jitter random seed
+ *   play SECONDS           send frames, 0 forever
+ *   drop SECONDS           send nothing, like a source dropout
+ *   stall SECONDS          hold frames back, they queue up in the receiver
+ *   loop                   start over from the first line
+ *   exit                   interrupt the process, as ^C would
+ *
+ * Without a script it sends 1080p29.97 UYVY with stereo audio forever. */
+
+#include <Processing.NDI.Lib.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "synthetic_source.h"
+#include "thread.h"
+
+#define FAKE_MAX_STEPS 256
+#define FAKE_MAX_SECTIONS 8
+
+typedef enum FakeStepType {
+    FAKE_STEP_VIDEO,
+    FAKE_STEP_AUDIO,
+    FAKE_STEP_JITTER,
+    FAKE_STEP_SPEED,
+    FAKE_STEP_SEED,
+    FAKE_STEP_PLAY,
+    FAKE_STEP_DROP,
+    FAKE_STEP_STALL,
+    FAKE_STEP_LOOP,
+    FAKE_STEP_EXIT,
+} FakeStepType;
+
+typedef struct FakeStep {
+    FakeStepType type;
+    NDIlib_FourCC_video_type_e fourcc;
+    int width;
+    int height;
+    int frame_rate_N;
+    int frame_rate_D;
+    NDIlib_frame_format_type_e frame_format;
+    int sample_rate;
+    int channels;
+    int value;
+    double seconds;
+} FakeStep;
+
+typedef struct FakeSection {
+    char address[256]; // source name or address of the receivers
+    int first;         // first step, the section ends with the next one
+} FakeSection;
+
+typedef struct FakeRecv {
+    SyntheticSourceCtx *source;
+    int first; // steps of the script section it plays
+    int end;
+    int step;
+    int video_ready;
+
+    int sample_rate;
+    int channels;
+    int jitter_ms;
+    int fast;
+    uint32_t rng;
+
+    int64_t start;       // wall clock of media time 0
+    int64_t step_start;  // media time where the current step began
+    int64_t step_frames; // frames sent in the current step
+    int audio_pending;
+
+    int64_t video_frames; // delivered, for NDIlib_recv_get_performance
+    int64_t audio_frames;
+} FakeRecv;
+
+static FakeStep fake_steps[FAKE_MAX_STEPS];
+static int fake_nb_steps;
+static FakeSection fake_sections[FAKE_MAX_SECTIONS];
+static int fake_nb_sections;
+static char fake_source_name[256] = "FAKE (Loopback)";
+static char fake_source_url[256] = "127.0.0.1:5961";
+static NDIlib_source_t fake_source;
+static int fake_finder;
+
+static int
+fake_parse_line(const char *line, FakeStep *step)
+{
+    char cmd[16], arg[64];
+    memset(step, 0, sizeof(FakeStep));
+
+    if (sscanf(line, "%15s", cmd) != 1 || cmd[0] == '#') {
+        return 0;
+    }
+
+    if (strcmp(cmd, "source") == 0 || strcmp(cmd, "url") == 0) {
+        char *dst = cmd[0] == 's' ? fake_source_name : fake_source_url;
+        const char *value = line + strspn(line, " \t") + strlen(cmd);
+        value += strspn(value, " \t");
+        snprintf(dst, 256, "%.*s", (int)strcspn(value, "\r\n"), value);
+        return 0;
+    }
+    if (strcmp(cmd, "receiver") == 0) {
+        const char *value = line + strspn(line, " \t") + strlen(cmd);
+        value += strspn(value, " \t");
+        int len = (int)strcspn(value, "\r\n");
+        if (fake_nb_sections == FAKE_MAX_SECTIONS || len == 0) {
+            return -1;
+        }
+        FakeSection *section = &fake_sections[fake_nb_sections++];
+        snprintf(section->address, sizeof section->address, "%.*s", len,
+                 value);
+        section->first = fake_nb_steps;
+        return 0;
+    }
+    if (strcmp(cmd, "video") == 0) {
+        char format[16] = "";
+        step->type = FAKE_STEP_VIDEO;
+        if (sscanf(line, "%*s %63s %dx%d %d/%d %15s", arg, &step->width,
+                   &step->height, &step->frame_rate_N, &step->frame_rate_D,
+                   format)
+                    < 5
+            || ss_fourcc_from_name(arg, &step->fourcc) < 0) {
+            return -1;
+        }
+        if (strcmp(format, "interleaved") == 0) {
+            step->frame_format = NDIlib_frame_format_type_interleaved;
+        }
+        else if (format[0] == '\0') {
+            step->frame_format = NDIlib_frame_format_type_progressive;
+        }
+        else {
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(cmd, "audio") == 0) {
+        step->type = FAKE_STEP_AUDIO;
+        return sscanf(line, "%*s %d %d", &step->sample_rate, &step->channels)
+                               == 2
+                       ? 1
+                       : -1;
+    }
+    if (strcmp(cmd, "jitter") == 0 || strcmp(cmd, "seed") == 0) {
+        step->type = cmd[0] == 'j' ? FAKE_STEP_JITTER : FAKE_STEP_SEED;
+        return sscanf(line, "%*s %d", &step->value) == 1 ? 1 : -1;
+    }
+    if (strcmp(cmd, "speed") == 0) {
+        step->type = FAKE_STEP_SPEED;
+        if (sscanf(line, "%*s %63s", arg) != 1
+            || (strcmp(arg, "fast") != 0 && strcmp(arg, "realtime") != 0)) {
+            return -1;
+        }
+        step->value = strcmp(arg, "fast") == 0;
+        return 1;
+    }
+    if (strcmp(cmd, "play") == 0 || strcmp(cmd, "drop") == 0
+        || strcmp(cmd, "stall") == 0) {
+        step->type = cmd[0] == 'p'   ? FAKE_STEP_PLAY
+                     : cmd[0] == 'd' ? FAKE_STEP_DROP
+                                     : FAKE_STEP_STALL;
+        if (sscanf(line, "%*s %lf", &step->seconds) != 1
+            || (step->type == FAKE_STEP_STALL && step->seconds <= 0)) {
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(cmd, "loop") == 0 || strcmp(cmd, "exit") == 0) {
+        step->type = cmd[0] == 'l' ? FAKE_STEP_LOOP : FAKE_STEP_EXIT;
+        return 1;
+    }
+    return -1;
+}
+
+static int
+fake_load_script(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "[fake-ndi] could not open script \"%s\"\n", path);
+        return -1;
+    }
+
+    char line[512];
+    int line_no = 0;
+    while (fgets(line, sizeof line, f)) {
+        line_no++;
+        if (fake_nb_steps == FAKE_MAX_STEPS) {
+            fprintf(stderr, "[fake-ndi] %s: too many lines\n", path);
+            fclose(f);
+            return -1;
+        }
+        int ret = fake_parse_line(line, &fake_steps[fake_nb_steps]);
+        if (ret < 0) {
+            line[strcspn(line, "\r\n")] = '\0';
+            fprintf(stderr, "[fake-ndi] %s:%d: invalid line \"%s\"\n", path,
+                    line_no, line);
+            fclose(f);
+            return -1;
+        }
+        fake_nb_steps += ret;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+bool
+NDIlib_initialize(void)
+{
+    const char *path = getenv("FAKE_NDI_SCRIPT");
+
+    fake_nb_steps = 0;
+    fake_nb_sections = 0;
+    if (path && strlen(path)) {
+        return fake_load_script(path) == 0;
+    }
+
+    fake_steps[0] = (FakeStep){ .type = FAKE_STEP_VIDEO,
+                                .fourcc = NDIlib_FourCC_video_type_UYVY,
+                                .width = 1920,
+                                .height = 1080,
+                                .frame_rate_N = 30000,
+                                .frame_rate_D = 1001 };
+    fake_steps[1] = (FakeStep){ .type = FAKE_STEP_AUDIO,
+                                .sample_rate = 48000,
+                                .channels = 2 };
+    fake_steps[2] = (FakeStep){ .type = FAKE_STEP_PLAY, .seconds = 0 };
+    fake_nb_steps = 3;
+    return true;
+}
+
+void
+NDIlib_destroy(void)
+{
+}
+
+NDIlib_find_instance_t
+NDIlib_find_create_v2(const NDIlib_find_create_t *p_create_settings)
+{
+    (void)p_create_settings;
+    return &fake_finder;
+}
+
+void
+NDIlib_find_destroy(NDIlib_find_instance_t p_instance)
+{
+    (void)p_instance;
+}
+
+const NDIlib_source_t *
+NDIlib_find_get_current_sources(NDIlib_find_instance_t p_instance,
+                                uint32_t *p_no_sources)
+{
+    (void)p_instance;
+    fake_source.p_ndi_name = fake_source_name;
+    fake_source.p_url_address = fake_source_url;
+    *p_no_sources = 1;
+    return &fake_source;
+}
+
+bool
+NDIlib_find_wait_for_sources(NDIlib_find_instance_t p_instance,
+                             uint32_t timeout_in_ms)
+{
+    (void)p_instance;
+    (void)timeout_in_ms;
+    return true;
+}
+
+static int
+fake_section_matches(const FakeSection *section, const NDIlib_source_t *src)
+{
+    return (src->p_ndi_name && strcmp(src->p_ndi_name, section->address) == 0)
+           || (src->p_url_address
+               && strcmp(src->p_url_address, section->address) == 0);
+}
+
+NDIlib_recv_instance_t
+NDIlib_recv_create_v3(const NDIlib_recv_create_v3_t *p_create_settings)
+{
+    const NDIlib_source_t *src = &p_create_settings->source_to_connect_to;
+
+    FakeRecv *recv = calloc(1, sizeof(FakeRecv));
+    recv->end = fake_nb_sections > 0 ? fake_sections[0].first : fake_nb_steps;
+    for (int i = 0; i < fake_nb_sections; ++i) {
+        if (fake_section_matches(&fake_sections[i], src)) {
+            recv->first = fake_sections[i].first;
+            recv->end = i + 1 < fake_nb_sections ? fake_sections[i + 1].first
+                                                 : fake_nb_steps;
+            break;
+        }
+    }
+    recv->step = recv->first;
+    recv->source = new_synthetic_source_ctx();
+    recv->rng = 1;
+    recv->start = get_current_ts_usec();
+    return recv;
+}
+
+void
+NDIlib_recv_destroy(NDIlib_recv_instance_t p_instance)
+{
+    FakeRecv *recv = p_instance;
+    free_synthetic_source_ctx(&recv->source);
+    free(recv);
+}
+
+static int64_t
+fake_frame_time(const FakeRecv *recv, int64_t frames)
+{
+    const SyntheticSourceCtx *src = recv->source;
+    return frames * 1000000 * src->frame_rate_D / src->frame_rate_N;
+}
+
+static int64_t
+fake_step_end(const FakeRecv *recv, const FakeStep *step)
+{
+    if (step->seconds <= 0) {
+        return INT64_MAX;
+    }
+    return recv->step_start + (int64_t)(step->seconds * 1000000);
+}
+
+static void
+fake_next_step(FakeRecv *recv, int64_t media_ts)
+{
+    recv->step++;
+    recv->step_start = media_ts;
+    recv->step_frames = 0;
+}
+
+/* Runs the settings lines up to the next play, drop or stall step.
+ * Returns that step, or NULL once the script has ended. */
+static const FakeStep *
+fake_current_step(FakeRecv *recv)
+{
+    for (int guard = 0; recv->step < recv->end; ++guard) {
+        const FakeStep *step = &fake_steps[recv->step];
+
+        switch (step->type) {
+        case FAKE_STEP_VIDEO:
+            if (ss_setup_video(recv->source, step->fourcc, step->width,
+                               step->height, step->frame_rate_N,
+                               step->frame_rate_D)
+                < 0) {
+                fprintf(stderr, "[fake-ndi] %s\n", recv->source->error_str);
+                recv->step = recv->end;
+                return NULL;
+            }
+            recv->source->frame_format = step->frame_format;
+            recv->video_ready = 1;
+            // audio is paced by the video rate and restarts with it
+            if (recv->sample_rate > 0) {
+                ss_setup_audio(recv->source, recv->sample_rate,
+                               recv->channels);
+            }
+            break;
+        case FAKE_STEP_AUDIO:
+            recv->sample_rate = step->sample_rate;
+            recv->channels = step->channels;
+            if (recv->sample_rate > 0
+                && ss_setup_audio(recv->source, step->sample_rate,
+                                  step->channels)
+                           < 0) {
+                recv->sample_rate = 0;
+            }
+            break;
+        case FAKE_STEP_JITTER:
+            recv->jitter_ms = step->value;
+            break;
+        case FAKE_STEP_SPEED:
+            recv->fast = step->value;
+            break;
+        case FAKE_STEP_SEED:
+            recv->rng = (uint32_t)step->value | 1;
+            break;
+        case FAKE_STEP_LOOP:
+            if (guard > recv->end - recv->first) {
+                return NULL; // nothing to play in the loop
+            }
+            recv->step = recv->first - 1;
+            break;
+        case FAKE_STEP_EXIT:
+#ifdef _WIN32
+            GenerateConsoleCtrlEvent(CTRL_C_EVENT, 0);
+#else
+            raise(SIGINT);
+#endif
+            recv->step = recv->end;
+            return NULL;
+        default:
+            return step;
+        }
+
+        recv->step++;
+    }
+    return NULL;
+}
+
+static int
+fake_jitter(FakeRecv *recv)
+{
+    if (recv->jitter_ms <= 0) {
+        return 0;
+    }
+    recv->rng ^= recv->rng << 13;
+    recv->rng ^= recv->rng >> 17;
+    recv->rng ^= recv->rng << 5;
+    return (int)(recv->rng % (uint32_t)(recv->jitter_ms * 1000 + 1));
+}
+
+/* Sleeps until `until` but not past `deadline`, returns 0 if it had to
+ * give up at the deadline. */
+static int
+fake_wait(int64_t until, int64_t deadline)
+{
+    int64_t now = get_current_ts_usec();
+    int64_t target = until < deadline ? until : deadline;
+    if (target > now) {
+        thread_sleep_ms((int)((target - now + 999) / 1000));
+    }
+    return until <= deadline;
+}
+
+NDIlib_frame_type_e
+NDIlib_recv_capture_v2(NDIlib_recv_instance_t p_instance,
+                       NDIlib_video_frame_v2_t *p_video_data,
+                       NDIlib_audio_frame_v2_t *p_audio_data,
+                       NDIlib_metadata_frame_t *p_metadata,
+                       uint32_t timeout_in_ms)
+{
+    FakeRecv *recv = p_instance;
+    SyntheticSourceCtx *src = recv->source;
+    int64_t deadline = get_current_ts_usec() + (int64_t)timeout_in_ms * 1000;
+    (void)p_metadata;
+
+    if (recv->audio_pending && p_audio_data) {
+        NDIlib_audio_frame_v2_t frame;
+        ss_next_audio(src, &frame);
+        recv->audio_frames++;
+
+        size_t size = (size_t)frame.channel_stride_in_bytes * frame.no_channels;
+        *p_audio_data = frame;
+        p_audio_data->p_data = malloc(size);
+        memcpy(p_audio_data->p_data, frame.p_data, size);
+        recv->audio_pending = 0;
+        return NDIlib_frame_type_audio;
+    }
+
+    for (;;) {
+        const FakeStep *step = fake_current_step(recv);
+        if (!step) {
+            fake_wait(deadline, deadline);
+            return NDIlib_frame_type_none;
+        }
+
+        int64_t step_end = fake_step_end(recv, step);
+
+        if (step->type == FAKE_STEP_DROP) {
+            if (!recv->fast && !fake_wait(recv->start + step_end, deadline)) {
+                return NDIlib_frame_type_none;
+            }
+            fake_next_step(recv, step_end);
+            continue;
+        }
+
+        if (step->type == FAKE_STEP_STALL) {
+            if (!recv->fast && !fake_wait(recv->start + step_end, deadline)) {
+                return NDIlib_frame_type_none;
+            }
+            // media time stands still, the next frames are overdue
+            fake_next_step(recv, recv->step_start);
+            continue;
+        }
+
+        if (!recv->video_ready) {
+            fprintf(stderr, "[fake-ndi] play before any video line\n");
+            recv->step = recv->end;
+            continue;
+        }
+
+        int64_t media_ts = recv->step_start
+                           + fake_frame_time(recv, recv->step_frames);
+        if (media_ts >= step_end) {
+            fake_next_step(recv, step_end);
+            continue;
+        }
+
+        if (recv->fast) {
+            // keep the wall clock in step so a later realtime part
+            // does not have to catch up
+            recv->start = get_current_ts_usec() - media_ts;
+        }
+        else if (!fake_wait(recv->start + media_ts + fake_jitter(recv),
+                            deadline)) {
+            return NDIlib_frame_type_none;
+        }
+
+        NDIlib_video_frame_v2_t frame;
+        ss_next_video(src, &frame);
+        recv->video_frames++;
+        recv->step_frames++;
+        recv->audio_pending = recv->sample_rate > 0;
+
+        if (!p_video_data) {
+            continue;
+        }
+
+        *p_video_data = frame;
+        p_video_data->p_data = malloc(src->video_size);
+        memcpy(p_video_data->p_data, frame.p_data, src->video_size);
+        return NDIlib_frame_type_video;
+    }
+}
+
+void
+NDIlib_recv_free_video_v2(NDIlib_recv_instance_t p_instance,
+                          const NDIlib_video_frame_v2_t *p_video_data)
+{
+    (void)p_instance;
+    free(p_video_data->p_data);
+}
+
+void
+NDIlib_recv_free_audio_v2(NDIlib_recv_instance_t p_instance,
+                          const NDIlib_audio_frame_v2_t *p_audio_data)
+{
+    (void)p_instance;
+    free(p_audio_data->p_data);
+}
+
+void
+NDIlib_recv_get_performance(NDIlib_recv_instance_t p_instance,
+                            NDIlib_recv_performance_t *p_total,
+                            NDIlib_recv_performance_t *p_dropped)
+{
+    FakeRecv *recv = p_instance;
+
+    if (p_total) {
+        memset(p_total, 0, sizeof(NDIlib_recv_performance_t));
+        p_total->video_frames = recv->video_frames;
+        p_total->audio_frames = recv->audio_frames;
+    }
+    if (p_dropped) {
+        memset(p_dropped, 0, sizeof(NDIlib_recv_performance_t));
+    }
+}
+
+void
+NDIlib_recv_get_queue(NDIlib_recv_instance_t p_instance,
+                      NDIlib_recv_queue_t *p_total)
+{
+    FakeRecv *recv = p_instance;
+    memset(p_total, 0, sizeof(NDIlib_recv_queue_t));
+
+    if (recv->fast || !recv->video_ready || recv->step >= recv->end
+        || fake_steps[recv->step].type != FAKE_STEP_PLAY) {
+        return;
+    }
+
+    // frames of the current step that are due but not captured yet
+    const SyntheticSourceCtx *src = recv->source;
+    int64_t media_ts = get_current_ts_usec() - recv->start;
+    int64_t step_end = fake_step_end(recv, &fake_steps[recv->step]);
+    if (media_ts >= step_end) {
+        media_ts = step_end - 1;
+    }
+    if (media_ts < recv->step_start) {
+        return;
+    }
+
+    int64_t due = (media_ts - recv->step_start) * src->frame_rate_N
+                          / ((int64_t)1000000 * src->frame_rate_D)
+                  + 1;
+    int64_t queued = due - recv->step_frames;
+    if (queued > 0) {
+        p_total->video_frames = (int)queued;
+        p_total->audio_frames = recv->sample_rate > 0 ? (int)queued : 0;
+    }
+    p_total->audio_frames += recv->audio_pending;
+}
+
+void
+NDIlib_recv_free_metadata(NDIlib_recv_instance_t p_instance,
+                          const NDIlib_metadata_frame_t *p_metadata)
+{
+    (void)p_instance;
+    (void)p_metadata;
+}
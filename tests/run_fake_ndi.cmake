@@ -0,0 +1,53 @@
+# Runs one ndi-streamer pipeline against the NDI stand-in and checks the
+# result.
+#
+#   STREAMER   path to ndi-streamer built with NDI_STREAMER_FAKE_NDI
+#   SCRIPT     sender script, see tests/fake_ndi/fake_ndi.c
+#   OUTPUT     output file, written with ffv1 and aac to nut
+#   EXPECT     regular expressions separated by | the log must match
+#   MIN_BYTES  minimum size of the output file
+#   INPUT      optional media file read as fast as possible instead of NDI
+#   PIPELINE   optional extra line for the pipeline section
+
+file(REMOVE ${OUTPUT})
+string(REPLACE "|" ";" EXPECT "${EXPECT}")
+
+if (INPUT)
+  set(SOURCE "input = ${INPUT}\ninput_fast = 1")
+else ()
+  set(SOURCE "source = 127.0.0.1:5961")
+endif ()
+
+file(WRITE ${OUTPUT}.conf "[daemon]
+workers = 2
+
+[pipeline fake]
+${SOURCE}
+video_codec = ffv1
+audio_codec = aac
+output = nut ${OUTPUT}
+${PIPELINE}
+")
+
+set(ENV{FAKE_NDI_SCRIPT} ${SCRIPT})
+execute_process(COMMAND ${STREAMER} --config ${OUTPUT}.conf
+    RESULT_VARIABLE RESULT OUTPUT_VARIABLE LOG ERROR_VARIABLE LOG)
+message("${LOG}")
+
+if (NOT RESULT EQUAL 0)
+  message(FATAL_ERROR "ndi-streamer exited with ${RESULT}")
+endif ()
+
+foreach (REGEX ${EXPECT})
+  if (NOT LOG MATCHES "${REGEX}")
+    message(FATAL_ERROR "log does not match \"${REGEX}\"")
+  endif ()
+endforeach ()
+
+if (NOT EXISTS ${OUTPUT})
+  message(FATAL_ERROR "${OUTPUT} was not written")
+endif ()
+file(SIZE ${OUTPUT} SIZE)
+if (SIZE LESS MIN_BYTES)
+  message(FATAL_ERROR "${OUTPUT} is ${SIZE} bytes, expected ${MIN_BYTES}+")
+endif ()